@@ -28,6 +28,40 @@
 #pragma warning(disable: 4800)              // 'BOOL' : forcing value to bool 'true' or 'false' (performance warning)
 #endif
 
+//-----------------------------------------------------------------------------
+// Local variables
+
+static SFILE_PART_CALLBACK DefaultPartFileCB = NULL; // Source of missing parts for newly open PART files
+static void * pvDefaultPartFileData = NULL;          // User data for the source
+
+// Protects the default source. Archives can be open by more threads at once
+#ifdef PLATFORM_WINDOWS
+static SRWLOCK DefaultPartFileLock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t DefaultPartFileLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+//-----------------------------------------------------------------------------
+// Locking the default source of missing parts
+
+static void LockDefaultPartFileCB()
+{
+#ifdef PLATFORM_WINDOWS
+    AcquireSRWLockExclusive(&DefaultPartFileLock);
+#else
+    pthread_mutex_lock(&DefaultPartFileLock);
+#endif
+}
+
+static void UnlockDefaultPartFileCB()
+{
+#ifdef PLATFORM_WINDOWS
+    ReleaseSRWLockExclusive(&DefaultPartFileLock);
+#else
+    pthread_mutex_unlock(&DefaultPartFileLock);
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // Local structures
 
@@ -66,22 +100,86 @@ struct TPartFileStream : public TFileStream
     ULONGLONG VirtualPos;                   // Virtual position in the file
     DWORD     PartCount;                    // Number of file parts. Used by partial file stream
     DWORD     PartSize;                     // Size of one part. Used by partial file stream
+    SFILE_PART_CALLBACK PartFileCB;         // Provides the missing parts. NULL if the missing parts can't be read
+    void    * pvPartFileData;               // User data for the callback
+    bool      bWriteAccess;                 // true if the file is open for write, so that the missing parts can be stored
 
     PART_FILE_MAP_ENTRY PartMap[1];         // File map, variable length
 };
 
-#define MPQE_CHUNK_SIZE 0x40                // Size of one chunk to be decrypted
+#define MPQE_CHUNK_SIZE       0x40          // Size of one chunk to be decrypted
+#define MPQE_KEYSTREAM_CHUNKS 0x10          // Number of chunks whose key stream is generated at once
+#define MPQE_CACHE_SIZE       0x1000        // Size of the decrypted data cache. Must be a multiple of MPQE_CHUNK_SIZE
+
+// The key stream of four chunks is generated at once with SSE2,
+// which is always available on x64 processors
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MPQE_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 struct TEncryptedStream : public TFileStream
 {
     BYTE Key[MPQE_CHUNK_SIZE];              // File key
+    ULONGLONG CacheOffset;                  // File offset of the decrypted data in the cache
+    DWORD     cbCache;                      // Number of valid bytes in the cache
+    BYTE      Cache[MPQE_CACHE_SIZE];       // Decrypted data, for small reads
+};
+
+#define MAPPED_FILE_PREFETCH_SIZE 0x10000   // Reads this large will prefetch the pages before copying
+#define READ_AHEAD_MIN_WINDOW     0x10000   // Initial size of the read-ahead window
+
+struct TMappedFileStream : public TFileStream
+{
+    ULONGLONG FileSize;                     // Size of the mapped file
+    LPBYTE    pbFileView;                   // Pointer to the view of the entire file
+    size_t    PageMask;                     // Mask for aligning addresses to page boundary
+#ifdef PLATFORM_WINDOWS
+    HANDLE    hMap;                         // Handle to the file mapping object
+#endif
+};
+
+struct TCallbackStream : public TFileStream
+{
+    SFILE_STREAM_CALLBACKS Callbacks;       // Stream functions provided by the caller
+    void * pvUserData;                      // User data for the callbacks
+};
+
+#define BLOCK_CACHE_BLOCK_SIZE    0x4000    // Size of one cached block. Must be a power of two
+#define WRITE_BUFFER_SIZE         0x100000  // Size of the write-combining buffer. Must be a power of two
+
+// One block of the raw file data. Blocks are in a hash table (by offset)
+// and in a LRU list, with the most recently used block first
+struct TCacheBlock
+{
+    TCacheBlock * pNextInHash;              // Next block in the same hash bucket
+    TCacheBlock * pPrev;                    // Previous (more recently used) block
+    TCacheBlock * pNext;                    // Next (less recently used) block
+    ULONGLONG     BlockOffset;              // File offset of the block
+    DWORD         cbData;                   // Number of valid bytes. Less than the block size at the end of the file
+    BYTE          Data[1];                  // Block data, variable length
+};
+
+struct TBlockCache
+{
+    TSyncLock     Lock;                     // Protects the cache. Thread-safe streams are read by more threads
+    TCacheBlock ** HashTable;               // Hash table of the cached blocks
+    TCacheBlock * pFirst;                   // Most recently used block
+    TCacheBlock * pLast;                    // Least recently used block
+    ULONGLONG     CacheHits;                // Number of blocks found in the cache
+    ULONGLONG     CacheMisses;              // Number of blocks that had to be read from the file
+    DWORD         dwHashMask;               // Number of hash buckets minus one
+    DWORD         dwMaxSize;                // Maximum number of bytes in the cache
+    DWORD         dwCachedSize;             // Current number of bytes in the cache
 };
 
 //-----------------------------------------------------------------------------
 // Non-Windows support for LastError
 
 #ifndef PLATFORM_WINDOWS
-static int nLastError = ERROR_SUCCESS;
+// The last error is per-thread, like on Windows. Otherwise, threads reading
+// from a thread-safe archive (MPQ_OPEN_THREAD_SAFE) would overwrite each other's error
+static __thread int nLastError = ERROR_SUCCESS;
 
 int GetLastError()
 {
@@ -419,36 +517,38 @@ static bool File_GetPos(
     return true;
 }
 
-static bool File_Read(
+// Reads the data from the given offset. Returns false only if the read failed.
+// If there is not enough data in the file, returns true and less bytes in pdwBytesRead.
+// Note that the platform-specific code always reads from an explicit offset
+// and never relies on the OS file pointer, so that more threads
+// can read from the same handle at once (see STREAM_FLAG_THREAD_SAFE)
+static bool File_ReadAt(
     TFileStream * pStream,                  // Pointer to an open stream
-    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
+    ULONGLONG ByteOffset,                   // File byte offset
     void * pvBuffer,                        // Pointer to data to be read
-    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+    DWORD dwBytesToRead,                    // Number of bytes to read from the file
+    LPDWORD pdwBytesRead)                   // Receives number of bytes read
 {
     DWORD dwBytesRead = 0;                  // Must be set by platform-specific code
 
-    // If the byte offset is not entered, use the current position
-    if(pByteOffset == NULL)
-        pByteOffset = &pStream->RawFilePos;
-
 #ifdef PLATFORM_WINDOWS
     {
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(*pByteOffset != pStream->RawFilePos)
-        {
-            LONG ByteOffsetHi = (LONG)(*pByteOffset >> 32);
-            LONG ByteOffsetLo = (LONG)(*pByteOffset);
+        OVERLAPPED Overlapped;
 
-            SetFilePointer(pStream->hFile, ByteOffsetLo, &ByteOffsetHi, FILE_BEGIN);
-            pStream->RawFilePos = *pByteOffset;
-        }
+        // ReadFile with OVERLAPPED structure on a synchronous handle
+        // performs a synchronous read from the given position
+        memset(&Overlapped, 0, sizeof(OVERLAPPED));
+        Overlapped.OffsetHigh = (DWORD)(ByteOffset >> 32);
+        Overlapped.Offset = (DWORD)ByteOffset;
 
         // Read the data
         if(dwBytesToRead != 0)
         {
-            if(!ReadFile(pStream->hFile, pvBuffer, dwBytesToRead, &dwBytesRead, NULL))
-                return false;
+            if(!ReadFile(pStream->hFile, pvBuffer, dwBytesToRead, &dwBytesRead, &Overlapped))
+            {
+                if(GetLastError() != ERROR_HANDLE_EOF)
+                    return false;
+            }
         }
     }
 #endif
@@ -459,18 +559,10 @@ static bool File_Read(
         ByteCount nBytesRead = 0;
         OSErr theErr;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(*pByteOffset != pStream->RawFilePos)
-        {
-            FSSetForkPosition((short)(long)pStream->hFile, fsFromStart, (SInt64)(*pByteOffset));
-            pStream->RawFilePos = *pByteOffset;
-        }
-
         // Read the data
         if(nBytesToRead != 0)
         {
-            theErr = FSReadFork((short)(long)pStream->hFile, fsAtMark, 0, nBytesToRead, pvBuffer, &nBytesRead);
+            theErr = FSReadFork((short)(long)pStream->hFile, fsFromStart, (SInt64)ByteOffset, nBytesToRead, pvBuffer, &nBytesRead);
             if (theErr != noErr && theErr != eofErr)
             {
                 nLastError = theErr;
@@ -485,18 +577,11 @@ static bool File_Read(
     {
         ssize_t bytes_read;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(*pByteOffset != pStream->RawFilePos)
-        {
-            lseek64((intptr_t)pStream->hFile, (off64_t)(*pByteOffset), SEEK_SET);
-            pStream->RawFilePos = *pByteOffset;
-        }
-
-        // Perform the read operation
+        // Perform the read operation. Positional read doesn't move
+        // the file pointer, so there is no seek/read race between threads
         if(dwBytesToRead != 0)
         {
-            bytes_read = read((intptr_t)pStream->hFile, pvBuffer, (size_t)dwBytesToRead);
+            bytes_read = pread64((intptr_t)pStream->hFile, pvBuffer, (size_t)dwBytesToRead, (off64_t)ByteOffset);
             if(bytes_read == -1)
             {
                 nLastError = errno;
@@ -508,9 +593,198 @@ static bool File_Read(
     }
 #endif
 
-    // Increment the current file position by number of bytes read
+    *pdwBytesRead = dwBytesRead;
+    return true;
+}
+
+// Sequential read-ahead
+//
+// Archive operations like extracting or verifying a file read the archive
+// sequentially in small chunks. When the stream detects that a read begins
+// where the previous one ended, it starts reading ahead into a buffer,
+// so the small reads are served from memory. The read-ahead window doubles
+// with each refill, up to the maximum set by SFileSetReadAheadSize.
+// Any non-sequential read outside of the buffer resets the window.
+// On Linux, the kernel is also told to prefetch the data that follow the buffer.
+//
+// Streams that are read by multiple threads (STREAM_FLAG_THREAD_SAFE)
+// don't read ahead, because the buffer would have to be locked.
+
+static void File_AdviseSequential(TFileStream * pStream, bool bSequential)
+{
+#if defined(PLATFORM_LINUX) && defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise((intptr_t)pStream->hFile, 0, 0, bSequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+#else
+    pStream = pStream;
+    bSequential = bSequential;
+#endif
+}
+
+static void File_AdviseWillNeed(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwLength)
+{
+#if defined(PLATFORM_LINUX) && defined(POSIX_FADV_WILLNEED)
+    posix_fadvise((intptr_t)pStream->hFile, (off64_t)ByteOffset, (off64_t)dwLength, POSIX_FADV_WILLNEED);
+#else
+    pStream = pStream;
+    ByteOffset = ByteOffset;
+    dwLength = dwLength;
+#endif
+}
+
+// Checks whether the read continues where the previous one ended.
+// A non-sequential read turns the read-ahead off.
+// The first read from the beginning of the file doesn't count as sequential
+static bool IsSequentialRead(TFileStream * pStream, ULONGLONG ByteOffset)
+{
+    if(ByteOffset == 0 || ByteOffset != pStream->SequentialPos)
+    {
+        if(pStream->dwReadAheadWindow != 0)
+            File_AdviseSequential(pStream, false);
+        pStream->dwReadAheadWindow = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// Starts with the minimum read-ahead window, or doubles it
+static void GrowReadAheadWindow(TFileStream * pStream)
+{
+    if(pStream->dwReadAheadWindow == 0)
+    {
+        File_AdviseSequential(pStream, true);
+        pStream->dwReadAheadWindow = STORMLIB_MIN(READ_AHEAD_MIN_WINDOW, dwMaxReadAhead);
+    }
+    else
+    {
+        pStream->dwReadAheadWindow = (pStream->dwReadAheadWindow < dwMaxReadAhead / 2) ? (pStream->dwReadAheadWindow * 2) : dwMaxReadAhead;
+    }
+}
+
+// Loads the read-ahead buffer with data from the given offset
+static bool FillReadAheadBuffer(TFileStream * pStream, ULONGLONG ByteOffset)
+{
+    DWORD dwWindow = pStream->dwReadAheadWindow;
+
+    // Reallocate the buffer if the window has grown
+    if(pStream->pbReadAhead == NULL || pStream->cbReadAheadBuffer < dwWindow)
+    {
+        if(pStream->pbReadAhead != NULL)
+            FREEMEM(pStream->pbReadAhead);
+        pStream->cbReadAheadBuffer = 0;
+        pStream->cbReadAhead = 0;
+
+        pStream->pbReadAhead = ALLOCMEM(BYTE, dwWindow);
+        if(pStream->pbReadAhead == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+        pStream->cbReadAheadBuffer = dwWindow;
+    }
+
+    // Read the data. Reading less than the full window is normal at the end of the file
+    pStream->cbReadAhead = 0;
+    if(!File_ReadAt(pStream, ByteOffset, pStream->pbReadAhead, dwWindow, &pStream->cbReadAhead))
+        return false;
+    pStream->ReadAheadPos = ByteOffset;
+
+    // Let the system prefetch what will be read next
+    if(pStream->cbReadAhead == dwWindow)
+        File_AdviseWillNeed(pStream, ByteOffset + dwWindow, dwWindow);
+    return true;
+}
+
+// Reads the data, using the read-ahead buffer where possible
+static bool File_ReadBuffered(TFileStream * pStream, ULONGLONG ByteOffset, LPBYTE pbBuffer, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+{
+    DWORD dwBytesRead = 0;
+    DWORD dwBytesInBuffer;
+    DWORD dwBufferOffset;
+    bool bSequential = false;
+
+    // Check if the read is sequential, unless it's entirely in the buffer
+    if(ByteOffset < pStream->ReadAheadPos || (ByteOffset + dwBytesToRead) > (pStream->ReadAheadPos + pStream->cbReadAhead))
+    {
+        bSequential = IsSequentialRead(pStream, ByteOffset);
+        if(bSequential)
+            GrowReadAheadWindow(pStream);
+    }
+
+    while(dwBytesToRead != 0)
+    {
+        // Copy whatever is in the read-ahead buffer
+        if(ByteOffset >= pStream->ReadAheadPos && ByteOffset < (pStream->ReadAheadPos + pStream->cbReadAhead))
+        {
+            dwBufferOffset = (DWORD)(ByteOffset - pStream->ReadAheadPos);
+            dwBytesInBuffer = STORMLIB_MIN(pStream->cbReadAhead - dwBufferOffset, dwBytesToRead);
+
+            memcpy(pbBuffer, pStream->pbReadAhead + dwBufferOffset, dwBytesInBuffer);
+            ByteOffset += dwBytesInBuffer;
+            pbBuffer += dwBytesInBuffer;
+            dwBytesToRead -= dwBytesInBuffer;
+            dwBytesRead += dwBytesInBuffer;
+            continue;
+        }
+
+        // Random reads and reads larger than the window go directly to the file
+        if(bSequential == false || dwBytesToRead >= pStream->dwReadAheadWindow)
+        {
+            if(!File_ReadAt(pStream, ByteOffset, pbBuffer, dwBytesToRead, &dwBytesInBuffer))
+                return false;
+            dwBytesRead += dwBytesInBuffer;
+            break;
+        }
+
+        // Load more data into the buffer. Stop at the end of the file
+        if(!FillReadAheadBuffer(pStream, ByteOffset))
+            return false;
+        if(pStream->cbReadAhead == 0)
+            break;
+    }
+
+    *pdwBytesRead = dwBytesRead;
+    return true;
+}
+
+// Must be called whenever the file data may change
+static void InvalidateReadAheadBuffer(TFileStream * pStream)
+{
+    pStream->cbReadAhead = 0;
+}
+
+static bool File_Read(
+    TFileStream * pStream,                  // Pointer to an open stream
+    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
+    void * pvBuffer,                        // Pointer to data to be read
+    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+{
+    ULONGLONG ByteOffset;
+    DWORD dwBytesRead = 0;
+    bool bResult;
+
+    // If the byte offset is not entered, use the current position
+    ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos;
+
+    // Read the data, through the read-ahead buffer if enabled
+    if(dwBytesToRead != 0 && dwMaxReadAhead != 0 && (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+    {
+        bResult = File_ReadBuffered(pStream, ByteOffset, (LPBYTE)pvBuffer, dwBytesToRead, &dwBytesRead);
+        pStream->SequentialPos = ByteOffset + dwBytesRead;
+    }
+    else
+    {
+        bResult = File_ReadAt(pStream, ByteOffset, pvBuffer, dwBytesToRead, &dwBytesRead);
+    }
+
+    if(bResult == false)
+        return false;
+
+    // Increment the current file position by number of bytes read.
+    // Thread-safe streams don't touch the position when reading from given offset
     // If the number of bytes read doesn't match to required amount, return false
-    pStream->RawFilePos = *pByteOffset + dwBytesRead;
+    if(pByteOffset == NULL || (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+        pStream->RawFilePos = ByteOffset + dwBytesRead;
     if(dwBytesRead != dwBytesToRead)
         SetLastError(ERROR_HANDLE_EOF);
     return (dwBytesRead == dwBytesToRead);
@@ -531,21 +805,20 @@ static bool File_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const voi
     if(pByteOffset == NULL)
         pByteOffset = &pStream->RawFilePos;
 
+    // The read-ahead buffer may contain the old data
+    InvalidateReadAheadBuffer(pStream);
+
 #ifdef PLATFORM_WINDOWS
     {
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(*pByteOffset != pStream->RawFilePos)
-        {
-            LONG ByteOffsetHi = (LONG)(*pByteOffset >> 32);
-            LONG ByteOffsetLo = (LONG)(*pByteOffset);
+        OVERLAPPED Overlapped;
 
-            SetFilePointer(pStream->hFile, ByteOffsetLo, &ByteOffsetHi, FILE_BEGIN);
-            pStream->RawFilePos = *pByteOffset;
-        }
+        // Write to the given position, regardless of the file pointer
+        memset(&Overlapped, 0, sizeof(OVERLAPPED));
+        Overlapped.OffsetHigh = (DWORD)(*pByteOffset >> 32);
+        Overlapped.Offset = (DWORD)(*pByteOffset);
 
-        // Read the data
-        if(!WriteFile(pStream->hFile, pvBuffer, dwBytesToWrite, &dwBytesWritten, NULL))
+        // Write the data
+        if(!WriteFile(pStream->hFile, pvBuffer, dwBytesToWrite, &dwBytesWritten, &Overlapped))
             return false;
     }
 #endif
@@ -556,15 +829,7 @@ static bool File_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const voi
         ByteCount nBytesWritten = 0;
         OSErr theErr;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(*pByteOffset != pStream->RawFilePos)
-        {
-            FSSetForkPosition((short)(long)pStream->hFile, fsFromStart, (SInt64)(*pByteOffset));
-            pStream->RawFilePos = *pByteOffset;
-        }
-
-        theErr = FSWriteFork((short)(long)pStream->hFile, fsAtMark, 0, nBytesToWrite, pvBuffer, &nBytesWritten);
+        theErr = FSWriteFork((short)(long)pStream->hFile, fsFromStart, (SInt64)(*pByteOffset), nBytesToWrite, pvBuffer, &nBytesWritten);
         if (theErr != noErr)
         {
             nLastError = theErr;
@@ -578,16 +843,8 @@ static bool File_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const voi
     {
         ssize_t bytes_written;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(*pByteOffset != pStream->RawFilePos)
-        {
-            lseek64((intptr_t)pStream->hFile, (off64_t)(*pByteOffset), SEEK_SET);
-            pStream->RawFilePos = *pByteOffset;
-        }
-
-        // Perform the read operation
-        bytes_written = write((intptr_t)pStream->hFile, pvBuffer, (size_t)dwBytesToWrite);
+        // Perform the write operation
+        bytes_written = pwrite64((intptr_t)pStream->hFile, pvBuffer, (size_t)dwBytesToWrite, (off64_t)(*pByteOffset));
         if(bytes_written == -1)
         {
             nLastError = errno;
@@ -656,6 +913,9 @@ static bool File_GetSize(
  */
 static bool File_SetSize(TFileStream * pStream, ULONGLONG NewFileSize)
 {
+    // The read-ahead buffer may contain data past the new end of the file
+    InvalidateReadAheadBuffer(pStream);
+
 #ifdef PLATFORM_WINDOWS
     {
         LONG FileSizeHi = (LONG)(NewFileSize >> 32);
@@ -720,6 +980,78 @@ static bool PartFile_GetPos(TPartFileStream * pStream, ULONGLONG & ByteOffset)
     return true;
 }
 
+// Returns the number of bytes in the given part. The last part may be shorter
+static DWORD PartFile_GetPartSize(TPartFileStream * pStream, DWORD dwPartIndex)
+{
+    ULONGLONG PartOffset = (ULONGLONG)dwPartIndex * pStream->PartSize;
+
+    return (DWORD)STORMLIB_MIN(pStream->VirtualSize - PartOffset, (ULONGLONG)pStream->PartSize);
+}
+
+// Returns the raw file offset of the given part, or zero if the part is not present
+static ULONGLONG PartFile_GetRawOffset(TPartFileStream * pStream, DWORD dwPartIndex)
+{
+    PPART_FILE_MAP_ENTRY PartMap = pStream->PartMap + dwPartIndex;
+
+    if((PartMap->Flags & 3) == 0)
+        return 0;
+    return MAKE_OFFSET64(PartMap->BlockOffsHi, PartMap->BlockOffsLo);
+}
+
+// Gets a missing part from the source callback, appends it to the end
+// of the file and marks it as present in the part map. The data are written
+// before the map entry, so an interrupted fill never leaves a part
+// marked as present without its data.
+static bool PartFile_FillPart(TPartFileStream * pStream, DWORD dwPartIndex)
+{
+    PART_FILE_MAP_ENTRY MapEntry;
+    ULONGLONG MapEntryOffset;
+    ULONGLONG RawByteOffset = 0;
+    LPBYTE pbPartData;
+    DWORD dwPartSize = PartFile_GetPartSize(pStream, dwPartIndex);
+    int nError = ERROR_SUCCESS;
+
+    // Allocate buffer for the part data
+    pbPartData = ALLOCMEM(BYTE, dwPartSize);
+    if(pbPartData == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Ask the source for the data
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!pStream->PartFileCB(pStream->pvPartFileData, (ULONGLONG)dwPartIndex * pStream->PartSize, pbPartData, dwPartSize))
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    // Append the data to the end of the file
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!File_GetSize(pStream, RawByteOffset) || !File_Write(pStream, &RawByteOffset, pbPartData, dwPartSize))
+            nError = GetLastError();
+    }
+
+    // Write the map entry
+    if(nError == ERROR_SUCCESS)
+    {
+        MapEntry = pStream->PartMap[dwPartIndex];
+        MapEntry.Flags = 3;
+        MapEntry.BlockOffsLo = (DWORD)RawByteOffset;
+        MapEntry.BlockOffsHi = (DWORD)(RawByteOffset >> 32);
+        pStream->PartMap[dwPartIndex] = MapEntry;
+
+        BSWAP_ARRAY32_UNSIGNED(&MapEntry, sizeof(PART_FILE_MAP_ENTRY));
+        MapEntryOffset = sizeof(PART_FILE_HEADER) + (ULONGLONG)dwPartIndex * sizeof(PART_FILE_MAP_ENTRY);
+        if(!File_Write(pStream, &MapEntryOffset, &MapEntry, sizeof(PART_FILE_MAP_ENTRY)))
+            nError = GetLastError();
+    }
+
+    if(pbPartData != NULL)
+        FREEMEM(pbPartData);
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
 /**
  * \a pStream Pointer to an open stream
  * \a pByteOffset Pointer to file byte offset. If NULL, reads from the current position
@@ -731,11 +1063,10 @@ static bool PartFile_Read(TPartFileStream * pStream, ULONGLONG * pByteOffset, vo
     ULONGLONG RawByteOffset;
     LPBYTE pbBuffer = (LPBYTE)pvBuffer;
     DWORD dwBytesRemaining = dwBytesToRead;
+    DWORD dwBytesInRun;
     DWORD dwPartOffset;
     DWORD dwPartIndex;
     DWORD dwBytesRead = 0;
-    DWORD dwPartSize = pStream->PartSize;
-    bool bResult = false;
     int nFailReason = ERROR_HANDLE_EOF;             // Why it failed if not enough bytes was read
 
     // If the byte offset is not entered, use the current position
@@ -763,53 +1094,44 @@ static bool PartFile_Read(TPartFileStream * pStream, ULONGLONG * pByteOffset, vo
     // Calculate the offset in the current part
     dwPartOffset = (DWORD)(*pByteOffset) & (pStream->PartSize - 1);
 
-    // Read all data, one part at a time
+    // Read all data. Parts that follow each other in the file are read at once
     while(dwBytesRemaining != 0)
     {
-        PPART_FILE_MAP_ENTRY PartMap = pStream->PartMap + dwPartIndex;
-        DWORD dwBytesInPart;
-
-        // If the part is not present in the file, we fail the read
-        if((PartMap->Flags & 3) == 0)
+        // If the part is not present in the file, get it from the source.
+        // If there is no source, we fail the read
+        RawByteOffset = PartFile_GetRawOffset(pStream, dwPartIndex);
+        if(RawByteOffset == 0)
         {
-            nFailReason = ERROR_CAN_NOT_COMPLETE;
-            bResult = false;
-            break;
+            if(pStream->PartFileCB == NULL || !PartFile_FillPart(pStream, dwPartIndex))
+            {
+                nFailReason = ERROR_CAN_NOT_COMPLETE;
+                break;
+            }
+            RawByteOffset = PartFile_GetRawOffset(pStream, dwPartIndex);
         }
 
-        // If we are in the last part, we have to cut the number of bytes in the last part
-        if(dwPartIndex == pStream->PartCount - 1)
-            dwPartSize = (DWORD)pStream->VirtualSize & (pStream->PartSize - 1);
-
-        // Get the number of bytes reamining in the current part
-        dwBytesInPart = dwPartSize - dwPartOffset;
+        // Get the number of bytes remaining in the current part
+        RawByteOffset += dwPartOffset;
+        dwBytesInRun = STORMLIB_MIN(PartFile_GetPartSize(pStream, dwPartIndex) - dwPartOffset, dwBytesRemaining);
 
-        // Compute the raw file offset of the file part
-        RawByteOffset = MAKE_OFFSET64(PartMap->BlockOffsHi, PartMap->BlockOffsLo);
-        if(RawByteOffset == 0)
+        // Append the following parts, as long as they are stored right after the current one
+        while(dwBytesInRun < dwBytesRemaining && PartFile_GetRawOffset(pStream, dwPartIndex + 1) == (RawByteOffset + dwBytesInRun))
         {
-            nFailReason = ERROR_CAN_NOT_COMPLETE;
-            bResult = false;
-            break;
+            dwPartIndex++;
+            dwBytesInRun += STORMLIB_MIN(PartFile_GetPartSize(pStream, dwPartIndex), dwBytesRemaining - dwBytesInRun);
         }
 
-        // If the number of bytes in part is too big, cut it
-        if(dwBytesInPart > dwBytesRemaining)
-            dwBytesInPart = dwBytesRemaining;
-
-        // Append the offset within the part
-        RawByteOffset += dwPartOffset;
-        if(!File_Read(pStream, &RawByteOffset, pbBuffer, dwBytesInPart))
+        // Read the whole run
+        if(!File_Read(pStream, &RawByteOffset, pbBuffer, dwBytesInRun))
         {
             nFailReason = ERROR_CAN_NOT_COMPLETE;
-            bResult = false;
             break;
         }
 
         // Increment the file position
-        dwBytesRemaining -= dwBytesInPart;
-        dwBytesRead += dwBytesInPart;
-        pbBuffer += dwBytesInPart;
+        dwBytesRemaining -= dwBytesInRun;
+        dwBytesRead += dwBytesInRun;
+        pbBuffer += dwBytesInRun;
 
         // Move to the next file part
         dwPartOffset = 0;
@@ -817,7 +1139,8 @@ static bool PartFile_Read(TPartFileStream * pStream, ULONGLONG * pByteOffset, vo
     }
 
     // Move the file position by the number of bytes read
-    pStream->VirtualPos = *pByteOffset + dwBytesRead;
+    if(pByteOffset == &pStream->VirtualPos || (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+        pStream->VirtualPos = *pByteOffset + dwBytesRead;
     if(dwBytesRead != dwBytesToRead)
         SetLastError(nFailReason);
     return (dwBytesRead == dwBytesToRead);
@@ -859,64 +1182,305 @@ static bool PartFile_SetSize(
     return false;
 }
 
-/*
- * Stream functions - encrypted stream
- *
- * Note: In original Starcraft II Installer.exe:                       Suffix derived from battle.net auth. code
- * Address of decryption routine: 0053A3D0                             http://us.battle.net/static/mediakey/sc2-authenticationcode-enUS.txt
- * Pointer to decryptor object: ECX                                    Numbers mean offset of 4-char group of auth code
- * Pointer to key: ECX+0x5C                                            -0C-    -1C--08-    -18--04-    -14--00-    -10-
- */
-static const char * MpqeKey_Starcraft2_Install_enUS = "expand 32-byte kTFD80000ETR5VM5G0000K859RE5N0000WT6F3DH500005LXG";
-static const char * MpqeKey_Starcraft2_Install_enGB = "expand 32-byte kANGY000029ZH6NA20000HRGF8UDG0000NY82G8MN00006A3D";
-static const char * MpqeKey_Starcraft2_Install_deDE = "expand 32-byte kSSXH00004XFXK4KX00008EKJD3CA0000Y64ZY45M0000YD9V";
-static const char * MpqeKey_Starcraft2_Install_esES = "expand 32-byte kQU4Y0000XKTQ94PF0000N4R4UAXE0000AZ248WLK0000249P";
-static const char * MpqeKey_Starcraft2_Install_frFR = "expand 32-byte kFWPQ00006EAJ8HJE0000PFER9K9300008MA2ZG7J0000UA76";
-static const char * MpqeKey_Starcraft2_Install_itIT = "expand 32-byte kXV7E00008BL2TVAP0000GVMWUNNN0000SVBWNE7C00003G2B";
-static const char * MpqeKey_Starcraft2_Install_plPL = "expand 32-byte k83U6000048L6LULJ00004MQDB8ME0000UP6K2NSF0000YHA3";
-static const char * MpqeKey_Starcraft2_Install_ruRU = "expand 32-byte k9SH70000YEGT4BAT0000QDK978W60000V9NLVHB30000D68V";
+//-----------------------------------------------------------------------------
+// Stream functions - memory-mapped file stream
+//
+// Used for files open for read-only access. Reading is just a memcpy from
+// the file view, so there is no system call per read operation.
+// Note that if the file is truncated by another process while mapped,
+// accessing the view raises SIGBUS (Linux) or EXCEPTION_IN_PAGE_ERROR (Windows).
+//
 
-static const char * MpqKeyArray[] =
+#ifdef PLATFORM_LINUX
+// Prefetches the pages ahead of a sequential read. The prefetched range
+// ends at ReadAheadPos; the window grows the same way as for regular files.
+static void MappedFile_ReadAhead(TMappedFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesRead)
 {
-    MpqeKey_Starcraft2_Install_enUS,
-    MpqeKey_Starcraft2_Install_enGB,
-    MpqeKey_Starcraft2_Install_deDE,
-    MpqeKey_Starcraft2_Install_esES,
-    MpqeKey_Starcraft2_Install_frFR,
-    MpqeKey_Starcraft2_Install_itIT,
-    MpqeKey_Starcraft2_Install_plPL,
-    MpqeKey_Starcraft2_Install_ruRU,
-    NULL
-};
+    ULONGLONG EndOffset = ByteOffset + dwBytesRead;
+    size_t ViewOffset;
+    size_t ViewLength;
 
-static DWORD Rol32(DWORD dwValue, DWORD dwRolCount)
-{
-    DWORD dwShiftRight = 32 - dwRolCount;
+    // Only advise again when the read gets to the second half of the prefetched range
+    if(IsSequentialRead(pStream, ByteOffset) == false)
+    {
+        pStream->ReadAheadPos = 0;
+    }
+    else if(EndOffset + (pStream->dwReadAheadWindow / 2) >= pStream->ReadAheadPos && EndOffset < pStream->FileSize)
+    {
+        GrowReadAheadWindow(pStream);
+        ViewOffset = (size_t)EndOffset & ~pStream->PageMask;
+        ViewLength = (size_t)STORMLIB_MIN(pStream->FileSize - ViewOffset, (ULONGLONG)pStream->dwReadAheadWindow);
 
-    return (dwValue << dwRolCount) | (dwValue >> dwShiftRight);
+        madvise(pStream->pbFileView + ViewOffset, ViewLength, MADV_WILLNEED);
+        pStream->ReadAheadPos = ViewOffset + ViewLength;
+    }
+
+    pStream->SequentialPos = EndOffset;
 }
+#endif
 
-static void DecryptFileChunk(
-    DWORD * MpqData,
-    LPBYTE pbKey,
-    ULONGLONG ByteOffset,
-    DWORD dwLength)
+/**
+ * \a pStream Pointer to an open stream
+ * \a pByteOffset Pointer to file byte offset. If NULL, reads from the current position
+ * \a pvBuffer Pointer to data to be read
+ * \a dwBytesToRead Number of bytes to read from the file
+ */
+static bool MappedFile_Read(TMappedFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead)
 {
-    ULONGLONG ChunkOffset;
-    DWORD KeyShuffled[0x10];
-    DWORD KeyMirror[0x10];
-    DWORD RoundCount = 0x14;
+    ULONGLONG ByteOffset;
+    DWORD dwBytesRead = dwBytesToRead;
 
-    // Prepare the key
-    ChunkOffset = ByteOffset / MPQE_CHUNK_SIZE;
-    memcpy(KeyMirror, pbKey, MPQE_CHUNK_SIZE);
-    BSWAP_ARRAY32_UNSIGNED(KeyMirror, MPQE_CHUNK_SIZE);
-    KeyMirror[0x05] = (DWORD)(ChunkOffset >> 32);
-    KeyMirror[0x08] = (DWORD)(ChunkOffset);
+    // If the byte offset is not entered, use the current position
+    ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos;
 
-    while(dwLength >= MPQE_CHUNK_SIZE)
+    // Cut the number of bytes if the read goes past the end of the file
+    if(ByteOffset >= pStream->FileSize)
+        dwBytesRead = 0;
+    else if((pStream->FileSize - ByteOffset) < dwBytesToRead)
+        dwBytesRead = (DWORD)(pStream->FileSize - ByteOffset);
+
+    // Copy the data from the file view
+    if(dwBytesRead != 0)
     {
-        // Shuffle the key - part 1
+#ifdef PLATFORM_LINUX
+        // Memory streams are already in memory, there's nothing to prefetch
+        if((pStream->StreamFlags & STREAM_FLAG_USER_DATA) == 0)
+        {
+            // For large reads, let the kernel bring all the pages in at once,
+            // instead of taking a page fault for each of them
+            if(dwBytesRead >= MAPPED_FILE_PREFETCH_SIZE)
+            {
+                size_t ViewOffset = (size_t)ByteOffset & ~pStream->PageMask;
+                size_t ViewLength = (size_t)ByteOffset + dwBytesRead - ViewOffset;
+
+                madvise(pStream->pbFileView + ViewOffset, ViewLength, MADV_WILLNEED);
+            }
+
+            // The view is mapped with MADV_RANDOM, so the kernel doesn't read ahead by itself.
+            // When the file is read sequentially, prefetch the pages that follow
+            if(dwMaxReadAhead != 0 && (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+                MappedFile_ReadAhead(pStream, ByteOffset, dwBytesRead);
+        }
+#endif
+        memcpy(pvBuffer, pStream->pbFileView + (size_t)ByteOffset, dwBytesRead);
+    }
+
+    // Move the file position by the number of bytes read
+    if(pByteOffset == NULL || (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+        pStream->RawFilePos = ByteOffset + dwBytesRead;
+    if(dwBytesRead != dwBytesToRead)
+        SetLastError(ERROR_HANDLE_EOF);
+    return (dwBytesRead == dwBytesToRead);
+}
+
+static bool MappedFile_Write(
+    TMappedFileStream * pStream,            // Pointer to an open stream
+    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it writes to the current position
+    const void * pvBuffer,                  // Pointer to data to be written
+    DWORD dwBytesToWrite)                   // Number of bytes to write to the file
+{
+    // Keep compiler happy
+    dwBytesToWrite = dwBytesToWrite;
+    pByteOffset = pByteOffset;
+    pvBuffer = pvBuffer;
+    pStream = pStream;
+
+    // Not allowed
+    return false;
+}
+
+static bool MappedFile_GetSize(
+    TMappedFileStream * pStream,            // Pointer to an open stream
+    ULONGLONG & FileSize)                   // Pointer where to store file size
+{
+    FileSize = pStream->FileSize;
+    return true;
+}
+
+static bool MappedFile_SetSize(
+    TMappedFileStream * pStream,            // Pointer to an open stream
+    ULONGLONG NewSize)                      // new size of the file
+{
+    // Keep compiler happy
+    pStream = pStream;
+    NewSize = NewSize;
+
+    // Not allowed
+    return false;
+}
+
+static void MappedFile_Close(TMappedFileStream * pStream)
+{
+#ifdef PLATFORM_WINDOWS
+    if(pStream->pbFileView != NULL)
+        UnmapViewOfFile(pStream->pbFileView);
+    if(pStream->hMap != NULL)
+        CloseHandle(pStream->hMap);
+    pStream->hMap = NULL;
+#endif
+
+#ifdef PLATFORM_LINUX
+    if(pStream->pbFileView != NULL)
+        munmap(pStream->pbFileView, (size_t)pStream->FileSize);
+#endif
+
+    pStream->pbFileView = NULL;
+}
+
+/**
+ * Attempts to convert a read-only file stream to a memory-mapped stream.
+ * Only regular, non-empty files that fit into the address space are mapped.
+ * If the file cannot be mapped, the original stream is returned unchanged,
+ * so the caller can continue with normal reads.
+ *
+ * \a pStream Pointer to an open read-only file stream
+ */
+static TFileStream * CreateMappedStream(TFileStream * pStream)
+{
+    TMappedFileStream * pMappedStream;
+    ULONGLONG FileSize = 0;
+    LPBYTE pbFileView = NULL;
+    size_t PageMask = 0;
+
+    // Get the size of the file. Empty files cannot be mapped
+    if(!File_GetSize(pStream, FileSize) || FileSize == 0)
+        return pStream;
+
+    // The entire file must fit into the address space
+    if((ULONGLONG)(size_t)FileSize != FileSize)
+        return pStream;
+
+#ifdef PLATFORM_WINDOWS
+    HANDLE hMap;
+    SYSTEM_INFO si;
+
+    // Only map files on disk (no pipes or devices)
+    if(GetFileType(pStream->hFile) != FILE_TYPE_DISK)
+        return pStream;
+
+    hMap = CreateFileMapping(pStream->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(hMap == NULL)
+        return pStream;
+
+    pbFileView = (LPBYTE)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if(pbFileView == NULL)
+    {
+        CloseHandle(hMap);
+        return pStream;
+    }
+
+    GetSystemInfo(&si);
+    PageMask = si.dwPageSize - 1;
+#endif
+
+#ifdef PLATFORM_LINUX
+    struct stat64 fileinfo;
+    void * pvFileView;
+
+    // Only map regular files
+    if(fstat64((intptr_t)pStream->hFile, &fileinfo) == -1 || !S_ISREG(fileinfo.st_mode))
+        return pStream;
+
+    pvFileView = mmap(NULL, (size_t)FileSize, PROT_READ, MAP_SHARED, (intptr_t)pStream->hFile, 0);
+    if(pvFileView == MAP_FAILED)
+        return pStream;
+    pbFileView = (LPBYTE)pvFileView;
+
+    // MPQ access is driven by hash table lookups, so it is mostly random.
+    // Don't let the kernel read around every faulting page.
+    madvise(pbFileView, (size_t)FileSize, MADV_RANDOM);
+    PageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+#endif
+
+    // Memory mapping is not supported on this platform
+    if(pbFileView == NULL)
+        return pStream;
+
+    // Allocate the mapped stream and copy the file stream to it
+    pMappedStream = ALLOCMEM(TMappedFileStream, 1);
+    if(pMappedStream == NULL)
+    {
+#ifdef PLATFORM_WINDOWS
+        UnmapViewOfFile(pbFileView);
+        CloseHandle(hMap);
+#endif
+#ifdef PLATFORM_LINUX
+        munmap(pbFileView, (size_t)FileSize);
+#endif
+        return pStream;
+    }
+
+    memset(pMappedStream, 0, sizeof(TMappedFileStream));
+    memcpy(pMappedStream, pStream, sizeof(TFileStream));
+
+    // Set new function pointers
+    pMappedStream->StreamRead    = (STREAM_READ)MappedFile_Read;
+    pMappedStream->StreamWrite   = (STREAM_WRITE)MappedFile_Write;
+    pMappedStream->StreamGetSize = (STREAM_GETSIZE)MappedFile_GetSize;
+    pMappedStream->StreamSetSize = (STREAM_SETSIZE)MappedFile_SetSize;
+    pMappedStream->StreamClose   = (STREAM_CLOSE)MappedFile_Close;
+    pMappedStream->StreamFlags  |= (STREAM_FLAG_READ_ONLY | STREAM_FLAG_MAPPED_FILE);
+
+    // Fill the members of the mapped stream
+    pMappedStream->FileSize = FileSize;
+    pMappedStream->pbFileView = pbFileView;
+    pMappedStream->PageMask = PageMask;
+#ifdef PLATFORM_WINDOWS
+    pMappedStream->hMap = hMap;
+#endif
+
+    FREEMEM(pStream);
+    return pMappedStream;
+}
+
+/*
+ * Stream functions - encrypted stream
+ *
+ * Note: In original Starcraft II Installer.exe:                       Suffix derived from battle.net auth. code
+ * Address of decryption routine: 0053A3D0                             http://us.battle.net/static/mediakey/sc2-authenticationcode-enUS.txt
+ * Pointer to decryptor object: ECX                                    Numbers mean offset of 4-char group of auth code
+ * Pointer to key: ECX+0x5C                                            -0C-    -1C--08-    -18--04-    -14--00-    -10-
+ */
+static const char * MpqeKey_Starcraft2_Install_enUS = "expand 32-byte kTFD80000ETR5VM5G0000K859RE5N0000WT6F3DH500005LXG";
+static const char * MpqeKey_Starcraft2_Install_enGB = "expand 32-byte kANGY000029ZH6NA20000HRGF8UDG0000NY82G8MN00006A3D";
+static const char * MpqeKey_Starcraft2_Install_deDE = "expand 32-byte kSSXH00004XFXK4KX00008EKJD3CA0000Y64ZY45M0000YD9V";
+static const char * MpqeKey_Starcraft2_Install_esES = "expand 32-byte kQU4Y0000XKTQ94PF0000N4R4UAXE0000AZ248WLK0000249P";
+static const char * MpqeKey_Starcraft2_Install_frFR = "expand 32-byte kFWPQ00006EAJ8HJE0000PFER9K9300008MA2ZG7J0000UA76";
+static const char * MpqeKey_Starcraft2_Install_itIT = "expand 32-byte kXV7E00008BL2TVAP0000GVMWUNNN0000SVBWNE7C00003G2B";
+static const char * MpqeKey_Starcraft2_Install_plPL = "expand 32-byte k83U6000048L6LULJ00004MQDB8ME0000UP6K2NSF0000YHA3";
+static const char * MpqeKey_Starcraft2_Install_ruRU = "expand 32-byte k9SH70000YEGT4BAT0000QDK978W60000V9NLVHB30000D68V";
+
+static const char * MpqKeyArray[] =
+{
+    MpqeKey_Starcraft2_Install_enUS,
+    MpqeKey_Starcraft2_Install_enGB,
+    MpqeKey_Starcraft2_Install_deDE,
+    MpqeKey_Starcraft2_Install_esES,
+    MpqeKey_Starcraft2_Install_frFR,
+    MpqeKey_Starcraft2_Install_itIT,
+    MpqeKey_Starcraft2_Install_plPL,
+    MpqeKey_Starcraft2_Install_ruRU,
+    NULL
+};
+
+static DWORD Rol32(DWORD dwValue, DWORD dwRolCount)
+{
+    DWORD dwShiftRight = 32 - dwRolCount;
+
+    return (dwValue << dwRolCount) | (dwValue >> dwShiftRight);
+}
+
+// Generates the key stream for the given number of consecutive chunks.
+// KeyMirror contains the key with the chunk index; the index is advanced.
+// The key stream words are in the same order as the data words they decrypt
+static void GenerateKeyStream(DWORD * KeyMirror, DWORD * KeyStream, DWORD dwChunkCount)
+{
+    DWORD KeyShuffled[0x10];
+    DWORD RoundCount = 0x14;
+
+    while(dwChunkCount > 0)
+    {
+        // Shuffle the key - part 1
         KeyShuffled[0x0E] = KeyMirror[0x00];
         KeyShuffled[0x0C] = KeyMirror[0x01];
         KeyShuffled[0x05] = KeyMirror[0x02];
@@ -978,156 +1542,774 @@ static void DecryptFileChunk(
             KeyShuffled[0x0F] = KeyShuffled[0x0F] ^ Rol32((KeyShuffled[0x0B] + KeyShuffled[0x06]), 0x12);
         }
 
-        // Decrypt one data chunk
-        BSWAP_ARRAY32_UNSIGNED(MpqData, MPQE_CHUNK_SIZE);
-        MpqData[0x00] = MpqData[0x00] ^ (KeyShuffled[0x0E] + KeyMirror[0x00]);
-        MpqData[0x01] = MpqData[0x01] ^ (KeyShuffled[0x04] + KeyMirror[0x0D]);
-        MpqData[0x02] = MpqData[0x02] ^ (KeyShuffled[0x08] + KeyMirror[0x0A]);
-        MpqData[0x03] = MpqData[0x03] ^ (KeyShuffled[0x09] + KeyMirror[0x07]);
-        MpqData[0x04] = MpqData[0x04] ^ (KeyShuffled[0x0A] + KeyMirror[0x04]);
-        MpqData[0x05] = MpqData[0x05] ^ (KeyShuffled[0x0C] + KeyMirror[0x01]);
-        MpqData[0x06] = MpqData[0x06] ^ (KeyShuffled[0x01] + KeyMirror[0x0E]);
-        MpqData[0x07] = MpqData[0x07] ^ (KeyShuffled[0x0D] + KeyMirror[0x0B]);
-        MpqData[0x08] = MpqData[0x08] ^ (KeyShuffled[0x03] + KeyMirror[0x08]);
-        MpqData[0x09] = MpqData[0x09] ^ (KeyShuffled[0x07] + KeyMirror[0x05]);
-        MpqData[0x0A] = MpqData[0x0A] ^ (KeyShuffled[0x05] + KeyMirror[0x02]);
-        MpqData[0x0B] = MpqData[0x0B] ^ (KeyShuffled[0x00] + KeyMirror[0x0F]);
-        MpqData[0x0C] = MpqData[0x0C] ^ (KeyShuffled[0x02] + KeyMirror[0x0C]);
-        MpqData[0x0D] = MpqData[0x0D] ^ (KeyShuffled[0x06] + KeyMirror[0x09]);
-        MpqData[0x0E] = MpqData[0x0E] ^ (KeyShuffled[0x0B] + KeyMirror[0x06]);
-        MpqData[0x0F] = MpqData[0x0F] ^ (KeyShuffled[0x0F] + KeyMirror[0x03]);
-        BSWAP_ARRAY32_UNSIGNED(MpqData, MPQE_CHUNK_SIZE);
+        // Produce the key stream for one chunk
+        KeyStream[0x00] = KeyShuffled[0x0E] + KeyMirror[0x00];
+        KeyStream[0x01] = KeyShuffled[0x04] + KeyMirror[0x0D];
+        KeyStream[0x02] = KeyShuffled[0x08] + KeyMirror[0x0A];
+        KeyStream[0x03] = KeyShuffled[0x09] + KeyMirror[0x07];
+        KeyStream[0x04] = KeyShuffled[0x0A] + KeyMirror[0x04];
+        KeyStream[0x05] = KeyShuffled[0x0C] + KeyMirror[0x01];
+        KeyStream[0x06] = KeyShuffled[0x01] + KeyMirror[0x0E];
+        KeyStream[0x07] = KeyShuffled[0x0D] + KeyMirror[0x0B];
+        KeyStream[0x08] = KeyShuffled[0x03] + KeyMirror[0x08];
+        KeyStream[0x09] = KeyShuffled[0x07] + KeyMirror[0x05];
+        KeyStream[0x0A] = KeyShuffled[0x05] + KeyMirror[0x02];
+        KeyStream[0x0B] = KeyShuffled[0x00] + KeyMirror[0x0F];
+        KeyStream[0x0C] = KeyShuffled[0x02] + KeyMirror[0x0C];
+        KeyStream[0x0D] = KeyShuffled[0x06] + KeyMirror[0x09];
+        KeyStream[0x0E] = KeyShuffled[0x0B] + KeyMirror[0x06];
+        KeyStream[0x0F] = KeyShuffled[0x0F] + KeyMirror[0x03];
+
+        // Update byte offset in the key
+        KeyMirror[0x08]++;
+        if(KeyMirror[0x08] == 0)
+            KeyMirror[0x05]++;
+
+        KeyStream += (MPQE_CHUNK_SIZE / sizeof(DWORD));
+        dwChunkCount--;
+    }
+}
+
+#ifdef MPQE_USE_SSE2
+// The same as GenerateKeyStream, but computes four chunks at once.
+// Each vector holds the same word of the key for four consecutive chunks
+#define MPQE_SSE2_ROL(x, n)  _mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+#define MPQE_SSE2_STEP(a, b, c, n)  KeyShuffled[a] = _mm_xor_si128(KeyShuffled[a], MPQE_SSE2_ROL(_mm_add_epi32(KeyShuffled[b], KeyShuffled[c]), n))
+
+static void GenerateKeyStream_SSE2(DWORD * KeyMirror, DWORD * KeyStream)
+{
+    static const BYTE KeyShuffleOrder[0x10] = {0x0E, 0x0C, 0x05, 0x0F, 0x0A, 0x07, 0x0B, 0x09, 0x03, 0x06, 0x08, 0x0D, 0x02, 0x04, 0x01, 0x00};
+    static const BYTE KeyStreamOrder[0x10]  = {0x0E, 0x04, 0x08, 0x09, 0x0A, 0x0C, 0x01, 0x0D, 0x03, 0x07, 0x05, 0x00, 0x02, 0x06, 0x0B, 0x0F};
+    static const BYTE KeyMirrorOrder[0x10]  = {0x00, 0x0D, 0x0A, 0x07, 0x04, 0x01, 0x0E, 0x0B, 0x08, 0x05, 0x02, 0x0F, 0x0C, 0x09, 0x06, 0x03};
+    ULONGLONG ChunkIndex = MAKE_OFFSET64(KeyMirror[0x05], KeyMirror[0x08]);
+    __m128i KeyInitial[0x10];
+    __m128i KeyShuffled[0x10];
+    DWORD KeyWords[0x10][4];
+    DWORD RoundCount = 0x14;
+    DWORD i, j;
+
+    // Load the key. Only the chunk index differs between the chunks
+    for(i = 0; i < 0x10; i++)
+        KeyInitial[i] = _mm_set1_epi32((int)KeyMirror[i]);
+    KeyInitial[0x05] = _mm_set_epi32((int)((ChunkIndex + 3) >> 32), (int)((ChunkIndex + 2) >> 32), (int)((ChunkIndex + 1) >> 32), (int)(ChunkIndex >> 32));
+    KeyInitial[0x08] = _mm_set_epi32((int)(ChunkIndex + 3), (int)(ChunkIndex + 2), (int)(ChunkIndex + 1), (int)ChunkIndex);
+
+    // Shuffle the key - part 1
+    for(i = 0; i < 0x10; i++)
+        KeyShuffled[KeyShuffleOrder[i]] = KeyInitial[i];
+
+    // Shuffle the key - part 2
+    for(i = 0; i < RoundCount; i += 2)
+    {
+        MPQE_SSE2_STEP(0x0A, 0x0E, 0x02, 0x07);
+        MPQE_SSE2_STEP(0x03, 0x0A, 0x0E, 0x09);
+        MPQE_SSE2_STEP(0x02, 0x03, 0x0A, 0x0D);
+        MPQE_SSE2_STEP(0x0E, 0x02, 0x03, 0x12);
+
+        MPQE_SSE2_STEP(0x07, 0x0C, 0x04, 0x07);
+        MPQE_SSE2_STEP(0x06, 0x07, 0x0C, 0x09);
+        MPQE_SSE2_STEP(0x04, 0x06, 0x07, 0x0D);
+        MPQE_SSE2_STEP(0x0C, 0x04, 0x06, 0x12);
+
+        MPQE_SSE2_STEP(0x0B, 0x05, 0x01, 0x07);
+        MPQE_SSE2_STEP(0x08, 0x0B, 0x05, 0x09);
+        MPQE_SSE2_STEP(0x01, 0x08, 0x0B, 0x0D);
+        MPQE_SSE2_STEP(0x05, 0x01, 0x08, 0x12);
+
+        MPQE_SSE2_STEP(0x09, 0x0F, 0x00, 0x07);
+        MPQE_SSE2_STEP(0x0D, 0x09, 0x0F, 0x09);
+        MPQE_SSE2_STEP(0x00, 0x0D, 0x09, 0x0D);
+        MPQE_SSE2_STEP(0x0F, 0x00, 0x0D, 0x12);
+
+        MPQE_SSE2_STEP(0x04, 0x0E, 0x09, 0x07);
+        MPQE_SSE2_STEP(0x08, 0x04, 0x0E, 0x09);
+        MPQE_SSE2_STEP(0x09, 0x08, 0x04, 0x0D);
+        MPQE_SSE2_STEP(0x0E, 0x09, 0x08, 0x12);
+
+        MPQE_SSE2_STEP(0x01, 0x0C, 0x0A, 0x07);
+        MPQE_SSE2_STEP(0x0D, 0x01, 0x0C, 0x09);
+        MPQE_SSE2_STEP(0x0A, 0x0D, 0x01, 0x0D);
+        MPQE_SSE2_STEP(0x0C, 0x0A, 0x0D, 0x12);
+
+        MPQE_SSE2_STEP(0x00, 0x05, 0x07, 0x07);
+        MPQE_SSE2_STEP(0x03, 0x00, 0x05, 0x09);
+        MPQE_SSE2_STEP(0x07, 0x03, 0x00, 0x0D);
+        MPQE_SSE2_STEP(0x05, 0x07, 0x03, 0x12);
+
+        MPQE_SSE2_STEP(0x02, 0x0F, 0x0B, 0x07);
+        MPQE_SSE2_STEP(0x06, 0x02, 0x0F, 0x09);
+        MPQE_SSE2_STEP(0x0B, 0x06, 0x02, 0x0D);
+        MPQE_SSE2_STEP(0x0F, 0x0B, 0x06, 0x12);
+    }
+
+    // Produce the key stream for four chunks
+    for(i = 0; i < 0x10; i++)
+        _mm_storeu_si128((__m128i *)KeyWords[i], _mm_add_epi32(KeyShuffled[KeyStreamOrder[i]], KeyInitial[KeyMirrorOrder[i]]));
+    for(j = 0; j < 4; j++)
+    {
+        for(i = 0; i < 0x10; i++)
+            KeyStream[j * 0x10 + i] = KeyWords[i][j];
+    }
+
+    // Update byte offset in the key
+    ChunkIndex += 4;
+    KeyMirror[0x05] = (DWORD)(ChunkIndex >> 32);
+    KeyMirror[0x08] = (DWORD)(ChunkIndex);
+}
+#endif
+
+void DecryptFileChunk(
+    DWORD * MpqData,
+    LPBYTE pbKey,
+    ULONGLONG ByteOffset,
+    DWORD dwLength)
+{
+    ULONGLONG ChunkOffset;
+    DWORD KeyStream[MPQE_KEYSTREAM_CHUNKS * (MPQE_CHUNK_SIZE / sizeof(DWORD))];
+    DWORD KeyMirror[0x10];
+    DWORD dwChunkCount;
+    DWORD dwWordCount;
+
+    // Prepare the key
+    ChunkOffset = ByteOffset / MPQE_CHUNK_SIZE;
+    memcpy(KeyMirror, pbKey, MPQE_CHUNK_SIZE);
+    BSWAP_ARRAY32_UNSIGNED(KeyMirror, MPQE_CHUNK_SIZE);
+    KeyMirror[0x05] = (DWORD)(ChunkOffset >> 32);
+    KeyMirror[0x08] = (DWORD)(ChunkOffset);
+
+    while(dwLength >= MPQE_CHUNK_SIZE)
+    {
+        // Generate the key stream for as many chunks as possible
+        dwChunkCount = STORMLIB_MIN(dwLength / MPQE_CHUNK_SIZE, MPQE_KEYSTREAM_CHUNKS);
+#ifdef MPQE_USE_SSE2
+        for(DWORD i = 0; i < (dwChunkCount & ~3); i += 4)
+            GenerateKeyStream_SSE2(KeyMirror, KeyStream + i * 0x10);
+        GenerateKeyStream(KeyMirror, KeyStream + (dwChunkCount & ~3) * 0x10, dwChunkCount & 3);
+#else
+        GenerateKeyStream(KeyMirror, KeyStream, dwChunkCount);
+#endif
+
+        // Decrypt the data chunks
+        dwWordCount = dwChunkCount * (MPQE_CHUNK_SIZE / sizeof(DWORD));
+        BSWAP_ARRAY32_UNSIGNED(MpqData, dwChunkCount * MPQE_CHUNK_SIZE);
+        for(DWORD i = 0; i < dwWordCount; i++)
+            MpqData[i] ^= KeyStream[i];
+        BSWAP_ARRAY32_UNSIGNED(MpqData, dwChunkCount * MPQE_CHUNK_SIZE);
+
+        // Move pointers and decrease number of bytes to decrypt
+        MpqData  += dwWordCount;
+        dwLength -= dwChunkCount * MPQE_CHUNK_SIZE;
+    }
+}
+
+static bool DetectFileKey(TEncryptedStream * pStream)
+{
+    ULONGLONG ByteOffset = 0;
+    BYTE EncryptedHeader[MPQE_CHUNK_SIZE];
+    BYTE FileHeader[MPQE_CHUNK_SIZE];
+
+    // Load the chunk from the file
+    if(!FileStream_Read(pStream, &ByteOffset, EncryptedHeader, sizeof(EncryptedHeader)))
+        return false;
+
+    // We just try all known keys one by one
+    for(int i = 0; MpqKeyArray[i] != NULL; i++)
+    {
+        // Copy the key there
+        memcpy(pStream->Key, MpqKeyArray[i], MPQE_CHUNK_SIZE);
+        BSWAP_ARRAY32_UNSIGNED(pStream->Key, MPQE_CHUNK_SIZE);
+
+        // Try to decrypt with the given key
+        memcpy(FileHeader, EncryptedHeader, MPQE_CHUNK_SIZE);
+        DecryptFileChunk((LPDWORD)FileHeader, pStream->Key, ByteOffset, MPQE_CHUNK_SIZE);
+
+        // We check the decrypoted data
+        // All known encrypted MPQs have header at the begin of the file,
+        // so we check for MPQ signature there.
+        if(FileHeader[0] == 'M' && FileHeader[1] == 'P' && FileHeader[2] == 'Q')
+            return true;
+    }
+
+    // Key not found, sorry
+    return false;
+}
+
+// Reads and decrypts the data. The whole chunks are decrypted right
+// in the caller's buffer, the partial ones go through a local buffer
+static bool EncryptedFile_ReadRange(TEncryptedStream * pStream, ULONGLONG ByteOffset, LPBYTE pbBuffer, DWORD dwBytesToRead)
+{
+    ULONGLONG ChunkOffset;
+    DWORD ChunkData[MPQE_CHUNK_SIZE / sizeof(DWORD)];
+    DWORD dwOffsetInChunk;
+    DWORD dwBytesInChunk;
+
+    while(dwBytesToRead != 0)
+    {
+        dwOffsetInChunk = (DWORD)ByteOffset & (MPQE_CHUNK_SIZE - 1);
+
+        // Whole chunks
+        if(dwOffsetInChunk == 0 && dwBytesToRead >= MPQE_CHUNK_SIZE)
+        {
+            dwBytesInChunk = dwBytesToRead & ~(MPQE_CHUNK_SIZE - 1);
+            if(!File_Read(pStream, &ByteOffset, pbBuffer, dwBytesInChunk))
+                return false;
+            DecryptFileChunk((LPDWORD)pbBuffer, pStream->Key, ByteOffset, dwBytesInChunk);
+        }
+        else
+        {
+            // Partial chunk. Note that the last chunk of the file may be incomplete
+            ChunkOffset = ByteOffset - dwOffsetInChunk;
+            dwBytesInChunk = STORMLIB_MIN(MPQE_CHUNK_SIZE - dwOffsetInChunk, dwBytesToRead);
+
+            memset(ChunkData, 0, sizeof(ChunkData));
+            if(!File_Read(pStream, &ChunkOffset, ChunkData, dwOffsetInChunk + dwBytesInChunk))
+                return false;
+            DecryptFileChunk(ChunkData, pStream->Key, ChunkOffset, MPQE_CHUNK_SIZE);
+            memcpy(pbBuffer, (LPBYTE)ChunkData + dwOffsetInChunk, dwBytesInChunk);
+        }
+
+        ByteOffset += dwBytesInChunk;
+        pbBuffer += dwBytesInChunk;
+        dwBytesToRead -= dwBytesInChunk;
+    }
+
+    return true;
+}
+
+// Loads the cache with decrypted data from the given offset
+static bool EncryptedFile_LoadCache(TEncryptedStream * pStream, ULONGLONG ByteOffset)
+{
+    ULONGLONG FileSize = 0;
+    DWORD cbCache = MPQE_CACHE_SIZE;
+
+    // Don't read past the end of the file
+    pStream->cbCache = 0;
+    if(!File_GetSize(pStream, FileSize))
+        return false;
+    if(ByteOffset >= FileSize)
+        return true;
+    if((FileSize - ByteOffset) < cbCache)
+        cbCache = (DWORD)(FileSize - ByteOffset);
+
+    if(!EncryptedFile_ReadRange(pStream, ByteOffset, pStream->Cache, cbCache))
+        return false;
+
+    pStream->CacheOffset = ByteOffset;
+    pStream->cbCache = cbCache;
+    return true;
+}
+
+static bool EncryptedFile_Read(
+    TEncryptedStream * pStream,             // Pointer to an open stream
+    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
+    void * pvBuffer,                        // Pointer to data to be read
+    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+{
+    ULONGLONG ByteOffset;                   // Offset that the caller wants
+    DWORD dwOffsetInCache;
+    DWORD dwBytesRead = dwBytesToRead;
+    bool bResult;
+
+    // Get the byte offset
+    if(pByteOffset != NULL)
+        ByteOffset = *pByteOffset;
+    else
+        ByteOffset = pStream->RawFilePos;
+
+    // Small reads are served from the decrypted data cache, so that the chunks
+    // shared by neighbouring reads are not read and decrypted again.
+    // Streams read by more threads don't use the cache.
+    if(dwBytesToRead <= (MPQE_CACHE_SIZE / 2) && (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+    {
+        if(ByteOffset < pStream->CacheOffset || (ByteOffset + dwBytesToRead) > (pStream->CacheOffset + pStream->cbCache))
+        {
+            if(!EncryptedFile_LoadCache(pStream, ByteOffset & ~(ULONGLONG)(MPQE_CHUNK_SIZE - 1)))
+                return false;
+        }
+
+        // Copy the data. If the read goes past the end of the file, copy what's there
+        dwBytesRead = 0;
+        if(ByteOffset >= pStream->CacheOffset && ByteOffset < (pStream->CacheOffset + pStream->cbCache))
+        {
+            dwOffsetInCache = (DWORD)(ByteOffset - pStream->CacheOffset);
+            dwBytesRead = STORMLIB_MIN(pStream->cbCache - dwOffsetInCache, dwBytesToRead);
+            memcpy(pvBuffer, pStream->Cache + dwOffsetInCache, dwBytesRead);
+        }
+
+        bResult = (dwBytesRead == dwBytesToRead);
+        if(bResult == false)
+            SetLastError(ERROR_HANDLE_EOF);
+    }
+    else
+    {
+        bResult = EncryptedFile_ReadRange(pStream, ByteOffset, (LPBYTE)pvBuffer, dwBytesToRead);
+    }
+
+    // Move the file position by the number of bytes read
+    if(bResult && (pByteOffset == NULL || (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0))
+        pStream->RawFilePos = ByteOffset + dwBytesRead;
+    return bResult;
+}
+
+static bool EncryptedFile_Write(
+    TEncryptedStream * pStream,             // Pointer to an open stream
+    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
+    const void * pvBuffer,                  // Pointer to data to be read
+    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+{
+    // Keep compiler happy
+    dwBytesToRead = dwBytesToRead;
+    pByteOffset = pByteOffset;
+    pvBuffer = pvBuffer;
+    pStream = pStream;
+
+    // Not allowed
+    return false;
+}
+
+static bool EncryptedFile_SetSize(
+    TEncryptedStream * pStream,             // Pointer to an open stream
+    ULONGLONG NewSize)                      // new size of the file
+{
+    // Keep compiler happy
+    pStream = pStream;
+    NewSize = NewSize;
+
+    // Not allowed
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Stream functions - callback stream
+//
+// The archive data are provided by the caller (see SFileOpenArchiveEx).
+// There is no file handle; all operations are passed to the callbacks.
+//
+
+static bool CallbackFile_Read(TCallbackStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead)
+{
+    ULONGLONG ByteOffset;
+    DWORD dwBytesRead = 0;
+
+    // If the byte offset is not entered, use the current position
+    ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos;
+
+    // Read the data. The callback may read less than required at the end of the data
+    if(dwBytesToRead != 0)
+    {
+        if(!pStream->Callbacks.StreamRead(pStream->pvUserData, ByteOffset, pvBuffer, dwBytesToRead, &dwBytesRead))
+            return false;
+        dwBytesRead = STORMLIB_MIN(dwBytesRead, dwBytesToRead);
+    }
+
+    // Move the file position by the number of bytes read
+    if(pByteOffset == NULL || (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+        pStream->RawFilePos = ByteOffset + dwBytesRead;
+    if(dwBytesRead != dwBytesToRead)
+        SetLastError(ERROR_HANDLE_EOF);
+    return (dwBytesRead == dwBytesToRead);
+}
+
+static bool CallbackFile_Write(TCallbackStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite)
+{
+    ULONGLONG ByteOffset;
+
+    // Streams without write callback are open as read only
+    if(pStream->Callbacks.StreamWrite == NULL)
+    {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return false;
+    }
+
+    // If the byte offset is not entered, use the current position
+    ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos;
+    if(!pStream->Callbacks.StreamWrite(pStream->pvUserData, ByteOffset, pvBuffer, dwBytesToWrite))
+        return false;
+
+    pStream->RawFilePos = ByteOffset + dwBytesToWrite;
+    return true;
+}
+
+static bool CallbackFile_GetSize(TCallbackStream * pStream, ULONGLONG & FileSize)
+{
+    return pStream->Callbacks.StreamGetSize(pStream->pvUserData, &FileSize);
+}
+
+static bool CallbackFile_SetSize(TCallbackStream * pStream, ULONGLONG NewFileSize)
+{
+    if(pStream->Callbacks.StreamSetSize == NULL)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    return pStream->Callbacks.StreamSetSize(pStream->pvUserData, NewFileSize);
+}
+
+static void CallbackFile_Close(TCallbackStream * pStream)
+{
+    if(pStream->Callbacks.StreamClose != NULL)
+        pStream->Callbacks.StreamClose(pStream->pvUserData);
+}
+
+//-----------------------------------------------------------------------------
+// Block cache
+//
+// Caches raw blocks of the file, so that the data which are read repeatedly
+// (e.g. the same file open by more handles) are read from the disk only once.
+// The cache sits under FileStream_Read, so it is shared by all handles
+// to files in the archive. Blocks are evicted in LRU order when the cache
+// gets over its size limit. Writes invalidate the affected blocks.
+//
+// Memory-mapped streams don't use the cache, because their data are
+// in memory already. Neither do PART file streams, which have their own position.
+//
+
+static TBlockCache * BlockCache_Create(DWORD dwMaxSize)
+{
+    TBlockCache * pCache;
+    DWORD dwMaxBlocks = dwMaxSize / BLOCK_CACHE_BLOCK_SIZE;
+    DWORD dwHashSize = 0x10;
+
+    // Have at least as many hash buckets as there can be blocks
+    while(dwHashSize < dwMaxBlocks)
+        dwHashSize <<= 1;
+
+    pCache = ALLOCMEM(TBlockCache, 1);
+    if(pCache != NULL)
+    {
+        memset(pCache, 0, sizeof(TBlockCache));
+        pCache->HashTable = ALLOCMEM(TCacheBlock *, dwHashSize);
+        if(pCache->HashTable == NULL)
+        {
+            FREEMEM(pCache);
+            return NULL;
+        }
+
+        memset(pCache->HashTable, 0, dwHashSize * sizeof(TCacheBlock *));
+        SyncLock_Init(&pCache->Lock);
+        pCache->dwHashMask = dwHashSize - 1;
+        pCache->dwMaxSize = dwMaxSize;
+    }
+
+    return pCache;
+}
+
+static TCacheBlock ** BlockCache_FindSlot(TBlockCache * pCache, ULONGLONG BlockOffset)
+{
+    TCacheBlock ** ppBlock;
+
+    ppBlock = &pCache->HashTable[(DWORD)(BlockOffset / BLOCK_CACHE_BLOCK_SIZE) & pCache->dwHashMask];
+    while(*ppBlock != NULL && (*ppBlock)->BlockOffset != BlockOffset)
+        ppBlock = &(*ppBlock)->pNextInHash;
+    return ppBlock;
+}
+
+static void BlockCache_Unlink(TBlockCache * pCache, TCacheBlock * pBlock)
+{
+    if(pBlock->pPrev != NULL)
+        pBlock->pPrev->pNext = pBlock->pNext;
+    else
+        pCache->pFirst = pBlock->pNext;
+
+    if(pBlock->pNext != NULL)
+        pBlock->pNext->pPrev = pBlock->pPrev;
+    else
+        pCache->pLast = pBlock->pPrev;
+}
+
+static void BlockCache_LinkFirst(TBlockCache * pCache, TCacheBlock * pBlock)
+{
+    pBlock->pPrev = NULL;
+    pBlock->pNext = pCache->pFirst;
+    if(pCache->pFirst != NULL)
+        pCache->pFirst->pPrev = pBlock;
+    else
+        pCache->pLast = pBlock;
+    pCache->pFirst = pBlock;
+}
+
+static void BlockCache_Remove(TBlockCache * pCache, TCacheBlock * pBlock)
+{
+    TCacheBlock ** ppBlock = BlockCache_FindSlot(pCache, pBlock->BlockOffset);
+
+    *ppBlock = pBlock->pNextInHash;
+    BlockCache_Unlink(pCache, pBlock);
+    pCache->dwCachedSize -= pBlock->cbData;
+    FREEMEM(pBlock);
+}
+
+// Removes the blocks that overlap the given range
+static void BlockCache_Invalidate(TBlockCache * pCache, ULONGLONG ByteOffset, ULONGLONG Length)
+{
+    TCacheBlock * pNextBlock;
+    TCacheBlock * pBlock;
+
+    SyncLock_Enter(&pCache->Lock);
+    for(pBlock = pCache->pFirst; pBlock != NULL; pBlock = pNextBlock)
+    {
+        pNextBlock = pBlock->pNext;
+        if(pBlock->BlockOffset < (ByteOffset + Length) && ByteOffset < (pBlock->BlockOffset + BLOCK_CACHE_BLOCK_SIZE))
+            BlockCache_Remove(pCache, pBlock);
+    }
+    SyncLock_Leave(&pCache->Lock);
+}
+
+static void BlockCache_Free(TBlockCache * pCache)
+{
+    if(pCache != NULL)
+    {
+        while(pCache->pFirst != NULL)
+            BlockCache_Remove(pCache, pCache->pFirst);
+
+        SyncLock_Free(&pCache->Lock);
+        FREEMEM(pCache->HashTable);
+        FREEMEM(pCache);
+    }
+}
+
+// Copies data from a cached block. Returns number of bytes copied.
+// Must be called with the lock held
+static DWORD BlockCache_Copy(TBlockCache * pCache, TCacheBlock * pBlock, ULONGLONG ByteOffset, LPBYTE pbBuffer, DWORD dwBytesToRead)
+{
+    DWORD dwOffsetInBlock = (DWORD)(ByteOffset - pBlock->BlockOffset);
+    DWORD dwBytesToCopy = 0;
 
-        // Update byte offset in the key
-        KeyMirror[0x08]++;
-        if(KeyMirror[0x08] == 0)
-            KeyMirror[0x05]++;
+    if(dwOffsetInBlock < pBlock->cbData)
+    {
+        dwBytesToCopy = STORMLIB_MIN(pBlock->cbData - dwOffsetInBlock, dwBytesToRead);
+        memcpy(pbBuffer, pBlock->Data + dwOffsetInBlock, dwBytesToCopy);
+    }
 
-        // Move pointers and decrease number of bytes to decrypt
-        MpqData  += (MPQE_CHUNK_SIZE / sizeof(DWORD));
-        dwLength -= MPQE_CHUNK_SIZE;
+    // Move the block to the begin of the LRU list
+    if(pCache->pFirst != pBlock)
+    {
+        BlockCache_Unlink(pCache, pBlock);
+        BlockCache_LinkFirst(pCache, pBlock);
     }
+    return dwBytesToCopy;
 }
 
-
-static bool DetectFileKey(TEncryptedStream * pStream)
+// Reads one block from the file. The block is not inserted to the cache yet
+static TCacheBlock * BlockCache_LoadBlock(TFileStream * pStream, ULONGLONG BlockOffset)
 {
-    ULONGLONG ByteOffset = 0;
-    BYTE EncryptedHeader[MPQE_CHUNK_SIZE];
-    BYTE FileHeader[MPQE_CHUNK_SIZE];
-
-    // Load the chunk from the file
-    if(!FileStream_Read(pStream, &ByteOffset, EncryptedHeader, sizeof(EncryptedHeader)))
-        return false;
+    TCacheBlock * pBlock;
+    ULONGLONG FileSize = 0;
+    DWORD cbData = BLOCK_CACHE_BLOCK_SIZE;
 
-    // We just try all known keys one by one
-    for(int i = 0; MpqKeyArray[i] != NULL; i++)
+    // The last block of the file is shorter
+    if(!pStream->StreamGetSize(pStream, FileSize))
+        return NULL;
+    if(BlockOffset >= FileSize)
     {
-        // Copy the key there
-        memcpy(pStream->Key, MpqKeyArray[i], MPQE_CHUNK_SIZE);
-        BSWAP_ARRAY32_UNSIGNED(pStream->Key, MPQE_CHUNK_SIZE);
+        SetLastError(ERROR_HANDLE_EOF);
+        return NULL;
+    }
+    if((FileSize - BlockOffset) < cbData)
+        cbData = (DWORD)(FileSize - BlockOffset);
 
-        // Try to decrypt with the given key
-        memcpy(FileHeader, EncryptedHeader, MPQE_CHUNK_SIZE);
-        DecryptFileChunk((LPDWORD)FileHeader, pStream->Key, ByteOffset, MPQE_CHUNK_SIZE);
+    pBlock = (TCacheBlock *)ALLOCMEM(BYTE, sizeof(TCacheBlock) + cbData);
+    if(pBlock == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
 
-        // We check the decrypoted data
-        // All known encrypted MPQs have header at the begin of the file,
-        // so we check for MPQ signature there.
-        if(FileHeader[0] == 'M' && FileHeader[1] == 'P' && FileHeader[2] == 'Q')
-            return true;
+    // Read the block. Thread-safe streams don't move the file position on that
+    if(!pStream->StreamRead(pStream, &BlockOffset, pBlock->Data, cbData))
+    {
+        FREEMEM(pBlock);
+        return NULL;
     }
 
-    // Key not found, sorry
-    return false;
+    pBlock->BlockOffset = BlockOffset;
+    pBlock->cbData = cbData;
+    return pBlock;
 }
 
-static bool EncryptedFile_Read(
-    TEncryptedStream * pStream,             // Pointer to an open stream
-    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
-    void * pvBuffer,                        // Pointer to data to be read
-    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+static bool BlockCache_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead)
 {
-    ULONGLONG StartOffset;                  // Offset of the first byte to be read from the file
-    ULONGLONG ByteOffset;                   // Offset that the caller wants
-    ULONGLONG EndOffset;                    // End offset that is to be read from the file
-    DWORD dwBytesToAllocate;
-    DWORD dwBytesToDecrypt;
-    DWORD dwOffsetInCache;
-    LPBYTE pbMpqData = NULL;
-    bool bResult = false;
-
-    // Get the byte offset
-    if(pByteOffset != NULL)
-        ByteOffset = *pByteOffset;
-    else
-        ByteOffset = pStream->RawFilePos;
+    TBlockCache * pCache = pStream->pCache;
+    TCacheBlock ** ppBlock;
+    TCacheBlock * pNewBlock;
+    ULONGLONG ByteOffset;
+    ULONGLONG BlockOffset;
+    LPBYTE pbBuffer = (LPBYTE)pvBuffer;
+    DWORD dwBytesCopied;
+    bool bResult = true;
 
-    // Cut it down to MPQE chunk size
-    StartOffset = ByteOffset;
-    StartOffset = StartOffset & ~(MPQE_CHUNK_SIZE - 1);
-    EndOffset = ByteOffset + dwBytesToRead;
+    // Large reads would only push everything else out of the cache
+    if(dwBytesToRead > (pCache->dwMaxSize / 8))
+        return pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
 
-    // Calculate number of bytes to decrypt
-    dwBytesToDecrypt = (DWORD)(EndOffset - StartOffset);
-    dwBytesToAllocate = (dwBytesToDecrypt + (MPQE_CHUNK_SIZE - 1)) & ~(MPQE_CHUNK_SIZE - 1);
+    // If the byte offset is not entered, use the current position
+    ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos;
 
-    // Allocate buffers for encrypted and decrypted data
-    pbMpqData = ALLOCMEM(BYTE, dwBytesToAllocate);
-    if(pbMpqData)
+    while(dwBytesToRead != 0)
     {
-        // Get the offset of the desired data in the cache
-        dwOffsetInCache = (DWORD)(ByteOffset - StartOffset);
+        BlockOffset = ByteOffset & ~(ULONGLONG)(BLOCK_CACHE_BLOCK_SIZE - 1);
 
-        // Read the file from the stream as-is
-        if(File_Read(pStream, &StartOffset, pbMpqData, dwBytesToDecrypt))
+        // Look the block up in the cache
+        SyncLock_Enter(&pCache->Lock);
+        ppBlock = BlockCache_FindSlot(pCache, BlockOffset);
+        if(*ppBlock != NULL)
         {
-            // Decrypt the data
-            DecryptFileChunk((LPDWORD)pbMpqData, pStream->Key, StartOffset, dwBytesToAllocate);
-
-            // Copy the decrypted data
-            memcpy(pvBuffer, pbMpqData + dwOffsetInCache, dwBytesToRead);
-            bResult = true;
+            pCache->CacheHits++;
+            dwBytesCopied = BlockCache_Copy(pCache, *ppBlock, ByteOffset, pbBuffer, dwBytesToRead);
+            SyncLock_Leave(&pCache->Lock);
         }
         else
         {
-            assert(false);
+            pCache->CacheMisses++;
+            SyncLock_Leave(&pCache->Lock);
+
+            // Read the block without holding the lock
+            pNewBlock = BlockCache_LoadBlock(pStream, BlockOffset);
+            if(pNewBlock == NULL)
+            {
+                bResult = false;
+                break;
+            }
+
+            // Another thread may have loaded the same block in the meantime
+            SyncLock_Enter(&pCache->Lock);
+            ppBlock = BlockCache_FindSlot(pCache, BlockOffset);
+            if(*ppBlock == NULL)
+            {
+                pNewBlock->pNextInHash = NULL;
+                *ppBlock = pNewBlock;
+                BlockCache_LinkFirst(pCache, pNewBlock);
+                pCache->dwCachedSize += pNewBlock->cbData;
+                pNewBlock = NULL;
+
+                // Evict the least recently used blocks
+                while(pCache->dwCachedSize > pCache->dwMaxSize && pCache->pLast != pCache->pFirst)
+                    BlockCache_Remove(pCache, pCache->pLast);
+                ppBlock = BlockCache_FindSlot(pCache, BlockOffset);
+            }
+            dwBytesCopied = BlockCache_Copy(pCache, *ppBlock, ByteOffset, pbBuffer, dwBytesToRead);
+            SyncLock_Leave(&pCache->Lock);
+
+            if(pNewBlock != NULL)
+                FREEMEM(pNewBlock);
+        }
+
+        // Reached the end of the file?
+        if(dwBytesCopied == 0)
+        {
+            SetLastError(ERROR_HANDLE_EOF);
+            bResult = false;
+            break;
         }
 
-        // Free decryption buffer
-        FREEMEM(pbMpqData);
+        ByteOffset += dwBytesCopied;
+        pbBuffer += dwBytesCopied;
+        dwBytesToRead -= dwBytesCopied;
     }
 
-    // Free buffers and exit
+    // Move the file position, like the stream's own read function does
+    if(pByteOffset == NULL || (pStream->StreamFlags & STREAM_FLAG_THREAD_SAFE) == 0)
+        pStream->RawFilePos = ByteOffset;
     return bResult;
 }
 
-static bool EncryptedFile_Write(
-    TEncryptedStream * pStream,             // Pointer to an open stream
-    ULONGLONG * pByteOffset,                // Pointer to file byte offset. If NULL, it reads from the current position
-    const void * pvBuffer,                  // Pointer to data to be read
-    DWORD dwBytesToRead)                    // Number of bytes to read from the file
+//-----------------------------------------------------------------------------
+// Write combining
+//
+// Writing an archive produces many small writes that follow each other
+// (sector after sector, file after file). The stream collects them into
+// a buffer and writes them at once when the buffer gets full or when
+// a write doesn't continue the buffered data. The buffer is always flushed
+// at an offset aligned to its size, so the large writes are aligned too.
+// The buffered data are written before any read, size change or closing
+// of the stream, so they are never visible as missing. Note that an error
+// of a buffered write is reported by the operation that flushes the buffer.
+//
+
+static bool WriteBuffer_Flush(TFileStream * pStream)
 {
-    // Keep compiler happy
-    dwBytesToRead = dwBytesToRead;
-    pByteOffset = pByteOffset;
-    pvBuffer = pvBuffer;
-    pStream = pStream;
+    ULONGLONG ByteOffset = pStream->WriteBufferPos;
+    ULONGLONG RawFilePos = pStream->RawFilePos;
+    DWORD cbWriteBuffer = pStream->cbWriteBuffer;
+    bool bResult = true;
 
-    // Not allowed
-    return false;
+    if(cbWriteBuffer != 0)
+    {
+        // The buffer is emptied even if the write fails, so the failed data
+        // are not written again by the next flush
+        pStream->cbWriteBuffer = 0;
+        bResult = pStream->StreamWrite(pStream, &ByteOffset, pStream->pbWriteBuffer, cbWriteBuffer);
+
+        // The stream position is where the last buffered write ended
+        pStream->RawFilePos = RawFilePos;
+    }
+
+    return bResult;
 }
 
-static bool EncryptedFile_SetSize(
-    TEncryptedStream * pStream,             // Pointer to an open stream
-    ULONGLONG NewSize)                      // new size of the file
+static bool WriteBuffer_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite)
 {
-    // Keep compiler happy
-    pStream = pStream;
-    NewSize = NewSize;
+    ULONGLONG ByteOffset;
+    LPBYTE pbBuffer = (LPBYTE)pvBuffer;
+    DWORD dwBufferEnd;
+    DWORD dwBytesToCopy;
 
-    // Not allowed
-    return false;
+    // If the byte offset is not entered, use the current position
+    ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos;
+
+    // Allocate the buffer on the first write. If that fails, don't combine the writes
+    if(pStream->pbWriteBuffer == NULL)
+    {
+        pStream->pbWriteBuffer = ALLOCMEM(BYTE, pStream->cbWriteBufferSize);
+        if(pStream->pbWriteBuffer == NULL)
+        {
+            pStream->cbWriteBufferSize = 0;
+            return pStream->StreamWrite(pStream, &ByteOffset, pvBuffer, dwBytesToWrite);
+        }
+    }
+
+    // A write that doesn't continue the buffered data flushes them
+    if(pStream->cbWriteBuffer != 0 && ByteOffset != (pStream->WriteBufferPos + pStream->cbWriteBuffer))
+    {
+        if(!WriteBuffer_Flush(pStream))
+            return false;
+    }
+
+    while(dwBytesToWrite != 0)
+    {
+        if(pStream->cbWriteBuffer == 0)
+            pStream->WriteBufferPos = ByteOffset;
+
+        // The buffered data end at the next offset aligned to the buffer size
+        dwBufferEnd = pStream->cbWriteBufferSize - (DWORD)(pStream->WriteBufferPos & (pStream->cbWriteBufferSize - 1));
+
+        // If the buffer is empty and the data reach the aligned offset,
+        // write the aligned part directly and buffer the rest
+        if(pStream->cbWriteBuffer == 0 && dwBytesToWrite >= dwBufferEnd)
+        {
+            dwBytesToCopy = dwBufferEnd + ((dwBytesToWrite - dwBufferEnd) & ~(pStream->cbWriteBufferSize - 1));
+            if(!pStream->StreamWrite(pStream, &ByteOffset, pbBuffer, dwBytesToCopy))
+                return false;
+        }
+        else
+        {
+            dwBytesToCopy = STORMLIB_MIN(dwBufferEnd - pStream->cbWriteBuffer, dwBytesToWrite);
+            memcpy(pStream->pbWriteBuffer + pStream->cbWriteBuffer, pbBuffer, dwBytesToCopy);
+            pStream->cbWriteBuffer += dwBytesToCopy;
+
+            // Flush the buffer when it gets to the aligned offset
+            pStream->RawFilePos = ByteOffset + dwBytesToCopy;
+            if(pStream->cbWriteBuffer == dwBufferEnd && !WriteBuffer_Flush(pStream))
+                return false;
+        }
+
+        ByteOffset += dwBytesToCopy;
+        pbBuffer += dwBytesToCopy;
+        dwBytesToWrite -= dwBytesToCopy;
+    }
+
+    pStream->RawFilePos = ByteOffset;
+    return true;
 }
 
 //-----------------------------------------------------------------------------
@@ -1173,6 +2355,7 @@ TFileStream * FileStream_CreateFile(const char * szFileName)
             pStream->StreamWrite   = File_Write;
             pStream->StreamGetSize = File_GetSize;
             pStream->StreamSetSize = File_SetSize;
+            pStream->cbWriteBufferSize = WRITE_BUFFER_SIZE;
             pStream->hFile = hFile;
         }
         else
@@ -1230,6 +2413,8 @@ TFileStream * FileStream_OpenRawFile(const char * szFileName, bool bWriteAccess)
         pStream->StreamSetSize = File_SetSize;
         if(bWriteAccess == false)
             pStream->StreamFlags |= STREAM_FLAG_READ_ONLY;
+        else
+            pStream->cbWriteBufferSize = WRITE_BUFFER_SIZE;
         pStream->hFile = hFile;
         return pStream;
     }
@@ -1241,6 +2426,9 @@ TFileStream * FileStream_OpenRawFile(const char * szFileName, bool bWriteAccess)
 /**
  * Opens a file
  *
+ * - If the file is a PART file, it is open as TPartFileStream
+ * - If the file is open for read only, it is memory-mapped, if possible
+ *
  * \a szFileName Name of the file to open
  * \a bWriteAccess false for read only, true for read+write
  */
@@ -1306,10 +2494,20 @@ TFileStream * FileStream_OpenFile(const char * szFileName, bool bWriteAccess)
                 pPartStream->StreamFlags  |= (STREAM_FLAG_READ_ONLY | STREAM_FLAG_PART_FILE);
 
                 // Fill the members of PART file stream
-                pPartStream->VirtualSize = ((ULONGLONG)PartHdr.FileSizeHi) + PartHdr.FileSizeLo;
+                pPartStream->VirtualSize = VirtualSize;
                 pPartStream->VirtualPos = 0;
                 pPartStream->PartCount = PartCount;
                 pPartStream->PartSize = PartHdr.PartSize;
+                pPartStream->bWriteAccess = bWriteAccess;
+
+                // If open for write, the missing parts can be filled from the default source
+                if(bWriteAccess)
+                {
+                    LockDefaultPartFileCB();
+                    pPartStream->PartFileCB = DefaultPartFileCB;
+                    pPartStream->pvPartFileData = pvDefaultPartFileData;
+                    UnlockDefaultPartFileCB();
+                }
 
                 FREEMEM(pStream);
             }
@@ -1320,6 +2518,10 @@ TFileStream * FileStream_OpenFile(const char * szFileName, bool bWriteAccess)
     // If the file doesn't contain PART file header,
     // reset the file position to begin of the file
     FileStream_Read(pStream, &ByteOffset, NULL, 0);
+
+    // Files open for read only are accessed through a memory-mapped view, if possible
+    if(bWriteAccess == false)
+        pStream = CreateMappedStream(pStream);
     return pStream;
 }
 
@@ -1349,8 +2551,8 @@ TFileStream * FileStream_OpenEncrypted(const char * szFileName)
             // Get the file key
             if(!DetectFileKey(pEncryptedStream))
             {
+                FileStream_Close(pEncryptedStream);
                 SetLastError(ERROR_UNKNOWN_FILE_KEY);
-                FREEMEM(pEncryptedStream);
                 pEncryptedStream = NULL;
             }
         }
@@ -1362,6 +2564,107 @@ TFileStream * FileStream_OpenEncrypted(const char * szFileName)
     return NULL;
 }
 
+/**
+ * Opens a read-only stream over a memory buffer provided by the caller.
+ * The stream behaves like a memory-mapped file, so the stored files
+ * can be accessed without copying (see FileStream_GetView).
+ *
+ * - The buffer is not copied; it must stay valid until the stream is closed
+ * - The buffer is not freed when the stream is closed
+ *
+ * \a szFileName Name of the archive, used for signature verification. Can be NULL
+ * \a pvData Pointer to the archive data
+ * \a cbData Size of the archive data, in bytes
+ */
+TFileStream * FileStream_OpenMemory(const char * szFileName, const void * pvData, ULONGLONG cbData)
+{
+    TMappedFileStream * pStream;
+
+    // The entire buffer must be addressable
+    if(pvData == NULL || (ULONGLONG)(size_t)cbData != cbData)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    pStream = ALLOCMEM(TMappedFileStream, 1);
+    if(pStream == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    // Reset entire structure to zero
+    memset(pStream, 0, sizeof(TMappedFileStream));
+    if(szFileName != NULL)
+        strncpy(pStream->szFileName, szFileName, MAX_PATH - 1);
+
+    // Set function pointers. Nothing is to be released on close
+    pStream->StreamGetPos  = File_GetPos;
+    pStream->StreamRead    = (STREAM_READ)MappedFile_Read;
+    pStream->StreamWrite   = (STREAM_WRITE)MappedFile_Write;
+    pStream->StreamGetSize = (STREAM_GETSIZE)MappedFile_GetSize;
+    pStream->StreamSetSize = (STREAM_SETSIZE)MappedFile_SetSize;
+    pStream->StreamFlags   = (STREAM_FLAG_READ_ONLY | STREAM_FLAG_MAPPED_FILE | STREAM_FLAG_USER_DATA);
+    pStream->hFile = INVALID_HANDLE_VALUE;
+
+    // Fill the members of the mapped stream
+    pStream->FileSize = cbData;
+    pStream->pbFileView = (LPBYTE)pvData;
+    return pStream;
+}
+
+/**
+ * Opens a stream whose data are provided by the caller's callbacks
+ *
+ * - The read and get size callbacks are required
+ * - If there is no write callback, the stream is read only
+ * - The close callback, if any, is called when the stream is closed
+ *
+ * \a szFileName Name of the archive, used for signature verification. Can be NULL
+ * \a pCallbacks Pointer to the stream callbacks. The structure is copied
+ * \a pvUserData User data passed to the callbacks
+ */
+TFileStream * FileStream_OpenCallbacks(const char * szFileName, const SFILE_STREAM_CALLBACKS * pCallbacks, void * pvUserData)
+{
+    TCallbackStream * pStream;
+
+    if(pCallbacks == NULL || pCallbacks->StreamRead == NULL || pCallbacks->StreamGetSize == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    pStream = ALLOCMEM(TCallbackStream, 1);
+    if(pStream == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    // Reset entire structure to zero
+    memset(pStream, 0, sizeof(TCallbackStream));
+    if(szFileName != NULL)
+        strncpy(pStream->szFileName, szFileName, MAX_PATH - 1);
+
+    // Set function pointers
+    pStream->StreamGetPos  = File_GetPos;
+    pStream->StreamRead    = (STREAM_READ)CallbackFile_Read;
+    pStream->StreamWrite   = (STREAM_WRITE)CallbackFile_Write;
+    pStream->StreamGetSize = (STREAM_GETSIZE)CallbackFile_GetSize;
+    pStream->StreamSetSize = (STREAM_SETSIZE)CallbackFile_SetSize;
+    pStream->StreamClose   = (STREAM_CLOSE)CallbackFile_Close;
+    pStream->StreamFlags   = STREAM_FLAG_USER_DATA;
+    if(pCallbacks->StreamWrite == NULL)
+        pStream->StreamFlags |= STREAM_FLAG_READ_ONLY;
+    pStream->hFile = INVALID_HANDLE_VALUE;
+
+    // Fill the members of the callback stream
+    pStream->Callbacks = *pCallbacks;
+    pStream->pvUserData = pvUserData;
+    return pStream;
+}
+
 /**
  * This function returns the current file position
  * \a pStream
@@ -1395,9 +2698,148 @@ bool FileStream_GetPos(TFileStream * pStream, ULONGLONG & ByteOffset)
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead)
 {
     assert(pStream->StreamRead != NULL);
+
+    // The data being read may be still in the write buffer
+    if(pStream->cbWriteBuffer != 0 && !WriteBuffer_Flush(pStream))
+        return false;
+
+    // Go through the block cache, if the stream has one
+    if(pStream->pCache != NULL && dwBytesToRead != 0)
+        return BlockCache_Read(pStream, pByteOffset, pvBuffer, dwBytesToRead);
     return pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
 }
 
+/**
+ * Gives direct access to the file data, without copying them
+ *
+ * - Only works on memory-mapped streams (STREAM_FLAG_MAPPED_FILE)
+ * - The returned pointer is valid until the stream is closed
+ * - Does not change the file position
+ *
+ * \a pStream Pointer to an open stream
+ * \a ByteOffset File offset of the first byte to be accessed
+ * \a dwBytesToMap Number of bytes to be accessed
+ *
+ * \returns
+ * - Pointer to the file data, if the whole range lies in the mapped view
+ * - NULL if the stream is not memory-mapped or the range goes beyond end of the file
+ */
+const void * FileStream_GetView(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesToMap)
+{
+    TMappedFileStream * pMappedStream = (TMappedFileStream *)pStream;
+
+    // Only mapped streams have a view of the file
+    if((pStream->StreamFlags & STREAM_FLAG_MAPPED_FILE) == 0)
+        return NULL;
+
+    // The entire range must be within the file
+    if(ByteOffset > pMappedStream->FileSize || (pMappedStream->FileSize - ByteOffset) < dwBytesToMap)
+        return NULL;
+
+    return pMappedStream->pbFileView + (size_t)ByteOffset;
+}
+
+/**
+ * Sets the source of missing parts of a PART file. When a read needs a part
+ * that is not present yet, the stream gets it from the callback, appends it
+ * to the file and marks it as present in the part map.
+ *
+ * - If pStream is NULL, sets the default source for PART files open later
+ * - The stream must be a PART file open for write access
+ * - NULL callback turns the filling off; reads of missing parts fail again
+ *
+ * \a pStream Pointer to an open stream, or NULL
+ * \a PartFileCB Callback that provides the data of the complete file
+ * \a pvUserData User data for the callback
+ */
+bool FileStream_SetPartFileCallback(TFileStream * pStream, SFILE_PART_CALLBACK PartFileCB, void * pvUserData)
+{
+    TPartFileStream * pPartStream = (TPartFileStream *)pStream;
+
+    // Set the default source
+    if(pStream == NULL)
+    {
+        LockDefaultPartFileCB();
+        DefaultPartFileCB = PartFileCB;
+        pvDefaultPartFileData = pvUserData;
+        UnlockDefaultPartFileCB();
+        return true;
+    }
+
+    // Only PART files can have missing parts
+    if((pStream->StreamFlags & STREAM_FLAG_PART_FILE) == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // The missing parts need to be stored to the file
+    if(pPartStream->bWriteAccess == false)
+    {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return false;
+    }
+
+    pPartStream->PartFileCB = PartFileCB;
+    pPartStream->pvPartFileData = pvUserData;
+    return true;
+}
+
+/**
+ * Sets the maximum size of the block cache. Any cached data are discarded.
+ * Must not be called while another thread reads from the stream.
+ *
+ * - Memory-mapped and PART file streams don't use the cache; the function does nothing for them
+ * - Zero size frees the cache
+ *
+ * \a pStream Pointer to an open stream
+ * \a dwMaxSize Maximum number of bytes held in the cache
+ */
+bool FileStream_SetCacheSize(TFileStream * pStream, DWORD dwMaxSize)
+{
+    // Free the old cache
+    BlockCache_Free(pStream->pCache);
+    pStream->pCache = NULL;
+
+    // Create the new one, if the stream can use it
+    if(dwMaxSize != 0 && (pStream->StreamFlags & (STREAM_FLAG_MAPPED_FILE | STREAM_FLAG_PART_FILE)) == 0)
+    {
+        pStream->pCache = BlockCache_Create(dwMaxSize);
+        if(pStream->pCache == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Retrieves the block cache statistics
+ *
+ * \a pStream Pointer to an open stream
+ * \a pCacheHits Receives number of blocks that were found in the cache
+ * \a pCacheMisses Receives number of blocks that were read from the file
+ * \a pdwCachedSize Receives number of bytes currently in the cache
+ */
+void FileStream_GetCacheStats(TFileStream * pStream, ULONGLONG * pCacheHits, ULONGLONG * pCacheMisses, LPDWORD pdwCachedSize)
+{
+    TBlockCache * pCache = pStream->pCache;
+
+    *pCacheHits = *pCacheMisses = 0;
+    *pdwCachedSize = 0;
+
+    if(pCache != NULL)
+    {
+        SyncLock_Enter(&pCache->Lock);
+        *pCacheHits = pCache->CacheHits;
+        *pCacheMisses = pCache->CacheMisses;
+        *pdwCachedSize = pCache->dwCachedSize;
+        SyncLock_Leave(&pCache->Lock);
+    }
+}
+
 /**
  * This function writes data to the stream
  *
@@ -1416,9 +2858,29 @@ bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void
         return false;
     assert(pStream->StreamWrite != NULL);
 
+    // Remove the cached blocks that are going to be overwritten
+    if(pStream->pCache != NULL)
+        BlockCache_Invalidate(pStream->pCache, (pByteOffset != NULL) ? *pByteOffset : pStream->RawFilePos, dwBytesToWrite);
+
+    // Combine the small writes, if the stream supports it
+    if(pStream->cbWriteBufferSize != 0)
+        return WriteBuffer_Write(pStream, pByteOffset, pvBuffer, dwBytesToWrite);
     return pStream->StreamWrite(pStream, pByteOffset, pvBuffer, dwBytesToWrite);
 }
 
+/**
+ * Writes the data waiting in the write buffer to the file
+ *
+ * - Returns true if there were no data to write or if all of them have been written
+ * - Does not change the file position
+ *
+ * \a pStream Pointer to an open stream
+ */
+bool FileStream_Flush(TFileStream * pStream)
+{
+    return WriteBuffer_Flush(pStream);
+}
+
 
 /**
  * Returns the last write time of a file
@@ -1484,6 +2946,10 @@ bool FileStream_GetLastWriteTime(TFileStream * pStream, ULONGLONG * pFileTime)
 bool FileStream_GetSize(TFileStream * pStream, ULONGLONG & FileSize)
 {
     assert(pStream->StreamGetSize != NULL);
+
+    // The buffered data may go past the end of the file
+    if(pStream->cbWriteBuffer != 0 && !WriteBuffer_Flush(pStream))
+        return false;
     return pStream->StreamGetSize(pStream, FileSize);
 }
 
@@ -1499,6 +2965,14 @@ bool FileStream_SetSize(TFileStream * pStream, ULONGLONG NewFileSize)
         return false;
     assert(pStream->StreamSetSize != NULL);
 
+    // The buffered data must be written before the file is truncated
+    if(pStream->cbWriteBuffer != 0 && !WriteBuffer_Flush(pStream))
+        return false;
+
+    // The last cached block may change its size
+    if(pStream->pCache != NULL)
+        BlockCache_Invalidate(pStream->pCache, 0, (ULONGLONG)-1);
+
     return pStream->StreamSetSize(pStream, NewFileSize);
 }
 
@@ -1517,6 +2991,12 @@ bool FileStream_MoveFile(TFileStream * pStream, TFileStream * pTempStream)
 {
     bool bWriteAccess;
 
+    // Write the buffered data of the temporary file. The buffered data
+    // of the source file are not needed, as the file is going to be replaced
+    if(!WriteBuffer_Flush(pTempStream))
+        return false;
+    pStream->cbWriteBuffer = 0;
+
     // Close the handle to the temporary file
     CloseTheFile(pTempStream->hFile);
     pTempStream->hFile = INVALID_HANDLE_VALUE;
@@ -1538,7 +3018,12 @@ bool FileStream_MoveFile(TFileStream * pStream, TFileStream * pTempStream)
     // Delete the temporary file stream
     FileStream_Close(pTempStream);
 
-    // The file position has been reset to zero by reopening the file
+    // The file position has been reset to zero by reopening the file.
+    // The read-ahead buffer and the block cache contain data of the old file
+    InvalidateReadAheadBuffer(pStream);
+    if(pStream->pCache != NULL)
+        BlockCache_Invalidate(pStream->pCache, 0, (ULONGLONG)-1);
+    pStream->SequentialPos = 0;
     pStream->RawFilePos = 0;
     return true;
 }
@@ -1556,10 +3041,25 @@ void FileStream_Close(TFileStream * pStream)
     // Check if the stream structure is allocated at all
     if(pStream != NULL)
     {
+        // Write the buffered data. There is no way to report an error here;
+        // callers that care call FileStream_Flush before closing the stream
+        WriteBuffer_Flush(pStream);
+
+        // Free the stream-specific data
+        if(pStream->StreamClose != NULL)
+            pStream->StreamClose(pStream);
+
         // Close the file handle
         if(pStream->hFile != INVALID_HANDLE_VALUE)
             CloseTheFile(pStream->hFile);
 
+        // Free the read-ahead buffer, the write buffer and the block cache
+        if(pStream->pbReadAhead != NULL)
+            FREEMEM(pStream->pbReadAhead);
+        if(pStream->pbWriteBuffer != NULL)
+            FREEMEM(pStream->pbWriteBuffer);
+        BlockCache_Free(pStream->pCache);
+
         // Free the stream itself
         FREEMEM(pStream);
     }
@@ -22,6 +22,7 @@ char StormLibCopyright[] = "StormLib v " STORMLIB_VERSION_STRING " Copyright Lad
 // The buffer for decryption engine.
 
 DWORD   dwGlobalFlags = 0;                      // Global flags
+DWORD   dwMaxReadAhead = SFILE_READ_AHEAD_DEFAULT; // Maximum read-ahead size
 LCID    lcFileLocale = LANG_NEUTRAL;            // File locale
 USHORT  wPlatform = 0;                          // File platform
 
@@ -537,6 +538,10 @@ bool IsValidFileHandle(TMPQFile * hf) {
  *
  * Retrieves the first hash entry for the given file.
  * Every locale version of a file has its own hash entry
+ *
+ * GetFirstHashEntry and GetNextHashEntry only read the hash table,
+ * so they can be called from multiple threads without locking
+ * as long as nobody modifies the archive (MPQ_OPEN_THREAD_SAFE)
  */
 
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName) {
@@ -697,22 +702,153 @@ void FindFreeMpqSpace(TMPQArchive * ha, ULONGLONG * pMpqPos) {
 /**
  * Common functions - MPQ File
  */
-TMPQFile * CreateMpqFile(TMPQArchive * ha) {
+
+#define FILE_POOL_MAX_HANDLES   16          // Maximum number of free handles kept by one archive
+
+// Free file handles of an archive. Closing a file puts its handle here,
+// together with its sector buffer, so that the next open of a file
+// doesn't need to allocate anything.
+// The pool is referenced by the archive and by every handle created from it,
+// so that file handles closed after their archive don't touch the freed archive
+struct TMPQFilePool {
+    TSyncLock       Lock;                   // Thread-safe archives open files from more threads
+    TMPQFile      * pFirstFree;             // List of free handles
+    DWORD           dwFreeCount;            // Number of handles in the list
+    DWORD           dwRefCount;             // The archive (while open) + number of handles created from the pool
+    DWORD           dwSectorSize;           // Sector size of the archive. Only buffers of this size are kept
+    bool            bArchiveClosed;         // If true, closed handles are freed
+};
+
+static void FilePool_FreeHandle(TMPQFile * hf) {
+    if (hf->pbSpareSector != NULL)
+        FREEMEM(hf->pbSpareSector);
+    FREEMEM(hf);
+}
+
+// Releases one reference. The pool lock must be held; it is released by the function
+static void FilePool_Release(TMPQFilePool * pFilePool) {
+    DWORD dwRefCount = --pFilePool->dwRefCount;
+
+    SyncLock_Leave(&pFilePool->Lock);
+    if (dwRefCount == 0) {
+        SyncLock_Free(&pFilePool->Lock);
+        FREEMEM(pFilePool);
+    }
+}
+
+TMPQFilePool * FilePool_Create(DWORD dwSectorSize) {
+    TMPQFilePool * pFilePool;
+
+    pFilePool = ALLOCMEM(TMPQFilePool, 1);
+    if (pFilePool != NULL) {
+        SyncLock_Init(&pFilePool->Lock);
+        pFilePool->pFirstFree = NULL;
+        pFilePool->dwFreeCount = 0;
+        pFilePool->dwRefCount = 1;
+        pFilePool->dwSectorSize = dwSectorSize;
+        pFilePool->bArchiveClosed = false;
+    }
+
+    return pFilePool;
+}
+
+// Called when the archive is closed. Frees the free handles; the pool itself
+// is freed when the last handle that is still open gets closed
+void FilePool_Free(TMPQFilePool * pFilePool) {
     TMPQFile * hf;
 
-    // Allocate space for TMPQFile
-    hf = ALLOCMEM(TMPQFile, 1);
+    if (pFilePool != NULL) {
+        SyncLock_Enter(&pFilePool->Lock);
+        while ((hf = pFilePool->pFirstFree) != NULL) {
+            pFilePool->pFirstFree = hf->pNextFree;
+            pFilePool->dwRefCount--;
+            FilePool_FreeHandle(hf);
+        }
+        pFilePool->dwFreeCount = 0;
+        pFilePool->bArchiveClosed = true;
+        FilePool_Release(pFilePool);
+    }
+}
+
+TMPQFile * CreateMpqFile(TMPQArchive * ha) {
+    TMPQFilePool * pFilePool = (ha != NULL) ? ha->pFilePool : NULL;
+    TMPQFile * hf = NULL;
+    LPBYTE pbSpareSector = NULL;
+
+    // Reuse a handle of a closed file, if there is any.
+    // A reused handle keeps the reference it took when it was created
+    if (pFilePool != NULL) {
+        SyncLock_Enter(&pFilePool->Lock);
+        hf = pFilePool->pFirstFree;
+        if (hf != NULL) {
+            pFilePool->pFirstFree = hf->pNextFree;
+            pFilePool->dwFreeCount--;
+            pbSpareSector = hf->pbSpareSector;
+        }
+        SyncLock_Leave(&pFilePool->Lock);
+    }
+
+    // Allocate space for TMPQFile. A new handle references the pool
+    if (hf == NULL) {
+        hf = ALLOCMEM(TMPQFile, 1);
+        if (hf != NULL && pFilePool != NULL) {
+            SyncLock_Enter(&pFilePool->Lock);
+            pFilePool->dwRefCount++;
+            SyncLock_Leave(&pFilePool->Lock);
+        }
+    }
+
     if (hf != NULL) {
         // Fill the file structure
         memset(hf, 0, sizeof(TMPQFile));
         hf->ha = ha;
         hf->pStream = NULL;
+        hf->pFilePool = pFilePool;
+        hf->pbSpareSector = pbSpareSector;
         hf->dwMagic = ID_MPQ_FILE;
     }
 
     return hf;
 }
 
+// Puts a closed file handle to the list of free handles of its pool.
+// The archive may be closed already, so only the pool is used
+static void ReleaseMpqFile(TMPQFile * hf) {
+    TMPQFilePool * pFilePool = hf->pFilePool;
+
+    // Handles without a pool are just freed
+    if (pFilePool == NULL) {
+        if (hf->pbFileSector != NULL)
+            FREEMEM(hf->pbFileSector);
+        FilePool_FreeHandle(hf);
+        return;
+    }
+
+    SyncLock_Enter(&pFilePool->Lock);
+
+    // Keep the sector buffer if it has the archive's sector size
+    if (hf->pbFileSector != NULL) {
+        if (hf->pbSpareSector == NULL && hf->dwSectorSize == pFilePool->dwSectorSize)
+            hf->pbSpareSector = hf->pbFileSector;
+        else
+            FREEMEM(hf->pbFileSector);
+        hf->pbFileSector = NULL;
+    }
+
+    // Give the handle back to the pool, unless it has enough of them
+    if (pFilePool->bArchiveClosed == false && pFilePool->dwFreeCount < FILE_POOL_MAX_HANDLES) {
+        hf->pNextFree = pFilePool->pFirstFree;
+        pFilePool->pFirstFree = hf;
+        pFilePool->dwFreeCount++;
+        SyncLock_Leave(&pFilePool->Lock);
+        return;
+    }
+
+    // Otherwise free the handle and its reference to the pool
+    FilePool_FreeHandle(hf);
+    FilePool_Release(pFilePool);
+}
+
 // Loads a table from MPQ.
 // Can be used for hash table, block table, sector offset table or sector checksum table
 int LoadMpqTable(TMPQArchive * ha, ULONGLONG ByteOffset, void * pvTable, DWORD dwCompressedSize, DWORD dwRealSize, DWORD dwKey) {
@@ -787,6 +923,19 @@ void CalculateRawSectorOffset(
         RawFilePos += hf->pPatchInfo->dwLength;
 }
 
+/**
+ * Reads raw data of a file from the archive. If the data have been read
+ * ahead (pPrefetched is not NULL and contains them), they are copied from there
+ */
+bool ReadMpqFileRaw(TMPQFile * hf, ULONGLONG RawFilePos, void * pvBuffer, DWORD dwBytesToRead, const TPrefetchedData * pPrefetched) {
+    if (pPrefetched != NULL && RawFilePos >= pPrefetched->ByteOffset && (RawFilePos + dwBytesToRead) <= (pPrefetched->ByteOffset + pPrefetched->cbData)) {
+        memcpy(pvBuffer, pPrefetched->pbData + (size_t)(RawFilePos - pPrefetched->ByteOffset), dwBytesToRead);
+        return true;
+    }
+
+    return FileStream_Read(hf->ha->pStream, &RawFilePos, pvBuffer, dwBytesToRead);
+}
+
 unsigned char * AllocateMd5Buffer(DWORD dwRawDataSize, DWORD dwChunkSize, LPDWORD pcbMd5Size) {
     unsigned char * md5_array;
     DWORD cbMd5Size;
@@ -819,9 +968,16 @@ int AllocateSectorBuffer(TMPQFile * hf) {
     assert(hf->dwDataSize != 0);
     assert(hf->ha != NULL);
 
-    // Determine the file sector size and allocate buffer for it
+    // Determine the file sector size and allocate buffer for it.
+    // Pooled handles may still have a buffer of the archive's sector size
     hf->dwSectorSize = (hf->pFileEntry->dwFlags & MPQ_FILE_SINGLE_UNIT) ? hf->dwDataSize : ha->dwSectorSize;
-    hf->pbFileSector = ALLOCMEM(BYTE, hf->dwSectorSize);
+    if (hf->pbSpareSector != NULL && hf->dwSectorSize == ha->dwSectorSize) {
+        hf->pbFileSector = hf->pbSpareSector;
+        hf->pbSpareSector = NULL;
+    }
+    else {
+        hf->pbFileSector = ALLOCMEM(BYTE, hf->dwSectorSize);
+    }
     hf->dwSectorOffs = SFILE_INVALID_POS;
 
     // Return result
@@ -883,7 +1039,7 @@ __AllocateAndLoadPatchInfo:
 }
 
 // Allocates sector offset table
-int AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile) {
+int AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile, const TPrefetchedData * pPrefetched) {
     TMPQArchive * ha = hf->ha;
     TFileEntry * pFileEntry = hf->pFileEntry;
     DWORD dwSectorOffsLen;
@@ -913,6 +1069,10 @@ int AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile) {
 
     // Only allocate and load the table if the file is compressed
     if (pFileEntry->dwFlags & MPQ_FILE_COMPRESSED) {
+        // The table may have been loaded by a recent open of the file
+        if (bLoadFromFile && SectorCache_LoadOffsets(hf))
+            return ERROR_SUCCESS;
+
         __LoadSectorOffsets:
 
         // Allocate the sector offset table
@@ -928,7 +1088,7 @@ int AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile) {
                 RawFilePos += hf->pPatchInfo->dwLength;
 
             // Load the sector offsets from the file
-            if (!FileStream_Read(ha->pStream, &RawFilePos, hf->SectorOffsets, dwSectorOffsLen)) {
+            if (!ReadMpqFileRaw(hf, RawFilePos, hf->SectorOffsets, dwSectorOffsLen, pPrefetched)) {
                 // Free the sector offsets
                 FREEMEM(hf->SectorOffsets);
                 hf->SectorOffsets = NULL;
@@ -989,6 +1149,9 @@ int AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile) {
                 hf->SectorOffsets = NULL;
                 return ERROR_FILE_CORRUPT;
             }
+
+            // Keep the decrypted table for the next open of the file
+            SectorCache_StoreOffsets(hf, dwSectorOffsLen);
         }
         else {
             memset(hf->SectorOffsets, 0, dwSectorOffsLen);
@@ -1007,6 +1170,7 @@ int AllocateSectorChecksums(TMPQFile * hf, bool bLoadFromFile) {
     DWORD dwCrcOffset; // Offset of the CRC table, relative to file offset in the MPQ
     DWORD dwLastIndex;
     DWORD dwCrcSize;
+    int nError;
 
     // Caller of AllocateSectorChecksums must ensure these
     assert(hf->SectorChksums == NULL);
@@ -1045,6 +1209,10 @@ int AllocateSectorChecksums(TMPQFile * hf, bool bLoadFromFile) {
     if (dwCompressedSize == 0)
         return ERROR_SUCCESS;
 
+    // The checksums may have been loaded by a recent open of the file
+    if (SectorCache_LoadChecksums(hf))
+        return ERROR_SUCCESS;
+
     // Allocate buffer for sector CRCs
     hf->SectorChksums = ALLOCMEM(DWORD, hf->dwSectorCount);
     if (hf->SectorChksums == NULL)
@@ -1056,7 +1224,10 @@ int AllocateSectorChecksums(TMPQFile * hf, bool bLoadFromFile) {
     CalculateRawSectorOffset(RawFilePos, hf, dwCrcOffset);
 
     // Now read the table from the MPQ
-    return LoadMpqTable(ha, RawFilePos, hf->SectorChksums, dwCompressedSize, dwCrcSize, 0);
+    nError = LoadMpqTable(ha, RawFilePos, hf->SectorChksums, dwCompressedSize, dwCrcSize, 0);
+    if (nError == ERROR_SUCCESS)
+        SectorCache_StoreChecksums(hf);
+    return nError;
 }
 
 int WritePatchInfo(TMPQFile * hf) {
@@ -1286,10 +1457,17 @@ void FreeMPQFile(TMPQFile *& hf) {
             FREEMEM(hf->SectorOffsets);
         if (hf->SectorChksums != NULL)
             FREEMEM(hf->SectorChksums);
-        if (hf->pbFileSector != NULL)
-            FREEMEM(hf->pbFileSector);
+        if (hf->pbFileView != NULL)
+            FREEMEM(hf->pbFileView);
+        if (hf->pWriteState != NULL)
+            FREEMEM(hf->pWriteState);
         FileStream_Close(hf->pStream);
-        FREEMEM(hf);
+
+        // Give the handle back to its pool. The archive may be closed already,
+        // so nothing in the archive may be used here.
+        // Clearing the magic makes the closed handle invalid
+        hf->dwMagic = 0;
+        ReleaseMpqFile(hf);
         hf = NULL;
     }
 }
@@ -1319,6 +1497,9 @@ void FreeMPQArchive(TMPQArchive *& ha) {
             FREEMEM(ha->pHashTable);
         if (ha->pHetTable != NULL)
             FreeHetTable(ha->pHetTable);
+        SectorCache_Free(ha->pSectorCache);
+        SectorCache_Free(ha->pTableCache);
+        FilePool_Free(ha->pFilePool);
         FileStream_Close(ha->pStream);
         FREEMEM(ha);
         ha = NULL;
@@ -1349,6 +1530,387 @@ bool IsInternalMpqFileName(const char * szFileName) {
     return false;
 }
 
+//-----------------------------------------------------------------------------
+// Cache of decompressed file sectors
+//
+// Keeps the decrypted and decompressed file sectors, so that files which are
+// opened and read repeatedly don't have to be decompressed again.
+// The cache belongs to the archive, so it outlives the file handles.
+// Sectors are identified by the index of the file in the file table and by
+// the sector index; files stored as single unit are one sector.
+// The byte offset of the file is stored with each sector, so that sectors
+// of a file that has been moved (e.g. by compacting) are never used.
+// The file key is stored too, so that sectors decrypted by a wrong key
+// (e.g. a file open by pseudo-name) are never given to another handle.
+// Sectors are evicted in LRU order when the cache gets over its size limit.
+//
+// The same structure is also used for the cache of sector offset tables.
+// That one is always present and keeps the decrypted sector offsets
+// and the sector checksums, so that opening
+// a recently used file doesn't need to read anything but the file data.
+//
+
+#define TABLE_SECTOR_OFFSETS    0           // "Sector index" of the sector offset table
+#define TABLE_SECTOR_CHKSUMS    1           // "Sector index" of the sector checksums
+
+// One cached file sector. Sectors are in a hash table and in a LRU list,
+// with the most recently used sector first
+struct TCachedSector {
+    TCachedSector * pNextInHash;            // Next sector in the same hash bucket
+    TCachedSector * pPrev;                  // Previous (more recently used) sector
+    TCachedSector * pNext;                  // Next (less recently used) sector
+    ULONGLONG       ByteOffset;             // Byte offset of the file at the time the sector was cached
+    DWORD           dwFileIndex;            // Index of the file in the file table
+    DWORD           dwSectorIndex;          // Index of the sector in the file
+    DWORD           dwFileKey;              // Key that decrypted the data
+    DWORD           cbData;                 // Size of the decompressed sector
+    BYTE            Data[1];                // Sector data, variable length
+};
+
+struct TSectorCache {
+    TSyncLock       Lock;                   // Protects the cache. Thread-safe archives are read by more threads
+    TCachedSector ** HashTable;             // Hash table of the cached sectors
+    TCachedSector * pFirst;                 // Most recently used sector
+    TCachedSector * pLast;                  // Least recently used sector
+    ULONGLONG       CacheHits;              // Number of sectors found in the cache
+    ULONGLONG       CacheMisses;            // Number of sectors that had to be decompressed
+    DWORD           dwHashMask;             // Number of hash buckets minus one
+    DWORD           dwMaxSize;              // Maximum number of bytes in the cache
+    DWORD           dwCachedSize;           // Current number of bytes in the cache
+};
+
+static TCachedSector ** SectorCache_FindSlot(TSectorCache * pCache, DWORD dwFileIndex, DWORD dwSectorIndex) {
+    TCachedSector ** ppSector;
+
+    ppSector = &pCache->HashTable[((dwFileIndex * 0x9E3779B1) + dwSectorIndex) & pCache->dwHashMask];
+    while (*ppSector != NULL && ((*ppSector)->dwFileIndex != dwFileIndex || (*ppSector)->dwSectorIndex != dwSectorIndex))
+        ppSector = &(*ppSector)->pNextInHash;
+    return ppSector;
+}
+
+static void SectorCache_Unlink(TSectorCache * pCache, TCachedSector * pSector) {
+    if (pSector->pPrev != NULL)
+        pSector->pPrev->pNext = pSector->pNext;
+    else
+        pCache->pFirst = pSector->pNext;
+
+    if (pSector->pNext != NULL)
+        pSector->pNext->pPrev = pSector->pPrev;
+    else
+        pCache->pLast = pSector->pPrev;
+}
+
+static void SectorCache_LinkFirst(TSectorCache * pCache, TCachedSector * pSector) {
+    pSector->pPrev = NULL;
+    pSector->pNext = pCache->pFirst;
+    if (pCache->pFirst != NULL)
+        pCache->pFirst->pPrev = pSector;
+    else
+        pCache->pLast = pSector;
+    pCache->pFirst = pSector;
+}
+
+static void SectorCache_Remove(TSectorCache * pCache, TCachedSector * pSector) {
+    TCachedSector ** ppSector = SectorCache_FindSlot(pCache, pSector->dwFileIndex, pSector->dwSectorIndex);
+
+    *ppSector = pSector->pNextInHash;
+    SectorCache_Unlink(pCache, pSector);
+    pCache->dwCachedSize -= pSector->cbData;
+    FREEMEM(pSector);
+}
+
+static bool SectorCache_Fits(TSectorCache * pCache, DWORD cbData) {
+    return (pCache != NULL && cbData <= (pCache->dwMaxSize / 8));
+}
+
+// Stores a new item to the cache. Evicts the least recently used items
+// if the cache gets too large
+static void SectorCache_Store(TSectorCache * pCache, TCachedSector * pNewSector) {
+    TCachedSector ** ppSector;
+
+    SyncLock_Enter(&pCache->Lock);
+
+    // Another thread may have cached the same sector in the meantime.
+    // An old version of the sector is replaced
+    ppSector = SectorCache_FindSlot(pCache, pNewSector->dwFileIndex, pNewSector->dwSectorIndex);
+    if (*ppSector != NULL)
+        SectorCache_Remove(pCache, *ppSector);
+
+    ppSector = SectorCache_FindSlot(pCache, pNewSector->dwFileIndex, pNewSector->dwSectorIndex);
+    *ppSector = pNewSector;
+    SectorCache_LinkFirst(pCache, pNewSector);
+    pCache->dwCachedSize += pNewSector->cbData;
+
+    // Evict the least recently used sectors
+    while (pCache->dwCachedSize > pCache->dwMaxSize && pCache->pLast != pCache->pFirst)
+        SectorCache_Remove(pCache, pCache->pLast);
+
+    SyncLock_Leave(&pCache->Lock);
+}
+
+static void SectorCache_RemoveFile(TSectorCache * pCache, TFileEntry * pFileEntry, DWORD dwFileIndex) {
+    TCachedSector * pNextSector;
+    TCachedSector * pSector;
+
+    if (pCache != NULL && pCache->pFirst != NULL) {
+        SyncLock_Enter(&pCache->Lock);
+        for (pSector = pCache->pFirst; pSector != NULL; pSector = pNextSector) {
+            pNextSector = pSector->pNext;
+            if (pFileEntry == NULL || pSector->dwFileIndex == dwFileIndex)
+                SectorCache_Remove(pCache, pSector);
+        }
+        SyncLock_Leave(&pCache->Lock);
+    }
+}
+
+TSectorCache * SectorCache_Create(DWORD dwMaxSize, DWORD dwItemSize) {
+    TSectorCache * pCache;
+    DWORD dwMaxSectors = dwMaxSize / dwItemSize;
+    DWORD dwHashSize = 0x10;
+
+    // Have at least as many hash buckets as there can be items of the typical size
+    while (dwHashSize < dwMaxSectors)
+        dwHashSize <<= 1;
+
+    pCache = ALLOCMEM(TSectorCache, 1);
+    if (pCache != NULL) {
+        memset(pCache, 0, sizeof(TSectorCache));
+        pCache->HashTable = ALLOCMEM(TCachedSector *, dwHashSize);
+        if (pCache->HashTable == NULL) {
+            FREEMEM(pCache);
+            return NULL;
+        }
+
+        memset(pCache->HashTable, 0, dwHashSize * sizeof(TCachedSector *));
+        SyncLock_Init(&pCache->Lock);
+        pCache->dwHashMask = dwHashSize - 1;
+        pCache->dwMaxSize = dwMaxSize;
+    }
+
+    return pCache;
+}
+
+/**
+ * Checks whether the archive has a sector cache and whether the data
+ * of given size are worth caching. Larger data would only push
+ * everything else out of the cache
+ */
+bool SectorCache_CanHold(TMPQArchive * ha, DWORD cbData) {
+    return SectorCache_Fits(ha->pSectorCache, cbData);
+}
+
+/**
+ * Copies a decompressed sector from the cache.
+ * Returns false if the sector is not in the cache
+ */
+bool SectorCache_Read(TMPQFile * hf, DWORD dwSectorIndex, LPBYTE pbBuffer, DWORD cbData) {
+    TMPQArchive * ha = hf->ha;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    TSectorCache * pCache = ha->pSectorCache;
+    TCachedSector * pSector;
+    bool bResult = false;
+
+    if (SectorCache_CanHold(ha, cbData)) {
+        SyncLock_Enter(&pCache->Lock);
+        pSector = *SectorCache_FindSlot(pCache, (DWORD)(pFileEntry - ha->pFileTable), dwSectorIndex);
+        if (pSector != NULL && pSector->ByteOffset == pFileEntry->ByteOffset && pSector->dwFileKey == hf->dwFileKey && pSector->cbData == cbData) {
+            memcpy(pbBuffer, pSector->Data, cbData);
+
+            // Move the sector to the begin of the LRU list
+            if (pCache->pFirst != pSector) {
+                SectorCache_Unlink(pCache, pSector);
+                SectorCache_LinkFirst(pCache, pSector);
+            }
+
+            pCache->CacheHits++;
+            bResult = true;
+        }
+        else {
+            pCache->CacheMisses++;
+        }
+        SyncLock_Leave(&pCache->Lock);
+    }
+
+    return bResult;
+}
+
+/**
+ * Stores a decompressed sector to the cache. Evicts the least recently used
+ * sectors if the cache gets too large. Failures are silently ignored
+ */
+void SectorCache_Insert(TMPQFile * hf, DWORD dwSectorIndex, LPBYTE pbData, DWORD cbData) {
+    TMPQArchive * ha = hf->ha;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    TCachedSector * pNewSector;
+
+    if (!SectorCache_CanHold(ha, cbData))
+        return;
+
+    // Copy the data before taking the lock
+    pNewSector = (TCachedSector *)ALLOCMEM(BYTE, sizeof(TCachedSector) + cbData);
+    if (pNewSector == NULL)
+        return;
+
+    pNewSector->pNextInHash = NULL;
+    pNewSector->ByteOffset = pFileEntry->ByteOffset;
+    pNewSector->dwFileIndex = (DWORD)(pFileEntry - ha->pFileTable);
+    pNewSector->dwSectorIndex = dwSectorIndex;
+    pNewSector->dwFileKey = hf->dwFileKey;
+    pNewSector->cbData = cbData;
+    memcpy(pNewSector->Data, pbData, cbData);
+
+    SectorCache_Store(ha->pSectorCache, pNewSector);
+}
+
+/**
+ * Removes all cached sectors and sector tables of the file. Must be called
+ * when a file entry is allocated, freed or its data are rewritten.
+ * If pFileEntry is NULL, the entire caches are emptied
+ */
+void SectorCache_InvalidateFile(TMPQArchive * ha, TFileEntry * pFileEntry) {
+    DWORD dwFileIndex = (pFileEntry != NULL) ? (DWORD)(pFileEntry - ha->pFileTable) : 0;
+
+    SectorCache_RemoveFile(ha->pSectorCache, pFileEntry, dwFileIndex);
+    SectorCache_RemoveFile(ha->pTableCache, pFileEntry, dwFileIndex);
+}
+
+// Finds a cached table of the file. The cache lock must be held by the caller
+static TCachedSector * SectorCache_FindTable(TMPQFile * hf, DWORD dwTableIndex) {
+    TMPQArchive * ha = hf->ha;
+    TCachedSector * pTable;
+
+    pTable = *SectorCache_FindSlot(ha->pTableCache, (DWORD)(hf->pFileEntry - ha->pFileTable), dwTableIndex);
+    if (pTable != NULL && pTable->ByteOffset == hf->pFileEntry->ByteOffset) {
+        // Move the table to the begin of the LRU list
+        if (ha->pTableCache->pFirst != pTable) {
+            SectorCache_Unlink(ha->pTableCache, pTable);
+            SectorCache_LinkFirst(ha->pTableCache, pTable);
+        }
+
+        ha->pTableCache->CacheHits++;
+        return pTable;
+    }
+
+    ha->pTableCache->CacheMisses++;
+    return NULL;
+}
+
+static void SectorCache_StoreTable(TMPQFile * hf, DWORD dwTableIndex, DWORD dwFileKey, void * pvTable, DWORD cbTable) {
+    TMPQArchive * ha = hf->ha;
+    TCachedSector * pNewTable;
+
+    if (!SectorCache_Fits(ha->pTableCache, cbTable))
+        return;
+
+    pNewTable = (TCachedSector *)ALLOCMEM(BYTE, sizeof(TCachedSector) + cbTable);
+    if (pNewTable == NULL)
+        return;
+
+    pNewTable->pNextInHash = NULL;
+    pNewTable->ByteOffset = hf->pFileEntry->ByteOffset;
+    pNewTable->dwFileIndex = (DWORD)(hf->pFileEntry - ha->pFileTable);
+    pNewTable->dwSectorIndex = dwTableIndex;
+    pNewTable->dwFileKey = dwFileKey;
+    pNewTable->cbData = cbTable;
+    memcpy(pNewTable->Data, pvTable, cbTable);
+
+    SectorCache_Store(ha->pTableCache, pNewTable);
+}
+
+/**
+ * Gives the file a copy of its cached sector offset table. The file key
+ * that decrypted the table is restored too, if the file doesn't know it.
+ * Returns false if the table is not in the cache
+ */
+bool SectorCache_LoadOffsets(TMPQFile * hf) {
+    TSectorCache * pCache = hf->ha->pTableCache;
+    TCachedSector * pTable;
+    bool bResult = false;
+
+    if (pCache != NULL) {
+        SyncLock_Enter(&pCache->Lock);
+        pTable = SectorCache_FindTable(hf, TABLE_SECTOR_OFFSETS);
+        if (pTable != NULL) {
+            // A table decrypted by another key is of no use
+            if (hf->dwFileKey == 0 || hf->dwFileKey == pTable->dwFileKey) {
+                hf->SectorOffsets = (DWORD *)ALLOCMEM(BYTE, pTable->cbData);
+                if (hf->SectorOffsets != NULL) {
+                    memcpy(hf->SectorOffsets, pTable->Data, pTable->cbData);
+                    hf->dwFileKey = pTable->dwFileKey;
+                    bResult = true;
+                }
+            }
+        }
+        SyncLock_Leave(&pCache->Lock);
+    }
+
+    return bResult;
+}
+
+void SectorCache_StoreOffsets(TMPQFile * hf, DWORD cbSectorOffsets) {
+    SectorCache_StoreTable(hf, TABLE_SECTOR_OFFSETS, hf->dwFileKey, hf->SectorOffsets, cbSectorOffsets);
+}
+
+/**
+ * Loads the cached sector checksums of the file.
+ * Returns false if they are not in the cache
+ */
+bool SectorCache_LoadChecksums(TMPQFile * hf) {
+    TSectorCache * pCache = hf->ha->pTableCache;
+    TCachedSector * pTable;
+    DWORD cbChksums = hf->dwSectorCount * sizeof(DWORD);
+    bool bResult = false;
+
+    if (pCache != NULL) {
+        SyncLock_Enter(&pCache->Lock);
+        pTable = SectorCache_FindTable(hf, TABLE_SECTOR_CHKSUMS);
+        if (pTable != NULL && pTable->cbData == cbChksums) {
+            hf->SectorChksums = ALLOCMEM(DWORD, hf->dwSectorCount);
+            if (hf->SectorChksums != NULL) {
+                memcpy(hf->SectorChksums, pTable->Data, cbChksums);
+                bResult = true;
+            }
+        }
+        SyncLock_Leave(&pCache->Lock);
+    }
+
+    return bResult;
+}
+
+void SectorCache_StoreChecksums(TMPQFile * hf) {
+    SectorCache_StoreTable(hf, TABLE_SECTOR_CHKSUMS, hf->dwFileKey, hf->SectorChksums, hf->dwSectorCount * sizeof(DWORD));
+}
+
+/**
+ * Retrieves the sector cache statistics. All values are zero
+ * if the archive has no sector cache
+ */
+void SectorCache_GetStats(TMPQArchive * ha, ULONGLONG * pCacheHits, ULONGLONG * pCacheMisses, LPDWORD pdwCachedSize) {
+    TSectorCache * pCache = ha->pSectorCache;
+
+    *pCacheHits = *pCacheMisses = 0;
+    *pdwCachedSize = 0;
+
+    if (pCache != NULL) {
+        SyncLock_Enter(&pCache->Lock);
+        *pCacheHits = pCache->CacheHits;
+        *pCacheMisses = pCache->CacheMisses;
+        *pdwCachedSize = pCache->dwCachedSize;
+        SyncLock_Leave(&pCache->Lock);
+    }
+}
+
+void SectorCache_Free(TSectorCache * pCache) {
+    if (pCache != NULL) {
+        while (pCache->pFirst != NULL)
+            SectorCache_Remove(pCache, pCache->pFirst);
+
+        SyncLock_Free(&pCache->Lock);
+        FREEMEM(pCache->HashTable);
+        FREEMEM(pCache);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Swapping functions
 
@@ -1360,6 +1360,10 @@ void FreeBetTable(TMPQBetTable * pBetTable)
 
 //-----------------------------------------------------------------------------
 // Support for file table
+//
+// The GetFileEntryXXX functions don't modify the archive in any way.
+// On archives open with MPQ_OPEN_THREAD_SAFE, the HET, hash and file tables
+// never change after SFileOpenArchive returns, so the lookups need no lock.
 
 TFileEntry * GetFileEntryAny(TMPQArchive * ha, const char * szFileName)
 {
@@ -1528,6 +1532,9 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID l
             return NULL;
     }
 
+    // The file entry may have been used by another file
+    SectorCache_InvalidateFile(ha, pFileEntry);
+
     // Fill the rest of the file entry
     pFileEntry->ByteOffset = 0;
     pFileEntry->FileTime   = 0;
@@ -1610,6 +1617,9 @@ void FreeFileEntry(
         FREEMEM(pFileEntry->szFileName);
     pFileEntry->szFileName = NULL;
 
+    // Forget the decompressed sectors of the file
+    SectorCache_InvalidateFile(ha, pFileEntry);
+
     // Clear the block entry
     memset(pFileEntry, 0, sizeof(TFileEntry));
 
@@ -2033,8 +2043,9 @@ int LoadAnyHashTable(TMPQArchive * ha)
     if(pHeader->dwHashTableSize == 0 && pHeader->HetTableSize64 == 0)
         return CreateHashTable(ha, HASH_TABLE_SIZE_DEFAULT);
 
-    // Try to load HET table
-    if(LoadHetTable(ha) == ERROR_SUCCESS)
+    // Try to load HET table. Note that LoadHetTable succeeds
+    // when there is no HET table, so check if the table is really there
+    if(LoadHetTable(ha) == ERROR_SUCCESS && ha->pHetTable != NULL)
         bHashTableLoaded = true;
 
     // Try to load the classic hash table
@@ -2116,6 +2127,11 @@ int SaveMPQTables(TMPQArchive * ha)
     // We expect this function to be called only when tables have been changed
     assert(ha->dwFlags & MPQ_FLAG_CHANGED);
 
+    // Write the file data that are still in the stream's write buffer,
+    // so that any write error is reported before the tables are saved
+    if(!FileStream_Flush(ha->pStream))
+        nError = GetLastError();
+
     // Find the space where the MPQ tables will be saved
     FindFreeMpqSpace(ha, &TablePos);
 
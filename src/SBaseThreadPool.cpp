@@ -0,0 +1,724 @@
+/*****************************************************************************/
+/* SBaseThreadPool.cpp                Copyright (c) StormLib contributors 2026 */
+/*---------------------------------------------------------------------------*/
+/* Description: Locks, worker threads and per-thread scratch buffers         */
+/*---------------------------------------------------------------------------*/
+/*   Date    Ver   Who  Comment                                              */
+/* --------  ----  ---  -------                                              */
+/* 16.10.26  1.00  ---  The first version of SBaseThreadPool.cpp             */
+/*****************************************************************************/
+
+#define __STORMLIB_SELF__
+#include "StormLib.h"
+#include "StormCommon.h"
+
+//-----------------------------------------------------------------------------
+// Local defines
+
+#define MAX_WORKER_THREADS  64              // Maximum number of worker threads
+
+#define SCRATCH_MIN_SHIFT       12          // The smallest size class is 4 KB
+#define SCRATCH_SIZE_CLASSES     9          // Number of size classes (4 KB .. 1 MB)
+#define SCRATCH_MAX_CACHED  0x200000        // Maximum size of the free buffers kept by one thread
+#define SCRATCH_HEADER_SIZE   0x10          // Size of the buffer header. Keeps the data aligned
+#define SCRATCH_NO_CLASS    0xFFFFFFFF      // The buffer is too large to be kept
+
+#define SCRATCH_CLASS_SIZE(c)  ((DWORD)1 << ((c) + SCRATCH_MIN_SHIFT))
+
+//-----------------------------------------------------------------------------
+// Local structures
+
+struct TWorkItem
+{
+    TWorkItem  * pNext;                     // Next item in the queue
+    WORK_ROUTINE pfnWork;                   // Function to be called
+    void       * pvParam;                   // Parameter for the function
+    void       * pvSerializeKey;            // Items with the same key are never run at the same time
+};
+
+// A loop whose items are processed by the worker threads and the calling thread.
+// The structure is freed by whoever releases the last reference; the work items
+// that start after all items are done just release their reference.
+struct TParallelJob
+{
+    TSyncLock        Lock;                  // Protects the members below
+    PARALLEL_ROUTINE pfnWork;               // Function to be called for each item
+    void           * pvParam;               // Parameter for the function
+    DWORD            dwItemCount;           // Number of items
+    DWORD            dwNextItem;            // Index of the next item to be taken
+    DWORD            dwItemsDone;           // Number of items finished (or skipped)
+    DWORD            dwRefCount;            // Number of queued work items + the caller
+    DWORD            dwErrorIndex;          // Index of the first item that failed
+    int              nError;                // Error of the first item that failed
+    volatile DWORD_PTR Completed;           // Set to 1 when all items are done
+};
+
+// Header of a scratch buffer, right before the data given to the caller
+struct TScratchBuffer
+{
+    TScratchBuffer * pNext;                 // Next free buffer of the same size class
+    DWORD            dwSizeClass;           // Size class of the buffer, or SCRATCH_NO_CLASS
+};
+
+// Free scratch buffers of one thread
+struct TScratchArena
+{
+    TScratchBuffer * FreeBuffers[SCRATCH_SIZE_CLASSES];
+    DWORD            dwCachedSize;          // Total size of the free buffers
+    void           * pvCodecData;           // Compression contexts of the thread (see SCompression.cpp)
+    FREE_THREAD_DATA pfnFreeCodecData;      // Function that frees the compression contexts
+};
+
+//-----------------------------------------------------------------------------
+// Local variables
+
+static TSyncLock PoolLock;                  // Protects the queue and the key array
+static TWorkItem * pQueueFirst = NULL;      // First item in the queue
+static TWorkItem * pQueueLast = NULL;       // Last item in the queue
+static void * RunningKeys[MAX_WORKER_THREADS]; // Keys of the work items currently running
+static DWORD dwWorkerThreads = 0;           // Number of worker threads
+
+#ifdef PLATFORM_WINDOWS
+static HANDLE hWorkAvailable = NULL;        // Semaphore, released once per each queued work item
+static volatile LONG PoolState = 0;         // 0 = not started, 1 = starting, 2 = running
+static DWORD dwScratchIndex = FLS_OUT_OF_INDEXES; // Fiber local storage slot for the scratch arena
+static volatile LONG ScratchState = 0;      // 0 = not initialized, 1 = initializing, 2 = ready
+static SRWLOCK ResultLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE ResultChanged = CONDITION_VARIABLE_INIT;
+#else
+static pthread_cond_t WorkAvailable = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t ResultLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ResultChanged = PTHREAD_COND_INITIALIZER;
+static pthread_once_t PoolOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ScratchKey;            // Thread-specific key for the scratch arena
+static pthread_once_t ScratchOnce = PTHREAD_ONCE_INIT;
+static bool bScratchKeyValid = false;
+#endif
+
+//-----------------------------------------------------------------------------
+// Locks
+
+void SyncLock_Init(TSyncLock * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    InitializeCriticalSection(pLock);
+#else
+    pthread_mutex_init(pLock, NULL);
+#endif
+}
+
+void SyncLock_Free(TSyncLock * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    DeleteCriticalSection(pLock);
+#else
+    pthread_mutex_destroy(pLock);
+#endif
+}
+
+void SyncLock_Enter(TSyncLock * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    EnterCriticalSection(pLock);
+#else
+    pthread_mutex_lock(pLock);
+#endif
+}
+
+void SyncLock_Leave(TSyncLock * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    LeaveCriticalSection(pLock);
+#else
+    pthread_mutex_unlock(pLock);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Worker threads
+
+// Takes the first work item whose key is not being processed by another thread.
+// Must be called with the pool lock held.
+static TWorkItem * TakeWorkItem()
+{
+    TWorkItem * pPrevItem = NULL;
+    TWorkItem * pWorkItem;
+    DWORD i;
+
+    for(pWorkItem = pQueueFirst; pWorkItem != NULL; pWorkItem = pWorkItem->pNext)
+    {
+        // Check if an item with the same key is already running
+        if(pWorkItem->pvSerializeKey != NULL)
+        {
+            for(i = 0; i < dwWorkerThreads; i++)
+            {
+                if(RunningKeys[i] == pWorkItem->pvSerializeKey)
+                    break;
+            }
+        }
+
+        // If not, remove the item from the queue
+        if(pWorkItem->pvSerializeKey == NULL || i == dwWorkerThreads)
+        {
+            if(pPrevItem != NULL)
+                pPrevItem->pNext = pWorkItem->pNext;
+            else
+                pQueueFirst = pWorkItem->pNext;
+            if(pQueueLast == pWorkItem)
+                pQueueLast = pPrevItem;
+            return pWorkItem;
+        }
+
+        pPrevItem = pWorkItem;
+    }
+
+    return NULL;
+}
+
+// The worker thread. When it finishes a work item, it always checks the queue
+// again before going to sleep. That's how the items waiting for a key are not left behind.
+static void WorkerThread(DWORD dwThreadIndex)
+{
+    TWorkItem * pWorkItem;
+
+    SyncLock_Enter(&PoolLock);
+    for(;;)
+    {
+        // Wait until there is something to do
+        while((pWorkItem = TakeWorkItem()) == NULL)
+        {
+#ifdef PLATFORM_WINDOWS
+            SyncLock_Leave(&PoolLock);
+            WaitForSingleObject(hWorkAvailable, INFINITE);
+            SyncLock_Enter(&PoolLock);
+#else
+            pthread_cond_wait(&WorkAvailable, &PoolLock);
+#endif
+        }
+
+        // Run the work item without holding the lock
+        RunningKeys[dwThreadIndex] = pWorkItem->pvSerializeKey;
+        SyncLock_Leave(&PoolLock);
+
+        pWorkItem->pfnWork(pWorkItem->pvParam);
+        FREEMEM(pWorkItem);
+
+        SyncLock_Enter(&PoolLock);
+        RunningKeys[dwThreadIndex] = NULL;
+    }
+}
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI WorkerThreadProc(LPVOID lpParameter)
+{
+    WorkerThread((DWORD)(DWORD_PTR)lpParameter);
+    return 0;
+}
+#else
+static void * WorkerThreadProc(void * pvParam)
+{
+    WorkerThread((DWORD)(DWORD_PTR)pvParam);
+    return NULL;
+}
+#endif
+
+// Starts the worker threads. Called once, when the first work item is queued.
+// The threads are never stopped; they wait for more work until the process exits.
+static void StartWorkerThreads()
+{
+    DWORD dwThreadCount;
+
+#ifdef PLATFORM_WINDOWS
+    SYSTEM_INFO SystemInfo;
+
+    GetSystemInfo(&SystemInfo);
+    dwThreadCount = SystemInfo.dwNumberOfProcessors;
+#else
+    dwThreadCount = (DWORD)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    // Always have at least two threads, so that one long work item doesn't block everything
+    dwThreadCount = STORMLIB_MAX(dwThreadCount, 2);
+    dwThreadCount = STORMLIB_MIN(dwThreadCount, MAX_WORKER_THREADS);
+
+    SyncLock_Init(&PoolLock);
+    memset(RunningKeys, 0, sizeof(RunningKeys));
+
+#ifdef PLATFORM_WINDOWS
+    hWorkAvailable = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+#endif
+
+    // Start the threads. We can't do anything if this fails,
+    // but at least one thread is needed for the work items to be processed.
+    // The new threads wait for the lock until all of them are started
+    SyncLock_Enter(&PoolLock);
+    for(DWORD i = 0; i < dwThreadCount; i++)
+    {
+#ifdef PLATFORM_WINDOWS
+        HANDLE hThread = CreateThread(NULL, 0, WorkerThreadProc, (LPVOID)(DWORD_PTR)dwWorkerThreads, 0, NULL);
+
+        if(hThread == NULL)
+            break;
+        CloseHandle(hThread);
+#else
+        pthread_t Thread;
+
+        if(pthread_create(&Thread, NULL, WorkerThreadProc, (void *)(DWORD_PTR)dwWorkerThreads) != 0)
+            break;
+        pthread_detach(Thread);
+#endif
+        dwWorkerThreads++;
+    }
+    SyncLock_Leave(&PoolLock);
+}
+
+static bool EnsureWorkerThreads()
+{
+#ifdef PLATFORM_WINDOWS
+    // Only one thread may start the pool. The others wait until it's done
+    if(InterlockedCompareExchange(&PoolState, 1, 0) == 0)
+    {
+        StartWorkerThreads();
+        InterlockedExchange(&PoolState, 2);
+    }
+
+    while(PoolState != 2)
+        Sleep(0);
+#else
+    pthread_once(&PoolOnce, StartWorkerThreads);
+#endif
+
+    return (dwWorkerThreads != 0);
+}
+
+DWORD GetWorkerThreadCount()
+{
+    EnsureWorkerThreads();
+    return dwWorkerThreads;
+}
+
+int QueueWorkItem(WORK_ROUTINE pfnWork, void * pvParam, void * pvSerializeKey)
+{
+    TWorkItem * pWorkItem;
+
+    // Start the worker threads, if not started yet
+    if(!EnsureWorkerThreads())
+        return ERROR_CAN_NOT_COMPLETE;
+
+    // Allocate and fill the work item
+    pWorkItem = ALLOCMEM(TWorkItem, 1);
+    if(pWorkItem == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    pWorkItem->pNext = NULL;
+    pWorkItem->pfnWork = pfnWork;
+    pWorkItem->pvParam = pvParam;
+    pWorkItem->pvSerializeKey = pvSerializeKey;
+
+    // Put the item to the end of the queue and wake up one thread
+    SyncLock_Enter(&PoolLock);
+    if(pQueueLast != NULL)
+        pQueueLast->pNext = pWorkItem;
+    else
+        pQueueFirst = pWorkItem;
+    pQueueLast = pWorkItem;
+
+#ifdef PLATFORM_WINDOWS
+    ReleaseSemaphore(hWorkAvailable, 1, NULL);
+#else
+    pthread_cond_signal(&WorkAvailable);
+#endif
+    SyncLock_Leave(&PoolLock);
+
+    return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Waiting for work item results
+
+void SetWorkItemResult(volatile DWORD_PTR * pResult, DWORD_PTR Result)
+{
+#ifdef PLATFORM_WINDOWS
+    AcquireSRWLockExclusive(&ResultLock);
+    *pResult = Result;
+    WakeAllConditionVariable(&ResultChanged);
+    ReleaseSRWLockExclusive(&ResultLock);
+#else
+    pthread_mutex_lock(&ResultLock);
+    *pResult = Result;
+    pthread_cond_broadcast(&ResultChanged);
+    pthread_mutex_unlock(&ResultLock);
+#endif
+}
+
+// Returns true if the result is not pending anymore
+bool WaitForWorkItemResult(volatile DWORD_PTR * pResult, DWORD_PTR PendingValue, bool bWait)
+{
+    bool bCompleted;
+
+#ifdef PLATFORM_WINDOWS
+    AcquireSRWLockExclusive(&ResultLock);
+    while(bWait && *pResult == PendingValue)
+        SleepConditionVariableSRW(&ResultChanged, &ResultLock, INFINITE, 0);
+    bCompleted = (*pResult != PendingValue);
+    ReleaseSRWLockExclusive(&ResultLock);
+#else
+    pthread_mutex_lock(&ResultLock);
+    while(bWait && *pResult == PendingValue)
+        pthread_cond_wait(&ResultChanged, &ResultLock);
+    bCompleted = (*pResult != PendingValue);
+    pthread_mutex_unlock(&ResultLock);
+#endif
+
+    return bCompleted;
+}
+
+void AddWorkItemRef(volatile DWORD_PTR * pRefCount)
+{
+#ifdef PLATFORM_WINDOWS
+    AcquireSRWLockExclusive(&ResultLock);
+    (*pRefCount)++;
+    ReleaseSRWLockExclusive(&ResultLock);
+#else
+    pthread_mutex_lock(&ResultLock);
+    (*pRefCount)++;
+    pthread_mutex_unlock(&ResultLock);
+#endif
+}
+
+// The object may be freed as soon as the lock is released,
+// so the caller must not use it after this call
+void ReleaseWorkItemRef(volatile DWORD_PTR * pRefCount)
+{
+#ifdef PLATFORM_WINDOWS
+    AcquireSRWLockExclusive(&ResultLock);
+    if(--(*pRefCount) == 0)
+        WakeAllConditionVariable(&ResultChanged);
+    ReleaseSRWLockExclusive(&ResultLock);
+#else
+    pthread_mutex_lock(&ResultLock);
+    if(--(*pRefCount) == 0)
+        pthread_cond_broadcast(&ResultChanged);
+    pthread_mutex_unlock(&ResultLock);
+#endif
+}
+
+void WaitForWorkItemRefs(volatile DWORD_PTR * pRefCount)
+{
+#ifdef PLATFORM_WINDOWS
+    AcquireSRWLockExclusive(&ResultLock);
+    while(*pRefCount != 0)
+        SleepConditionVariableSRW(&ResultChanged, &ResultLock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&ResultLock);
+#else
+    pthread_mutex_lock(&ResultLock);
+    while(*pRefCount != 0)
+        pthread_cond_wait(&ResultChanged, &ResultLock);
+    pthread_mutex_unlock(&ResultLock);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Parallel loops
+
+static void ParallelJob_Release(TParallelJob * pJob)
+{
+    DWORD dwRefCount;
+
+    SyncLock_Enter(&pJob->Lock);
+    dwRefCount = --pJob->dwRefCount;
+    SyncLock_Leave(&pJob->Lock);
+
+    if(dwRefCount == 0)
+    {
+        SyncLock_Free(&pJob->Lock);
+        FREEMEM(pJob);
+    }
+}
+
+// Takes the items one by one until there are none left.
+// Once an item fails, the items that follow are skipped
+static void ParallelJob_Run(TParallelJob * pJob)
+{
+    DWORD dwItemIndex;
+    bool bSkipItem;
+    int nError;
+
+    for(;;)
+    {
+        SyncLock_Enter(&pJob->Lock);
+        if(pJob->dwNextItem >= pJob->dwItemCount)
+        {
+            SyncLock_Leave(&pJob->Lock);
+            break;
+        }
+        dwItemIndex = pJob->dwNextItem++;
+        bSkipItem = (pJob->nError != ERROR_SUCCESS);
+        SyncLock_Leave(&pJob->Lock);
+
+        nError = bSkipItem ? ERROR_SUCCESS : pJob->pfnWork(pJob->pvParam, dwItemIndex);
+
+        SyncLock_Enter(&pJob->Lock);
+        if(nError != ERROR_SUCCESS && (pJob->nError == ERROR_SUCCESS || dwItemIndex < pJob->dwErrorIndex))
+        {
+            pJob->dwErrorIndex = dwItemIndex;
+            pJob->nError = nError;
+        }
+        if(++pJob->dwItemsDone == pJob->dwItemCount)
+            SetWorkItemResult(&pJob->Completed, 1);
+        SyncLock_Leave(&pJob->Lock);
+    }
+}
+
+static void ParallelJob_Worker(void * pvParam)
+{
+    TParallelJob * pJob = (TParallelJob *)pvParam;
+
+    ParallelJob_Run(pJob);
+    ParallelJob_Release(pJob);
+}
+
+// The calling thread processes the items too, so the function can be called
+// from a work item without waiting for the items queued behind it.
+// Returns the error of the first item (by index) that failed
+int RunParallel(PARALLEL_ROUTINE pfnWork, void * pvParam, DWORD dwItemCount)
+{
+    TParallelJob * pJob;
+    DWORD dwWorkItems;
+    int nError = ERROR_SUCCESS;
+
+    // Nothing to share with other threads
+    if(dwItemCount == 0)
+        return ERROR_SUCCESS;
+    dwWorkItems = STORMLIB_MIN(GetWorkerThreadCount(), dwItemCount - 1);
+
+    // If the job cannot be allocated, process the items in this thread
+    pJob = ALLOCMEM(TParallelJob, 1);
+    if(pJob == NULL || dwWorkItems == 0)
+    {
+        for(DWORD i = 0; i < dwItemCount && nError == ERROR_SUCCESS; i++)
+            nError = pfnWork(pvParam, i);
+        if(pJob != NULL)
+            FREEMEM(pJob);
+        return nError;
+    }
+
+    memset(pJob, 0, sizeof(TParallelJob));
+    SyncLock_Init(&pJob->Lock);
+    pJob->pfnWork = pfnWork;
+    pJob->pvParam = pvParam;
+    pJob->dwItemCount = dwItemCount;
+    pJob->dwRefCount = 1;
+
+    // Let the worker threads help. The reference is taken before the item
+    // is queued, because the item may finish before QueueWorkItem returns
+    for(DWORD i = 0; i < dwWorkItems; i++)
+    {
+        SyncLock_Enter(&pJob->Lock);
+        pJob->dwRefCount++;
+        SyncLock_Leave(&pJob->Lock);
+
+        if(QueueWorkItem(ParallelJob_Worker, pJob, NULL) != ERROR_SUCCESS)
+        {
+            ParallelJob_Release(pJob);
+            break;
+        }
+    }
+
+    // Process the items and wait for those taken by the worker threads
+    ParallelJob_Run(pJob);
+    WaitForWorkItemResult(&pJob->Completed, 0, true);
+
+    SyncLock_Enter(&pJob->Lock);
+    nError = pJob->nError;
+    SyncLock_Leave(&pJob->Lock);
+
+    ParallelJob_Release(pJob);
+    return nError;
+}
+
+//-----------------------------------------------------------------------------
+// Scratch buffers
+//
+// Temporary buffers for reading, writing and compressing file sectors.
+// Instead of being freed, the buffers are kept in an arena of the thread
+// that freed them, sorted into size classes (powers of two from 4 KB to 1 MB).
+// The next allocation of the same size class in that thread takes the buffer
+// from the arena, so the hot paths don't need to call malloc at all.
+// Larger buffers are allocated and freed directly. The arena is freed
+// when the thread ends.
+//
+
+static void FreeScratchArena(TScratchArena * pArena)
+{
+    TScratchBuffer * pBuffer;
+
+    if(pArena != NULL)
+    {
+        if(pArena->pvCodecData != NULL && pArena->pfnFreeCodecData != NULL)
+            pArena->pfnFreeCodecData(pArena->pvCodecData);
+
+        for(DWORD i = 0; i < SCRATCH_SIZE_CLASSES; i++)
+        {
+            while((pBuffer = pArena->FreeBuffers[i]) != NULL)
+            {
+                pArena->FreeBuffers[i] = pBuffer->pNext;
+                FREEMEM(pBuffer);
+            }
+        }
+
+        FREEMEM(pArena);
+    }
+}
+
+#ifdef PLATFORM_WINDOWS
+static VOID WINAPI ScratchArenaDestructor(PVOID pvArena)
+{
+    FreeScratchArena((TScratchArena *)pvArena);
+}
+#else
+static void ScratchArenaDestructor(void * pvArena)
+{
+    FreeScratchArena((TScratchArena *)pvArena);
+}
+
+static void CreateScratchKey()
+{
+    bScratchKeyValid = (pthread_key_create(&ScratchKey, ScratchArenaDestructor) == 0);
+}
+#endif
+
+// Returns the arena of the calling thread. Creates it, if needed.
+// Returns NULL if the thread can't have an arena
+static TScratchArena * GetScratchArena()
+{
+    TScratchArena * pArena = NULL;
+
+#ifdef PLATFORM_WINDOWS
+    if(InterlockedCompareExchange(&ScratchState, 1, 0) == 0)
+    {
+        dwScratchIndex = FlsAlloc(ScratchArenaDestructor);
+        InterlockedExchange(&ScratchState, 2);
+    }
+
+    while(ScratchState != 2)
+        Sleep(0);
+
+    if(dwScratchIndex == FLS_OUT_OF_INDEXES)
+        return NULL;
+    pArena = (TScratchArena *)FlsGetValue(dwScratchIndex);
+#else
+    pthread_once(&ScratchOnce, CreateScratchKey);
+    if(bScratchKeyValid == false)
+        return NULL;
+    pArena = (TScratchArena *)pthread_getspecific(ScratchKey);
+#endif
+
+    if(pArena == NULL)
+    {
+        pArena = ALLOCMEM(TScratchArena, 1);
+        if(pArena != NULL)
+        {
+            memset(pArena, 0, sizeof(TScratchArena));
+#ifdef PLATFORM_WINDOWS
+            FlsSetValue(dwScratchIndex, pArena);
+#else
+            pthread_setspecific(ScratchKey, pArena);
+#endif
+        }
+    }
+
+    return pArena;
+}
+
+void * AllocateScratchBuffer(DWORD cbBuffer)
+{
+    TScratchArena * pArena;
+    TScratchBuffer * pBuffer;
+    DWORD dwSizeClass = 0;
+
+    // Find the smallest size class that fits
+    while(dwSizeClass < SCRATCH_SIZE_CLASSES && cbBuffer > SCRATCH_CLASS_SIZE(dwSizeClass))
+        dwSizeClass++;
+
+    if(dwSizeClass < SCRATCH_SIZE_CLASSES)
+    {
+        // Reuse a buffer that this thread has freed before
+        pArena = GetScratchArena();
+        if(pArena != NULL && pArena->FreeBuffers[dwSizeClass] != NULL)
+        {
+            pBuffer = pArena->FreeBuffers[dwSizeClass];
+            pArena->FreeBuffers[dwSizeClass] = pBuffer->pNext;
+            pArena->dwCachedSize -= SCRATCH_CLASS_SIZE(dwSizeClass);
+            return (LPBYTE)pBuffer + SCRATCH_HEADER_SIZE;
+        }
+
+        // Allocate the whole size class, so that the buffer can be reused
+        cbBuffer = SCRATCH_CLASS_SIZE(dwSizeClass);
+    }
+    else
+    {
+        dwSizeClass = SCRATCH_NO_CLASS;
+    }
+
+    pBuffer = (TScratchBuffer *)ALLOCMEM(BYTE, SCRATCH_HEADER_SIZE + cbBuffer);
+    if(pBuffer == NULL)
+        return NULL;
+
+    pBuffer->dwSizeClass = dwSizeClass;
+    return (LPBYTE)pBuffer + SCRATCH_HEADER_SIZE;
+}
+
+void FreeScratchBuffer(void * pvBuffer)
+{
+    TScratchArena * pArena;
+    TScratchBuffer * pBuffer;
+    DWORD dwSizeClass;
+
+    if(pvBuffer != NULL)
+    {
+        pBuffer = (TScratchBuffer *)((LPBYTE)pvBuffer - SCRATCH_HEADER_SIZE);
+        dwSizeClass = pBuffer->dwSizeClass;
+
+        // Keep the buffer in the arena, unless the thread keeps too much already
+        if(dwSizeClass != SCRATCH_NO_CLASS)
+        {
+            pArena = GetScratchArena();
+            if(pArena != NULL && (pArena->dwCachedSize + SCRATCH_CLASS_SIZE(dwSizeClass)) <= SCRATCH_MAX_CACHED)
+            {
+                pBuffer->pNext = pArena->FreeBuffers[dwSizeClass];
+                pArena->FreeBuffers[dwSizeClass] = pBuffer;
+                pArena->dwCachedSize += SCRATCH_CLASS_SIZE(dwSizeClass);
+                return;
+            }
+        }
+
+        FREEMEM(pBuffer);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Per-thread compression contexts
+//
+// The compression code keeps its initialized codecs in the arena, so that
+// each thread reuses its own contexts and they are freed when the thread ends
+//
+
+void * GetThreadCodecData()
+{
+    TScratchArena * pArena = GetScratchArena();
+
+    return (pArena != NULL) ? pArena->pvCodecData : NULL;
+}
+
+bool SetThreadCodecData(void * pvData, FREE_THREAD_DATA pfnFree)
+{
+    TScratchArena * pArena = GetScratchArena();
+
+    if(pArena == NULL)
+        return false;
+
+    pArena->pvCodecData = pvData;
+    pArena->pfnFreeCodecData = pfnFree;
+    return true;
+}
@@ -64,6 +64,186 @@ typedef struct
     DECOMPRESS    Decompress;           // Decompression function
 } TDecompressTable;
 
+// Effort level of the PKWARE implode, set by SCompSetImplodeLevel
+static unsigned int ImplodeLevel = CMP_LEVEL_DEFAULT;
+
+// LZMA encoder settings, set by SCompSetLzmaOptions
+static int LzmaLevel = MPQ_LZMA_LEVEL_DEFAULT;
+static DWORD LzmaDictSize = MPQ_LZMA_DICT_SIZE_AUTO;
+static DWORD LzmaThreads = MPQ_LZMA_THREADS_DEFAULT;
+
+// Compressions tried by MPQ_COMPRESSION_AUTO, from the fastest to decompress
+static const DWORD DefaultAutoCandidates[] =
+{
+    MPQ_COMPRESSION_ZLIB,
+    MPQ_COMPRESSION_PKWARE,
+    MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB,
+    MPQ_COMPRESSION_BZIP2,
+    MPQ_COMPRESSION_LZMA
+};
+
+// Settings of MPQ_COMPRESSION_AUTO, set by SCompSetAutoCompression
+static DWORD AutoCandidates[MPQ_AUTO_MAX_CANDIDATES] =
+{
+    MPQ_COMPRESSION_ZLIB,
+    MPQ_COMPRESSION_PKWARE,
+    MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB,
+    MPQ_COMPRESSION_BZIP2,
+    MPQ_COMPRESSION_LZMA
+};
+static DWORD AutoCandidateCount = sizeof(DefaultAutoCandidates) / sizeof(DWORD);
+static DWORD AutoSampleSize = MPQ_AUTO_SAMPLE_ALL;
+
+/*****************************************************************************/
+/*                                                                           */
+/*  Per-thread codec contexts                                                */
+/*                                                                           */
+/*****************************************************************************/
+
+// Initializing zlib, bzip2 or LZMA costs more than compressing a small sector.
+// Each thread keeps its initialized codecs and only resets them for the next
+// sector. If the contexts can't be allocated, the codecs are initialized per call.
+
+#define ZLIB_WINDOW_BITS_MIN    8       // Smallest window bits used by Compress_ZLIB
+#define ZLIB_WINDOW_BITS_COUNT  8       // Number of window bits values (8 .. 15)
+
+#define CODEC_MAX_BLOCKS        8       // Max number of freed bzip2 blocks kept by a thread
+#define CODEC_MAX_CACHED        0x00800000  // Max total size of the freed bzip2 blocks
+#define CODEC_BLOCK_HEADER      0x10    // Size of the header of a bzip2 block
+
+typedef struct
+{
+    z_stream Deflate[ZLIB_WINDOW_BITS_COUNT];       // Deflate streams, one per window bits value
+    bool     bDeflateReady[ZLIB_WINDOW_BITS_COUNT]; // true if the deflate stream has been initialized
+    z_stream Inflate;                               // Inflate stream
+    bool     bInflateReady;                         // true if the inflate stream has been initialized
+
+    CLzmaEncHandle LzmaEncoder;                     // LZMA encoder. Keeps its match finder between calls
+    CLzmaDec       LzmaDecoder;                     // LZMA decoder. Keeps its probability tables between calls
+
+    THuffmannDecoder HuffDecoder;                   // Huffmann decoder. Keeps the initial tree between calls
+    TDcmpTables      ExplodeTables;                 // Decode tables of explode_buffer, built by the first call
+
+    void   * FreeBlocks[CODEC_MAX_BLOCKS];          // Memory blocks freed by bzip2, kept for the next stream
+    size_t   cbFreeBlocks;                          // Total size of the kept blocks
+} TCodecContexts;
+
+// Memory functions for bzip2. The work buffers of bzip2 have the same sizes
+// for every stream, so the freed ones are kept and given to the next stream
+static void * Codec_Alloc(void * pvContexts, int nItems, int cbItem)
+{
+    TCodecContexts * pCodecs = (TCodecContexts *)pvContexts;
+    size_t cbBlock = (size_t)nItems * (size_t)cbItem;
+    LPBYTE pbBlock;
+
+    if(pCodecs != NULL)
+    {
+        for(int i = 0; i < CODEC_MAX_BLOCKS; i++)
+        {
+            pbBlock = (LPBYTE)pCodecs->FreeBlocks[i];
+            if(pbBlock != NULL && *(size_t *)pbBlock == cbBlock)
+            {
+                pCodecs->FreeBlocks[i] = NULL;
+                pCodecs->cbFreeBlocks -= cbBlock;
+                return pbBlock + CODEC_BLOCK_HEADER;
+            }
+        }
+    }
+
+    pbBlock = ALLOCMEM(BYTE, CODEC_BLOCK_HEADER + cbBlock);
+    if(pbBlock == NULL)
+        return NULL;
+
+    *(size_t *)pbBlock = cbBlock;
+    return pbBlock + CODEC_BLOCK_HEADER;
+}
+
+static void Codec_Free(void * pvContexts, void * pvBlock)
+{
+    TCodecContexts * pCodecs = (TCodecContexts *)pvContexts;
+    LPBYTE pbBlock;
+    size_t cbBlock;
+
+    if(pvBlock != NULL)
+    {
+        pbBlock = (LPBYTE)pvBlock - CODEC_BLOCK_HEADER;
+        cbBlock = *(size_t *)pbBlock;
+
+        if(pCodecs != NULL && (pCodecs->cbFreeBlocks + cbBlock) <= CODEC_MAX_CACHED)
+        {
+            for(int i = 0; i < CODEC_MAX_BLOCKS; i++)
+            {
+                if(pCodecs->FreeBlocks[i] == NULL)
+                {
+                    pCodecs->FreeBlocks[i] = pbBlock;
+                    pCodecs->cbFreeBlocks += cbBlock;
+                    return;
+                }
+            }
+        }
+
+        FREEMEM(pbBlock);
+    }
+}
+
+static void * LZMA_Callback_Alloc(void *p, size_t size);
+static void LZMA_Callback_Free(void *p, void *address);
+
+// Called when the thread ends
+static void FreeCodecContexts(void * pvContexts)
+{
+    TCodecContexts * pCodecs = (TCodecContexts *)pvContexts;
+    ISzAlloc SzAlloc;
+
+    SzAlloc.Alloc = LZMA_Callback_Alloc;
+    SzAlloc.Free = LZMA_Callback_Free;
+
+    for(int i = 0; i < ZLIB_WINDOW_BITS_COUNT; i++)
+    {
+        if(pCodecs->bDeflateReady[i])
+            deflateEnd(&pCodecs->Deflate[i]);
+    }
+
+    if(pCodecs->bInflateReady)
+        inflateEnd(&pCodecs->Inflate);
+
+    if(pCodecs->LzmaEncoder != NULL)
+        LzmaEnc_Destroy(pCodecs->LzmaEncoder, &SzAlloc, &SzAlloc);
+    LzmaDec_FreeProbs(&pCodecs->LzmaDecoder, &SzAlloc);
+
+    for(int i = 0; i < CODEC_MAX_BLOCKS; i++)
+    {
+        if(pCodecs->FreeBlocks[i] != NULL)
+            FREEMEM(pCodecs->FreeBlocks[i]);
+    }
+
+    FREEMEM(pCodecs);
+}
+
+// Returns the codec contexts of the calling thread, or NULL if there are none
+static TCodecContexts * GetCodecContexts()
+{
+    TCodecContexts * pCodecs = (TCodecContexts *)GetThreadCodecData();
+
+    if(pCodecs == NULL)
+    {
+        pCodecs = ALLOCMEM(TCodecContexts, 1);
+        if(pCodecs != NULL)
+        {
+            memset(pCodecs, 0, sizeof(TCodecContexts));
+            LzmaDec_Construct(&pCodecs->LzmaDecoder);
+
+            if(!SetThreadCodecData(pCodecs, FreeCodecContexts))
+            {
+                FREEMEM(pCodecs);
+                pCodecs = NULL;
+            }
+        }
+    }
+
+    return pCodecs;
+}
+
 
 /*****************************************************************************/
 /*                                                                           */
@@ -104,25 +284,24 @@ void Compress_huff(
 // 1500F5F0
 int Decompress_huff(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer)
 {
-    THuffmannTree ht;
-    TInputStream  is;
+    TCodecContexts * pCodecs = GetCodecContexts();
+    THuffmannDecoder * pDecoder;
+    THuffmannDecoder LocalDecoder;
 
-    // Initialize input stream
-    is.pbInBufferEnd = (unsigned char *)pbInBuffer + cbInBuffer;
-    is.pbInBuffer = (unsigned char *)pbInBuffer;
-    is.BitBuffer  = 0;
-    is.BitCount   = 0;
+    // Use the decoder of this thread, if there is one
+    if(pCodecs != NULL)
+    {
+        pDecoder = &pCodecs->HuffDecoder;
+    }
+    else
+    {
+        LocalDecoder.InitDecoder();
+        pDecoder = &LocalDecoder;
+    }
 
-    // Initialize the Huffmann tree for compression
-    ht.InitTree(false);
-    *pcbOutBuffer = ht.DoDecompression((unsigned char *)pbOutBuffer, *pcbOutBuffer, &is);
+    *pcbOutBuffer = pDecoder->DoDecompression((unsigned char *)pbOutBuffer, *pcbOutBuffer, (unsigned char *)pbInBuffer, cbInBuffer);
     if(*pcbOutBuffer == 0)
         return 0;
-
-    // The following code is not necessary to run, because it has no
-    // effect on the output data. It only clears the huffmann tree, but when
-    // the tree is on the stack, who cares ?
-//  ht.UninitTree();
     return 1;
 }
 
@@ -140,20 +319,12 @@ void Compress_ZLIB(
     int * /* pCmpType */,
     int /* nCmpLevel */)
 {
-    z_stream z;                        // Stream information for zlib
+    TCodecContexts * pCodecs = GetCodecContexts();
+    z_stream LocalStream;              // Stream information for zlib, if the thread has no contexts
+    z_stream * z = &LocalStream;
     int windowBits;
     int nResult;
 
-    // Fill the stream structure for zlib
-    z.next_in   = (Bytef *)pbInBuffer;
-    z.avail_in  = (uInt)cbInBuffer;
-    z.total_in  = cbInBuffer;
-    z.next_out  = (Bytef *)pbOutBuffer;
-    z.avail_out = *pcbOutBuffer;
-    z.total_out = 0;
-    z.zalloc    = NULL;
-    z.zfree     = NULL;
-
     // Determine the proper window bits (WoW.exe build 12694)
     if(cbInBuffer <= 0x100)
         windowBits = 8;
@@ -172,49 +343,93 @@ void Compress_ZLIB(
     else
         windowBits = 15;
 
-    // Initialize the compression.
-    // Storm.dll uses zlib version 1.1.3
-    // Wow.exe uses zlib version 1.2.3
-    nResult = deflateInit2(&z,
-                            Z_DEFAULT_COMPRESSION,
-                            Z_DEFLATED,
-                            windowBits,
-                            8,
-                            Z_DEFAULT_STRATEGY);
+    // Reuse the stream of the thread, if it has already been initialized
+    if(pCodecs != NULL)
+        z = &pCodecs->Deflate[windowBits - ZLIB_WINDOW_BITS_MIN];
+
+    if(pCodecs != NULL && pCodecs->bDeflateReady[windowBits - ZLIB_WINDOW_BITS_MIN])
+    {
+        nResult = deflateReset(z);
+    }
+    else
+    {
+        // Initialize the compression.
+        // Storm.dll uses zlib version 1.1.3
+        // Wow.exe uses zlib version 1.2.3
+        z->zalloc = NULL;
+        z->zfree  = NULL;
+        z->opaque = NULL;
+        nResult = deflateInit2(z,
+                                Z_DEFAULT_COMPRESSION,
+                                Z_DEFLATED,
+                                windowBits,
+                                8,
+                                Z_DEFAULT_STRATEGY);
+        if(pCodecs != NULL && nResult == Z_OK)
+            pCodecs->bDeflateReady[windowBits - ZLIB_WINDOW_BITS_MIN] = true;
+    }
+
     if(nResult == Z_OK)
     {
+        // Fill the stream structure for zlib
+        z->next_in   = (Bytef *)pbInBuffer;
+        z->avail_in  = (uInt)cbInBuffer;
+        z->next_out  = (Bytef *)pbOutBuffer;
+        z->avail_out = *pcbOutBuffer;
+
         // Call zlib to compress the data
-        nResult = deflate(&z, Z_FINISH);
+        nResult = deflate(z, Z_FINISH);
 
         if(nResult == Z_OK || nResult == Z_STREAM_END)
-            *pcbOutBuffer = z.total_out;
+            *pcbOutBuffer = z->total_out;
 
-        deflateEnd(&z);
+        if(z == &LocalStream)
+            deflateEnd(z);
     }
 }
 
 int Decompress_ZLIB(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer)
 {
-    z_stream z;                        // Stream information for zlib
+    TCodecContexts * pCodecs = GetCodecContexts();
+    z_stream LocalStream;              // Stream information for zlib, if the thread has no contexts
+    z_stream * z = &LocalStream;
     int nResult;
 
-    // Fill the stream structure for zlib
-    z.next_in   = (Bytef *)pbInBuffer;
-    z.avail_in  = (uInt)cbInBuffer;
-    z.total_in  = cbInBuffer;
-    z.next_out  = (Bytef *)pbOutBuffer;
-    z.avail_out = *pcbOutBuffer;
-    z.total_out = 0;
-    z.zalloc    = NULL;
-    z.zfree     = NULL;
-
-    // Initialize the decompression structure. Storm.dll uses zlib version 1.1.3
-    if((nResult = inflateInit(&z)) == 0)
+    // Reuse the stream of the thread, if it has already been initialized
+    if(pCodecs != NULL)
+        z = &pCodecs->Inflate;
+
+    if(pCodecs != NULL && pCodecs->bInflateReady)
+    {
+        nResult = inflateReset(z);
+    }
+    else
+    {
+        // Initialize the decompression structure. Storm.dll uses zlib version 1.1.3
+        z->next_in  = NULL;
+        z->avail_in = 0;
+        z->zalloc   = NULL;
+        z->zfree    = NULL;
+        z->opaque   = NULL;
+        nResult = inflateInit(z);
+        if(pCodecs != NULL && nResult == Z_OK)
+            pCodecs->bInflateReady = true;
+    }
+
+    if(nResult == Z_OK)
     {
+        // Fill the stream structure for zlib
+        z->next_in   = (Bytef *)pbInBuffer;
+        z->avail_in  = (uInt)cbInBuffer;
+        z->next_out  = (Bytef *)pbOutBuffer;
+        z->avail_out = *pcbOutBuffer;
+
         // Call zlib to decompress the data
-        nResult = inflate(&z, Z_FINISH);
-        *pcbOutBuffer = z.total_out;
-        inflateEnd(&z);
+        nResult = inflate(z, Z_FINISH);
+        *pcbOutBuffer = z->total_out;
+
+        if(z == &LocalStream)
+            inflateEnd(z);
     }
     return nResult;
 }
@@ -282,10 +497,15 @@ static void Compress_PKLIB(
     int /* nCmpLevel */)
 {
     TDataInfo Info;                                     // Data information
-    char * work_buf = ALLOCMEM(char, CMP_BUFFER_SIZE);  // Pklib's work buffer
+    char * work_buf;                                    // Pklib's work buffer
     unsigned int dict_size;                             // Dictionary size
     unsigned int ctype = CMP_BINARY;                    // Compression type
 
+    // Get the work buffer. If there is none, the data is stored uncompressed
+    work_buf = (char *)AllocateScratchBuffer(CMP_BUFFER_SIZE);
+    if(work_buf == NULL)
+        return;
+
     // Fill data information structure
     memset(work_buf, 0, CMP_BUFFER_SIZE);
     Info.pbInBuff     = pbInBuffer;
@@ -302,34 +522,43 @@ static void Compress_PKLIB(
         dict_size = CMP_IMPLODE_DICT_SIZE3;
 
     // Do the compression
-    if(implode(ReadInputData, WriteOutputData, work_buf, &Info, &ctype, &dict_size) == CMP_NO_ERROR)
+    if(implode_level(ReadInputData, WriteOutputData, work_buf, &Info, &ctype, &dict_size, ImplodeLevel) == CMP_NO_ERROR)
         *pcbOutBuffer = (int)(Info.pbOutBuff - pbOutBuffer);
 
-    FREEMEM(work_buf);
+    FreeScratchBuffer(work_buf);
 }
 
 static int Decompress_PKLIB(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer)
 {
-    TDataInfo Info;                             // Data information
-    char * work_buf = ALLOCMEM(char, EXP_BUFFER_SIZE);// Pklib's work buffer
+    TCodecContexts * pCodecs = GetCodecContexts();
+    unsigned int cbOutBuffer = *pcbOutBuffer;
+    char * work_buf;                            // Decode tables for explode_buffer
 
-    // Fill data information structure
-    memset(work_buf, 0, EXP_BUFFER_SIZE);
-    Info.pbInBuff     = pbInBuffer;
-    Info.pbInBuffEnd  = pbInBuffer + cbInBuffer;
-    Info.pbOutBuff    = pbOutBuffer;
-    Info.pbOutBuffEnd = pbOutBuffer + *pcbOutBuffer;
+    // Use the decode tables of this thread. If there are none, build them in a work buffer
+    if(pCodecs != NULL)
+    {
+        work_buf = (char *)&pCodecs->ExplodeTables;
+    }
+    else
+    {
+        work_buf = (char *)AllocateScratchBuffer(EXP_TABLES_SIZE);
+        if(work_buf == NULL)
+            return 0;
+        memset(work_buf, 0, EXP_TABLES_SIZE);
+    }
 
-    // Do the decompression
-    explode(ReadInputData, WriteOutputData, work_buf, &Info);
+    // Do the decompression. The data are entirely in memory,
+    // so the buffer version of explode is used
+    explode_buffer(pbOutBuffer, &cbOutBuffer, pbInBuffer, cbInBuffer, work_buf);
+    if(pCodecs == NULL)
+        FreeScratchBuffer(work_buf);
 
     // If PKLIB is unable to decompress the data, return 0;
-    if(Info.pbOutBuff == pbOutBuffer)
+    if(cbOutBuffer == 0)
         return 0;
 
     // Give away the number of decompressed bytes
-    *pcbOutBuffer = (int)(Info.pbOutBuff - pbOutBuffer);
-    FREEMEM(work_buf);
+    *pcbOutBuffer = (int)cbOutBuffer;
     return 1;
 }
 
@@ -347,14 +576,16 @@ static void Compress_BZIP2(
     int * /* pCmpType */,
     int /* nCmpLevel */)
 {
+    TCodecContexts * pCodecs = GetCodecContexts();
     bz_stream strm;
     int blockSize100k = 9;
     int workFactor = 30;
     int bzError;
 
-    // Initialize the BZIP2 compression
-    strm.bzalloc = NULL;
-    strm.bzfree  = NULL;
+    // Initialize the BZIP2 compression. The work buffers come from the thread's codec contexts
+    strm.bzalloc = (pCodecs != NULL) ? Codec_Alloc : NULL;
+    strm.bzfree  = (pCodecs != NULL) ? Codec_Free : NULL;
+    strm.opaque  = pCodecs;
 
     // Blizzard uses 9 as blockSize100k, (0x30 as workFactor)
     // Last checked on Starcraft II
@@ -383,12 +614,14 @@ static void Compress_BZIP2(
 
 static int Decompress_BZIP2(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer)
 {
+    TCodecContexts * pCodecs = GetCodecContexts();
     bz_stream strm;
     int nResult = BZ_OK;
 
-    // Initialize the BZIP2 decompression
-    strm.bzalloc = NULL;
-    strm.bzfree  = NULL;
+    // Initialize the BZIP2 decompression. The work buffers come from the thread's codec contexts
+    strm.bzalloc = (pCodecs != NULL) ? Codec_Alloc : NULL;
+    strm.bzfree  = (pCodecs != NULL) ? Codec_Free : NULL;
+    strm.opaque  = pCodecs;
     if(BZ2_bzDecompressInit(&strm, 0, 0) == BZ_OK)
     {
         strm.next_in   = pbInBuffer;
@@ -429,6 +662,10 @@ static int Decompress_BZIP2(char * pbOutBuffer, int * pcbOutBuffer, char * pbInB
 /******************************************************************************/
 
 #define LZMA_HEADER_SIZE (1 + LZMA_PROPS_SIZE + 8)
+#define LZMA_MIN_DICT_SIZE  0x00001000  // Smallest dictionary used for compression
+#define LZMA_MAX_DICT_SIZE  0x08000000  // Largest dictionary that can be set by SCompSetLzmaOptions
+#define LZMA_MT_MIN_SIZE    0x00040000  // Smaller data are not worth starting the match finder threads
+#define LZMA_KEEP_DICT_SIZE 0x00100000  // Largest dictionary whose encoder is kept by the thread
 
 static SRes LZMA_Callback_Progress(void * /* p */, UInt64 /* inSize */, UInt64 /* outSize */)
 {
@@ -464,12 +701,15 @@ static void Compress_LZMA(
     int * /* pCmpType */,
     int /* nCmpLevel */)
 {
+    TCodecContexts * pCodecs = GetCodecContexts();
     ICompressProgress Progress;
+    CLzmaEncHandle Encoder = NULL;
     CLzmaEncProps props;
     ISzAlloc SzAlloc;
     Byte * destBuffer;
     SizeT destLen = *pcbOutBuffer;
     SizeT srcLen = cbInBuffer;
+    UInt32 dictSize;
     Byte encodedProps[LZMA_PROPS_SIZE];
     size_t encodedPropsSize = LZMA_PROPS_SIZE;
     SRes nResult;
@@ -479,23 +719,63 @@ static void Compress_LZMA(
     SzAlloc.Alloc = LZMA_Callback_Alloc;
     SzAlloc.Free = LZMA_Callback_Free;
 
-    // Initialize properties
+    // Initialize properties. The dictionary doesn't need to be bigger
+    // than the data, and a smaller one keeps the match finder small
     LzmaEncProps_Init(&props);
+    props.level = LzmaLevel;
+    props.dictSize = LzmaDictSize;
+    LzmaEncProps_Normalize(&props);
+    dictSize = LZMA_MIN_DICT_SIZE;
+    while(dictSize < srcLen && dictSize < props.dictSize)
+        dictSize <<= 1;
+    if(dictSize < props.dictSize)
+        props.dictSize = dictSize;
+
+    // The match finder threads are only used when asked for by SCompSetLzmaOptions.
+    // They only pay off for large blocks, like single-unit files.
+    // Sectors are compressed in parallel anyway.
+    props.numThreads = (int)LzmaThreads;
+    if(srcLen < LZMA_MT_MIN_SIZE)
+        props.numThreads = 1;
+
+    // Use the encoder of the thread. It keeps its buffers between the calls.
+    // Encoders with large dictionaries are not kept; their match finder
+    // would stay allocated for the life of the thread. Neither are encoders
+    // that use the match finder threads, which would stay parked
+    if(props.dictSize > LZMA_KEEP_DICT_SIZE || props.numThreads > 1)
+        pCodecs = NULL;
+    if(pCodecs != NULL)
+        Encoder = pCodecs->LzmaEncoder;
+    if(Encoder == NULL)
+    {
+        Encoder = LzmaEnc_Create(&SzAlloc);
+        if(Encoder == NULL)
+            return;
+        if(pCodecs != NULL)
+            pCodecs->LzmaEncoder = Encoder;
+    }
 
     // Perform compression
     destBuffer = (Byte *)pbOutBuffer + LZMA_HEADER_SIZE;
     destLen = *pcbOutBuffer - LZMA_HEADER_SIZE;
-    nResult = LzmaEncode(destBuffer,
-                        &destLen,
-                 (Byte *)pbInBuffer,
-                         srcLen,
-                        &props,
-                         encodedProps,
-                        &encodedPropsSize,
-                         0,
-                        &Progress,
-                        &SzAlloc,
-                        &SzAlloc);
+    nResult = LzmaEnc_SetProps(Encoder, &props);
+    if(nResult == SZ_OK)
+        nResult = LzmaEnc_WriteProperties(Encoder, encodedProps, &encodedPropsSize);
+    if(nResult == SZ_OK)
+    {
+        nResult = LzmaEnc_MemEncode(Encoder,
+                                    destBuffer,
+                                   &destLen,
+                            (Byte *)pbInBuffer,
+                                    srcLen,
+                                    0,
+                                   &Progress,
+                                   &SzAlloc,
+                                   &SzAlloc);
+    }
+
+    if(pCodecs == NULL)
+        LzmaEnc_Destroy(Encoder, &SzAlloc, &SzAlloc);
     if(nResult != SZ_OK)
         return;
 
@@ -526,7 +806,9 @@ static void Compress_LZMA(
 
 static int Decompress_LZMA(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer)
 {
+    TCodecContexts * pCodecs;
     ELzmaStatus LzmaStatus;
+    CLzmaDec * pDecoder;
     ISzAlloc SzAlloc;
     Byte * destBuffer = (Byte *)pbOutBuffer;
     Byte * srcBuffer = (Byte *)pbInBuffer;
@@ -546,8 +828,29 @@ static int Decompress_LZMA(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBu
     SzAlloc.Alloc = LZMA_Callback_Alloc;
     SzAlloc.Free = LZMA_Callback_Free;
 
-    // Perform compression
+    // Use the decoder of the thread. It keeps its probability tables
+    // as long as the properties of the data don't require bigger ones
     srcLen = cbInBuffer - LZMA_HEADER_SIZE;
+    pCodecs = GetCodecContexts();
+    if(pCodecs != NULL)
+    {
+        pDecoder = &pCodecs->LzmaDecoder;
+        if(LzmaDec_AllocateProbs(pDecoder, srcBuffer + 1, LZMA_PROPS_SIZE, &SzAlloc) != SZ_OK)
+            return 0;
+
+        pDecoder->dic = destBuffer;
+        pDecoder->dicBufSize = destLen;
+        LzmaDec_Init(pDecoder);
+
+        nResult = LzmaDec_DecodeToDic(pDecoder, destLen, srcBuffer + LZMA_HEADER_SIZE, &srcLen, LZMA_FINISH_END, &LzmaStatus);
+        if(nResult != SZ_OK || LzmaStatus == LZMA_STATUS_NEEDS_MORE_INPUT)
+            return 0;
+
+        *pcbOutBuffer = (unsigned int)pDecoder->dicPos;
+        return 1;
+    }
+
+    // Perform decompression
     nResult = LzmaDecode(destBuffer,
                         &destLen,
                          srcBuffer + LZMA_HEADER_SIZE,
@@ -666,6 +969,118 @@ static int Decompress_ADPCM_stereo(char * pbOutBuffer, int * pcbOutBuffer, char
     return 1;
 }
 
+/*****************************************************************************/
+/*                                                                           */
+/*   SCompSetImplodeLevel                                                    */
+/*                                                                           */
+/*****************************************************************************/
+
+// Level 0 produces the same data as all previous versions of StormLib.
+// Levels 1 to 9 use a hash chain match finder; the output is a valid
+// PKWARE stream, but not byte-identical to level 0.
+bool WINAPI SCompSetImplodeLevel(int nLevel)
+{
+    if(nLevel < MPQ_IMPLODE_LEVEL_DEFAULT || nLevel > MPQ_IMPLODE_LEVEL_BEST)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    ImplodeLevel = (unsigned int)nLevel;
+    return true;
+}
+
+/*****************************************************************************/
+/*                                                                           */
+/*   SCompSetLzmaOptions                                                     */
+/*                                                                           */
+/*****************************************************************************/
+
+// Sets the LZMA level (0-9), the maximum dictionary size and the number
+// of match finder threads (1 or 2) for all following LZMA compressions.
+// MPQ_LZMA_DICT_SIZE_AUTO lets LZMA choose the dictionary by the level.
+// The dictionary is never bigger than the compressed data.
+bool WINAPI SCompSetLzmaOptions(int nLevel, DWORD dwDictSize, DWORD dwThreads)
+{
+    if(nLevel < MPQ_LZMA_LEVEL_FASTEST || nLevel > MPQ_LZMA_LEVEL_BEST)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    if(dwDictSize != MPQ_LZMA_DICT_SIZE_AUTO && (dwDictSize < LZMA_MIN_DICT_SIZE || dwDictSize > LZMA_MAX_DICT_SIZE))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    if(dwThreads < 1 || dwThreads > 2)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+#ifdef _7ZIP_ST
+    // StormLib was built without the multi-threaded match finder
+    if(dwThreads > 1)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+#endif
+
+    LzmaLevel = nLevel;
+    LzmaDictSize = dwDictSize;
+    LzmaThreads = dwThreads;
+    return true;
+}
+
+/*****************************************************************************/
+/*                                                                           */
+/*   SCompSetAutoCompression                                                 */
+/*                                                                           */
+/*****************************************************************************/
+
+// Sets the compressions tried by MPQ_COMPRESSION_AUTO. Each candidate is
+// a mask for SCompCompress; lossy compressions can't be candidates.
+// dwSampleSize limits the CPU spent on choosing: the candidates only
+// compress the first dwSampleSize bytes of a sector, then the winner
+// compresses the whole sector. MPQ_AUTO_SAMPLE_ALL tries them on whole sectors.
+// If pCandidates is NULL, the default candidates are used.
+bool WINAPI SCompSetAutoCompression(const DWORD * pCandidates, DWORD dwCandidates, DWORD dwSampleSize)
+{
+    DWORD dwValidMask = (MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE | MPQ_COMPRESSION_BZIP2 | MPQ_COMPRESSION_SPARSE);
+
+    if(pCandidates == NULL)
+    {
+        pCandidates = DefaultAutoCandidates;
+        dwCandidates = sizeof(DefaultAutoCandidates) / sizeof(DWORD);
+    }
+
+    if(dwCandidates == 0 || dwCandidates > MPQ_AUTO_MAX_CANDIDATES)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    for(DWORD i = 0; i < dwCandidates; i++)
+    {
+        if(pCandidates[i] == MPQ_COMPRESSION_LZMA)
+            continue;
+
+        if(pCandidates[i] == 0 || (pCandidates[i] & dwValidMask) != pCandidates[i])
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return false;
+        }
+    }
+
+    memcpy(AutoCandidates, pCandidates, dwCandidates * sizeof(DWORD));
+    AutoCandidateCount = dwCandidates;
+    AutoSampleSize = dwSampleSize;
+    return true;
+}
+
 /*****************************************************************************/
 /*                                                                           */
 /*   SCompImplode                                                            */
@@ -762,6 +1177,63 @@ static TCompressTable cmp_table[] =
     {MPQ_COMPRESSION_BZIP2,       Compress_BZIP2}           // Compression Bzip2 library
 };
 
+// Compresses the data by each candidate of MPQ_COMPRESSION_AUTO and keeps
+// the smallest output. If only a sample is compared, the winner then
+// compresses the whole data.
+static int CompressAuto(char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer)
+{
+    char * pbTrialBuffer;
+    DWORD dwBestCompression = 0;
+    int cbSample = cbInBuffer;
+    int cbBestOutput;
+    int cbTrialOutput;
+
+    if(AutoSampleSize != MPQ_AUTO_SAMPLE_ALL && AutoSampleSize < (DWORD)cbInBuffer)
+        cbSample = (int)AutoSampleSize;
+
+    pbTrialBuffer = (char *)AllocateScratchBuffer(*pcbOutBuffer);
+    if(pbTrialBuffer == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return 0;
+    }
+
+    // Storing the data uncompressed is the size to beat
+    cbBestOutput = cbSample;
+    for(DWORD i = 0; i < AutoCandidateCount; i++)
+    {
+        cbTrialOutput = *pcbOutBuffer;
+        if(!SCompCompress(pbTrialBuffer, &cbTrialOutput, pbInBuffer, cbSample, AutoCandidates[i], 0, 0))
+            continue;
+
+        if(cbTrialOutput < cbBestOutput)
+        {
+            // If the whole data have been compressed, keep the output
+            if(cbSample == cbInBuffer)
+                memcpy(pbOutBuffer, pbTrialBuffer, cbTrialOutput);
+            dwBestCompression = AutoCandidates[i];
+            cbBestOutput = cbTrialOutput;
+        }
+    }
+
+    FreeScratchBuffer(pbTrialBuffer);
+
+    // Nothing compressed the data, so they are stored
+    if(dwBestCompression == 0)
+    {
+        memcpy(pbOutBuffer, pbInBuffer, cbInBuffer);
+        *pcbOutBuffer = cbInBuffer;
+        return 1;
+    }
+
+    // Only a sample was compared, compress the whole data by the winner
+    if(cbSample < cbInBuffer)
+        return SCompCompress(pbOutBuffer, pcbOutBuffer, pbInBuffer, cbInBuffer, dwBestCompression, 0, 0);
+
+    *pcbOutBuffer = cbBestOutput;
+    return 1;
+}
+
 int WINAPI SCompCompress(
     char * pbOutBuffer,
     int * pcbOutBuffer,
@@ -797,6 +1269,10 @@ int WINAPI SCompCompress(
         return true;
     }
 
+    // Let the candidates compete for the data
+    if(uCompressionMask == MPQ_COMPRESSION_AUTO)
+        return CompressAuto(pbOutBuffer, pcbOutBuffer, pbInBuffer, cbInBuffer);
+
     // Setup the compression function array
     if(uCompressionMask == MPQ_COMPRESSION_LZMA)
     {
@@ -833,7 +1309,7 @@ int WINAPI SCompCompress(
         // If we need to do more than 1 compression, allocate intermediate buffer
         if(nCompressCount > 1)
         {
-            pbWorkBuffer = ALLOCMEM(char, *pcbOutBuffer);
+            pbWorkBuffer = (char *)AllocateScratchBuffer(*pcbOutBuffer);
             if(pbWorkBuffer == NULL)
             {
                 SetLastError(ERROR_NOT_ENOUGH_MEMORY);
@@ -890,7 +1366,7 @@ int WINAPI SCompCompress(
 
     // Cleanup and return
     if(pbWorkBuffer != NULL)
-        FREEMEM(pbWorkBuffer);
+        FreeScratchBuffer(pbWorkBuffer);
     return nResult;
 }
 
@@ -1002,7 +1478,7 @@ int WINAPI SCompDecompress(
         // If there is more than one compression, we have to allocate extra buffer
         if(nCompressCount > 1)
         {
-            pbWorkBuffer = ALLOCMEM(char, *pcbOutBuffer);
+            pbWorkBuffer = (char *)AllocateScratchBuffer(*pcbOutBuffer);
             if(pbWorkBuffer == NULL)
             {
                 SetLastError(ERROR_NOT_ENOUGH_MEMORY);
@@ -1046,6 +1522,6 @@ int WINAPI SCompDecompress(
 
     // Cleanup and return
     if(pbWorkBuffer != NULL)
-        FREEMEM(pbWorkBuffer);
+        FreeScratchBuffer(pbWorkBuffer);
     return nResult;
 }
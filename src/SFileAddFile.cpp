@@ -29,6 +29,199 @@ static void * pvUserData = NULL;
 
 #define LOSSY_COMPRESSION_MASK (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO | MPQ_COMPRESSION_HUFFMANN)
 
+#define ADD_FILE_FIRST_READ_SIZE  0x1000    // SFileAddFileEx: Size of the first piece, which gets the first sector compression
+#define ADD_FILE_READ_SIZE      0x100000    // SFileAddFileEx: Size of the next pieces read from the local file
+
+#define PARALLEL_ENCODE_MIN_SECTORS       8   // Minimum number of sectors that are encoded by more threads
+#define PARALLEL_ENCODE_MIN_BYTES   0x40000   // Minimum number of bytes that are encoded by more threads
+#define PARALLEL_ENCODE_MAX_BYTES 0x1000000   // Maximum number of bytes that are encoded by more threads at once
+#define SECTOR_OVERRUN_SIZE           0x100   // Extra space for compressions that overrun the output buffer
+
+// Compresses, checksums and encrypts one file sector.
+// pbOutSector may be the same as pbInSector if the file is not compressed.
+// The sector is independent on the other sectors, so more sectors
+// can be processed at once by different threads
+// Returns the number of bytes to be written
+static DWORD EncodeMpqSector(
+    TMPQFile * hf,
+    DWORD dwIndex,
+    LPBYTE pbInSector,
+    DWORD dwBytesInThisSector,
+    LPBYTE pbOutSector,
+    DWORD dwCompression,
+    int nCompressionLevel)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+
+    // Compress the file sector, if needed
+    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESSED)
+    {
+        int nOutBuffer = (int)dwBytesInThisSector;
+        int nInBuffer = (int)dwBytesInThisSector;
+
+        //
+        // Note that both SCompImplode and SCompCompress give original buffer,
+        // if they are unable to comperss the data.
+        //
+
+        if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
+        {
+            SCompImplode((char *)pbOutSector,
+                                &nOutBuffer,
+                         (char *)pbInSector,
+                                 nInBuffer);
+        }
+
+        if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
+        {
+            SCompCompress((char *)pbOutSector,
+                                 &nOutBuffer,
+                          (char *)pbInSector,
+                                  nInBuffer,
+                        (unsigned)dwCompression,
+                                  0,
+                                  nCompressionLevel);
+        }
+
+        // We have to calculate sector CRC, if enabled
+        dwBytesInThisSector = nOutBuffer;
+        if(hf->SectorChksums != NULL)
+            hf->SectorChksums[dwIndex] = adler32(0, pbOutSector, nOutBuffer);
+    }
+    else
+    {
+        if(pbOutSector != pbInSector)
+            memcpy(pbOutSector, pbInSector, dwBytesInThisSector);
+    }
+
+    // Encrypt the sector, if necessary
+    if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+    {
+        BSWAP_ARRAY32_UNSIGNED(pbOutSector, dwBytesInThisSector);
+        EncryptMpqBlock(pbOutSector, dwBytesInThisSector, hf->dwFileKey + dwIndex);
+        BSWAP_ARRAY32_UNSIGNED(pbOutSector, dwBytesInThisSector);
+    }
+
+    return dwBytesInThisSector;
+}
+
+// Sectors given to WriteDataToMpqFile, to be encoded by more threads
+struct TSectorWriteBatch
+{
+    TMPQFile * hf;                          // The file the sectors belong to
+    LPBYTE pbInBuffer;                      // Plain data of the sectors
+    LPBYTE pbOutBuffer;                     // Encoded sectors, one per each dwOutSectorSize bytes
+    LPDWORD OutSectorSizes;                 // Sizes of the encoded sectors
+    DWORD dwOutSectorSize;                  // Space for one encoded sector in pbOutBuffer
+    DWORD dwSectorIndex;                    // Index of the first sector in the file
+    DWORD dwDataSize;                       // Number of plain bytes of all sectors
+    DWORD dwCompression;                    // Compression of the sectors
+    int nCompressionLevel;                  // ADPCM compression level
+};
+
+static int EncodeMpqSectorInBatch(void * pvParam, DWORD dwItemIndex)
+{
+    TSectorWriteBatch * pBatch = (TSectorWriteBatch *)pvParam;
+    TMPQFile * hf = pBatch->hf;
+    DWORD dwInOffset = dwItemIndex * hf->dwSectorSize;
+
+    // The last sector may be incomplete
+    pBatch->OutSectorSizes[dwItemIndex] = EncodeMpqSector(hf,
+                                                          pBatch->dwSectorIndex + dwItemIndex,
+                                                          pBatch->pbInBuffer + dwInOffset,
+                                                          STORMLIB_MIN(pBatch->dwDataSize - dwInOffset, hf->dwSectorSize),
+                                                          pBatch->pbOutBuffer + dwItemIndex * pBatch->dwOutSectorSize,
+                                                          pBatch->dwCompression,
+                                                          pBatch->nCompressionLevel);
+    return ERROR_SUCCESS;
+}
+
+// Writes whole sectors directly from the caller's data. The sectors are encoded
+// by more threads, then their offsets, the MD5 and CRC32 are updated in order
+// and all the sectors are written at once. The result is the same as if they
+// were written one by one
+static int WriteSectorsParallel(
+    TMPQArchive * ha,
+    TMPQFile * hf,
+    LPBYTE pbFileData,
+    DWORD dwDataSize,
+    DWORD dwCompression,
+    int nCompressionLevel)
+{
+    TSectorWriteBatch Batch;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    ULONGLONG ByteOffset;
+    LPBYTE pbWorkBuffer;
+    LPBYTE pbOutSector;
+    DWORD dwSectorCount = (dwDataSize + hf->dwSectorSize - 1) / hf->dwSectorSize;
+    DWORD dwBytesToWrite = 0;
+    DWORD dwFilePos = hf->dwFilePos;
+    int nError;
+
+    // Allocate space for the encoded sectors and their sizes
+    Batch.dwOutSectorSize = hf->dwSectorSize + SECTOR_OVERRUN_SIZE;
+    pbWorkBuffer = ALLOCMEM(BYTE, dwSectorCount * (Batch.dwOutSectorSize + sizeof(DWORD)));
+    if(pbWorkBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    Batch.hf = hf;
+    Batch.pbInBuffer = pbFileData;
+    Batch.pbOutBuffer = pbWorkBuffer;
+    Batch.OutSectorSizes = (LPDWORD)(pbWorkBuffer + dwSectorCount * Batch.dwOutSectorSize);
+    Batch.dwSectorIndex = hf->dwFilePos / hf->dwSectorSize;
+    Batch.dwDataSize = dwDataSize;
+    Batch.dwCompression = dwCompression;
+    Batch.nCompressionLevel = nCompressionLevel;
+
+    // Encode all sectors
+    nError = RunParallel(EncodeMpqSectorInBatch, &Batch, dwSectorCount);
+    if(nError == ERROR_SUCCESS)
+    {
+        // Update CRC32 and MD5 of the file
+        md5_process((hash_state *)hf->pWriteState->hctx, pbFileData, dwDataSize);
+        hf->pWriteState->dwCrc32 = crc32(hf->pWriteState->dwCrc32, pbFileData, dwDataSize);
+
+        // Update sector positions and move the encoded sectors together
+        for(DWORD i = 0; i < dwSectorCount; i++)
+        {
+            DWORD dwIndex = Batch.dwSectorIndex + i;
+
+            pbOutSector = pbWorkBuffer + i * Batch.dwOutSectorSize;
+            if(pbOutSector != pbWorkBuffer + dwBytesToWrite)
+                memmove(pbWorkBuffer + dwBytesToWrite, pbOutSector, Batch.OutSectorSizes[i]);
+
+            if((pFileEntry->dwFlags & MPQ_FILE_COMPRESSED) && hf->SectorOffsets != NULL)
+                hf->SectorOffsets[dwIndex+1] = hf->SectorOffsets[dwIndex] + Batch.OutSectorSizes[i];
+            dwBytesToWrite += Batch.OutSectorSizes[i];
+        }
+
+        // Write all file sectors
+        ByteOffset = hf->RawFilePos + pFileEntry->dwCmpSize;
+        if(!FileStream_Write(ha->pStream, &ByteOffset, pbWorkBuffer, dwBytesToWrite))
+            nError = GetLastError();
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        // Update the file position and the compressed file size
+        hf->dwFilePos += dwDataSize;
+        pFileEntry->dwCmpSize += dwBytesToWrite;
+
+        // Call the compact callback, if any
+        if(AddFileCB != NULL)
+        {
+            for(DWORD i = 0; i < dwSectorCount; i++)
+            {
+                dwFilePos = STORMLIB_MIN(dwFilePos + hf->dwSectorSize, hf->dwFilePos);
+                AddFileCB(pvUserData, dwFilePos, hf->dwDataSize, false);
+            }
+        }
+    }
+
+    FREEMEM(pbWorkBuffer);
+    return nError;
+}
+
 static int WriteDataToMpqFile(
     TMPQArchive * ha,
     TMPQFile * hf,
@@ -40,6 +233,7 @@ static int WriteDataToMpqFile(
     ULONGLONG ByteOffset;
     LPBYTE pbCompressed = NULL;         // Compressed (target) data
     LPBYTE pbToWrite = NULL;            // Data to write to the file
+    DWORD dwParallelSize;
     int nCompressionLevel = -1;         // ADPCM compression level (only used for wave files)
     int nError = ERROR_SUCCESS;
 
@@ -56,6 +250,40 @@ static int WriteDataToMpqFile(
         return ERROR_DISK_FULL;
     pbToWrite = hf->pbFileSector;
 
+    // Large writes of sectors that need some work are encoded by more threads.
+    // This is only possible if the sector buffer is empty, so the sector
+    // started by the previous write is completed first
+    dwParallelSize = hf->dwSectorSize - (hf->dwFilePos % hf->dwSectorSize);
+    if((pFileEntry->dwFlags & (MPQ_FILE_COMPRESSED | MPQ_FILE_ENCRYPTED)) && dwParallelSize < hf->dwSectorSize && dwDataSize >= dwParallelSize + PARALLEL_ENCODE_MIN_BYTES)
+    {
+        nError = WriteDataToMpqFile(ha, hf, pbFileData, dwParallelSize, dwCompression);
+        if(nError != ERROR_SUCCESS)
+            return nError;
+
+        pbFileData += dwParallelSize;
+        dwDataSize -= dwParallelSize;
+    }
+
+    // Only whole sectors are taken, unless the data ends the file
+    while((pFileEntry->dwFlags & (MPQ_FILE_COMPRESSED | MPQ_FILE_ENCRYPTED)) && (hf->dwFilePos % hf->dwSectorSize) == 0)
+    {
+        dwParallelSize = dwDataSize;
+        if((hf->dwFilePos + dwDataSize) < pFileEntry->dwFileSize)
+            dwParallelSize -= (dwDataSize % hf->dwSectorSize);
+        if(dwParallelSize > PARALLEL_ENCODE_MAX_BYTES)
+            dwParallelSize = PARALLEL_ENCODE_MAX_BYTES - (PARALLEL_ENCODE_MAX_BYTES % hf->dwSectorSize);
+
+        if((dwParallelSize / hf->dwSectorSize) < PARALLEL_ENCODE_MIN_SECTORS || dwParallelSize < PARALLEL_ENCODE_MIN_BYTES)
+            break;
+
+        nError = WriteSectorsParallel(ha, hf, pbFileData, dwParallelSize, dwCompression, nCompressionLevel);
+        if(nError != ERROR_SUCCESS)
+            return nError;
+
+        pbFileData += dwParallelSize;
+        dwDataSize -= dwParallelSize;
+    }
+
     // Now write all data to the file sector buffer
     if(nError == ERROR_SUCCESS)
     {
@@ -93,64 +321,24 @@ static int WriteDataToMpqFile(
                 // for case if the compression method performs a buffer overrun
                 if((pFileEntry->dwFlags & MPQ_FILE_COMPRESSED) && pbCompressed == NULL)
                 {
-                    pbToWrite = pbCompressed = ALLOCMEM(BYTE, hf->dwSectorSize + 0x100);
+                    pbToWrite = pbCompressed = (LPBYTE)AllocateScratchBuffer(hf->dwSectorSize + SECTOR_OVERRUN_SIZE);
                     if(pbCompressed == NULL)
+                    {
                         nError = ERROR_NOT_ENOUGH_MEMORY;
+                        break;
+                    }
                 }
 
                 // Update CRC32 and MD5 of the file
-                md5_process((hash_state *)hf->hctx, hf->pbFileSector, dwBytesInSector);
-                hf->dwCrc32 = crc32(hf->dwCrc32, hf->pbFileSector, dwBytesInSector);
-
-                // Compress the file sector, if needed
-                if(pFileEntry->dwFlags & MPQ_FILE_COMPRESSED)
-                {
-                    int nOutBuffer = (int)dwBytesInSector;
-                    int nInBuffer = (int)dwBytesInSector;
-
-                    assert(pbCompressed != NULL);
-
-                    //
-                    // Note that both SCompImplode and SCompCompress give original buffer,
-                    // if they are unable to comperss the data.
-                    //
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                    {
-                        SCompImplode((char *)pbCompressed,
-                                            &nOutBuffer,
-                                     (char *)hf->pbFileSector,
-                                             nInBuffer);
-                    }
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                    {
-                        SCompCompress((char *)pbCompressed,
-                                             &nOutBuffer,
-                                      (char *)hf->pbFileSector,
-                                              nInBuffer,
-                                    (unsigned)dwCompression,
-                                              0,
-                                              nCompressionLevel);
-                    }
-
-                    // Update sector positions
-                    dwBytesInSector = nOutBuffer;
-                    if(hf->SectorOffsets != NULL)
-                        hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + dwBytesInSector;
+                md5_process((hash_state *)hf->pWriteState->hctx, hf->pbFileSector, dwBytesInSector);
+                hf->pWriteState->dwCrc32 = crc32(hf->pWriteState->dwCrc32, hf->pbFileSector, dwBytesInSector);
 
-                    // We have to calculate sector CRC, if enabled
-                    if(hf->SectorChksums != NULL)
-                        hf->SectorChksums[dwSectorIndex] = adler32(0, pbCompressed, nOutBuffer);
-                }
+                // Compress, checksum and encrypt the file sector
+                dwBytesInSector = EncodeMpqSector(hf, dwSectorIndex, hf->pbFileSector, dwBytesInSector, pbToWrite, dwCompression, nCompressionLevel);
 
-                // Encrypt the sector, if necessary
-                if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-                {
-                    BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
-                    EncryptMpqBlock(pbToWrite, dwBytesInSector, hf->dwFileKey + dwSectorIndex);
-                    BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
-                }
+                // Update sector positions
+                if((pFileEntry->dwFlags & MPQ_FILE_COMPRESSED) && hf->SectorOffsets != NULL)
+                    hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + dwBytesInSector;
 
                 // Write the file sector
                 if(!FileStream_Write(ha->pStream, &ByteOffset, pbToWrite, dwBytesInSector))
@@ -173,7 +361,7 @@ static int WriteDataToMpqFile(
 
     // Cleanup
     if(pbCompressed != NULL)
-        FREEMEM(pbCompressed);
+        FreeScratchBuffer(pbCompressed);
     return nError;
 }
 
@@ -220,7 +408,7 @@ static int RecryptFileData(
 
     // Also allocate buffer for sector offsets
     // Note: Don't load sector checksums, we don't need to recrypt them
-    nError = AllocateSectorOffsets(hf, true);
+    nError = AllocateSectorOffsets(hf, true, NULL);
     if(nError != ERROR_SUCCESS)
         return nError;
 
@@ -372,6 +560,10 @@ int SFileAddFile_Init(
         {
             if((dwFlags & MPQ_FILE_REPLACEEXISTING) == 0)
                 nError = ERROR_ALREADY_EXISTS;
+
+            // The cached sectors belong to the file being replaced
+            if(nError == ERROR_SUCCESS)
+                SectorCache_InvalidateFile(ha, pFileEntry);
         }
     }
 
@@ -379,6 +571,14 @@ int SFileAddFile_Init(
     // At this point, the file name in file entry must be non-NULL
     //
 
+    // Allocate the MD5 and CRC32 state. Read handles don't need it
+    if(nError == ERROR_SUCCESS)
+    {
+        hf->pWriteState = ALLOCMEM(TMPQWriteState, 1);
+        if(hf->pWriteState == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
     // Create key for file encryption
     if(nError == ERROR_SUCCESS && (dwFlags & MPQ_FILE_ENCRYPTED))
     {
@@ -399,9 +599,10 @@ int SFileAddFile_Init(
         pFileEntry->lcLocale = (USHORT)lcLocale;
 
         // Initialize the file time, CRC32 and MD5
-        assert(sizeof(hf->hctx) >= sizeof(hash_state));
+        assert(sizeof(hf->pWriteState->hctx) >= sizeof(hash_state));
         memset(pFileEntry->md5, 0, MD5_DIGEST_SIZE);
-        md5_init((hash_state *)hf->hctx);
+        md5_init((hash_state *)hf->pWriteState->hctx);
+        hf->pWriteState->dwCrc32 = crc32(0, Z_NULL, 0);
         pFileEntry->dwCrc32 = crc32(0, Z_NULL, 0);
 
         // If the caller gave us a file time, use it.
@@ -467,7 +668,7 @@ int SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD d
         // Allocate sector offsets
         if(hf->SectorOffsets == NULL)
         {
-            nError = AllocateSectorOffsets(hf, false);
+            nError = AllocateSectorOffsets(hf, false, NULL);
             if(nError != ERROR_SUCCESS)
             {
                 hf->bErrorOccured = true;
@@ -520,10 +721,10 @@ int SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD d
         if(hf->dwFilePos >= pFileEntry->dwFileSize)
         {
             // Finish calculating CRC32
-            hf->pFileEntry->dwCrc32 = hf->dwCrc32;
+            hf->pFileEntry->dwCrc32 = hf->pWriteState->dwCrc32;
 
             // Finish calculating MD5
-            md5_done((hash_state *)hf->hctx, hf->pFileEntry->md5);
+            md5_done((hash_state *)hf->pWriteState->hctx, hf->pFileEntry->md5);
 
             // If we also have sector checksums, write them to the file
             if(hf->SectorChksums != NULL)
@@ -764,7 +965,8 @@ bool WINAPI SFileAddFileEx(
     LPBYTE pbFileData = NULL;
     DWORD dwBytesRemaining = 0;
     DWORD dwBytesToRead;
-    DWORD dwSectorSize = 0x1000;
+    DWORD dwBufferSize;
+    DWORD dwReadSize = ADD_FILE_FIRST_READ_SIZE;
     int nError = ERROR_SUCCESS;
 
     // Check parameters
@@ -793,8 +995,10 @@ bool WINAPI SFileAddFileEx(
     // Allocate data buffer for reading from the source file
     if(nError == ERROR_SUCCESS)
     {
+        // Small files don't need the whole read buffer
         dwBytesRemaining = (DWORD)FileSize;
-        pbFileData = ALLOCMEM(BYTE, dwSectorSize);
+        dwBufferSize = STORMLIB_MIN(dwBytesRemaining, ADD_FILE_READ_SIZE);
+        pbFileData = ALLOCMEM(BYTE, STORMLIB_MAX(dwBufferSize, ADD_FILE_FIRST_READ_SIZE));
         if(pbFileData == NULL)
             nError = ERROR_NOT_ENOUGH_MEMORY;
     }
@@ -826,8 +1030,8 @@ bool WINAPI SFileAddFileEx(
     {
         // Get the number of bytes remaining in the source file
         dwBytesToRead = dwBytesRemaining;
-        if(dwBytesToRead > dwSectorSize)
-            dwBytesToRead = dwSectorSize;
+        if(dwBytesToRead > dwReadSize)
+            dwBytesToRead = dwReadSize;
 
         // Read data from the local file
         if(!FileStream_Read(pStream, NULL, pbFileData, dwBytesToRead))
@@ -843,9 +1047,11 @@ bool WINAPI SFileAddFileEx(
             break;
         }
 
-        // Set the next data compression
+        // Set the next data compression. The rest of the file
+        // is read in larger pieces, as the compression doesn't change
         dwBytesRemaining -= dwBytesToRead;
         dwCompression = dwCompressionNext;
+        dwReadSize = ADD_FILE_READ_SIZE;
     }
 
     // Finish the file writing
@@ -1085,6 +1291,9 @@ bool WINAPI SFileRenameFile(HANDLE hMpq, const char * szFileName, const char * s
                 hf->dwDataSize = pNewFileEntry->dwFileSize;
                 nError = RecryptFileData(ha, hf, szFileName, szNewFileName);
 
+                // The sector offsets have been encrypted with the new key
+                SectorCache_InvalidateFile(ha, pNewFileEntry);
+
                 // Update the MD5
                 if(ha->pHeader->dwRawChunkSize != 0)
                 {
@@ -1121,7 +1330,7 @@ bool WINAPI SFileSetDataCompression(DWORD DataCompression)
 {
     unsigned int uValidMask = (MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_PKWARE | MPQ_COMPRESSION_BZIP2 | MPQ_COMPRESSION_SPARSE);
 
-    if((DataCompression & uValidMask) != DataCompression)
+    if(DataCompression != MPQ_COMPRESSION_AUTO && (DataCompression & uValidMask) != DataCompression)
     {
         SetLastError(ERROR_INVALID_PARAMETER);
         return false;
@@ -381,7 +381,7 @@ static int CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewS
                 break;
 
             // Also allocate sector offset table and sector checksum table
-            nError = AllocateSectorOffsets(hf, true);
+            nError = AllocateSectorOffsets(hf, true, NULL);
             if (nError != ERROR_SUCCESS)
                 break;
 
@@ -442,6 +442,10 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const char * szListFile, bool /* bR
     if (ha->dwFlags & MPQ_FLAG_READ_ONLY)
         nError = ERROR_ACCESS_DENIED;
 
+    // The archive is rebuilt in a temporary file, so it must be a file too
+    if (nError == ERROR_SUCCESS && (ha->pStream->StreamFlags & STREAM_FLAG_USER_DATA))
+        nError = ERROR_NOT_SUPPORTED;
+
     // If the MPQ is changed at this moment, we have to flush the archive
     if (nError == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_CHANGED))
     {
@@ -536,6 +540,9 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const char * szListFile, bool /* bR
             pTempStream = NULL;
         else
             nError = ERROR_CAN_NOT_COMPLETE;
+
+        // The files have moved, so the cached sectors would not be used anymore
+        SectorCache_InvalidateFile(ha, NULL);
     }
 
     // If all succeeded, save the MPQ tables
@@ -83,82 +83,16 @@ static int VerifyMpqTablePositions(TMPQArchive * ha, ULONGLONG FileSize)
     return ERROR_SUCCESS;
 }
 
-
-/*****************************************************************************/
-/* Public functions                                                          */
-/*****************************************************************************/
-
-//-----------------------------------------------------------------------------
-// SFileGetLocale and SFileSetLocale
-// Set the locale for all newly opened files
-
-DWORD WINAPI SFileGetGlobalFlags()
-{
-    return dwGlobalFlags;
-}
-
-DWORD WINAPI SFileSetGlobalFlags(DWORD dwNewFlags)
-{
-    DWORD dwOldFlags = dwGlobalFlags;
-
-    dwGlobalFlags = dwNewFlags;
-    return dwOldFlags;
-}
-
-LCID WINAPI SFileGetLocale()
-{
-    return lcFileLocale;
-}
-
-LCID WINAPI SFileSetLocale(LCID lcNewLocale)
+// Opens the archive on an already open stream. The stream is
+// always consumed; it is closed if the archive cannot be open.
+static bool OpenArchiveStream(TFileStream * pStream, DWORD dwFlags, HANDLE * phMpq)
 {
-    lcFileLocale = lcNewLocale;
-    return lcFileLocale;
-}
-
-//-----------------------------------------------------------------------------
-// SFileOpenArchive
-//
-//   szFileName - MPQ archive file name to open
-//   dwPriority - When SFileOpenFileEx called, this contains the search priority for searched archives
-//   dwFlags    - See MPQ_OPEN_XXX in StormLib.h
-//   phMpq      - Pointer to store open archive handle
-
-bool WINAPI SFileOpenArchive(
-    const char * szMpqName,
-    DWORD dwPriority,
-    DWORD dwFlags,
-    HANDLE * phMpq)
-{
-    TFileStream * pStream = NULL;       // Open file stream
     TMPQArchive * ha = NULL;            // Archive handle
     ULONGLONG FileSize = 0;             // Size of the file
     int nError = ERROR_SUCCESS;
 
-    // Verify the parameters
-    if(szMpqName == NULL || *szMpqName == 0 || phMpq == NULL)
-        nError = ERROR_INVALID_PARAMETER;
-
     // One time initialization of MPQ cryptography
     InitializeMpqCryptography();
-    dwPriority = dwPriority;
-
-    // Open the MPQ archive file
-    if(nError == ERROR_SUCCESS)
-    {
-        if(!(dwFlags & MPQ_OPEN_ENCRYPTED))
-        {
-            pStream = FileStream_OpenFile(szMpqName, (dwFlags & MPQ_OPEN_READ_ONLY) ? false : true);
-            if(pStream == NULL)
-                nError = GetLastError();
-        }
-        else
-        {
-            pStream = FileStream_OpenEncrypted(szMpqName);
-            if(pStream == NULL)
-                nError = GetLastError();
-        }
-    }
 
     // Allocate the MPQhandle
     if(nError == ERROR_SUCCESS)
@@ -175,6 +109,10 @@ bool WINAPI SFileOpenArchive(
         ha->pStream = pStream;
         pStream = NULL;
 
+        // Keep the sector offset tables of recently opened files.
+        // If the cache can't be created, the tables are always loaded
+        ha->pTableCache = SectorCache_Create(SECTOR_TABLE_CACHE_SIZE, 0x100);
+
         // Remember if the archive is open for write
         if(ha->pStream->StreamFlags & (STREAM_FLAG_READ_ONLY | STREAM_FLAG_ENCRYPTED_FILE))
             ha->dwFlags |= MPQ_FLAG_READ_ONLY;
@@ -284,6 +222,9 @@ bool WINAPI SFileOpenArchive(
         // Set the size of file sector
         ha->dwSectorSize = (0x200 << ha->pHeader->wSectorSize);
 
+        // Keep closed file handles, so that opening files doesn't allocate
+        ha->pFilePool = FilePool_Create(ha->dwSectorSize);
+
         // Verify if any of the tables doesn't start beyond the end of the file
         nError = VerifyMpqTablePositions(ha, FileSize);
     }
@@ -356,6 +297,15 @@ bool WINAPI SFileOpenArchive(
         SAttrLoadAttributes(ha);
     }
 
+    // From now on, the archive tables are not modified by reading.
+    // Tell the stream not to update the shared file position
+    // when reading from explicit offset
+    if(nError == ERROR_SUCCESS && (dwFlags & MPQ_OPEN_THREAD_SAFE))
+    {
+        ha->pStream->StreamFlags |= STREAM_FLAG_THREAD_SAFE;
+        ha->dwFlags |= MPQ_FLAG_THREAD_SAFE;
+    }
+
     // Cleanup and exit
     if(nError != ERROR_SUCCESS)
     {
@@ -369,10 +319,263 @@ bool WINAPI SFileOpenArchive(
     return (nError == ERROR_SUCCESS);
 }
 
+
+/*****************************************************************************/
+/* Public functions                                                          */
+/*****************************************************************************/
+
+//-----------------------------------------------------------------------------
+// SFileGetLocale and SFileSetLocale
+// Set the locale for all newly opened files
+
+DWORD WINAPI SFileGetGlobalFlags()
+{
+    return dwGlobalFlags;
+}
+
+DWORD WINAPI SFileSetGlobalFlags(DWORD dwNewFlags)
+{
+    DWORD dwOldFlags = dwGlobalFlags;
+
+    dwGlobalFlags = dwNewFlags;
+    return dwOldFlags;
+}
+
+DWORD WINAPI SFileGetReadAheadSize()
+{
+    return dwMaxReadAhead;
+}
+
+// Note that the new size applies to the streams
+// when they grow their read-ahead window next time
+DWORD WINAPI SFileSetReadAheadSize(DWORD dwNewReadAhead)
+{
+    DWORD dwOldReadAhead = dwMaxReadAhead;
+
+    dwMaxReadAhead = dwNewReadAhead;
+    return dwOldReadAhead;
+}
+
+LCID WINAPI SFileGetLocale()
+{
+    return lcFileLocale;
+}
+
+LCID WINAPI SFileSetLocale(LCID lcNewLocale)
+{
+    lcFileLocale = lcNewLocale;
+    return lcFileLocale;
+}
+
+//-----------------------------------------------------------------------------
+// SFileOpenArchive
+//
+//   szFileName - MPQ archive file name to open
+//   dwPriority - When SFileOpenFileEx called, this contains the search priority for searched archives
+//   dwFlags    - See MPQ_OPEN_XXX in StormLib.h
+//   phMpq      - Pointer to store open archive handle
+//
+// If MPQ_OPEN_THREAD_SAFE is given, the archive is open for read-only access
+// and the returned handle can be used by multiple threads at once for
+// SFileHasFile, SFileOpenFileEx, SFileReadFile and SFileCloseFile.
+// The file handles themselves must not be shared between threads.
+// SFileAddListFile, SFileCloseArchive and all write operations
+// must not run concurrently with anything else on the same archive.
+
+bool WINAPI SFileOpenArchive(
+    const char * szMpqName,
+    DWORD dwPriority,
+    DWORD dwFlags,
+    HANDLE * phMpq)
+{
+    SFILE_ARCHIVE_SOURCE Source;
+
+    memset(&Source, 0, sizeof(SFILE_ARCHIVE_SOURCE));
+    Source.dwSourceType = SFILE_SOURCE_FILE;
+    Source.szFileName = szMpqName;
+    return SFileOpenArchiveEx(&Source, dwPriority, dwFlags, phMpq);
+}
+
+//-----------------------------------------------------------------------------
+// SFileOpenArchiveEx
+//
+//   pSource    - Describes where the archive data come from
+//   dwPriority - When SFileOpenFileEx called, this contains the search priority for searched archives
+//   dwFlags    - See MPQ_OPEN_XXX in StormLib.h
+//   phMpq      - Pointer to store open archive handle
+//
+// Besides files, the archive can be open from a memory buffer
+// (SFILE_SOURCE_MEMORY) or from the caller's stream callbacks
+// (SFILE_SOURCE_CALLBACKS). Memory archives are read only and the buffer
+// must stay valid until the archive is closed. Archives from callbacks
+// are read only unless the write callback is given. Neither of them
+// can be encrypted (MPQ_OPEN_ENCRYPTED) or compacted.
+
+bool WINAPI SFileOpenArchiveEx(
+    const SFILE_ARCHIVE_SOURCE * pSource,
+    DWORD dwPriority,
+    DWORD dwFlags,
+    HANDLE * phMpq)
+{
+    TFileStream * pStream = NULL;       // Open file stream
+    int nError = ERROR_SUCCESS;
+
+    // Verify the parameters
+    if(pSource == NULL || phMpq == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+    dwPriority = dwPriority;
+
+    // Concurrent access is only supported for reading
+    if(dwFlags & MPQ_OPEN_THREAD_SAFE)
+        dwFlags |= MPQ_OPEN_READ_ONLY;
+
+    // Open the MPQ archive stream
+    if(nError == ERROR_SUCCESS)
+    {
+        switch(pSource->dwSourceType)
+        {
+            case SFILE_SOURCE_FILE:
+                if(pSource->szFileName == NULL || pSource->szFileName[0] == 0)
+                    nError = ERROR_INVALID_PARAMETER;
+                else if(!(dwFlags & MPQ_OPEN_ENCRYPTED))
+                    pStream = FileStream_OpenFile(pSource->szFileName, (dwFlags & MPQ_OPEN_READ_ONLY) ? false : true);
+                else
+                    pStream = FileStream_OpenEncrypted(pSource->szFileName);
+                break;
+
+            case SFILE_SOURCE_MEMORY:
+                if(dwFlags & MPQ_OPEN_ENCRYPTED)
+                    nError = ERROR_NOT_SUPPORTED;
+                else
+                    pStream = FileStream_OpenMemory(pSource->szFileName, pSource->pvData, pSource->cbData);
+                break;
+
+            case SFILE_SOURCE_CALLBACKS:
+                if(dwFlags & MPQ_OPEN_ENCRYPTED)
+                    nError = ERROR_NOT_SUPPORTED;
+                else
+                    pStream = FileStream_OpenCallbacks(pSource->szFileName, pSource->pCallbacks, pSource->pvUserData);
+                break;
+
+            default:
+                nError = ERROR_INVALID_PARAMETER;
+                break;
+        }
+
+        if(nError == ERROR_SUCCESS && pStream == NULL)
+            nError = GetLastError();
+    }
+
+    if(nError != ERROR_SUCCESS)
+    {
+        if(phMpq != NULL)
+            *phMpq = NULL;
+        SetLastError(nError);
+        return false;
+    }
+
+    return OpenArchiveStream(pStream, dwFlags, phMpq);
+}
+
+//-----------------------------------------------------------------------------
+// bool SFileSetPartFileCallback(HANDLE hMpq, SFILE_PART_CALLBACK PartFileCB, void * pvData)
+//
+// Sets the source of missing parts of a PART archive ("*.MPQ.part").
+// When a read needs a missing part, it's obtained from the callback,
+// stored to the PART file and marked as present, so the archive can be used
+// while it's still being downloaded. The archive must be open for write access
+// (it stays read-only for the MPQ functions). If hMpq is NULL, the callback
+// is used for the PART archives open later, which allows to fill the parts
+// with MPQ header and tables during SFileOpenArchive.
+//
+
+bool WINAPI SFileSetPartFileCallback(HANDLE hMpq, SFILE_PART_CALLBACK PartFileCB, void * pvData)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    if(ha == NULL)
+        return FileStream_SetPartFileCallback(NULL, PartFileCB, pvData);
+
+    if(!IsValidMpqHandle(ha))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    return FileStream_SetPartFileCallback(ha->pStream, PartFileCB, pvData);
+}
+
+//-----------------------------------------------------------------------------
+// bool SFileSetCacheSize(HANDLE hMpq, DWORD dwMaxSize)
+//
+// Changes the maximum size of the archive's block cache. The cache keeps
+// the raw data blocks that are read repeatedly, e.g. when more handles
+// read the same file. The cache is off until this function turns it on;
+// zero turns it off again. Memory-mapped archives have no cache. Cache statistics can be obtained by SFileGetFileInfo.
+// Must not be called while other threads read from the archive.
+//
+
+bool WINAPI SFileSetCacheSize(HANDLE hMpq, DWORD dwMaxSize)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    if(!IsValidMpqHandle(ha))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    return FileStream_SetCacheSize(ha->pStream, dwMaxSize);
+}
+
+//-----------------------------------------------------------------------------
+// bool SFileSetSectorCacheSize(HANDLE hMpq, DWORD dwMaxSize)
+//
+// Changes the maximum size of the cache of decompressed file sectors.
+// Unlike the data held by the file handles, the cached sectors stay
+// in memory after the files are closed, so files that are opened and read
+// repeatedly are decompressed only once. Also applies to the patch archives
+// that have already been added to the MPQ. Zero turns the cache off,
+// which is the default.
+// Cache statistics can be obtained by SFileGetFileInfo.
+// Must not be called while other threads read from the archive.
+//
+
+bool WINAPI SFileSetSectorCacheSize(HANDLE hMpq, DWORD dwMaxSize)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    if(!IsValidMpqHandle(ha))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Replace the caches of the archive and all its patches
+    for(; ha != NULL; ha = ha->haPatch)
+    {
+        SectorCache_Free(ha->pSectorCache);
+        ha->pSectorCache = NULL;
+
+        if(dwMaxSize != 0)
+        {
+            ha->pSectorCache = SectorCache_Create(dwMaxSize, 0x1000);
+            if(ha->pSectorCache == NULL)
+            {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 // bool SFileFlushArchive(HANDLE hMpq)
 //
-// Saves all dirty data into MPQ archive.
+// Saves all dirty data into MPQ archive, including the data that wait
+// in the stream's write buffer.
 // Has similar effect like SFileCloseArchive, but the archive is not closed.
 // Use on clients who keep MPQ archive open even for write operations,
 // and terminating without calling SFileCloseArchive might corrupt the archive.
@@ -411,6 +614,10 @@ bool WINAPI SFileFlushArchive(HANDLE hMpq)
             nResultError = nError;
     }
 
+    // Write the data that are still in the stream's write buffer
+    if(!FileStream_Flush(ha->pStream))
+        nResultError = GetLastError();
+
     // Return the error
     if(nResultError != ERROR_SUCCESS)
         SetLastError(nResultError);
@@ -426,6 +633,10 @@ bool WINAPI SFileCloseArchive(HANDLE hMpq)
     TMPQArchive * ha = (TMPQArchive *)hMpq;
     bool bResult;
 
+    // Wait for the asynchronous reads of the files from the archive
+    if(IsValidMpqHandle(ha))
+        WaitForWorkItemRefs(&ha->AsyncReads);
+
     // Flush all unsaved data to the storage
     bResult = SFileFlushArchive(hMpq);
 
@@ -372,21 +372,17 @@ bool WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, DWORD dwSearch
             nError = ERROR_NOT_SUPPORTED;
     }
 
-    // Allocate file handle
+    // Allocate file handle. Closed handles of the archive are reused
     if(nError == ERROR_SUCCESS)
     {
-        if((hf = ALLOCMEM(TMPQFile, 1)) == NULL)
+        if((hf = CreateMpqFile(ha)) == NULL)
             nError = ERROR_NOT_ENOUGH_MEMORY;
     }
 
     // Initialize file handle
     if(nError == ERROR_SUCCESS)
     {
-        memset(hf, 0, sizeof(TMPQFile));
         hf->pFileEntry = pFileEntry;
-        hf->dwMagic = ID_MPQ_FILE;
-        hf->ha = ha;
-
         hf->MpqFilePos   = pFileEntry->ByteOffset;
         hf->RawFilePos   = ha->MpqPos + hf->MpqFilePos;
         hf->dwDataSize   = pFileEntry->dwFileSize;
@@ -445,7 +441,8 @@ bool WINAPI SFileCloseFile(HANDLE hFile)
         return false;
     }
 
-    // Free the structure
+    // Wait for the asynchronous reads of the file, then free the structure
+    WaitForWorkItemRefs(&hf->AsyncReads);
     FreeMPQFile(hf);
     return true;
 }
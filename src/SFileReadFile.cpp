@@ -14,6 +14,12 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+//-----------------------------------------------------------------------------
+// Local defines
+
+#define PARALLEL_DECODE_MIN_SECTORS     8   // Minimum number of sectors that are decoded by more threads
+#define PARALLEL_DECODE_MIN_BYTES 0x40000   // Minimum number of bytes that are decoded by more threads
+
 //-----------------------------------------------------------------------------
 // Local structures
 
@@ -73,12 +79,119 @@ static DWORD GetMpqFileCount(TMPQArchive * ha)
 }
 
 
+// Decrypts, checks and decompresses one file sector.
+// The file key must be known already, if the file is encrypted.
+// The sector is independent on the other sectors, so more sectors
+// can be processed at once by different threads
+static int DecodeMpqSector(
+    TMPQFile * hf,
+    DWORD dwIndex,
+    LPBYTE pbInSector,
+    DWORD dwRawBytesInThisSector,
+    LPBYTE pbOutSector,
+    DWORD dwBytesInThisSector)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+
+    // If the file is encrypted, we have to decrypt the sector
+    if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+    {
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+        DecryptMpqBlock(pbInSector, dwRawBytesInThisSector, hf->dwFileKey + dwIndex);
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+    }
+
+    // If the file has sector CRC check turned on, perform it
+    if(hf->bCheckSectorCRCs && hf->SectorChksums != NULL)
+    {
+        DWORD dwAdlerExpected = hf->SectorChksums[dwIndex];
+        DWORD dwAdlerValue = 0;
+
+        // We can only check sector CRC when it's not zero
+        // Neither can we check it if it's 0xFFFFFFFF.
+        if(dwAdlerExpected != 0 && dwAdlerExpected != 0xFFFFFFFF)
+        {
+            dwAdlerValue = adler32(0, pbInSector, dwRawBytesInThisSector);
+            if(dwAdlerValue != dwAdlerExpected)
+                return ERROR_CHECKSUM_ERROR;
+        }
+    }
+
+    // If the sector is really compressed, decompress it.
+    // WARNING : Some sectors may not be compressed, it can be determined only
+    // by comparing uncompressed and compressed size !!!
+    if(dwRawBytesInThisSector < dwBytesInThisSector)
+    {
+        int cbOutSector = dwBytesInThisSector;
+        int cbInSector = dwRawBytesInThisSector;
+        int nResult = 0;
+
+        // Is the file compressed by PKWARE Data Compression Library ?
+        if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
+            nResult = SCompExplode((char *)pbOutSector, &cbOutSector, (char *)pbInSector, cbInSector);
+
+        // Is the file compressed by Blizzard's multiple compression ?
+        if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
+            nResult = SCompDecompress((char *)pbOutSector, &cbOutSector, (char *)pbInSector, cbInSector);
+
+        // Did the decompression fail ?
+        if(nResult == 0)
+            return ERROR_FILE_CORRUPT;
+    }
+    else
+    {
+        if(pbOutSector != pbInSector)
+            memcpy(pbOutSector, pbInSector, dwBytesInThisSector);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// Sectors loaded by LoadMpqSectors, to be decoded by more threads
+struct TSectorBatch
+{
+    TMPQFile * hf;                          // The file the sectors belong to
+    LPBYTE pbInBuffer;                      // Raw data of the sectors
+    LPBYTE pbOutBuffer;                     // Decoded data of the sectors
+    DWORD dwSectorIndex;                    // Index of the first sector in the file
+    DWORD dwBytesToRead;                    // Number of decoded bytes of all sectors
+};
+
+static int DecodeMpqSectorInBatch(void * pvParam, DWORD dwItemIndex)
+{
+    TSectorBatch * pBatch = (TSectorBatch *)pvParam;
+    TMPQFile * hf = pBatch->hf;
+    DWORD dwSectorSize = hf->ha->dwSectorSize;
+    DWORD dwIndex = pBatch->dwSectorIndex + dwItemIndex;
+    DWORD dwInOffset = dwItemIndex * dwSectorSize;
+    DWORD dwRawBytesInThisSector;
+    DWORD dwBytesInThisSector;
+
+    // The last sector may be incomplete
+    dwBytesInThisSector = STORMLIB_MIN(pBatch->dwBytesToRead - dwInOffset, dwSectorSize);
+    dwRawBytesInThisSector = dwBytesInThisSector;
+
+    // Compressed sectors are stored one after another, with variable size
+    if(hf->pFileEntry->dwFlags & MPQ_FILE_COMPRESSED)
+    {
+        dwInOffset = hf->SectorOffsets[dwIndex] - hf->SectorOffsets[pBatch->dwSectorIndex];
+        dwRawBytesInThisSector = hf->SectorOffsets[dwIndex + 1] - hf->SectorOffsets[dwIndex];
+    }
+
+    return DecodeMpqSector(hf,
+                           dwIndex,
+                           pBatch->pbInBuffer + dwInOffset,
+                           dwRawBytesInThisSector,
+                           pBatch->pbOutBuffer + dwItemIndex * dwSectorSize,
+                           dwBytesInThisSector);
+}
+
 //  hf            - MPQ File handle.
 //  pbBuffer      - Pointer to target buffer to store sectors.
 //  dwByteOffset  - Position of sector in the file (relative to file begin)
 //  dwBytesToRead - Number of bytes to read. Must be multiplier of sector size.
 //  pdwBytesRead  - Stored number of bytes loaded
-static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+static int LoadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead, const TPrefetchedData * pPrefetched)
 {
     ULONGLONG RawFilePos;
     TMPQArchive * ha = hf->ha;
@@ -110,7 +223,7 @@ static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DW
         // If the sector positions are not loaded yet, do it
         if(hf->SectorOffsets == NULL)
         {
-            nError = AllocateSectorOffsets(hf, true);
+            nError = AllocateSectorOffsets(hf, true, pPrefetched);
             if(nError != ERROR_SUCCESS)
                 return nError;
         }
@@ -131,7 +244,7 @@ static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DW
         }
 
         // If the file is compressed, also allocate secondary buffer
-        pbInSector = pbRawSector = ALLOCMEM(BYTE, dwBytesToRead);
+        pbInSector = pbRawSector = (LPBYTE)AllocateScratchBuffer(dwBytesToRead);
         if(pbRawSector == NULL)
             return ERROR_NOT_ENOUGH_MEMORY;
 
@@ -144,12 +257,51 @@ static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DW
     CalculateRawSectorOffset(RawFilePos, hf, dwRawSectorOffset);
 
     // Set file pointer and read all required sectors
-    if(!FileStream_Read(ha->pStream, &RawFilePos, pbInSector, dwRawBytesToRead))
+    if(!ReadMpqFileRaw(hf, RawFilePos, pbInSector, dwRawBytesToRead, pPrefetched))
+    {
+        if(pbRawSector != NULL)
+            FreeScratchBuffer(pbRawSector);
         return GetLastError();
+    }
     dwBytesRead = 0;
 
+    // If we don't know the key, try to detect it by content of the first sector
+    if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && hf->dwFileKey == 0 && dwSectorsToRead != 0)
+    {
+        DWORD dwRawBytesInThisSector = STORMLIB_MIN(dwBytesToRead, ha->dwSectorSize);
+        DWORD dwBytesInThisSector = dwRawBytesInThisSector;
+
+        if(pFileEntry->dwFlags & MPQ_FILE_COMPRESSED)
+            dwRawBytesInThisSector = hf->SectorOffsets[dwSectorIndex + 1] - hf->SectorOffsets[dwSectorIndex];
+
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+        hf->dwFileKey = DetectFileKeyByContent(pbInSector, dwBytesInThisSector);
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+        if(hf->dwFileKey == 0)
+            nError = ERROR_UNKNOWN_FILE_KEY;
+    }
+
+    // Large reads of sectors that need some work are decoded by more threads.
+    // The sectors don't depend on each other, except for the output buffer
+    if(nError == ERROR_SUCCESS && dwSectorsToRead >= PARALLEL_DECODE_MIN_SECTORS && dwBytesToRead >= PARALLEL_DECODE_MIN_BYTES &&
+       ((pFileEntry->dwFlags & (MPQ_FILE_COMPRESSED | MPQ_FILE_ENCRYPTED)) || (hf->bCheckSectorCRCs && hf->SectorChksums != NULL)))
+    {
+        TSectorBatch Batch;
+
+        Batch.hf = hf;
+        Batch.pbInBuffer = pbInSector;
+        Batch.pbOutBuffer = pbOutSector;
+        Batch.dwSectorIndex = dwSectorIndex;
+        Batch.dwBytesToRead = dwBytesToRead;
+
+        nError = RunParallel(DecodeMpqSectorInBatch, &Batch, dwSectorsToRead);
+        if(nError == ERROR_SUCCESS)
+            dwBytesRead = dwBytesToRead;
+        dwSectorsToRead = 0;
+    }
+
     // Now we have to decrypt and decompress all file sectors that have been loaded
-    for(DWORD i = 0; i < dwSectorsToRead; i++)
+    for(DWORD i = 0; nError == ERROR_SUCCESS && i < dwSectorsToRead; i++)
     {
         DWORD dwRawBytesInThisSector = ha->dwSectorSize;
         DWORD dwBytesInThisSector = ha->dwSectorSize;
@@ -166,100 +318,211 @@ static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DW
         if(pFileEntry->dwFlags & MPQ_FILE_COMPRESSED)
             dwRawBytesInThisSector = hf->SectorOffsets[dwIndex + 1] - hf->SectorOffsets[dwIndex];
 
-        // If the file is encrypted, we have to decrypt the sector
-        if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-        {
-            BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+        // Decrypt, check and decompress the sector
+        nError = DecodeMpqSector(hf, dwIndex, pbInSector, dwRawBytesInThisSector, pbOutSector, dwBytesInThisSector);
+        if(nError != ERROR_SUCCESS)
+            break;
+
+        // Move pointers
+        dwBytesToRead -= dwBytesInThisSector;
+        dwByteOffset += dwBytesInThisSector;
+        dwBytesRead += dwBytesInThisSector;
+        pbOutSector += dwBytesInThisSector;
+        pbInSector += dwRawBytesInThisSector;
+        dwSectorsDone++;
+    }
+
+    // Free all used buffers
+    if(pbRawSector != NULL)
+        FreeScratchBuffer(pbRawSector);
+
+    // Give the caller thenumber of bytes read
+    *pdwBytesRead = dwBytesRead;
+    return nError;
+}
+
+// Same as LoadMpqSectors, but uses the sector cache of the archive, if any.
+// The sectors found in the cache are copied, the runs of sectors
+// that are not there are loaded at once and stored to the cache.
+static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead, const TPrefetchedData * pPrefetched)
+{
+    TMPQArchive * ha = hf->ha;
+    DWORD dwSectorSize = ha->dwSectorSize;
+    DWORD dwSectorIndex = dwByteOffset / dwSectorSize;
+    DWORD dwSectorCount;
+    DWORD dwBytesInSector;
+    DWORD dwBytesRead;
+    DWORD dwRunStart = 0;
+    DWORD dwRunCount = 0;
+    int nError = ERROR_SUCCESS;
+
+    // Without the cache, or if the read would push everything else out of it, load the sectors directly
+    if(!SectorCache_CanHold(ha, dwBytesToRead))
+        return LoadMpqSectors(hf, pbBuffer, dwByteOffset, dwBytesToRead, pdwBytesRead, pPrefetched);
+
+    // If there is not enough bytes remaining, cut dwBytesToRead
+    if((dwByteOffset + dwBytesToRead) > hf->dwDataSize)
+        dwBytesToRead = hf->dwDataSize - dwByteOffset;
+    dwSectorCount = (dwBytesToRead + dwSectorSize - 1) / dwSectorSize;
 
-            // If we don't know the key, try to detect it by file content
-            if(hf->dwFileKey == 0)
+    // Go one sector past the end, so that the last run of missing sectors is loaded too
+    for(DWORD i = 0; i <= dwSectorCount; i++)
+    {
+        // Copy the sector from the cache, or add it to the run of sectors to load
+        if(i < dwSectorCount)
+        {
+            dwBytesInSector = STORMLIB_MIN(dwBytesToRead - i * dwSectorSize, dwSectorSize);
+            if(!SectorCache_Read(hf, dwSectorIndex + i, pbBuffer + i * dwSectorSize, dwBytesInSector))
             {
-                hf->dwFileKey = DetectFileKeyByContent(pbInSector, dwBytesInThisSector);
-                if(hf->dwFileKey == 0)
-                {
-                    nError = ERROR_UNKNOWN_FILE_KEY;
-                    break;
-                }
+                if(dwRunCount == 0)
+                    dwRunStart = i;
+                dwRunCount++;
+                continue;
             }
-
-            DecryptMpqBlock(pbInSector, dwRawBytesInThisSector, hf->dwFileKey + dwIndex);
-            BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
         }
 
-        // If the file has sector CRC check turned on, perform it
-        if(hf->bCheckSectorCRCs && hf->SectorChksums != NULL)
+        // Load the run of sectors that were not in the cache, then cache them
+        if(dwRunCount != 0)
         {
-            DWORD dwAdlerExpected = hf->SectorChksums[dwIndex];
-            DWORD dwAdlerValue = 0;
+            nError = LoadMpqSectors(hf, pbBuffer + dwRunStart * dwSectorSize, dwByteOffset + dwRunStart * dwSectorSize, dwRunCount * dwSectorSize, &dwBytesRead, pPrefetched);
+            if(nError != ERROR_SUCCESS)
+                break;
 
-            // We can only check sector CRC when it's not zero
-            // Neither can we check it if it's 0xFFFFFFFF.
-            if(dwAdlerExpected != 0 && dwAdlerExpected != 0xFFFFFFFF)
+            for(DWORD j = dwRunStart; j < dwRunStart + dwRunCount; j++)
             {
-                dwAdlerValue = adler32(0, pbInSector, dwRawBytesInThisSector);
-                if(dwAdlerValue != dwAdlerExpected)
-                {
-                    nError = ERROR_CHECKSUM_ERROR;
-                    break;
-                }
+                dwBytesInSector = STORMLIB_MIN(dwBytesToRead - j * dwSectorSize, dwSectorSize);
+                SectorCache_Insert(hf, dwSectorIndex + j, pbBuffer + j * dwSectorSize, dwBytesInSector);
             }
+            dwRunCount = 0;
         }
+    }
 
-        // If the sector is really compressed, decompress it.
-        // WARNING : Some sectors may not be compressed, it can be determined only
-        // by comparing uncompressed and compressed size !!!
-        if(dwRawBytesInThisSector < dwBytesInThisSector)
-        {
-            int cbOutSector = dwBytesInThisSector;
-            int cbInSector = dwRawBytesInThisSector;
-            int nResult = 0;
+    *pdwBytesRead = (nError == ERROR_SUCCESS) ? dwBytesToRead : 0;
+    return nError;
+}
 
-            // Is the file compressed by PKWARE Data Compression Library ?
-            if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                nResult = SCompExplode((char *)pbOutSector, &cbOutSector, (char *)pbInSector, cbInSector);
+// Loads the entire content of a file stored as single unit.
+// The output buffer must be large enough for hf->dwDataSize bytes.
+static int LoadMpqFileSingleUnit(TMPQFile * hf, LPBYTE pbOutBuffer, const TPrefetchedData * pPrefetched)
+{
+    ULONGLONG RawFilePos = hf->RawFilePos;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    LPBYTE pbCompressed = NULL;
+    LPBYTE pbRawData = pbOutBuffer;
 
-            // Is the file compressed by Blizzard's multiple compression ?
-            if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                nResult = SCompDecompress((char *)pbOutSector, &cbOutSector, (char *)pbInSector, cbInSector);
+    // If the file is a patch file, adjust raw data offset
+    if(hf->pPatchInfo != NULL)
+        RawFilePos += hf->pPatchInfo->dwLength;
+
+    // The decompressed file may be in the sector cache of the archive
+    if(SectorCache_Read(hf, 0, pbOutBuffer, hf->dwDataSize))
+        return ERROR_SUCCESS;
+
+    //
+    // In "wow-update-12694.MPQ" from Wow-Cataclysm BETA:
+    //
+    // File                                    CmpSize FileSize  Data
+    // --------------------------------------  ------- --------  ---------------
+    // esES\DBFilesClient\LightSkyBox.dbc      0xBE    0xBC      Is compressed
+    // deDE\DBFilesClient\MountCapability.dbc  0x93    0x77      Is uncompressed
+    //
+    // Now tell me how to deal with this mess. Apparently
+    // someone made a mistake at Blizzard ...
+    //
+
+    if(hf->pPatchInfo != NULL)
+    {
+        // Allocate space for
+        pbCompressed = (LPBYTE)AllocateScratchBuffer(pFileEntry->dwCmpSize);
+        if(pbCompressed == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+
+        // Read the entire file
+        if(!ReadMpqFileRaw(hf, RawFilePos, pbCompressed, pFileEntry->dwCmpSize, pPrefetched))
+        {
+            FreeScratchBuffer(pbCompressed);
+            return GetLastError();
+        }
+
+        // We assume that patch files are not encrypted
+        assert((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) == 0);
+        assert((pFileEntry->dwFlags & MPQ_FILE_IMPLODE) == 0);
 
-            // Did the decompression fail ?
+        // Check the 'PTCH' signature to find out if it's compressed or not
+        if(pbCompressed[0] != 'P' || pbCompressed[1] != 'T' || pbCompressed[2] != 'C' || pbCompressed[3] != 'H')
+        {
+            int cbOutBuffer = (int)hf->dwDataSize;
+            int nResult = SCompDecompress((char *)pbOutBuffer,
+                                                 &cbOutBuffer,
+                                          (char *)pbCompressed,
+                                             (int)pFileEntry->dwCmpSize);
             if(nResult == 0)
             {
-                nError = ERROR_FILE_CORRUPT;
-                break;
+                FreeScratchBuffer(pbCompressed);
+                return ERROR_FILE_CORRUPT;
             }
         }
         else
         {
-            if(pbOutSector != pbInSector)
-                memcpy(pbOutSector, pbInSector, dwBytesInThisSector);
+            memcpy(pbOutBuffer, pbCompressed, hf->dwDataSize);
         }
 
-        // Move pointers
-        dwBytesToRead -= dwBytesInThisSector;
-        dwByteOffset += dwBytesInThisSector;
-        dwBytesRead += dwBytesInThisSector;
-        pbOutSector += dwBytesInThisSector;
-        pbInSector += dwRawBytesInThisSector;
-        dwSectorsDone++;
+        // Free the decompression buffer.
+        FreeScratchBuffer(pbCompressed);
     }
+    else
+    {
+        // If the file is compressed, we have to allocate buffer for compressed data
+        if(pFileEntry->dwCmpSize < hf->dwDataSize)
+        {
+            pbCompressed = (LPBYTE)AllocateScratchBuffer(pFileEntry->dwCmpSize);
+            if(pbCompressed == NULL)
+                return ERROR_NOT_ENOUGH_MEMORY;
+            pbRawData = pbCompressed;
+        }
 
-    // Free all used buffers
-    if(pbRawSector != NULL)
-        FREEMEM(pbRawSector);
+        // Read the entire file
+        if(!ReadMpqFileRaw(hf, RawFilePos, pbRawData, pFileEntry->dwCmpSize, pPrefetched))
+        {
+            if(pbCompressed != NULL)
+                FreeScratchBuffer(pbCompressed);
+            return GetLastError();
+        }
 
-    // Give the caller thenumber of bytes read
-    *pdwBytesRead = dwBytesRead;
-    return nError;
+        // If the file is encrypted, we have to decrypt the data first
+        if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+        {
+            BSWAP_ARRAY32_UNSIGNED(pbRawData, pFileEntry->dwCmpSize);
+            DecryptMpqBlock(pbRawData, pFileEntry->dwCmpSize, hf->dwFileKey);
+            BSWAP_ARRAY32_UNSIGNED(pbRawData, pFileEntry->dwCmpSize);
+        }
+
+        // If the file is compressed, we have to decompress it now
+        if(pFileEntry->dwCmpSize < hf->dwDataSize)
+        {
+            int cbOutBuffer = (int)hf->dwDataSize;
+            int nResult = 0;
+
+            // Note: Single unit files compressed with IMPLODE are not supported by Blizzard
+            if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
+                nResult = SCompExplode((char *)pbOutBuffer, &cbOutBuffer, (char *)pbRawData, (int)pFileEntry->dwCmpSize);
+            if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
+                nResult = SCompDecompress((char *)pbOutBuffer, &cbOutBuffer, (char *)pbRawData, (int)pFileEntry->dwCmpSize);
+
+            // Free the decompression buffer.
+            FreeScratchBuffer(pbCompressed);
+            if(nResult == 0)
+                return ERROR_FILE_CORRUPT;
+        }
+    }
+
+    // Remember the decompressed file for the next time
+    SectorCache_Insert(hf, 0, pbOutBuffer, hf->dwDataSize);
+    return ERROR_SUCCESS;
 }
 
 static int ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwToRead, LPDWORD pdwBytesRead)
 {
-    ULONGLONG RawFilePos = hf->RawFilePos;
-    TMPQArchive * ha = hf->ha;
-    TFileEntry * pFileEntry = hf->pFileEntry;
-    LPBYTE pbCompressed = NULL;
-    LPBYTE pbRawData = NULL;
     int nError;
 
     // If the file buffer is not allocated yet, do it.
@@ -268,112 +531,14 @@ static int ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwToRead,
         nError = AllocateSectorBuffer(hf);
         if(nError != ERROR_SUCCESS)
             return nError;
-        pbRawData = hf->pbFileSector;
     }
 
-    // If the file is a patch file, adjust raw data offset
-    if(hf->pPatchInfo != NULL)
-        RawFilePos += hf->pPatchInfo->dwLength;
-
     // If the file buffer is not loaded yet, do it
     if(hf->dwSectorOffs != 0)
     {
-        //
-        // In "wow-update-12694.MPQ" from Wow-Cataclysm BETA:
-        //
-        // File                                    CmpSize FileSize  Data
-        // --------------------------------------  ------- --------  ---------------
-        // esES\DBFilesClient\LightSkyBox.dbc      0xBE    0xBC      Is compressed
-        // deDE\DBFilesClient\MountCapability.dbc  0x93    0x77      Is uncompressed
-        //
-        // Now tell me how to deal with this mess. Apparently
-        // someone made a mistake at Blizzard ...
-        //
-
-        if(hf->pPatchInfo != NULL)
-        {
-            // Allocate space for
-            pbCompressed = ALLOCMEM(BYTE, pFileEntry->dwCmpSize);
-            if(pbCompressed == NULL)
-                return ERROR_NOT_ENOUGH_MEMORY;
-
-            // Read the entire file
-            if(!FileStream_Read(ha->pStream, &RawFilePos, pbCompressed, pFileEntry->dwCmpSize))
-            {
-                FREEMEM(pbCompressed);
-                return GetLastError();
-            }
-
-            // We assume that patch files are not encrypted
-            assert((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) == 0);
-            assert((pFileEntry->dwFlags & MPQ_FILE_IMPLODE) == 0);
-
-            // Check the 'PTCH' signature to find out if it's compressed or not
-            if(pbCompressed[0] != 'P' || pbCompressed[1] != 'T' || pbCompressed[2] != 'C' || pbCompressed[3] != 'H')
-            {
-                int cbOutBuffer = (int)hf->dwDataSize;
-                int nResult = SCompDecompress((char *)hf->pbFileSector,
-                                                     &cbOutBuffer,
-                                              (char *)pbCompressed,
-                                                 (int)pFileEntry->dwCmpSize);
-                if(nResult == 0)
-                {
-                    FREEMEM(pbCompressed);
-                    return ERROR_FILE_CORRUPT;
-                }
-            }
-            else
-            {
-                memcpy(hf->pbFileSector, pbCompressed, hf->dwDataSize);
-            }
-
-            // Free the decompression buffer.
-            FREEMEM(pbCompressed);
-        }
-        else
-        {
-            // If the file is compressed, we have to allocate buffer for compressed data
-            if(pFileEntry->dwCmpSize < hf->dwDataSize)
-            {
-                pbCompressed = ALLOCMEM(BYTE, pFileEntry->dwCmpSize);
-                if(pbCompressed == NULL)
-                    return ERROR_NOT_ENOUGH_MEMORY;
-                pbRawData = pbCompressed;
-            }
-
-            // Read the entire file
-            if(!FileStream_Read(ha->pStream, &RawFilePos, pbRawData, pFileEntry->dwCmpSize))
-            {
-                FREEMEM(pbCompressed);
-                return GetLastError();
-            }
-
-            // If the file is encrypted, we have to decrypt the data first
-            if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-            {
-                BSWAP_ARRAY32_UNSIGNED(pbRawData, pFileEntry->dwCmpSize);
-                DecryptMpqBlock(pbRawData, pFileEntry->dwCmpSize, hf->dwFileKey);
-                BSWAP_ARRAY32_UNSIGNED(pbRawData, pFileEntry->dwCmpSize);
-            }
-
-            // If the file is compressed, we have to decompress it now
-            if(pFileEntry->dwCmpSize < hf->dwDataSize)
-            {
-                int cbOutBuffer = (int)hf->dwDataSize;
-                int nResult = 0;
-
-                // Note: Single unit files compressed with IMPLODE are not supported by Blizzard
-                if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                    nResult = SCompExplode((char *)hf->pbFileSector, &cbOutBuffer, (char *)pbRawData, (int)pFileEntry->dwCmpSize);
-                if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                    nResult = SCompDecompress((char *)hf->pbFileSector, &cbOutBuffer, (char *)pbRawData, (int)pFileEntry->dwCmpSize);
-
-                // Free the decompression buffer.
-                FREEMEM(pbCompressed);
-                if(nResult == 0)
-                    return ERROR_FILE_CORRUPT;
-            }
-        }
+        nError = LoadMpqFileSingleUnit(hf, hf->pbFileSector, NULL);
+        if(nError != ERROR_SUCCESS)
+            return nError;
 
         // The file sector is now properly loaded
         hf->dwSectorOffs = 0;
@@ -450,7 +615,7 @@ static int ReadMpqFile(TMPQFile * hf, void * pvBuffer, DWORD dwBytesToRead, LPDW
         if(hf->dwSectorOffs != dwFileSectorPos)
         {
             // Load one MPQ sector into archive buffer
-            nError = ReadMpqSectors(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesInSector);
+            nError = ReadMpqSectors(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesInSector, NULL);
             if(nError != ERROR_SUCCESS)
                 return nError;
 
@@ -484,7 +649,7 @@ static int ReadMpqFile(TMPQFile * hf, void * pvBuffer, DWORD dwBytesToRead, LPDW
         DWORD dwBlockBytes = dwBytesToRead & ~dwSectorSizeMask;
 
         // Load all sectors to the output buffer
-        nError = ReadMpqSectors(hf, pbBuffer, dwFileSectorPos, dwBlockBytes, &dwBytesRead);
+        nError = ReadMpqSectors(hf, pbBuffer, dwFileSectorPos, dwBlockBytes, &dwBytesRead, NULL);
         if(nError != ERROR_SUCCESS)
             return nError;
 
@@ -504,7 +669,7 @@ static int ReadMpqFile(TMPQFile * hf, void * pvBuffer, DWORD dwBytesToRead, LPDW
         if(hf->dwSectorOffs != dwFileSectorPos)
         {
             // Load one MPQ sector into archive buffer
-            nError = ReadMpqSectors(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesRead);
+            nError = ReadMpqSectors(hf, hf->pbFileSector, dwFileSectorPos, ha->dwSectorSize, &dwBytesRead, NULL);
             if(nError != ERROR_SUCCESS)
                 return nError;
 
@@ -593,28 +758,13 @@ static int ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwToRead,
 //-----------------------------------------------------------------------------
 // SFileReadFile
 
-bool WINAPI SFileReadFile(HANDLE hFile, void * pvBuffer, DWORD dwToRead, LPDWORD pdwRead, LPOVERLAPPED lpOverlapped)
+// Reads the data from the current file position. Used for both
+// synchronous and asynchronous reading
+static int ReadFileData(TMPQFile * hf, void * pvBuffer, DWORD dwToRead, LPDWORD pdwBytesRead)
 {
-    TMPQFile * hf = (TMPQFile *)hFile;
     DWORD dwBytesRead = 0;                      // Number of bytes read
     int nError = ERROR_SUCCESS;
 
-    // Keep compilers happy
-    lpOverlapped = lpOverlapped;
-
-    // Check valid parameters
-    if(!IsValidFileHandle(hf))
-    {
-        SetLastError(ERROR_INVALID_HANDLE);
-        return false;
-    }
-
-    if(pvBuffer == NULL)
-    {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return false;
-    }
-
     // If the file is local file, read the data directly from the stream
     if(hf->pStream != NULL)
     {
@@ -668,50 +818,703 @@ bool WINAPI SFileReadFile(HANDLE hFile, void * pvBuffer, DWORD dwToRead, LPDWORD
     }
 
     // Give the caller the number of bytes read
-    if(pdwRead != NULL)
-        *pdwRead = dwBytesRead;
+    *pdwBytesRead = dwBytesRead;
 
     // If the read operation succeeded, but not full number of bytes was read,
     // set the last error to ERROR_HANDLE_EOF
     if(nError == ERROR_SUCCESS && (dwBytesRead < dwToRead))
         nError = ERROR_HANDLE_EOF;
-
-    // If something failed, set the last error value
-    if(nError != ERROR_SUCCESS)
-        SetLastError(nError);
-    return (nError == ERROR_SUCCESS);
+    return nError;
 }
 
 //-----------------------------------------------------------------------------
-// SFileGetFileSize
+// Asynchronous reading
+//
+// When SFileReadFile gets an OVERLAPPED structure, the read request is queued
+// to the worker threads and SFileReadFile returns immediately. The worker reads
+// the raw sectors, decrypts and decompresses them, stores the result
+// in the OVERLAPPED structure and signals its event (Windows only).
+// Use SFileGetOverlappedResult to wait for the result.
+//
+// Closing the file or the archive waits until their pending requests are done.
+// Requests for the same file handle are always processed one after another,
+// in the order they have been submitted. Files in MPQ can only be read
+// asynchronously if the archive has been open with MPQ_OPEN_THREAD_SAFE.
+// Otherwise, the worker would share the archive stream with the synchronous
+// reads of the caller.
+
+struct TAsyncRead
+{
+    TMPQFile   * hf;                        // File handle
+    void       * pvBuffer;                  // Target buffer
+    DWORD        dwToRead;                  // Number of bytes to read
+    LPOVERLAPPED lpOverlapped;              // Caller's OVERLAPPED structure
+};
 
-DWORD WINAPI SFileGetFileSize(HANDLE hFile, LPDWORD pdwFileSizeHigh)
+static void AsyncReadWorker(void * pvParam)
 {
-    ULONGLONG FileSize;
-    TMPQFile * hf = (TMPQFile *)hFile;
+    TAsyncRead * pAsyncRead = (TAsyncRead *)pvParam;
+    LPOVERLAPPED lpOverlapped = pAsyncRead->lpOverlapped;
+    ULONGLONG ByteOffset = MAKE_OFFSET64(lpOverlapped->OffsetHigh, lpOverlapped->Offset);
+    TMPQFile * hf = pAsyncRead->hf;
+    TMPQArchive * ha = hf->ha;
+#ifdef PLATFORM_WINDOWS
+    HANDLE hEvent = lpOverlapped->hEvent;
+#endif
+    DWORD dwBytesRead = 0;
+    int nError = ERROR_SUCCESS;
 
-    // Validate the file handle before we go on
-    if(IsValidFileHandle(hf))
+    // Move to the position given by the OVERLAPPED structure
+    if(hf->pStream != NULL)
     {
-        // Make sure that the variable is initialized
-        FileSize = 0;
+        FileStream_Read(hf->pStream, &ByteOffset, NULL, 0);
+    }
+    else
+    {
+        // Files in MPQ can't be bigger than 4 GB
+        if(ByteOffset >> 32)
+            nError = ERROR_HANDLE_EOF;
+        hf->dwFilePos = (DWORD)ByteOffset;
+    }
 
-        // If the file is patched file, we have to get the size of the last version
-        if(hf->hfPatchFile != NULL)
-        {
-            // Walk through the entire patch chain, take the last version
-            while(hf != NULL)
-            {
-                // Get the size of the currently pointed version
-                FileSize = hf->pFileEntry->dwFileSize;
+    // Read the data
+    if(nError == ERROR_SUCCESS)
+        nError = ReadFileData(hf, pAsyncRead->pvBuffer, pAsyncRead->dwToRead, &dwBytesRead);
+
+    // Give the result to the caller. The error code must be set as the last one,
+    // because that's what the waiting thread checks. Once it is set, the caller
+    // may free the OVERLAPPED structure, so it must not be touched anymore
+    lpOverlapped->InternalHigh = dwBytesRead;
+    SetWorkItemResult(&lpOverlapped->Internal, nError);
+
+#ifdef PLATFORM_WINDOWS
+    if(hEvent != NULL)
+        SetEvent(hEvent);
+#endif
+
+    // Let the file and the archive be closed
+    FREEMEM(pAsyncRead);
+    ReleaseWorkItemRef(&hf->AsyncReads);
+    if(ha != NULL)
+        ReleaseWorkItemRef(&ha->AsyncReads);
+}
 
-                // Move to the next patch file in the hierarchy
-                hf = hf->hfPatchFile;
-            }
-        }
-        else
-        {
-            // Is it a local file ?
+static bool ReadFileAsync(TMPQFile * hf, void * pvBuffer, DWORD dwToRead, LPOVERLAPPED lpOverlapped)
+{
+    TAsyncRead * pAsyncRead;
+    int nError;
+
+    // The archive stream must be safe for reading from more threads
+    if(hf->pStream == NULL && (hf->ha->dwFlags & MPQ_FLAG_THREAD_SAFE) == 0)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    // Prepare the read request
+    pAsyncRead = ALLOCMEM(TAsyncRead, 1);
+    if(pAsyncRead == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    pAsyncRead->hf = hf;
+    pAsyncRead->pvBuffer = pvBuffer;
+    pAsyncRead->dwToRead = dwToRead;
+    pAsyncRead->lpOverlapped = lpOverlapped;
+
+    // Mark the request as pending
+    lpOverlapped->Internal = ERROR_IO_PENDING;
+    lpOverlapped->InternalHigh = 0;
+#ifdef PLATFORM_WINDOWS
+    if(lpOverlapped->hEvent != NULL)
+        ResetEvent(lpOverlapped->hEvent);
+#endif
+
+    // Give the request to the worker threads. The file and the archive
+    // can't be closed until the request is complete
+    if(hf->ha != NULL)
+        AddWorkItemRef(&hf->ha->AsyncReads);
+    AddWorkItemRef(&hf->AsyncReads);
+    nError = QueueWorkItem(AsyncReadWorker, pAsyncRead, hf);
+    if(nError != ERROR_SUCCESS)
+    {
+        lpOverlapped->Internal = nError;
+        ReleaseWorkItemRef(&hf->AsyncReads);
+        if(hf->ha != NULL)
+            ReleaseWorkItemRef(&hf->ha->AsyncReads);
+        FREEMEM(pAsyncRead);
+    }
+    else
+        nError = ERROR_IO_PENDING;
+
+    SetLastError(nError);
+    return false;
+}
+
+bool WINAPI SFileReadFile(HANDLE hFile, void * pvBuffer, DWORD dwToRead, LPDWORD pdwRead, LPOVERLAPPED lpOverlapped)
+{
+    TMPQFile * hf = (TMPQFile *)hFile;
+    DWORD dwBytesRead = 0;                      // Number of bytes read
+    int nError = ERROR_SUCCESS;
+
+    // Check valid parameters
+    if(!IsValidFileHandle(hf))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(pvBuffer == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // If the caller gave us OVERLAPPED structure, the read is asynchronous.
+    // Just like ReadFile on Windows, we return false with ERROR_IO_PENDING
+    if(lpOverlapped != NULL)
+    {
+        if(pdwRead != NULL)
+            *pdwRead = 0;
+        return ReadFileAsync(hf, pvBuffer, dwToRead, lpOverlapped);
+    }
+
+    // Read the data
+    nError = ReadFileData(hf, pvBuffer, dwToRead, &dwBytesRead);
+
+    // Give the caller the number of bytes read
+    if(pdwRead != NULL)
+        *pdwRead = dwBytesRead;
+
+    // If something failed, set the last error value
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
+//-----------------------------------------------------------------------------
+// SFileGetOverlappedResult
+//
+// Retrieves the result of an asynchronous read started by SFileReadFile.
+// If bWait is true, waits until the read is complete. Otherwise,
+// returns false with ERROR_IO_PENDING if the read is still in progress.
+
+bool WINAPI SFileGetOverlappedResult(HANDLE hFile, LPOVERLAPPED lpOverlapped, LPDWORD pdwBytesRead, bool bWait)
+{
+    TMPQFile * hf = (TMPQFile *)hFile;
+    int nError = ERROR_SUCCESS;
+
+    // Check valid parameters
+    if(!IsValidFileHandle(hf))
+        nError = ERROR_INVALID_HANDLE;
+    if(lpOverlapped == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+
+    if(nError == ERROR_SUCCESS)
+    {
+#ifdef PLATFORM_WINDOWS
+        // If there is an event, the worker signals it after the read is complete
+        if(bWait && lpOverlapped->hEvent != NULL)
+            WaitForSingleObject(lpOverlapped->hEvent, INFINITE);
+#endif
+
+        // Check if the read is complete
+        if(WaitForWorkItemResult(&lpOverlapped->Internal, ERROR_IO_PENDING, bWait))
+        {
+            if(pdwBytesRead != NULL)
+                *pdwBytesRead = (DWORD)lpOverlapped->InternalHigh;
+            nError = (int)lpOverlapped->Internal;
+        }
+        else
+        {
+            nError = ERROR_IO_PENDING;
+        }
+    }
+
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
+//-----------------------------------------------------------------------------
+// SFileLoadFile
+//
+// Loads the entire file into a buffer allocated by StormLib.
+// Same as opening the file, allocating a buffer of the file size,
+// reading the file and closing it, but the sectors of the file are read
+// from the archive at once and decompressed directly into the buffer.
+// The buffer must be freed by SFileFreeFileData.
+
+// Loads the entire file to the buffer. The buffer must be large enough
+// for the whole file and the file position must be zero.
+// Raw data that have been read ahead are taken from pPrefetched, if not NULL
+static int LoadFileData(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwFileSize, const TPrefetchedData * pPrefetched)
+{
+    DWORD dwSectorMask;
+    DWORD dwBytesRead = 0;
+    int nError;
+
+    // Empty files have nothing to load
+    if(dwFileSize == 0)
+        return ERROR_SUCCESS;
+
+    // Local files and patched files are read the usual way
+    if(hf->pStream == NULL && hf->hfPatchFile == NULL)
+    {
+        assert(dwFileSize == hf->dwDataSize);
+
+        // Files stored as single unit are decompressed directly into the buffer
+        if(hf->pFileEntry->dwFlags & MPQ_FILE_SINGLE_UNIT)
+            return LoadMpqFileSingleUnit(hf, pbBuffer, pPrefetched);
+
+        // The file sector size is normally set when the sector buffer
+        // is allocated, but this path doesn't need the sector buffer
+        if(hf->dwSectorSize == 0)
+            hf->dwSectorSize = hf->ha->dwSectorSize;
+
+        // Sector-based files are read by one read and the sectors
+        // are decoded directly into the buffer
+        dwSectorMask = hf->ha->dwSectorSize - 1;
+        nError = ReadMpqSectors(hf, pbBuffer, 0, (dwFileSize + dwSectorMask) & ~dwSectorMask, &dwBytesRead, pPrefetched);
+        if(nError == ERROR_SUCCESS && dwBytesRead != dwFileSize)
+            nError = ERROR_FILE_CORRUPT;
+        return nError;
+    }
+
+    nError = ReadFileData(hf, pbBuffer, dwFileSize, &dwBytesRead);
+    if(nError == ERROR_SUCCESS && dwBytesRead != dwFileSize)
+        nError = ERROR_HANDLE_EOF;
+    return nError;
+}
+
+bool WINAPI SFileLoadFile(HANDLE hMpq, const char * szFileName, void ** ppvData, LPDWORD pcbData, DWORD dwSearchScope)
+{
+    TMPQFile * hf = NULL;
+    LPBYTE pbFileData = NULL;
+    DWORD dwFileSizeHi = 0;
+    DWORD dwFileSize = 0;
+    int nError = ERROR_SUCCESS;
+
+    // Check valid parameters
+    if(ppvData == NULL || pcbData == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Open the file
+    if(!SFileOpenFileEx(hMpq, szFileName, dwSearchScope, (HANDLE *)&hf))
+        return false;
+
+    // Files larger than 4 GB can't be loaded as one block
+    dwFileSize = SFileGetFileSize(hf, &dwFileSizeHi);
+    if(dwFileSizeHi != 0)
+        nError = ERROR_NOT_SUPPORTED;
+
+    // Allocate the buffer. Empty files get a buffer too
+    if(nError == ERROR_SUCCESS)
+    {
+        pbFileData = ALLOCMEM(BYTE, dwFileSize + 1);
+        if(pbFileData == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Load the file
+    if(nError == ERROR_SUCCESS)
+        nError = LoadFileData(hf, pbFileData, dwFileSize, NULL);
+    SFileCloseFile(hf);
+
+    // Give the buffer to the caller
+    if(nError == ERROR_SUCCESS)
+    {
+        *ppvData = pbFileData;
+        *pcbData = dwFileSize;
+    }
+    else
+    {
+        if(pbFileData != NULL)
+            FREEMEM(pbFileData);
+        SetLastError(nError);
+    }
+    return (nError == ERROR_SUCCESS);
+}
+
+bool WINAPI SFileFreeFileData(void * pvData)
+{
+    if(pvData != NULL)
+        FREEMEM(pvData);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// SFileReadFilesBatch
+//
+// Loads many files at once and gives each of them to a callback.
+// The files are sorted by their position in the archive, and files that
+// are close to each other are read from the archive by one large read,
+// so the archive is read in one forward sweep. The files of one such read
+// are decompressed by more threads, if the archive is thread-safe.
+// Each file is given to the callback exactly once, in the order
+// of the file positions, together with an error code if it couldn't be loaded.
+
+#define BATCH_MAX_READ_SIZE     0x00400000  // Maximum size of one merged read (4 MB)
+#define BATCH_MAX_GAP           0x00010000  // Files closer than this are read by the same read
+
+// One file of the batch
+struct TBatchFile
+{
+    TMPQFile * hf;                          // Open file. NULL if the file could not be opened
+    TPrefetchedData * pPrefetched;          // Raw data of the file read ahead by the merged read, or NULL
+    LPBYTE pbData;                          // Loaded file data
+    DWORD dwFileSize;                       // Size of the file data
+    DWORD dwIndex;                          // Index of the file name given by the caller
+    int nError;                             // Result of loading the file
+};
+
+static int CompareBatchFiles(const void * p1, const void * p2)
+{
+    TBatchFile * pFile1 = *(TBatchFile **)p1;
+    TBatchFile * pFile2 = *(TBatchFile **)p2;
+
+    // Files that could not be opened go first
+    if(pFile1->hf == NULL || pFile2->hf == NULL)
+        return (pFile1->hf != NULL) - (pFile2->hf != NULL);
+
+    // Keep the files of one archive together
+    if(pFile1->hf->ha != pFile2->hf->ha)
+        return (pFile1->hf->ha < pFile2->hf->ha) ? -1 : 1;
+
+    // Sort by the position in the archive
+    if(pFile1->hf->RawFilePos != pFile2->hf->RawFilePos)
+        return (pFile1->hf->RawFilePos < pFile2->hf->RawFilePos) ? -1 : 1;
+    return (int)pFile1->dwIndex - (int)pFile2->dwIndex;
+}
+
+// Checks whether the raw data of the file can be read as part of a merged read
+static bool CanPrefetchFile(TMPQFile * hf)
+{
+    return (hf->pStream == NULL &&
+            hf->hfPatchFile == NULL &&
+            hf->pPatchInfo == NULL &&
+            hf->dwDataSize != 0 &&
+            hf->pFileEntry->dwCmpSize <= BATCH_MAX_READ_SIZE);
+}
+
+static int LoadBatchFile(void * pvParam, DWORD dwItemIndex)
+{
+    TBatchFile * pFile = ((TBatchFile **)pvParam)[dwItemIndex];
+
+    // Empty files get a buffer too
+    pFile->pbData = ALLOCMEM(BYTE, pFile->dwFileSize + 1);
+    if(pFile->pbData != NULL)
+        pFile->nError = LoadFileData(pFile->hf, pFile->pbData, pFile->dwFileSize, pFile->pPrefetched);
+    else
+        pFile->nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Errors are reported per file, the other files are loaded anyway
+    return ERROR_SUCCESS;
+}
+
+bool WINAPI SFileReadFilesBatch(HANDLE hMpq, const char ** szFileNames, DWORD dwFileCount, SFILE_BATCH_CALLBACK BatchCB, void * pvUserData)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TBatchFile ** SortTable = NULL;
+    TBatchFile * pFiles = NULL;
+    TBatchFile * pFile;
+    TPrefetchedData Prefetched;
+    ULONGLONG StartPos;
+    ULONGLONG EndPos;
+    DWORD dwFileSizeHi;
+    DWORD dwFirst;
+    DWORD dwLast;
+    int nError = ERROR_SUCCESS;
+
+    // Check valid parameters
+    if(!IsValidMpqHandle(ha))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    if((szFileNames == NULL && dwFileCount != 0) || BatchCB == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+    if(dwFileCount == 0)
+        return true;
+
+    // Allocate the files and the table for sorting them
+    pFiles = ALLOCMEM(TBatchFile, dwFileCount);
+    SortTable = ALLOCMEM(TBatchFile *, dwFileCount);
+    if(pFiles == NULL || SortTable == NULL)
+    {
+        if(pFiles != NULL)
+            FREEMEM(pFiles);
+        if(SortTable != NULL)
+            FREEMEM(SortTable);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    // Open all files. This also finds the newest version of each file in the patches
+    for(DWORD i = 0; i < dwFileCount; i++)
+    {
+        pFile = SortTable[i] = &pFiles[i];
+        memset(pFile, 0, sizeof(TBatchFile));
+        pFile->dwIndex = i;
+
+        if(SFileOpenFileEx(hMpq, szFileNames[i], SFILE_OPEN_FROM_MPQ, (HANDLE *)&pFile->hf))
+        {
+            pFile->dwFileSize = SFileGetFileSize(pFile->hf, &dwFileSizeHi);
+            if(dwFileSizeHi != 0)
+                pFile->nError = ERROR_NOT_SUPPORTED;
+        }
+        else
+        {
+            pFile->nError = GetLastError();
+        }
+    }
+
+    // Sort the files by their position in the archive
+    qsort(SortTable, dwFileCount, sizeof(TBatchFile *), CompareBatchFiles);
+
+    // Process the files in groups that are read by one read
+    Prefetched.pbData = NULL;
+    for(dwFirst = 0; dwFirst < dwFileCount; dwFirst = dwLast)
+    {
+        pFile = SortTable[dwFirst];
+        dwLast = dwFirst + 1;
+
+        if(pFile->hf != NULL && pFile->nError == ERROR_SUCCESS)
+        {
+            // Add the files that follow closely after this one
+            if(CanPrefetchFile(pFile->hf))
+            {
+                StartPos = pFile->hf->RawFilePos;
+                EndPos = StartPos + pFile->hf->pFileEntry->dwCmpSize;
+
+                while(dwLast < dwFileCount)
+                {
+                    TMPQFile * hfNext = SortTable[dwLast]->hf;
+                    ULONGLONG NextEndPos;
+
+                    if(SortTable[dwLast]->nError != ERROR_SUCCESS || hfNext->ha != pFile->hf->ha || !CanPrefetchFile(hfNext))
+                        break;
+                    if(hfNext->RawFilePos > EndPos + BATCH_MAX_GAP)
+                        break;
+
+                    NextEndPos = STORMLIB_MAX(EndPos, hfNext->RawFilePos + hfNext->pFileEntry->dwCmpSize);
+                    if((NextEndPos - StartPos) > BATCH_MAX_READ_SIZE)
+                        break;
+
+                    EndPos = NextEndPos;
+                    dwLast++;
+                }
+
+                // Read all the files at once. If the read fails,
+                // each file reads its own data and reports the error
+                Prefetched.ByteOffset = StartPos;
+                Prefetched.cbData = (DWORD)(EndPos - StartPos);
+                Prefetched.pbData = ALLOCMEM(BYTE, Prefetched.cbData);
+                if(Prefetched.pbData != NULL && ReadMpqFileRaw(pFile->hf, StartPos, Prefetched.pbData, Prefetched.cbData, NULL))
+                {
+                    for(DWORD i = dwFirst; i < dwLast; i++)
+                        SortTable[i]->pPrefetched = &Prefetched;
+                }
+            }
+
+            // Decode the files. Files of archives that are not thread-safe
+            // are loaded one by one, because they may need to read more data.
+            // If the work can't be given to the worker threads, the files are loaded here
+            if((pFile->hf->ha->dwFlags & MPQ_FLAG_THREAD_SAFE) == 0 || RunParallel(LoadBatchFile, SortTable + dwFirst, dwLast - dwFirst) != ERROR_SUCCESS)
+            {
+                for(DWORD i = 0; i < dwLast - dwFirst; i++)
+                {
+                    if(SortTable[dwFirst + i]->pbData == NULL)
+                        LoadBatchFile(SortTable + dwFirst, i);
+                }
+            }
+
+            if(Prefetched.pbData != NULL)
+                FREEMEM(Prefetched.pbData);
+            Prefetched.pbData = NULL;
+        }
+
+        // Give the files to the caller and free them
+        for(DWORD i = dwFirst; i < dwLast; i++)
+        {
+            pFile = SortTable[i];
+            BatchCB(pvUserData,
+                    pFile->dwIndex,
+                    szFileNames[pFile->dwIndex],
+                    (pFile->nError == ERROR_SUCCESS) ? pFile->pbData : NULL,
+                    (pFile->nError == ERROR_SUCCESS) ? pFile->dwFileSize : 0,
+                    pFile->nError);
+
+            if(pFile->nError != ERROR_SUCCESS)
+                nError = pFile->nError;
+            if(pFile->pbData != NULL)
+                FREEMEM(pFile->pbData);
+            if(pFile->hf != NULL)
+                SFileCloseFile(pFile->hf);
+        }
+    }
+
+    FREEMEM(SortTable);
+    FREEMEM(pFiles);
+
+    // Returns false if any of the files failed
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
+//-----------------------------------------------------------------------------
+// SFileMapFileView
+//
+// Gives the caller the entire content of the file.
+//
+// If the file is stored in the archive as-is (not compressed, not encrypted)
+// and the archive is memory-mapped, the view points directly to the archive
+// and no data are copied. Such a view remains valid until the archive is closed.
+//
+// Otherwise, the file is loaded into a buffer owned by the file handle.
+// Mapping the same file again returns the same buffer. The buffer is freed
+// by SFileUnmapFileView or when the file handle is closed.
+
+bool WINAPI SFileMapFileView(HANDLE hFile, const void ** ppvView, LPDWORD pcbView)
+{
+    TMPQFile * hf = (TMPQFile *)hFile;
+    const void * pvView = NULL;
+    ULONGLONG RawFilePos;
+    DWORD dwFileSizeHi = 0;
+    DWORD dwFileSize = 0;
+    DWORD dwFilePos;
+    int nError = ERROR_SUCCESS;
+
+    // Check valid parameters
+    if(!IsValidFileHandle(hf))
+        nError = ERROR_INVALID_HANDLE;
+    if(ppvView == NULL || pcbView == NULL)
+        nError = ERROR_INVALID_PARAMETER;
+
+    // Files larger than 4 GB can't be mapped as one block
+    if(nError == ERROR_SUCCESS)
+    {
+        dwFileSize = SFileGetFileSize(hFile, &dwFileSizeHi);
+        if(dwFileSizeHi != 0)
+            nError = ERROR_NOT_SUPPORTED;
+    }
+
+    // Try to get direct view of the file data
+    if(nError == ERROR_SUCCESS && hf->pbFileView == NULL)
+    {
+        if(hf->pStream != NULL)
+        {
+            pvView = FileStream_GetView(hf->pStream, 0, dwFileSize);
+        }
+        else if(hf->hfPatchFile == NULL && hf->pPatchInfo == NULL)
+        {
+            if((hf->pFileEntry->dwFlags & (MPQ_FILE_COMPRESSED | MPQ_FILE_ENCRYPTED)) == 0)
+            {
+                CalculateRawSectorOffset(RawFilePos, hf, 0);
+                pvView = FileStream_GetView(hf->ha->pStream, RawFilePos, dwFileSize);
+            }
+        }
+    }
+
+    // If the file can't be mapped directly, load it into a buffer
+    if(nError == ERROR_SUCCESS && pvView == NULL)
+    {
+        if(hf->pbFileView == NULL)
+        {
+            hf->pbFileView = ALLOCMEM(BYTE, dwFileSize + 1);
+            if(hf->pbFileView != NULL)
+            {
+                // Read the entire file, but keep the file position as it was
+                dwFilePos = SFileSetFilePointer(hFile, 0, NULL, FILE_CURRENT);
+                SFileSetFilePointer(hFile, 0, NULL, FILE_BEGIN);
+                nError = LoadFileData(hf, hf->pbFileView, dwFileSize, NULL);
+                SFileSetFilePointer(hFile, dwFilePos, NULL, FILE_BEGIN);
+
+                // Don't keep partially loaded data
+                if(nError != ERROR_SUCCESS)
+                {
+                    FREEMEM(hf->pbFileView);
+                    hf->pbFileView = NULL;
+                }
+            }
+            else
+                nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+        pvView = hf->pbFileView;
+    }
+
+    // Give the view to the caller
+    if(nError == ERROR_SUCCESS)
+    {
+        *ppvView = pvView;
+        *pcbView = dwFileSize;
+    }
+
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
+bool WINAPI SFileUnmapFileView(HANDLE hFile, const void * pvView)
+{
+    TMPQFile * hf = (TMPQFile *)hFile;
+
+    // Check valid parameters
+    if(!IsValidFileHandle(hf))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Direct views point to the archive and don't need to be released.
+    // Only free the buffer if the view has been loaded into memory
+    if(pvView != NULL && pvView == hf->pbFileView)
+    {
+        FREEMEM(hf->pbFileView);
+        hf->pbFileView = NULL;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// SFileGetFileSize
+
+DWORD WINAPI SFileGetFileSize(HANDLE hFile, LPDWORD pdwFileSizeHigh)
+{
+    ULONGLONG FileSize;
+    TMPQFile * hf = (TMPQFile *)hFile;
+
+    // Validate the file handle before we go on
+    if(IsValidFileHandle(hf))
+    {
+        // Make sure that the variable is initialized
+        FileSize = 0;
+
+        // If the file is patched file, we have to get the size of the last version
+        if(hf->hfPatchFile != NULL)
+        {
+            // Walk through the entire patch chain, take the last version
+            while(hf != NULL)
+            {
+                // Get the size of the currently pointed version
+                FileSize = hf->pFileEntry->dwFileSize;
+
+                // Move to the next patch file in the hierarchy
+                hf = hf->hfPatchFile;
+            }
+        }
+        else
+        {
+            // Is it a local file ?
             if(hf->pStream != NULL)
             {
                 FileStream_GetSize(hf->pStream, FileSize);
@@ -907,7 +1710,15 @@ bool WINAPI SFileGetFileName(HANDLE hFile, char * szFileName)
             }
         }
 
-        // Put the file name to the file table
+        // Put the file name to the file table. On archives open for concurrent
+        // reading, the file table is shared between threads and must not be
+        // changed, so the pseudo-name is only given to the caller
+        if(hf->ha->dwFlags & MPQ_FLAG_THREAD_SAFE)
+        {
+            if(szFileName != NULL)
+                strcpy(szFileName, szPseudoName);
+            return true;
+        }
         AllocateFileName(pFileEntry, szPseudoName);
     }
 
@@ -954,10 +1765,13 @@ bool WINAPI SFileGetFileInfo(
 {
     TMPQArchive * ha = (TMPQArchive *)hMpqOrFile;
     ULONGLONG ResultValue = 0;
+    ULONGLONG CacheHits;
+    ULONGLONG CacheMisses;
     TMPQBlock * pBlock;
     TMPQFile * hf = (TMPQFile *)hMpqOrFile;
     DWORD cbLengthNeeded = 0;
     DWORD dwIsReadOnly;
+    DWORD dwCachedSize;
     DWORD dwFileCount = 0;
     DWORD dwFileKey;
     DWORD i;
@@ -1051,6 +1865,42 @@ bool WINAPI SFileGetFileInfo(
             RESULT_IS_32BIT_VALUE(dwIsReadOnly);
             break;
 
+        case SFILE_INFO_CACHE_HITS:
+            VERIFY_MPQ_HANDLE(ha);
+            FileStream_GetCacheStats(ha->pStream, &CacheHits, &CacheMisses, &dwCachedSize);
+            RESULT_IS_64BIT_VALUE(CacheHits);
+            break;
+
+        case SFILE_INFO_CACHE_MISSES:
+            VERIFY_MPQ_HANDLE(ha);
+            FileStream_GetCacheStats(ha->pStream, &CacheHits, &CacheMisses, &dwCachedSize);
+            RESULT_IS_64BIT_VALUE(CacheMisses);
+            break;
+
+        case SFILE_INFO_CACHE_SIZE:
+            VERIFY_MPQ_HANDLE(ha);
+            FileStream_GetCacheStats(ha->pStream, &CacheHits, &CacheMisses, &dwCachedSize);
+            RESULT_IS_32BIT_VALUE(dwCachedSize);
+            break;
+
+        case SFILE_INFO_SECTOR_CACHE_HITS:
+            VERIFY_MPQ_HANDLE(ha);
+            SectorCache_GetStats(ha, &CacheHits, &CacheMisses, &dwCachedSize);
+            RESULT_IS_64BIT_VALUE(CacheHits);
+            break;
+
+        case SFILE_INFO_SECTOR_CACHE_MISSES:
+            VERIFY_MPQ_HANDLE(ha);
+            SectorCache_GetStats(ha, &CacheHits, &CacheMisses, &dwCachedSize);
+            RESULT_IS_64BIT_VALUE(CacheMisses);
+            break;
+
+        case SFILE_INFO_SECTOR_CACHE_SIZE:
+            VERIFY_MPQ_HANDLE(ha);
+            SectorCache_GetStats(ha, &CacheHits, &CacheMisses, &dwCachedSize);
+            RESULT_IS_32BIT_VALUE(dwCachedSize);
+            break;
+
         case SFILE_INFO_HASH_INDEX:
             VERIFY_FILE_HANDLE(hf);
             RESULT_IS_32BIT_VALUE(hf->pFileEntry->dwHashIndex);
@@ -65,6 +65,7 @@
 // StormLib internal global variables
 
 extern DWORD dwGlobalFlags;                 // Global StormLib flags
+extern DWORD dwMaxReadAhead;                // Maximum size of the read-ahead buffer
 extern LCID lcFileLocale;                   // Preferred file locale
 
 //-----------------------------------------------------------------------------
@@ -96,6 +97,8 @@ DWORD DetectFileKeyBySectorSize(LPDWORD SectorOffsets, DWORD decrypted);
 DWORD DetectFileKeyByContent(void * pvFileContent, DWORD dwFileSize);
 DWORD DecryptFileKey(const char * szFileName, ULONGLONG MpqPos, DWORD dwFileSize, DWORD dwFlags);
 
+void  DecryptFileChunk(DWORD * MpqData, LPBYTE pbKey, ULONGLONG ByteOffset, DWORD dwLength);
+
 //-----------------------------------------------------------------------------
 // Handle validation functions
 
@@ -141,13 +144,25 @@ void FreeFileEntry(TMPQArchive * ha, TFileEntry * pFileEntry);
 //-----------------------------------------------------------------------------
 // Common functions - MPQ File
 
+// Raw data of files read ahead by one read (see SFileReadFilesBatch)
+struct TPrefetchedData
+{
+    LPBYTE    pbData;                       // Raw data read from the archive
+    ULONGLONG ByteOffset;                   // Position of the data in the archive
+    DWORD     cbData;                       // Size of the data
+};
+
+TMPQFilePool * FilePool_Create(DWORD dwSectorSize);
+void FilePool_Free(TMPQFilePool * pFilePool);
+
 TMPQFile * CreateMpqFile(TMPQArchive * ha);
 int  LoadMpqTable(TMPQArchive * ha, ULONGLONG ByteOffset, void * pvTable, DWORD dwCompressedSize, DWORD dwRealSize, DWORD dwKey);
 int  AllocateSectorBuffer(TMPQFile * hf);
 int  AllocatePatchInfo(TMPQFile * hf, bool bLoadFromFile);
-int  AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile);
+int  AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile, const TPrefetchedData * pPrefetched);
 int  AllocateSectorChecksums(TMPQFile * hf, bool bLoadFromFile);
 void CalculateRawSectorOffset(ULONGLONG & RawFilePos, TMPQFile * hf, DWORD dwSectorOffset);
+bool ReadMpqFileRaw(TMPQFile * hf, ULONGLONG RawFilePos, void * pvBuffer, DWORD dwBytesToRead, const TPrefetchedData * pPrefetched);
 int  WritePatchInfo(TMPQFile * hf);
 int  WriteSectorOffsets(TMPQFile * hf);
 int  WriteSectorChecksums(TMPQFile * hf);
@@ -202,6 +217,72 @@ int  SAttrFileSaveToMpq(TMPQArchive * ha);
 
 int  SListFileSaveToMpq(TMPQArchive * ha);
 
+//-----------------------------------------------------------------------------
+// Thread synchronization and worker threads
+
+#ifdef PLATFORM_WINDOWS
+typedef CRITICAL_SECTION TSyncLock;
+#else
+typedef pthread_mutex_t TSyncLock;
+#endif
+
+void SyncLock_Init(TSyncLock * pLock);
+void SyncLock_Free(TSyncLock * pLock);
+void SyncLock_Enter(TSyncLock * pLock);
+void SyncLock_Leave(TSyncLock * pLock);
+
+// Work items with the same serialization key never run at the same time
+// and are executed in the order they have been queued. NULL = no restriction
+typedef void (*WORK_ROUTINE)(void * pvParam);
+
+DWORD GetWorkerThreadCount();
+int   QueueWorkItem(WORK_ROUTINE pfnWork, void * pvParam, void * pvSerializeKey);
+
+// Setting and waiting for the result of a work item
+void  SetWorkItemResult(volatile DWORD_PTR * pResult, DWORD_PTR Result);
+bool  WaitForWorkItemResult(volatile DWORD_PTR * pResult, DWORD_PTR PendingValue, bool bWait);
+
+// Counting the work items that use an object. The object may only be freed
+// after WaitForWorkItemRefs returns
+void  AddWorkItemRef(volatile DWORD_PTR * pRefCount);
+void  ReleaseWorkItemRef(volatile DWORD_PTR * pRefCount);
+void  WaitForWorkItemRefs(volatile DWORD_PTR * pRefCount);
+
+// Runs the routine for items 0 .. dwItemCount-1 on the worker threads and the calling thread.
+// Returns when all items are done
+typedef int (*PARALLEL_ROUTINE)(void * pvParam, DWORD dwItemIndex);
+
+int   RunParallel(PARALLEL_ROUTINE pfnWork, void * pvParam, DWORD dwItemCount);
+
+// Temporary buffers for the hot paths. Freed buffers are kept by the thread
+// and reused, so these don't call malloc most of the time
+void * AllocateScratchBuffer(DWORD cbBuffer);
+void  FreeScratchBuffer(void * pvBuffer);
+
+// Data kept per thread by the compression code. The free function
+// is called when the thread ends
+typedef void (*FREE_THREAD_DATA)(void * pvData);
+
+void * GetThreadCodecData();
+bool  SetThreadCodecData(void * pvData, FREE_THREAD_DATA pfnFree);
+
+//-----------------------------------------------------------------------------
+// Cache of decompressed file sectors
+
+#define SECTOR_TABLE_CACHE_SIZE 0x00100000  // Size of the cache of sector offset tables (1 MB)
+
+TSectorCache * SectorCache_Create(DWORD dwMaxSize, DWORD dwItemSize);
+bool SectorCache_CanHold(TMPQArchive * ha, DWORD cbData);
+bool SectorCache_Read(TMPQFile * hf, DWORD dwSectorIndex, LPBYTE pbBuffer, DWORD cbData);
+void SectorCache_Insert(TMPQFile * hf, DWORD dwSectorIndex, LPBYTE pbData, DWORD cbData);
+void SectorCache_InvalidateFile(TMPQArchive * ha, TFileEntry * pFileEntry);
+bool SectorCache_LoadOffsets(TMPQFile * hf);
+void SectorCache_StoreOffsets(TMPQFile * hf, DWORD cbSectorOffsets);
+bool SectorCache_LoadChecksums(TMPQFile * hf);
+void SectorCache_StoreChecksums(TMPQFile * hf);
+void SectorCache_GetStats(TMPQArchive * ha, ULONGLONG * pCacheHits, ULONGLONG * pCacheMisses, LPDWORD pdwCachedSize);
+void SectorCache_Free(TSectorCache * pCache);
+
 //-----------------------------------------------------------------------------
 // Dump data support
 
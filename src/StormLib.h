@@ -134,6 +134,9 @@
 #define STREAM_FLAG_READ_ONLY          0x01 // The stream is read only
 #define STREAM_FLAG_PART_FILE          0x02 // The stream is a PART file.
 #define STREAM_FLAG_ENCRYPTED_FILE     0x04 // The stream is an encrypted MPQ (MPQE).
+#define STREAM_FLAG_MAPPED_FILE        0x08 // The stream is a memory-mapped view of the file (read only)
+#define STREAM_FLAG_THREAD_SAFE        0x10 // Reads with explicit byte offset don't move the stream position
+#define STREAM_FLAG_USER_DATA          0x20 // The stream is not a file; the data are provided by the caller (memory or callbacks)
 
 // Values for SFileOpenArchive
 #define SFILE_OPEN_HARD_DISK_FILE         2 // Open the archive on HDD
@@ -154,6 +157,7 @@
 #define MPQ_FLAG_NEED_FIX_SIZE   0x00000010 // Used during opening the archive
 #define MPQ_FLAG_LISTFILE_VALID  0x00000020 // Used when (listfile) has already been saved
 #define MPQ_FLAG_ATTRIBS_VALID   0x00000040 // Used when (attributes) has already been saved
+#define MPQ_FLAG_THREAD_SAFE     0x00000080 // The archive has been open with MPQ_OPEN_THREAD_SAFE
 
 // Return value for SFilGetFileSize and SFileSetFilePointer
 #define SFILE_INVALID_SIZE       0xFFFFFFFF
@@ -201,12 +205,32 @@
 // LZMA compression. Added in Starcraft 2. This value is NOT a combination of flags.
 #define MPQ_COMPRESSION_LZMA           0x12
 
+// Each sector is compressed by the best of the compressions set by SCompSetAutoCompression.
+// The winner is stored in the sector like any other compression. This value is NOT a combination of flags.
+#define MPQ_COMPRESSION_AUTO          0x100
+
 
 // Constants for SFileAddWave
 #define MPQ_WAVE_QUALITY_HIGH        0      // Best quality, the worst compression
 #define MPQ_WAVE_QUALITY_MEDIUM      1      // Medium quality, medium compression
 #define MPQ_WAVE_QUALITY_LOW         2      // Low quality, the best compression
 
+// Constants for SCompSetImplodeLevel
+#define MPQ_IMPLODE_LEVEL_DEFAULT    0      // Same output as previous versions
+#define MPQ_IMPLODE_LEVEL_FASTEST    1      // Hash chains, the fastest compression
+#define MPQ_IMPLODE_LEVEL_BEST       9      // Hash chains, the best compression
+
+// Constants for SCompSetLzmaOptions
+#define MPQ_LZMA_LEVEL_FASTEST       0      // The fastest LZMA compression
+#define MPQ_LZMA_LEVEL_DEFAULT       5      // Default LZMA level
+#define MPQ_LZMA_LEVEL_BEST          9      // The best LZMA compression
+#define MPQ_LZMA_DICT_SIZE_AUTO      0      // Dictionary size given by the level
+#define MPQ_LZMA_THREADS_DEFAULT     1      // One match finder thread. Two threads must be asked for
+
+// Constants for SCompSetAutoCompression
+#define MPQ_AUTO_MAX_CANDIDATES      8      // Max number of compressions tried by MPQ_COMPRESSION_AUTO
+#define MPQ_AUTO_SAMPLE_ALL          0      // Try the compressions on whole sectors
+
 // Constants for SFileGetFileInfo
 #define SFILE_INFO_ARCHIVE_NAME      1      // MPQ size (value from header)
 #define SFILE_INFO_ARCHIVE_SIZE      2      // MPQ size (value from header)
@@ -219,6 +243,12 @@
 #define SFILE_INFO_NUM_FILES         9      // Real number of files within archive
 #define SFILE_INFO_STREAM_FLAGS     10      // Stream flags for the MPQ. See STREAM_FLAG_XXX
 #define SFILE_INFO_IS_READ_ONLY     11      // TRUE of the MPQ was open as read only
+#define SFILE_INFO_CACHE_HITS       12      // Number of blocks read from the block cache (ULONGLONG)
+#define SFILE_INFO_CACHE_MISSES     13      // Number of blocks read from the file (ULONGLONG)
+#define SFILE_INFO_CACHE_SIZE       14      // Current size of the block cache, in bytes
+#define SFILE_INFO_SECTOR_CACHE_HITS   15   // Number of file sectors read from the sector cache (ULONGLONG)
+#define SFILE_INFO_SECTOR_CACHE_MISSES 16   // Number of file sectors that had to be decompressed (ULONGLONG)
+#define SFILE_INFO_SECTOR_CACHE_SIZE   17   // Current size of the sector cache, in bytes
 //------
 #define SFILE_INFO_HASH_INDEX      100      // Hash index of file in MPQ
 #define SFILE_INFO_CODENAME1       101      // The first codename of the file
@@ -260,6 +290,12 @@
 #define MPQ_OPEN_CHECK_SECTOR_CRC    0x0080 // On files with MPQ_FILE_SECTOR_CRC, the CRC will be checked when reading file
 #define MPQ_OPEN_READ_ONLY           0x0100 // Open the archive for read-only access
 #define MPQ_OPEN_ENCRYPTED           0x0200 // Opens an encrypted MPQ archive (Example: Starcraft II installation)
+#define MPQ_OPEN_THREAD_SAFE         0x0400 // Open the archive for concurrent reading from multiple threads. Implies MPQ_OPEN_READ_ONLY.
+
+// Values for SFILE_ARCHIVE_SOURCE::dwSourceType
+#define SFILE_SOURCE_FILE                 0 // The archive is a file on disk (szFileName)
+#define SFILE_SOURCE_MEMORY               1 // The archive is a memory buffer (pvData, cbData)
+#define SFILE_SOURCE_CALLBACKS            2 // The archive data are provided by the caller's callbacks (pCallbacks, pvUserData)
 
 // Flags for SFileCreateArchive
 #define MPQ_CREATE_ATTRIBUTES    0x00000001 // Also add the (attributes) file
@@ -330,6 +366,23 @@
 typedef void (WINAPI * SFILE_ADDFILE_CALLBACK)(void * pvUserData, DWORD dwBytesWritten, DWORD dwTotalBytes, bool bFinalCall);
 typedef void (WINAPI * SFILE_COMPACT_CALLBACK)(void * pvUserData, DWORD dwWorkType, ULONGLONG BytesProcessed, ULONGLONG TotalBytes);
 
+// Receives one file loaded by SFileReadFilesBatch. dwIndex is the index of the file name
+// in the array given to SFileReadFilesBatch. The data are only valid during the call
+typedef void (WINAPI * SFILE_BATCH_CALLBACK)(void * pvUserData, DWORD dwIndex, const char * szFileName, const void * pvData, DWORD cbData, DWORD dwErrCode);
+
+// Provides data of a missing part of a PART file. ByteOffset is relative to the begin of the complete file.
+// Returns false if the data are not available (yet)
+typedef bool (WINAPI * SFILE_PART_CALLBACK)(void * pvUserData, ULONGLONG ByteOffset, void * pvBuffer, DWORD dwBytesToRead);
+
+// Callbacks of an archive stream provided by the caller (see SFileOpenArchiveEx).
+// The read callback returns false only if the read failed. If there is not enough data,
+// it returns true and stores the number of bytes read to pdwBytesRead.
+typedef bool (WINAPI * SFILE_STREAM_READ)(void * pvUserData, ULONGLONG ByteOffset, void * pvBuffer, DWORD dwBytesToRead, LPDWORD pdwBytesRead);
+typedef bool (WINAPI * SFILE_STREAM_WRITE)(void * pvUserData, ULONGLONG ByteOffset, const void * pvBuffer, DWORD dwBytesToWrite);
+typedef bool (WINAPI * SFILE_STREAM_GETSIZE)(void * pvUserData, ULONGLONG * pFileSize);
+typedef bool (WINAPI * SFILE_STREAM_SETSIZE)(void * pvUserData, ULONGLONG NewFileSize);
+typedef void (WINAPI * SFILE_STREAM_CLOSE)(void * pvUserData);
+
 //-----------------------------------------------------------------------------
 // Stream support - structures
 
@@ -364,6 +417,10 @@ typedef bool (*STREAM_SETSIZE)(
     ULONGLONG FileSize                  // New size for the file, in bytes
     );
 
+typedef void (*STREAM_CLOSE)(
+    struct TFileStream * pStream        // Pointer to an open stream
+    );
+
 // Common stream structure. Can be variable length
 struct TFileStream
 {
@@ -377,10 +434,47 @@ struct TFileStream
     STREAM_WRITE   StreamWrite;         // Pointer to stream write function for this archive. Do not use directly.
     STREAM_GETSIZE StreamGetSize;       // Pointer to function returning file size
     STREAM_SETSIZE StreamSetSize;       // Pointer to function changing file size
+    STREAM_CLOSE   StreamClose;         // Pointer to function releasing stream-specific data. Can be NULL.
+
+    LPBYTE         pbReadAhead;         // Read-ahead buffer. NULL if not allocated yet
+    ULONGLONG      ReadAheadPos;        // File offset of the data in the read-ahead buffer
+    ULONGLONG      SequentialPos;       // End of the previous read. The next read from here is sequential
+    DWORD          cbReadAhead;         // Number of valid bytes in the read-ahead buffer
+    DWORD          cbReadAheadBuffer;   // Allocated size of the read-ahead buffer
+    DWORD          dwReadAheadWindow;   // Current read-ahead window. Zero if the stream is not read sequentially
+    struct TBlockCache * pCache;        // Cache of raw file blocks. NULL if the stream has no cache
+
+    LPBYTE         pbWriteBuffer;       // Write-combining buffer. NULL if not allocated yet
+    ULONGLONG      WriteBufferPos;      // File offset of the data in the write buffer
+    DWORD          cbWriteBuffer;       // Number of bytes waiting in the write buffer
+    DWORD          cbWriteBufferSize;   // Size of the write buffer. Zero if the writes are not combined
 
     // Extra members may follow
 };
 
+//-----------------------------------------------------------------------------
+// Structures for opening archives that are not files on disk
+
+typedef struct _SFILE_STREAM_CALLBACKS
+{
+    SFILE_STREAM_READ    StreamRead;        // Reads data from the archive. Required.
+    SFILE_STREAM_WRITE   StreamWrite;       // Writes data to the archive. If NULL, the archive is read only.
+    SFILE_STREAM_GETSIZE StreamGetSize;     // Returns size of the archive. Required.
+    SFILE_STREAM_SETSIZE StreamSetSize;     // Changes size of the archive. Can be NULL.
+    SFILE_STREAM_CLOSE   StreamClose;       // Called when the archive is closed. Can be NULL.
+} SFILE_STREAM_CALLBACKS, *PSFILE_STREAM_CALLBACKS;
+
+typedef struct _SFILE_ARCHIVE_SOURCE
+{
+    DWORD dwSourceType;                     // See SFILE_SOURCE_XXX
+    const char * szFileName;                // SFILE_SOURCE_FILE: Name of the archive file. Otherwise the archive name
+                                            // used for signature verification and patch prefix detection. Can be NULL.
+    const void * pvData;                    // SFILE_SOURCE_MEMORY: The archive data. Must stay valid until the archive is closed.
+    ULONGLONG cbData;                       // SFILE_SOURCE_MEMORY: Size of the archive data, in bytes
+    const SFILE_STREAM_CALLBACKS * pCallbacks; // SFILE_SOURCE_CALLBACKS: Stream callbacks
+    void * pvUserData;                      // SFILE_SOURCE_CALLBACKS: User data passed to the callbacks
+} SFILE_ARCHIVE_SOURCE, *PSFILE_ARCHIVE_SOURCE;
+
 //-----------------------------------------------------------------------------
 // Structure for bit arrays used for HET and BET tables
 
@@ -702,6 +796,18 @@ struct TMPQArchive
     DWORD          dwFileFlags2;        // Flags for (attributes)
     DWORD          dwAttrFlags;         // Flags for the (attributes) file, see MPQ_ATTRIBUTE_XXX
     DWORD          dwFlags;             // See MPQ_FLAG_XXXXX
+
+    struct TSectorCache * pSectorCache; // Cache of decompressed file sectors. NULL if not enabled
+    struct TSectorCache * pTableCache;  // Cache of decoded sector offset tables and sector checksums
+    struct TMPQFilePool * pFilePool;    // Closed file handles, kept for reuse. NULL if not used
+    volatile DWORD_PTR AsyncReads;      // Number of asynchronous reads in progress. Closing waits for them
+};
+
+// State of a file that is being written to the archive
+struct TMPQWriteState
+{
+    unsigned char  hctx[HASH_STATE_SIZE];// Hash state for MD5
+    DWORD          dwCrc32;             // CRC32 value of the data written so far
 };
 
 // File handle structure
@@ -729,11 +835,16 @@ struct TMPQFile
     DWORD          dwDataSize;          // Size of data in the file (on patch files, this differs from file size in block table entry)
 
     LPBYTE         pbFileSector;        // Last loaded file sector. For single unit files, entire file content
+    LPBYTE         pbFileView;          // File data given by SFileMapFileView, if they couldn't be mapped directly
     DWORD          dwSectorOffs;        // File position of currently loaded file sector
     DWORD          dwSectorSize;        // Size of the file sector. For single unit files, this is equal to the file size
 
-    unsigned char  hctx[HASH_STATE_SIZE];// Hash state for MD5. Used when saving file to MPQ
-    DWORD          dwCrc32;             // CRC32 value, used when saving file to MPQ
+    TMPQWriteState * pWriteState;       // MD5 and CRC32 state. Only used when saving file to MPQ
+
+    struct TMPQFilePool * pFilePool;    // Pool the handle returns to when closed. Stays valid after the archive is closed
+    TMPQFile     * pNextFree;           // Next handle in the list of free handles of the archive
+    LPBYTE         pbSpareSector;       // Sector buffer kept from the previous use of a pooled handle
+    volatile DWORD_PTR AsyncReads;      // Number of asynchronous reads in progress. Closing waits for them
 
     bool           bLoadedSectorCRCs;   // If true, we already tried to load sector CRCs
     bool           bCheckSectorCRCs;    // If true, then SFileReadFile will check sector CRCs when reading the file
@@ -796,9 +907,16 @@ __inline void DebugFree(void * ptr)
 TFileStream * FileStream_CreateFile(const char * szFileName);
 TFileStream * FileStream_OpenFile(const char * szFileName, bool bWriteAccess);
 TFileStream * FileStream_OpenEncrypted(const char * szFileName);
+TFileStream * FileStream_OpenMemory(const char * szFileName, const void * pvData, ULONGLONG cbData);
+TFileStream * FileStream_OpenCallbacks(const char * szFileName, const SFILE_STREAM_CALLBACKS * pCallbacks, void * pvUserData);
 bool FileStream_GetPos(TFileStream * pStream, ULONGLONG & ByteOffset);
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead);
+const void * FileStream_GetView(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesToMap);
+bool FileStream_SetCacheSize(TFileStream * pStream, DWORD dwMaxSize);
+bool FileStream_SetPartFileCallback(TFileStream * pStream, SFILE_PART_CALLBACK PartFileCB, void * pvUserData);
+void FileStream_GetCacheStats(TFileStream * pStream, ULONGLONG * pCacheHits, ULONGLONG * pCacheMisses, LPDWORD pdwCachedSize);
 bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite);
+bool FileStream_Flush(TFileStream * pStream);
 bool FileStream_GetLastWriteTime(TFileStream * pStream, ULONGLONG * pFT);
 bool FileStream_GetSize(TFileStream * pStream, ULONGLONG & FileSize);
 bool FileStream_SetSize(TFileStream * pStream, ULONGLONG NewFileSize);
@@ -827,6 +945,13 @@ typedef bool  (WINAPI * SFILEREADFILE)(HANDLE, void *, DWORD, LPDWORD, LPOVERLAP
 DWORD  WINAPI SFileGetGlobalFlags();
 DWORD  WINAPI SFileSetGlobalFlags(DWORD dwNewFlags);
 
+// Maximum size of the read-ahead buffer for sequentially read archives.
+// Zero turns the read-ahead off.
+#define SFILE_READ_AHEAD_DEFAULT        0x00400000  // Default maximum read-ahead size (4 MB)
+
+DWORD  WINAPI SFileGetReadAheadSize();
+DWORD  WINAPI SFileSetReadAheadSize(DWORD dwMaxReadAhead);
+
 LCID   WINAPI SFileGetLocale();
 LCID   WINAPI SFileSetLocale(LCID lcNewLocale);
 
@@ -834,6 +959,7 @@ LCID   WINAPI SFileSetLocale(LCID lcNewLocale);
 // Functions for archive manipulation
 
 extern "C" bool   WINAPI SFileOpenArchive(const char * szMpqName, DWORD dwPriority, DWORD dwFlags, HANDLE * phMpq);
+extern "C" bool   WINAPI SFileOpenArchiveEx(const SFILE_ARCHIVE_SOURCE * pSource, DWORD dwPriority, DWORD dwFlags, HANDLE * phMpq);
 extern "C" bool   WINAPI SFileCreateArchive(const char * szMpqName, DWORD dwFlags, DWORD dwMaxFileCount, HANDLE * phMpq);
 
 extern "C" bool   WINAPI SFileFlushArchive(HANDLE hMpq);
@@ -848,6 +974,17 @@ extern "C" int    WINAPI SFileAddListFile(HANDLE hMpq, const char * szListFile);
 extern "C" bool   WINAPI SFileSetCompactCallback(HANDLE hMpq, SFILE_COMPACT_CALLBACK CompactCB, void * pvData);
 extern "C" bool   WINAPI SFileCompactArchive(HANDLE hMpq, const char * szListFile = NULL, bool bReserved = 0);
 
+// Filling missing parts of PART files (e.g. while the archive is being downloaded).
+// If hMpq is NULL, sets the source for archives open later
+extern "C" bool   WINAPI SFileSetPartFileCallback(HANDLE hMpq, SFILE_PART_CALLBACK PartFileCB, void * pvData);
+
+// Changing the size of the block cache. Zero (default) turns the cache off
+#define SFILE_CACHE_SIZE_DEFAULT     0x00400000  // Suggested block cache size (4 MB)
+extern "C" bool   WINAPI SFileSetCacheSize(HANDLE hMpq, DWORD dwMaxSize);
+
+// Changing the size of the cache of decompressed file sectors. Zero (default) turns the cache off
+extern "C" bool   WINAPI SFileSetSectorCacheSize(HANDLE hMpq, DWORD dwMaxSize);
+
 // Changing the maximum file count
 extern "C" DWORD  WINAPI SFileGetMaxFileCount(HANDLE hMpq);
 extern "C" bool   WINAPI SFileSetMaxFileCount(HANDLE hMpq, DWORD dwMaxFileCount);
@@ -871,8 +1008,21 @@ extern "C" bool   WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, D
 extern "C" DWORD  WINAPI SFileGetFileSize(HANDLE hFile, LPDWORD pdwFileSizeHigh = NULL);
 extern "C" DWORD  WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHigh, DWORD dwMoveMethod);
 extern "C" bool   WINAPI SFileReadFile(HANDLE hFile, void * lpBuffer, DWORD dwToRead, LPDWORD pdwRead = NULL, LPOVERLAPPED lpOverlapped = NULL);
+extern "C" bool   WINAPI SFileGetOverlappedResult(HANDLE hFile, LPOVERLAPPED lpOverlapped, LPDWORD pdwBytesRead, bool bWait);
 extern "C" bool   WINAPI SFileCloseFile(HANDLE hFile);
 
+// Access to the entire file data. For stored files in a memory-mapped archive,
+// the view points directly to the archive and no data are copied
+extern "C" bool   WINAPI SFileMapFileView(HANDLE hFile, const void ** ppvView, LPDWORD pcbView);
+extern "C" bool   WINAPI SFileUnmapFileView(HANDLE hFile, const void * pvView);
+
+// Loading the entire file into a buffer allocated by StormLib. The buffer is freed by SFileFreeFileData
+extern "C" bool   WINAPI SFileLoadFile(HANDLE hMpq, const char * szFileName, void ** ppvData, LPDWORD pcbData, DWORD dwSearchScope = SFILE_OPEN_FROM_MPQ);
+extern "C" bool   WINAPI SFileFreeFileData(void * pvData);
+
+// Loading many files at once. The files are read in the order of their position in the archive
+extern "C" bool   WINAPI SFileReadFilesBatch(HANDLE hMpq, const char ** szFileNames, DWORD dwFileCount, SFILE_BATCH_CALLBACK BatchCB, void * pvUserData);
+
 // Retrieving info about the file
 extern "C" bool   WINAPI SFileHasFile(HANDLE hMpq, const char * szFileName);
 extern "C" bool   WINAPI SFileGetFileName(HANDLE hFile, char * szFileName);
@@ -927,6 +1077,9 @@ extern "C" bool   WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALL
 //-----------------------------------------------------------------------------
 // Compression and decompression
 
+extern "C" bool   WINAPI SCompSetImplodeLevel(int nLevel);
+extern "C" bool   WINAPI SCompSetLzmaOptions(int nLevel, DWORD dwDictSize, DWORD dwThreads);
+extern "C" bool   WINAPI SCompSetAutoCompression(const DWORD * pCandidates, DWORD dwCandidates, DWORD dwSampleSize);
 extern "C" int    WINAPI SCompImplode    (char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer);
 extern "C" int    WINAPI SCompExplode    (char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer);
 extern "C" int    WINAPI SCompCompress   (char * pbOutBuffer, int * pcbOutBuffer, char * pbInBuffer, int cbInBuffer, unsigned uCompressionMask, int nCmpType, int nCmpLevel);
@@ -61,6 +61,7 @@
 
     // Macintosh using Carbon
     #include <Carbon/Carbon.h> // Mac OS X
+    #include <pthread.h>
 
     #define PKEXPORT
     #define __SYS_ZLIB
@@ -79,6 +80,7 @@
 #if !defined(PLATFORM_DEFINED)
     #include <sys/types.h>
     #include <sys/stat.h>
+    #include <sys/mman.h>
     #include <fcntl.h>
     #include <unistd.h>
     #include <stdint.h>
@@ -89,6 +91,7 @@
     #include <ctype.h>
     #include <assert.h>
     #include <errno.h>
+    #include <pthread.h>
 
     #define PLATFORM_LITTLE_ENDIAN
     #define PLATFORM_LINUX
@@ -114,7 +117,6 @@
     typedef long long          LONGLONG;
     typedef unsigned long long ULONGLONG;
     typedef void               * HANDLE;
-    typedef void               * LPOVERLAPPED; // Unsupported on Linux and Mac
     typedef char               TCHAR;
     typedef unsigned int       LCID;
     typedef LONG               * PLONG;
@@ -139,6 +141,18 @@
     #define _stricmp strcasecmp
     #define _strnicmp strncasecmp
 
+    // Structure for asynchronous reading (see SFileReadFile).
+    // Has the same members as the Windows structure
+    typedef struct _OVERLAPPED
+    {
+        DWORD_PTR Internal;                 // Result of the operation. ERROR_IO_PENDING while in progress
+        DWORD_PTR InternalHigh;             // Number of bytes read
+        DWORD     Offset;                   // Low 32 bits of the file position to read from
+        DWORD     OffsetHigh;               // High 32 bits of the file position to read from
+        HANDLE    hEvent;                   // Not used on Linux and Mac
+
+    } OVERLAPPED, *LPOVERLAPPED;
+
     void    SetLastError(int err);
     int     GetLastError();
 #endif // !WIN32
@@ -160,6 +174,7 @@
     #define ERROR_CAN_NOT_COMPLETE      202 // A generic error, when any operation fails from an unknown reason
     #define ERROR_FILE_CORRUPT          203 // At any point when there is bad data format in the file
     #define ERROR_INSUFFICIENT_BUFFER   errFSBadBuffer
+    #define ERROR_IO_PENDING            204 // Asynchronous read is still in progress
 #endif
 
 #ifdef PLATFORM_LINUX
@@ -178,6 +193,7 @@
     #define ERROR_CAN_NOT_COMPLETE      108 // No such error code under Linux
     #define ERROR_FILE_CORRUPT          109 // No such error code under Linux
     #define ERROR_INSUFFICIENT_BUFFER   ENOBUFS
+    #define ERROR_IO_PENDING            EINPROGRESS
 #endif
 
 #ifdef PLATFORM_LITTLE_ENDIAN
@@ -56,6 +56,195 @@ static long step_table[] =
     0x00007FFF
 };
 
+// Sums of (step_table[i] >> n) for each combination of bits n = 0-2 (StepSumsLo)
+// and n = 3-5 (StepSumsHi). The decompression gets the sum for the bits 0-5
+// of a sample by two lookups, instead of testing each bit
+static const unsigned short StepSumsLo[89][8] =
+{
+    {0x0000, 0x0007, 0x0003, 0x000A, 0x0001, 0x0008, 0x0004, 0x000B},
+    {0x0000, 0x0008, 0x0004, 0x000C, 0x0002, 0x000A, 0x0006, 0x000E},
+    {0x0000, 0x0009, 0x0004, 0x000D, 0x0002, 0x000B, 0x0006, 0x000F},
+    {0x0000, 0x000A, 0x0005, 0x000F, 0x0002, 0x000C, 0x0007, 0x0011},
+    {0x0000, 0x000B, 0x0005, 0x0010, 0x0002, 0x000D, 0x0007, 0x0012},
+    {0x0000, 0x000C, 0x0006, 0x0012, 0x0003, 0x000F, 0x0009, 0x0015},
+    {0x0000, 0x000D, 0x0006, 0x0013, 0x0003, 0x0010, 0x0009, 0x0016},
+    {0x0000, 0x000E, 0x0007, 0x0015, 0x0003, 0x0011, 0x000A, 0x0018},
+    {0x0000, 0x0010, 0x0008, 0x0018, 0x0004, 0x0014, 0x000C, 0x001C},
+    {0x0000, 0x0011, 0x0008, 0x0019, 0x0004, 0x0015, 0x000C, 0x001D},
+    {0x0000, 0x0013, 0x0009, 0x001C, 0x0004, 0x0017, 0x000D, 0x0020},
+    {0x0000, 0x0015, 0x000A, 0x001F, 0x0005, 0x001A, 0x000F, 0x0024},
+    {0x0000, 0x0017, 0x000B, 0x0022, 0x0005, 0x001C, 0x0010, 0x0027},
+    {0x0000, 0x0019, 0x000C, 0x0025, 0x0006, 0x001F, 0x0012, 0x002B},
+    {0x0000, 0x001C, 0x000E, 0x002A, 0x0007, 0x0023, 0x0015, 0x0031},
+    {0x0000, 0x001F, 0x000F, 0x002E, 0x0007, 0x0026, 0x0016, 0x0035},
+    {0x0000, 0x0022, 0x0011, 0x0033, 0x0008, 0x002A, 0x0019, 0x003B},
+    {0x0000, 0x0025, 0x0012, 0x0037, 0x0009, 0x002E, 0x001B, 0x0040},
+    {0x0000, 0x0029, 0x0014, 0x003D, 0x000A, 0x0033, 0x001E, 0x0047},
+    {0x0000, 0x002D, 0x0016, 0x0043, 0x000B, 0x0038, 0x0021, 0x004E},
+    {0x0000, 0x0032, 0x0019, 0x004B, 0x000C, 0x003E, 0x0025, 0x0057},
+    {0x0000, 0x0037, 0x001B, 0x0052, 0x000D, 0x0044, 0x0028, 0x005F},
+    {0x0000, 0x003C, 0x001E, 0x005A, 0x000F, 0x004B, 0x002D, 0x0069},
+    {0x0000, 0x0042, 0x0021, 0x0063, 0x0010, 0x0052, 0x0031, 0x0073},
+    {0x0000, 0x0049, 0x0024, 0x006D, 0x0012, 0x005B, 0x0036, 0x007F},
+    {0x0000, 0x0050, 0x0028, 0x0078, 0x0014, 0x0064, 0x003C, 0x008C},
+    {0x0000, 0x0058, 0x002C, 0x0084, 0x0016, 0x006E, 0x0042, 0x009A},
+    {0x0000, 0x0061, 0x0030, 0x0091, 0x0018, 0x0079, 0x0048, 0x00A9},
+    {0x0000, 0x006B, 0x0035, 0x00A0, 0x001A, 0x0085, 0x004F, 0x00BA},
+    {0x0000, 0x0076, 0x003B, 0x00B1, 0x001D, 0x0093, 0x0058, 0x00CE},
+    {0x0000, 0x0082, 0x0041, 0x00C3, 0x0020, 0x00A2, 0x0061, 0x00E3},
+    {0x0000, 0x008F, 0x0047, 0x00D6, 0x0023, 0x00B2, 0x006A, 0x00F9},
+    {0x0000, 0x009D, 0x004E, 0x00EB, 0x0027, 0x00C4, 0x0075, 0x0112},
+    {0x0000, 0x00AD, 0x0056, 0x0103, 0x002B, 0x00D8, 0x0081, 0x012E},
+    {0x0000, 0x00BE, 0x005F, 0x011D, 0x002F, 0x00ED, 0x008E, 0x014C},
+    {0x0000, 0x00D1, 0x0068, 0x0139, 0x0034, 0x0105, 0x009C, 0x016D},
+    {0x0000, 0x00E6, 0x0073, 0x0159, 0x0039, 0x011F, 0x00AC, 0x0192},
+    {0x0000, 0x00FD, 0x007E, 0x017B, 0x003F, 0x013C, 0x00BD, 0x01BA},
+    {0x0000, 0x0117, 0x008B, 0x01A2, 0x0045, 0x015C, 0x00D0, 0x01E7},
+    {0x0000, 0x0133, 0x0099, 0x01CC, 0x004C, 0x017F, 0x00E5, 0x0218},
+    {0x0000, 0x0151, 0x00A8, 0x01F9, 0x0054, 0x01A5, 0x00FC, 0x024D},
+    {0x0000, 0x0173, 0x00B9, 0x022C, 0x005C, 0x01CF, 0x0115, 0x0288},
+    {0x0000, 0x0198, 0x00CC, 0x0264, 0x0066, 0x01FE, 0x0132, 0x02CA},
+    {0x0000, 0x01C1, 0x00E0, 0x02A1, 0x0070, 0x0231, 0x0150, 0x0311},
+    {0x0000, 0x01EE, 0x00F7, 0x02E5, 0x007B, 0x0269, 0x0172, 0x0360},
+    {0x0000, 0x0220, 0x0110, 0x0330, 0x0088, 0x02A8, 0x0198, 0x03B8},
+    {0x0000, 0x0256, 0x012B, 0x0381, 0x0095, 0x02EB, 0x01C0, 0x0416},
+    {0x0000, 0x0292, 0x0149, 0x03DB, 0x00A4, 0x0336, 0x01ED, 0x047F},
+    {0x0000, 0x02D4, 0x016A, 0x043E, 0x00B5, 0x0389, 0x021F, 0x04F3},
+    {0x0000, 0x031C, 0x018E, 0x04AA, 0x00C7, 0x03E3, 0x0255, 0x0571},
+    {0x0000, 0x036C, 0x01B6, 0x0522, 0x00DB, 0x0447, 0x0291, 0x05FD},
+    {0x0000, 0x03C3, 0x01E1, 0x05A4, 0x00F0, 0x04B3, 0x02D1, 0x0694},
+    {0x0000, 0x0424, 0x0212, 0x0636, 0x0109, 0x052D, 0x031B, 0x073F},
+    {0x0000, 0x048E, 0x0247, 0x06D5, 0x0123, 0x05B1, 0x036A, 0x07F8},
+    {0x0000, 0x0502, 0x0281, 0x0783, 0x0140, 0x0642, 0x03C1, 0x08C3},
+    {0x0000, 0x0583, 0x02C1, 0x0844, 0x0160, 0x06E3, 0x0421, 0x09A4},
+    {0x0000, 0x0610, 0x0308, 0x0918, 0x0184, 0x0794, 0x048C, 0x0A9C},
+    {0x0000, 0x06AB, 0x0355, 0x0A00, 0x01AA, 0x0855, 0x04FF, 0x0BAA},
+    {0x0000, 0x0756, 0x03AB, 0x0B01, 0x01D5, 0x092B, 0x0580, 0x0CD6},
+    {0x0000, 0x0812, 0x0409, 0x0C1B, 0x0204, 0x0A16, 0x060D, 0x0E1F},
+    {0x0000, 0x08E0, 0x0470, 0x0D50, 0x0238, 0x0B18, 0x06A8, 0x0F88},
+    {0x0000, 0x09C3, 0x04E1, 0x0EA4, 0x0270, 0x0C33, 0x0751, 0x1114},
+    {0x0000, 0x0ABD, 0x055E, 0x101B, 0x02AF, 0x0D6C, 0x080D, 0x12CA},
+    {0x0000, 0x0BD0, 0x05E8, 0x11B8, 0x02F4, 0x0EC4, 0x08DC, 0x14AC},
+    {0x0000, 0x0CFF, 0x067F, 0x137E, 0x033F, 0x103E, 0x09BE, 0x16BD},
+    {0x0000, 0x0E4C, 0x0726, 0x1572, 0x0393, 0x11DF, 0x0AB9, 0x1905},
+    {0x0000, 0x0FBA, 0x07DD, 0x1797, 0x03EE, 0x13A8, 0x0BCB, 0x1B85},
+    {0x0000, 0x114C, 0x08A6, 0x19F2, 0x0453, 0x159F, 0x0CF9, 0x1E45},
+    {0x0000, 0x1307, 0x0983, 0x1C8A, 0x04C1, 0x17C8, 0x0E44, 0x214B},
+    {0x0000, 0x14EE, 0x0A77, 0x1F65, 0x053B, 0x1A29, 0x0FB2, 0x24A0},
+    {0x0000, 0x1706, 0x0B83, 0x2289, 0x05C1, 0x1CC7, 0x1144, 0x284A},
+    {0x0000, 0x1954, 0x0CAA, 0x25FE, 0x0655, 0x1FA9, 0x12FF, 0x2C53},
+    {0x0000, 0x1BDC, 0x0DEE, 0x29CA, 0x06F7, 0x22D3, 0x14E5, 0x30C1},
+    {0x0000, 0x1EA5, 0x0F52, 0x2DF7, 0x07A9, 0x264E, 0x16FB, 0x35A0},
+    {0x0000, 0x21B6, 0x10DB, 0x3291, 0x086D, 0x2A23, 0x1948, 0x3AFE},
+    {0x0000, 0x2515, 0x128A, 0x379F, 0x0945, 0x2E5A, 0x1BCF, 0x40E4},
+    {0x0000, 0x28CA, 0x1465, 0x3D2F, 0x0A32, 0x32FC, 0x1E97, 0x4761},
+    {0x0000, 0x2CDF, 0x166F, 0x434E, 0x0B37, 0x3816, 0x21A6, 0x4E85},
+    {0x0000, 0x315B, 0x18AD, 0x4A08, 0x0C56, 0x3DB1, 0x2503, 0x565E},
+    {0x0000, 0x364B, 0x1B25, 0x5170, 0x0D92, 0x43DD, 0x28B7, 0x5F02},
+    {0x0000, 0x3BB9, 0x1DDC, 0x5995, 0x0EEE, 0x4AA7, 0x2CCA, 0x6883},
+    {0x0000, 0x41B2, 0x20D9, 0x628B, 0x106C, 0x521E, 0x3145, 0x72F7},
+    {0x0000, 0x4844, 0x2422, 0x6C66, 0x1211, 0x5A55, 0x3633, 0x7E77},
+    {0x0000, 0x4F7E, 0x27BF, 0x773D, 0x13DF, 0x635D, 0x3B9E, 0x8B1C},
+    {0x0000, 0x5771, 0x2BB8, 0x8329, 0x15DC, 0x6D4D, 0x4194, 0x9905},
+    {0x0000, 0x602F, 0x3017, 0x9046, 0x180B, 0x783A, 0x4822, 0xA851},
+    {0x0000, 0x69CE, 0x34E7, 0x9EB5, 0x1A73, 0x8441, 0x4F5A, 0xB928},
+    {0x0000, 0x7462, 0x3A31, 0xAE93, 0x1D18, 0x917A, 0x5749, 0xCBAB},
+    {0x0000, 0x7FFF, 0x3FFF, 0xBFFE, 0x1FFF, 0x9FFE, 0x5FFE, 0xDFFD}
+};
+
+static const unsigned short StepSumsHi[89][8] =
+{
+    {0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001, 0x0000, 0x0001},
+    {0x0000, 0x0002, 0x0001, 0x0003, 0x0000, 0x0002, 0x0001, 0x0003},
+    {0x0000, 0x0002, 0x0001, 0x0003, 0x0000, 0x0002, 0x0001, 0x0003},
+    {0x0000, 0x0002, 0x0001, 0x0003, 0x0000, 0x0002, 0x0001, 0x0003},
+    {0x0000, 0x0002, 0x0001, 0x0003, 0x0000, 0x0002, 0x0001, 0x0003},
+    {0x0000, 0x0002, 0x0001, 0x0003, 0x0000, 0x0002, 0x0001, 0x0003},
+    {0x0000, 0x0003, 0x0001, 0x0004, 0x0000, 0x0003, 0x0001, 0x0004},
+    {0x0000, 0x0003, 0x0001, 0x0004, 0x0000, 0x0003, 0x0001, 0x0004},
+    {0x0000, 0x0003, 0x0001, 0x0004, 0x0000, 0x0003, 0x0001, 0x0004},
+    {0x0000, 0x0004, 0x0002, 0x0006, 0x0001, 0x0005, 0x0003, 0x0007},
+    {0x0000, 0x0004, 0x0002, 0x0006, 0x0001, 0x0005, 0x0003, 0x0007},
+    {0x0000, 0x0005, 0x0002, 0x0007, 0x0001, 0x0006, 0x0003, 0x0008},
+    {0x0000, 0x0005, 0x0002, 0x0007, 0x0001, 0x0006, 0x0003, 0x0008},
+    {0x0000, 0x0006, 0x0003, 0x0009, 0x0001, 0x0007, 0x0004, 0x000A},
+    {0x0000, 0x0006, 0x0003, 0x0009, 0x0001, 0x0007, 0x0004, 0x000A},
+    {0x0000, 0x0007, 0x0003, 0x000A, 0x0001, 0x0008, 0x0004, 0x000B},
+    {0x0000, 0x0008, 0x0004, 0x000C, 0x0002, 0x000A, 0x0006, 0x000E},
+    {0x0000, 0x0009, 0x0004, 0x000D, 0x0002, 0x000B, 0x0006, 0x000F},
+    {0x0000, 0x000A, 0x0005, 0x000F, 0x0002, 0x000C, 0x0007, 0x0011},
+    {0x0000, 0x000B, 0x0005, 0x0010, 0x0002, 0x000D, 0x0007, 0x0012},
+    {0x0000, 0x000C, 0x0006, 0x0012, 0x0003, 0x000F, 0x0009, 0x0015},
+    {0x0000, 0x000D, 0x0006, 0x0013, 0x0003, 0x0010, 0x0009, 0x0016},
+    {0x0000, 0x000E, 0x0007, 0x0015, 0x0003, 0x0011, 0x000A, 0x0018},
+    {0x0000, 0x0010, 0x0008, 0x0018, 0x0004, 0x0014, 0x000C, 0x001C},
+    {0x0000, 0x0011, 0x0008, 0x0019, 0x0004, 0x0015, 0x000C, 0x001D},
+    {0x0000, 0x0013, 0x0009, 0x001C, 0x0004, 0x0017, 0x000D, 0x0020},
+    {0x0000, 0x0015, 0x000A, 0x001F, 0x0005, 0x001A, 0x000F, 0x0024},
+    {0x0000, 0x0017, 0x000B, 0x0022, 0x0005, 0x001C, 0x0010, 0x0027},
+    {0x0000, 0x001A, 0x000D, 0x0027, 0x0006, 0x0020, 0x0013, 0x002D},
+    {0x0000, 0x001C, 0x000E, 0x002A, 0x0007, 0x0023, 0x0015, 0x0031},
+    {0x0000, 0x001F, 0x000F, 0x002E, 0x0007, 0x0026, 0x0016, 0x0035},
+    {0x0000, 0x0022, 0x0011, 0x0033, 0x0008, 0x002A, 0x0019, 0x003B},
+    {0x0000, 0x0026, 0x0013, 0x0039, 0x0009, 0x002F, 0x001C, 0x0042},
+    {0x0000, 0x002A, 0x0015, 0x003F, 0x000A, 0x0034, 0x001F, 0x0049},
+    {0x0000, 0x002E, 0x0017, 0x0045, 0x000B, 0x0039, 0x0022, 0x0050},
+    {0x0000, 0x0033, 0x0019, 0x004C, 0x000C, 0x003F, 0x0025, 0x0058},
+    {0x0000, 0x0038, 0x001C, 0x0054, 0x000E, 0x0046, 0x002A, 0x0062},
+    {0x0000, 0x003D, 0x001E, 0x005B, 0x000F, 0x004C, 0x002D, 0x006A},
+    {0x0000, 0x0044, 0x0022, 0x0066, 0x0011, 0x0055, 0x0033, 0x0077},
+    {0x0000, 0x004A, 0x0025, 0x006F, 0x0012, 0x005C, 0x0037, 0x0081},
+    {0x0000, 0x0052, 0x0029, 0x007B, 0x0014, 0x0066, 0x003D, 0x008F},
+    {0x0000, 0x005A, 0x002D, 0x0087, 0x0016, 0x0070, 0x0043, 0x009D},
+    {0x0000, 0x0063, 0x0031, 0x0094, 0x0018, 0x007B, 0x0049, 0x00AC},
+    {0x0000, 0x006D, 0x0036, 0x00A3, 0x001B, 0x0088, 0x0051, 0x00BE},
+    {0x0000, 0x0078, 0x003C, 0x00B4, 0x001E, 0x0096, 0x005A, 0x00D2},
+    {0x0000, 0x0084, 0x0042, 0x00C6, 0x0021, 0x00A5, 0x0063, 0x00E7},
+    {0x0000, 0x0091, 0x0048, 0x00D9, 0x0024, 0x00B5, 0x006C, 0x00FD},
+    {0x0000, 0x00A0, 0x0050, 0x00F0, 0x0028, 0x00C8, 0x0078, 0x0118},
+    {0x0000, 0x00B0, 0x0058, 0x0108, 0x002C, 0x00DC, 0x0084, 0x0134},
+    {0x0000, 0x00C2, 0x0061, 0x0123, 0x0030, 0x00F2, 0x0091, 0x0153},
+    {0x0000, 0x00D5, 0x006A, 0x013F, 0x0035, 0x010A, 0x009F, 0x0174},
+    {0x0000, 0x00EA, 0x0075, 0x015F, 0x003A, 0x0124, 0x00AF, 0x0199},
+    {0x0000, 0x0102, 0x0081, 0x0183, 0x0040, 0x0142, 0x00C1, 0x01C3},
+    {0x0000, 0x011C, 0x008E, 0x01AA, 0x0047, 0x0163, 0x00D5, 0x01F1},
+    {0x0000, 0x0138, 0x009C, 0x01D4, 0x004E, 0x0186, 0x00EA, 0x0222},
+    {0x0000, 0x0157, 0x00AB, 0x0202, 0x0055, 0x01AC, 0x0100, 0x0257},
+    {0x0000, 0x017A, 0x00BD, 0x0237, 0x005E, 0x01D8, 0x011B, 0x0295},
+    {0x0000, 0x019F, 0x00CF, 0x026E, 0x0067, 0x0206, 0x0136, 0x02D5},
+    {0x0000, 0x01C9, 0x00E4, 0x02AD, 0x0072, 0x023B, 0x0156, 0x031F},
+    {0x0000, 0x01F7, 0x00FB, 0x02F2, 0x007D, 0x0274, 0x0178, 0x036F},
+    {0x0000, 0x0229, 0x0114, 0x033D, 0x008A, 0x02B3, 0x019E, 0x03C7},
+    {0x0000, 0x0260, 0x0130, 0x0390, 0x0098, 0x02F8, 0x01C8, 0x0428},
+    {0x0000, 0x029D, 0x014E, 0x03EB, 0x00A7, 0x0344, 0x01F5, 0x0492},
+    {0x0000, 0x02E0, 0x0170, 0x0450, 0x00B8, 0x0398, 0x0228, 0x0508},
+    {0x0000, 0x032A, 0x0195, 0x04BF, 0x00CA, 0x03F4, 0x025F, 0x0589},
+    {0x0000, 0x037B, 0x01BD, 0x0538, 0x00DE, 0x0459, 0x029B, 0x0616},
+    {0x0000, 0x03D4, 0x01EA, 0x05BE, 0x00F5, 0x04C9, 0x02DF, 0x06B3},
+    {0x0000, 0x0436, 0x021B, 0x0651, 0x010D, 0x0543, 0x0328, 0x075E},
+    {0x0000, 0x04A2, 0x0251, 0x06F3, 0x0128, 0x05CA, 0x0379, 0x081B},
+    {0x0000, 0x0519, 0x028C, 0x07A5, 0x0146, 0x065F, 0x03D2, 0x08EB},
+    {0x0000, 0x059B, 0x02CD, 0x0868, 0x0166, 0x0701, 0x0433, 0x09CE},
+    {0x0000, 0x062B, 0x0315, 0x0940, 0x018A, 0x07B5, 0x049F, 0x0ACA},
+    {0x0000, 0x06C9, 0x0364, 0x0A2D, 0x01B2, 0x087B, 0x0516, 0x0BDF},
+    {0x0000, 0x0777, 0x03BB, 0x0B32, 0x01DD, 0x0954, 0x0598, 0x0D0F},
+    {0x0000, 0x0836, 0x041B, 0x0C51, 0x020D, 0x0A43, 0x0628, 0x0E5E},
+    {0x0000, 0x0908, 0x0484, 0x0D8C, 0x0242, 0x0B4A, 0x06C6, 0x0FCE},
+    {0x0000, 0x09EF, 0x04F7, 0x0EE6, 0x027B, 0x0C6A, 0x0772, 0x1161},
+    {0x0000, 0x0AEE, 0x0577, 0x1065, 0x02BB, 0x0DA9, 0x0832, 0x1320},
+    {0x0000, 0x0C05, 0x0602, 0x1207, 0x0301, 0x0F06, 0x0903, 0x1508},
+    {0x0000, 0x0D39, 0x069C, 0x13D5, 0x034E, 0x1087, 0x09EA, 0x1723},
+    {0x0000, 0x0E8C, 0x0746, 0x15D2, 0x03A3, 0x122F, 0x0AE9, 0x1975},
+    {0x0000, 0x0FFF, 0x07FF, 0x17FE, 0x03FF, 0x13FE, 0x0BFE, 0x1BFD}
+};
+
 //----------------------------------------------------------------------------
 // CompressWave
 
@@ -229,7 +418,8 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
     long SInt32Array1[2];
     long SInt32Array2[2];
     long nOneWord;
-    int dwOutLengthCopy = dwOutLength;
+    int nSwitch;
+    int nShift;
     int nIndex;
 
     SInt32Array1[0] = SInt32Array1[1] = 0x2C;
@@ -242,15 +432,19 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
     {
         nOneWord = BSWAP_INT16_SIGNED(*in.pw++);
         SInt32Array2[i] = nOneWord;
-        if(dwOutLengthCopy < 2)
+        if(dwOutLength < 2)
             return (int)(out.pb - pbOutBuffer);
 
         *out.pw++ = BSWAP_INT16_SIGNED((short)nOneWord);
-        dwOutLengthCopy -= sizeof(short);
+        dwOutLength -= sizeof(short);
     }
 
-    // Get the initial index
+    // The shift is stored in the second byte of the header
+    nShift = pbInBuffer[1];
+
+    // Get the initial index. For stereo, the index is switched by XOR with 1
     nIndex = nChannels - 1;
+    nSwitch = (nChannels == 2) ? 1 : 0;
 
     // Perform the decompression
     while(in.pb < pbInBufferEnd)
@@ -258,8 +452,7 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
         unsigned char nOneByte = *in.pb++;
 
         // Switch index
-        if(nChannels == 2)
-            nIndex = (nIndex == 0) ? 1 : 0;
+        nIndex ^= nSwitch;
 
         // 1500F2A2: Get one byte from input buffer
         if(nOneByte & 0x80)
@@ -270,7 +463,7 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
                     if(SInt32Array1[nIndex] != 0)
                         SInt32Array1[nIndex]--;
 
-                    if(dwOutLengthCopy < 2)
+                    if(dwOutLength < 2)
                         return (int)(out.pb - pbOutBuffer);
 
                     *out.pw++ = BSWAP_INT16_SIGNED((unsigned short)SInt32Array2[nIndex]);
@@ -282,8 +475,7 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
                     if(SInt32Array1[nIndex] > 0x58)
                         SInt32Array1[nIndex] = 0x58;
                     
-                    if(nChannels == 2)
-                        nIndex = (nIndex == 0) ? 1 : 0;
+                    nIndex ^= nSwitch;
                     break;
 
                 case 2:     // 1500F41E
@@ -294,8 +486,7 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
                     if(SInt32Array1[nIndex] < 0)
                         SInt32Array1[nIndex] = 0;
 
-                    if(nChannels == 2)
-                        nIndex = (nIndex == 0) ? 1 : 0;
+                    nIndex ^= nSwitch;
                     break;
             }
         }
@@ -303,39 +494,13 @@ int DecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char
         {
             // 1500F349
             long temp1 = step_table[SInt32Array1[nIndex]];     // EDI
-            long temp2 = temp1 >> pbInBuffer[1];               // ESI
+            long temp2 = (temp1 >> nShift) + StepSumsLo[SInt32Array1[nIndex]][nOneByte & 0x07] + StepSumsHi[SInt32Array1[nIndex]][(nOneByte >> 3) & 0x07];
             long temp3 = SInt32Array2[nIndex];                 // ECX
 
-            if(nOneByte & 0x01)          // EBX = nOneByte
-                temp2 += (temp1 >> 0);
-
-            if(nOneByte & 0x02)
-                temp2 += (temp1 >> 1);
-
-            if(nOneByte & 0x04)
-                temp2 += (temp1 >> 2);
-
-            if(nOneByte & 0x08)
-                temp2 += (temp1 >> 3);
-
-            if(nOneByte & 0x10)
-                temp2 += (temp1 >> 4);
-
-            if(nOneByte & 0x20)
-                temp2 += (temp1 >> 5);
-
-            if(nOneByte & 0x40)
-            {
-                temp3 = temp3 - temp2;
-                if(temp3 <= -32768)
-                    temp3 = -32768;
-            }
-            else
-            {
-                temp3 = temp3 + temp2;
-                if(temp3 >= 32767)
-                    temp3 = 32767;
-            }
+            // Clamp the sample to the 16-bit range
+            temp3 = (nOneByte & 0x40) ? (temp3 - temp2) : (temp3 + temp2);
+            temp3 = (temp3 < -32768) ? -32768 : temp3;
+            temp3 = (temp3 > 32767) ? 32767 : temp3;
 
             SInt32Array2[nIndex] = temp3;
             if(dwOutLength < 2)
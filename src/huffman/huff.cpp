@@ -1119,6 +1119,512 @@ _1500E549:
 }
 
 
+//-----------------------------------------------------------------------------
+// THuffmannDecoder class functions
+
+// Bit reader for THuffmannDecoder. Keeps up to 64 bits in the buffer.
+// The bits beyond the end of the input are zero; the decoder checks
+// whether it has used them.
+struct TBitReader
+{
+    void Refill()
+    {
+        ULONGLONG NextBits;
+
+        // Fast path: load 8 bytes at once and keep the ones that fit
+        if((InPos + 8) <= cbInBuffer)
+        {
+            memcpy(&NextBits, pbInBuffer + InPos, sizeof(ULONGLONG));
+            BitBuffer |= BSWAP_INT64_UNSIGNED(NextBits) << BitCount;
+            InPos += (63 - BitCount) >> 3;
+            BitCount |= 56;
+            return;
+        }
+
+        while(BitCount <= 56)
+        {
+            if(InPos < cbInBuffer)
+                BitBuffer |= (ULONGLONG)pbInBuffer[InPos] << BitCount;
+            BitCount += 8;
+            InPos++;
+        }
+    }
+
+    unsigned int PeekBits(unsigned int nBits)
+    {
+        if(BitCount < nBits)
+            Refill();
+        return (unsigned int)BitBuffer & ((1 << nBits) - 1);
+    }
+
+    void SkipBits(unsigned int nBits)
+    {
+        BitBuffer >>= nBits;
+        BitCount -= nBits;
+    }
+
+    unsigned int GetBit()
+    {
+        unsigned int nOneBit;
+
+        if(BitCount == 0)
+            Refill();
+        nOneBit = (unsigned int)BitBuffer & 0x01;
+        BitBuffer >>= 1;
+        BitCount--;
+        return nOneBit;
+    }
+
+    unsigned int Get8Bits()
+    {
+        unsigned int nOneByte = PeekBits(8);
+
+        SkipBits(8);
+        return nOneByte;
+    }
+
+    // Number of bits taken from the input so far
+    ULONGLONG GetBitPosition()
+    {
+        return (ULONGLONG)InPos * 8 - BitCount;
+    }
+
+    unsigned char * pbInBuffer;         // Input data
+    unsigned int    cbInBuffer;         // Size of the input data
+    unsigned int    InPos;              // Number of bytes loaded to the bit buffer (can be beyond the end)
+    ULONGLONG       BitBuffer;          // Input bit buffer
+    unsigned int    BitCount;           // Number of bits remaining in the bit buffer
+};
+
+void THuffmannDecoder::InitDecoder()
+{
+    memset(Lookup, 0, sizeof(Lookup));
+    Generation = 0;
+    nItems = 0;
+    First = Last = HUFF_NO_ITEM;
+    InitCmpType = 0;
+}
+
+void THuffmannDecoder::NextGeneration()
+{
+    // All lookup entries become invalid
+    if(++Generation == 0)
+    {
+        memset(Lookup, 0, sizeof(Lookup));
+        Generation = 1;
+    }
+}
+
+// Invalidates the lookup entries whose codes go through the item.
+// The items deeper than HUFF_LOOKUP_BITS don't affect any lookup entry,
+// because the longer codes are walked from the item at that depth.
+void THuffmannDecoder::InvalidateItem(unsigned int nItem, unsigned int nSwapItem)
+{
+    unsigned int nBitCount = 0;
+    unsigned int nParent;
+    unsigned int nCode = 0;
+
+    // The type 0 doesn't use the lookup table
+    if(bIsCmp0)
+        return;
+
+    // Get the code of the item
+    for(; (nParent = Items[nItem].Parent) != HUFF_NO_ITEM; nItem = nParent)
+    {
+        // The item is switched with its own parent; this only happens
+        // with corrupt data, so just invalidate all entries
+        if(nParent == nSwapItem || ++nBitCount > HUFF_ITEM_COUNT)
+        {
+            NextGeneration();
+            return;
+        }
+
+        nCode = (nCode << 1) | ((Items[nParent].Child != nItem) ? 1 : 0);
+    }
+
+    if(nBitCount <= HUFF_LOOKUP_BITS)
+    {
+        for(nCode &= (1 << nBitCount) - 1; nCode < HUFF_LOOKUP_SIZE; nCode += (1 << nBitCount))
+            Lookup[nCode].Generation = 0;
+    }
+}
+
+unsigned int THuffmannDecoder::CreateItem(unsigned int nValue, unsigned int nWeight)
+{
+    THuffItem * pItem = &Items[nItems];
+
+    pItem->Next = pItem->Prev = HUFF_NO_ITEM;
+    pItem->Parent = pItem->Child = HUFF_NO_ITEM;
+    pItem->Weight = nWeight;
+    pItem->Value = nValue;
+    return nItems++;
+}
+
+void THuffmannDecoder::RemoveItem(unsigned int nItem)
+{
+    THuffItem * pItem = &Items[nItem];
+
+    if(pItem->Prev != HUFF_NO_ITEM)
+        Items[pItem->Prev].Next = pItem->Next;
+    else
+        First = pItem->Next;
+
+    if(pItem->Next != HUFF_NO_ITEM)
+        Items[pItem->Next].Prev = pItem->Prev;
+    else
+        Last = pItem->Prev;
+
+    pItem->Next = pItem->Prev = HUFF_NO_ITEM;
+}
+
+// Inserts the item after nPrev. If nPrev is HUFF_NO_ITEM, inserts the item as the first one
+void THuffmannDecoder::InsertItemAfter(unsigned int nPrev, unsigned int nItem)
+{
+    THuffItem * pItem = &Items[nItem];
+    unsigned int nNext = (nPrev != HUFF_NO_ITEM) ? Items[nPrev].Next : First;
+
+    pItem->Prev = (unsigned short)nPrev;
+    pItem->Next = (unsigned short)nNext;
+
+    if(nPrev != HUFF_NO_ITEM)
+        Items[nPrev].Next = (unsigned short)nItem;
+    else
+        First = nItem;
+
+    if(nNext != HUFF_NO_ITEM)
+        Items[nNext].Prev = (unsigned short)nItem;
+    else
+        Last = nItem;
+}
+
+// Same as THuffmannTree::BuildTree
+bool THuffmannDecoder::BuildTree(unsigned int nCmpType)
+{
+    unsigned char * byteArray = THuffmannTree::Table1502A630 + nCmpType * 258;
+    unsigned int nMaxWeight = 0;
+    unsigned int nChild1;
+    unsigned int nChild2;
+    unsigned int nItem;
+    unsigned int nPrev;
+
+    // The weight table only has data for a few compression types
+    if(nCmpType >= HUFF_CMP_TYPES)
+        return false;
+
+    // Copy the tree that has been built before, if there is one
+    if(InitCmpType == nCmpType + 1)
+    {
+        memcpy(Items, InitItems, nInitItems * sizeof(THuffItem));
+        memcpy(ItemByValue, InitItemByValue, sizeof(ItemByValue));
+        nItems = nInitItems;
+        First = InitFirst;
+        Last = InitLast;
+        return true;
+    }
+
+    memset(ItemByValue, 0xFF, sizeof(ItemByValue));
+    First = Last = HUFF_NO_ITEM;
+    nItems = 0;
+
+    // Create the items for all values that have nonzero weight
+    for(unsigned int i = 0; i < 0x100; i++)
+    {
+        if(byteArray[i] == 0)
+            continue;
+
+        // The item goes to the beginning of the list, if it has the greatest weight
+        nItem = CreateItem(i, byteArray[i]);
+        InsertItemAfter(HUFF_NO_ITEM, nItem);
+        ItemByValue[i] = (unsigned short)nItem;
+        if(byteArray[i] >= nMaxWeight)
+        {
+            nMaxWeight = byteArray[i];
+            continue;
+        }
+
+        // Otherwise, put it after the last item with greater or equal weight
+        for(nPrev = Last; nPrev != HUFF_NO_ITEM; nPrev = Items[nPrev].Prev)
+        {
+            if(Items[nPrev].Weight >= byteArray[i])
+                break;
+        }
+
+        RemoveItem(nItem);
+        InsertItemAfter(nPrev, nItem);
+    }
+
+    // The end-of-data and the new-value items go to the end of the list
+    for(unsigned int i = 0x100; i < HUFF_VALUE_COUNT; i++)
+    {
+        nItem = CreateItem(i, 1);
+        InsertItemAfter(Last, nItem);
+        ItemByValue[i] = (unsigned short)nItem;
+    }
+
+    // Join the two items with the lowest weight until only the root remains
+    for(nChild1 = Last; (nChild2 = Items[nChild1].Prev) != HUFF_NO_ITEM; nChild1 = Items[nChild2].Prev)
+    {
+        nItem = CreateItem(0, Items[nChild1].Weight + Items[nChild2].Weight);
+        InsertItemAfter(HUFF_NO_ITEM, nItem);
+        Items[nItem].Child = (unsigned short)nChild1;
+        Items[nChild1].Parent = (unsigned short)nItem;
+        Items[nChild2].Parent = (unsigned short)nItem;
+
+        if(Items[nItem].Weight >= nMaxWeight)
+        {
+            nMaxWeight = Items[nItem].Weight;
+        }
+        else
+        {
+            for(nPrev = Items[nChild2].Prev; nPrev != HUFF_NO_ITEM; nPrev = Items[nPrev].Prev)
+            {
+                if(Items[nPrev].Weight >= Items[nItem].Weight)
+                    break;
+            }
+
+            // The item is already the first one if no item before the children has a greater weight
+            if(nPrev != nItem)
+            {
+                RemoveItem(nItem);
+                InsertItemAfter(nPrev, nItem);
+            }
+        }
+
+        if(Items[nChild2].Prev == HUFF_NO_ITEM)
+            break;
+    }
+
+    // Keep the tree for the next data with the same compression type
+    memcpy(InitItems, Items, nItems * sizeof(THuffItem));
+    memcpy(InitItemByValue, ItemByValue, sizeof(ItemByValue));
+    nInitItems = nItems;
+    InitFirst = First;
+    InitLast = Last;
+    InitCmpType = nCmpType + 1;
+    return true;
+}
+
+// Same as THuffmannTree::Call1500E820. Increments the weights of the item
+// and all its parents, and keeps the list sorted by switching the items
+bool THuffmannDecoder::IncWeights(unsigned int nItem)
+{
+    THuffItem * pItem;
+    unsigned int nHigher;
+    unsigned int nParent;
+    unsigned int nPrev;
+
+    for(; nItem != HUFF_NO_ITEM; nItem = pItem->Parent)
+    {
+        pItem = &Items[nItem];
+        pItem->Weight++;
+
+        // Find the first of the items before this one that have lower weight
+        for(nHigher = nItem; ; nHigher = nPrev)
+        {
+            nPrev = Items[nHigher].Prev;
+            if(nPrev == HUFF_NO_ITEM || Items[nPrev].Weight >= pItem->Weight)
+                break;
+        }
+
+        if(nHigher == nItem)
+            continue;
+
+        // Only the root has no parent, and the root can never be switched
+        if(pItem->Parent == HUFF_NO_ITEM || Items[nHigher].Parent == HUFF_NO_ITEM)
+            return false;
+
+        // The items exchange their positions in the tree
+        InvalidateItem(nItem, nHigher);
+        InvalidateItem(nHigher, nItem);
+
+        // Switch the positions of the two items in the list
+        RemoveItem(nHigher);
+        InsertItemAfter(nItem, nHigher);
+        RemoveItem(nItem);
+        InsertItemAfter(nPrev, nItem);
+
+        // Switch their parents
+        nParent = Items[Items[nHigher].Parent].Child;
+        if(Items[pItem->Parent].Child == nItem)
+            Items[pItem->Parent].Child = (unsigned short)nHigher;
+        if(nParent == nHigher)
+            Items[Items[nHigher].Parent].Child = (unsigned short)nItem;
+
+        nParent = pItem->Parent;
+        pItem->Parent = Items[nHigher].Parent;
+        Items[nHigher].Parent = (unsigned short)nParent;
+    }
+
+    return true;
+}
+
+// Splits the last item into the old value and the new one (as in THuffmannTree::DoDecompression)
+bool THuffmannDecoder::InsertNewValue(unsigned int nValue)
+{
+    unsigned int nLast = Last;
+    unsigned int nItem;
+
+    if((nItems + 2) > HUFF_ITEM_COUNT)
+        return false;
+
+    // The last item gets children
+    InvalidateItem(nLast, HUFF_NO_ITEM);
+
+    nItem = CreateItem(Items[nLast].Value, Items[nLast].Weight);
+    InsertItemAfter(Last, nItem);
+    Items[nItem].Parent = (unsigned short)nLast;
+    ItemByValue[Items[nItem].Value] = (unsigned short)nItem;
+
+    nItem = CreateItem(nValue, 0);
+    InsertItemAfter(Last, nItem);
+    Items[nItem].Parent = (unsigned short)nLast;
+    ItemByValue[nValue] = (unsigned short)nItem;
+
+    Items[nLast].Child = (unsigned short)nItem;
+
+    if(!IncWeights(nItem))
+        return false;
+    if(bIsCmp0 == false && !IncWeights(ItemByValue[nValue]))
+        return false;
+    return true;
+}
+
+// Decompresses the data the same way as THuffmannTree::DoDecompression.
+// Returns the number of bytes decompressed, or 0 if the data is corrupt
+unsigned int THuffmannDecoder::DoDecompression(unsigned char * pbOutBuffer, unsigned int dwOutLength, unsigned char * pbInBuffer, unsigned int cbInBuffer)
+{
+    THuffLookup * pLookup;
+    TBitReader is;
+    unsigned char * pbOutPos = pbOutBuffer;
+    ULONGLONG InputBits = (ULONGLONG)cbInBuffer * 8;
+    ULONGLONG PeekEnd = 8;              // Bits loaded for the compression type
+    unsigned int nBitCount;
+    unsigned int nLinkItem;
+    unsigned int nValue;
+    unsigned int nItem;
+    unsigned int nCode;
+
+    // Test the output length. Must not be NULL.
+    if(dwOutLength == 0)
+        return 0;
+
+    // Initialize the input stream
+    is.pbInBuffer = pbInBuffer;
+    is.cbInBuffer = cbInBuffer;
+    is.InPos = 0;
+    is.BitBuffer = 0;
+    is.BitCount = 0;
+
+    // Get the compression type from the input stream and build the tree
+    nValue = is.Get8Bits();
+    if(!BuildTree(nValue))
+        return 0;
+    bIsCmp0 = (nValue == 0);
+
+    // The lookup entries from the previous data are not valid
+    NextGeneration();
+
+    for(;;)
+    {
+        // Security check: THuffmannTree fails when it has loaded a byte
+        // beyond the end of the input before decoding the next value.
+        // It always loads 7 bits ahead for its quick decompression table.
+        if(PeekEnd > InputBits || is.GetBitPosition() > InputBits)
+            return 0;
+        PeekEnd = is.GetBitPosition() + 7;
+
+        // The compression type 0 changes the tree with each value,
+        // so there is no point in filling the lookup table
+        nItem = First;
+        nBitCount = 0;
+        pLookup = NULL;
+        if(bIsCmp0 == false)
+        {
+            nCode = is.PeekBits(HUFF_LOOKUP_BITS);
+            pLookup = &Lookup[nCode];
+
+            if(pLookup->Generation == Generation)
+            {
+                if(pLookup->BitCount <= HUFF_LOOKUP_BITS)
+                {
+                    is.SkipBits(pLookup->BitCount);
+                    nValue = pLookup->Target;
+                    goto _ValueDecoded;
+                }
+
+                // Longer code: continue walking from the item at depth HUFF_LOOKUP_BITS
+                is.SkipBits(HUFF_LOOKUP_BITS);
+                nItem = pLookup->Target;
+                nBitCount = HUFF_LOOKUP_BITS;
+                pLookup = NULL;
+            }
+        }
+
+        // Walk down the tree. Bit 1 means the child with the higher weight
+        nLinkItem = HUFF_NO_ITEM;
+        do
+        {
+            nItem = Items[nItem].Child;
+            if(is.GetBit())
+                nItem = Items[nItem].Prev;
+
+            if(nItem == HUFF_NO_ITEM || nBitCount >= HUFF_ITEM_COUNT)
+                return 0;
+            if(++nBitCount == HUFF_LOOKUP_BITS)
+                nLinkItem = nItem;
+        }
+        while(Items[nItem].Child != HUFF_NO_ITEM);
+        nValue = Items[nItem].Value;
+
+        // Remember the code, so the next time it is decoded by one lookup
+        if(pLookup != NULL)
+        {
+            if(nBitCount > HUFF_LOOKUP_BITS)
+            {
+                pLookup->Generation = Generation;
+                pLookup->BitCount = (unsigned short)nBitCount;
+                pLookup->Target = (unsigned short)nLinkItem;
+            }
+            else
+            {
+                for(nCode &= (1 << nBitCount) - 1; nCode < HUFF_LOOKUP_SIZE; nCode += (1 << nBitCount))
+                {
+                    Lookup[nCode].Generation = Generation;
+                    Lookup[nCode].BitCount = (unsigned short)nBitCount;
+                    Lookup[nCode].Target = (unsigned short)nValue;
+                }
+            }
+        }
+
+_ValueDecoded:
+        // A new value follows; add it to the tree
+        if(nValue == 0x101)
+        {
+            nValue = is.Get8Bits();
+            if(!InsertNewValue(nValue))
+                return 0;
+        }
+
+        // A value that needed bits beyond the end of the input means
+        // that the input is truncated. The stream must be rejected
+        // even if the value happens to be the end of data
+        if(is.GetBitPosition() > InputBits)
+            return 0;
+
+        if(nValue == 0x100)
+            break;
+
+        *pbOutPos++ = (unsigned char)nValue;
+        if(--dwOutLength == 0)
+            break;
+
+        if(bIsCmp0 && !IncWeights(ItemByValue[nValue]))
+            return 0;
+    }
+
+    return (unsigned int)(pbOutPos - pbOutBuffer);
+}
+
 // Table for (de)compression. Every compression type has 258 entries
 unsigned char THuffmannTree::Table1502A630[] =
 {
@@ -141,4 +141,75 @@ class THuffmannTree
     static unsigned char Table1502A630[];// Some table
 };
  
+//-----------------------------------------------------------------------------
+// Table-driven Huffmann decoder. Builds and updates exactly the same adaptive
+// tree as THuffmannTree, but the items are referenced by their index and
+// the codes are decoded by HUFF_LOOKUP_BITS bits at once. A lookup entry
+// is only valid for the generation of the tree it has been created for.
+// When the tree changes, only the entries of the moved items are invalidated.
+// The decoder doesn't need a constructor, so it can be kept in zeroed memory.
+
+#define HUFF_ITEM_COUNT      0x203          // Max number of items in the tree
+#define HUFF_VALUE_COUNT     0x102          // Number of values (0x100 = end of data, 0x101 = a new value follows)
+#define HUFF_CMP_TYPES           9          // Number of compression types in THuffmannTree::Table1502A630
+#define HUFF_NO_ITEM        0xFFFF          // Index of a nonexistent item
+#define HUFF_LOOKUP_BITS        10          // Number of bits decoded by one lookup
+#define HUFF_LOOKUP_SIZE    (1 << HUFF_LOOKUP_BITS)
+
+// Huffmann tree item. The items are kept in a list sorted by their weight
+struct THuffItem
+{
+    unsigned short Next;                // Next item in the list (lower weight), HUFF_NO_ITEM if none
+    unsigned short Prev;                // Previous item in the list (higher weight), HUFF_NO_ITEM if none
+    unsigned short Parent;              // Parent item, HUFF_NO_ITEM for the root
+    unsigned short Child;               // Child with the lower weight. The other child is its previous item
+    unsigned int   Weight;              // Weight of the item
+    unsigned int   Value;               // Decompressed value (leaf items only)
+};
+
+// Entry of the lookup table
+struct THuffLookup
+{
+    unsigned int   Generation;          // Generation of the tree that the entry is valid for
+    unsigned short BitCount;            // Number of bits of the code. More than HUFF_LOOKUP_BITS if the code is longer
+    unsigned short Target;              // Decompressed value, or the item at depth HUFF_LOOKUP_BITS for longer codes
+};
+
+class THuffmannDecoder
+{
+    public:
+
+    void InitDecoder();
+    unsigned int DoDecompression(unsigned char * pbOutBuffer, unsigned int dwOutLength, unsigned char * pbInBuffer, unsigned int cbInBuffer);
+
+    protected:
+
+    bool BuildTree(unsigned int nCmpType);
+    unsigned int CreateItem(unsigned int nValue, unsigned int nWeight);
+    void RemoveItem(unsigned int nItem);
+    void InsertItemAfter(unsigned int nPrev, unsigned int nItem);
+    bool IncWeights(unsigned int nItem);
+    bool InsertNewValue(unsigned int nValue);
+    void InvalidateItem(unsigned int nItem, unsigned int nSwapItem);
+    void NextGeneration();
+
+    THuffItem      Items[HUFF_ITEM_COUNT];          // Items of the tree
+    unsigned short ItemByValue[HUFF_VALUE_COUNT];   // Leaf item for each value, HUFF_NO_ITEM if none
+    THuffLookup    Lookup[HUFF_LOOKUP_SIZE];        // Decoded codes of HUFF_LOOKUP_BITS bits
+    unsigned int   nItems;                          // Number of used items
+    unsigned int   First;                           // First item in the list (the root)
+    unsigned int   Last;                            // Last item in the list (the lowest weight)
+    unsigned int   Generation;                      // Incremented when all lookup entries become invalid
+    bool           bIsCmp0;                         // true if compression type 0 (the lookup table is not used)
+
+    // The initial tree only depends on the compression type, so the tree built
+    // for the last compression type is kept and copied for the next data
+    THuffItem      InitItems[HUFF_ITEM_COUNT];      // Items of the initial tree
+    unsigned short InitItemByValue[HUFF_VALUE_COUNT];
+    unsigned int   nInitItems;
+    unsigned int   InitFirst;
+    unsigned int   InitLast;
+    unsigned int   InitCmpType;                     // Compression type of the initial tree + 1 (0 if none)
+};
+
 #endif // __HUFFMAN_H__
@@ -455,7 +455,7 @@ static unsigned long Expand(TDcmpStruct * pWork)
             // Note that if the output buffer overflowed previously, the extra decompressed bytes
             // are stored in "out_buff_overflow", and they will now be
             // within decompressed part of the output buffer.
-            memcpy(pWork->out_buff, &pWork->out_buff[0x1000], pWork->outputPos - 0x1000);
+            memmove(pWork->out_buff, &pWork->out_buff[0x1000], pWork->outputPos - 0x1000);
             pWork->outputPos -= 0x1000;
         }
     }
@@ -520,3 +520,245 @@ unsigned int explode(
         
     return CMP_ABORT;
 }
+
+//-----------------------------------------------------------------------------
+// Fast exploding function for data that is entirely in memory.
+// Reads the input through a 64-bit bit buffer and decodes every literal,
+// length and distance by a single table lookup.
+
+// Builds the decode tables. The ASCII table is made by running the lookups
+// of DecodeLit for every combination of 13 bits, so it decodes the same
+// values and consumes the same number of bits as DecodeLit.
+static void GenFastTabs(TDcmpTables * pTables)
+{
+    TDcmpStruct Work;
+    unsigned long value;
+    unsigned long waste;
+    unsigned long i;
+
+    memset(&Work, 0, sizeof(TDcmpStruct));
+    memcpy(Work.ChBitsAsc, ChBitsAsc, sizeof(Work.ChBitsAsc));
+    GenAscTabs(&Work);
+    memcpy(Work.LenBits, LenBits, sizeof(Work.LenBits));
+    GenDecodeTabs(Work.LengthCodes, LenCode, Work.LenBits, sizeof(Work.LenBits));
+    memcpy(Work.DistBits, DistBits, sizeof(Work.DistBits));
+    GenDecodeTabs(Work.DistPosCodes, DistCode, Work.DistBits, sizeof(Work.DistBits));
+
+    for(i = 0; i < 0x100; i++)
+    {
+        value = Work.LengthCodes[i];
+        pTables->Lengths[i].base       = LenBase[value];
+        pTables->Lengths[i].bits       = LenBits[value];
+        pTables->Lengths[i].extra_bits = ExLenBits[value];
+
+        pTables->DistPosCodes[i] = Work.DistPosCodes[i];
+        pTables->DistPosBits[i]  = DistBits[Work.DistPosCodes[i]];
+    }
+
+    for(i = 0; i < 0x2000; i++)
+    {
+        if(i & 0xFF)
+        {
+            waste = 0;
+            value = Work.offs2C34[i & 0xFF];
+
+            if(value == 0xFF)
+            {
+                if(i & 0x3F)
+                {
+                    waste = 4;
+                    value = Work.offs2D34[(i >> 4) & 0xFF];
+                }
+                else
+                {
+                    waste = 6;
+                    value = Work.offs2E34[(i >> 6) & 0x7F];
+                }
+            }
+        }
+        else
+        {
+            waste = 8;
+            value = Work.offs2EB4[(i >> 8) & 0xFF];
+        }
+
+        pTables->ChCodesAsc[i] = (unsigned short)(value | ((waste + Work.ChBitsAsc[value]) << 8));
+    }
+
+    pTables->tables_ready = 1;
+}
+
+// Copies the repetition. The source may overlap the target
+static void CopyRepetition(unsigned char * target, unsigned long distance, unsigned long length)
+{
+    unsigned char * source = target - distance;
+
+    if(distance >= length)
+    {
+        memcpy(target, source, length);
+    }
+    else if(distance == 1)
+    {
+        memset(target, *source, length);
+    }
+    else
+    {
+        // Blocks of 8 bytes don't overlap if the distance is at least 8
+        if(distance >= 8)
+        {
+            for(; length >= 8; target += 8, source += 8, length -= 8)
+                memcpy(target, source, 8);
+        }
+
+        while(length-- > 0)
+            *target++ = *source++;
+    }
+}
+
+unsigned int explode_buffer(
+        char         *out_buf,
+        unsigned int *out_size,
+        char         *in_buf,
+        unsigned int  in_size,
+        char         *work_buf)
+{
+    TDcmpTables * pTables = (TDcmpTables *)work_buf;
+    TDcmpLength * pLength;
+    unsigned char * in_bytes = (unsigned char *)in_buf;
+    unsigned char * out_begin = (unsigned char *)out_buf;
+    unsigned char * out_pos = out_begin;
+    unsigned char * out_end = out_begin + *out_size;
+    ULONGLONG bit_buff = 0;             // Bit buffer, the next bit is the lowest one
+    ULONGLONG in_bits;                  // Number of bits in the input buffer, increased by 8 (see below)
+    unsigned long bit_count = 0;        // Number of bits in the bit buffer
+    unsigned long dsize_bits;
+    unsigned long ctype;
+    unsigned long rep_length;
+    unsigned long minus_dist;
+    unsigned long dist_bits;
+    unsigned long value;
+    unsigned int in_pos = 3;            // Number of bytes loaded to the bit buffer (can be beyond the end)
+    unsigned int result = CMP_ABORT;
+
+    *out_size = 0;
+
+    // Same checks as in explode
+    if(in_size <= 4)
+        return CMP_BAD_DATA;
+
+    ctype      = in_bytes[0];
+    dsize_bits = in_bytes[1];
+    if(4 > dsize_bits || dsize_bits > 6)
+        return CMP_INVALID_DICTSIZE;
+    if(ctype != CMP_BINARY && ctype != CMP_ASCII)
+        return CMP_INVALID_MODE;
+
+    if(pTables->tables_ready == 0)
+        GenFastTabs(pTables);
+
+    // WasteBits fails if it can't keep 8 bits in the bit buffer.
+    // A decoded value is only valid if the input had 8 more bits after it.
+    in_bits = ((ULONGLONG)in_size << 3) - 8;
+    bit_buff = in_bytes[2];
+    bit_count = 8;
+
+    while(out_pos < out_end)
+    {
+        // Refill the bit buffer. The longest repetition takes 30 bits
+        if(bit_count < 32)
+        {
+            if((in_pos + 8) <= in_size)
+            {
+                while(bit_count <= 56)
+                {
+                    bit_buff |= (ULONGLONG)in_bytes[in_pos++] << bit_count;
+                    bit_count += 8;
+                }
+            }
+            else
+            {
+                while(bit_count <= 56)
+                {
+                    if(in_pos < in_size)
+                        bit_buff |= (ULONGLONG)in_bytes[in_pos] << bit_count;
+                    bit_count += 8;
+                    in_pos++;
+                }
+            }
+        }
+
+        // Literal byte
+        if((bit_buff & 1) == 0)
+        {
+            if(ctype == CMP_BINARY)
+            {
+                value = (unsigned long)(bit_buff >> 1) & 0xFF;
+                bit_buff >>= 9;
+                bit_count -= 9;
+            }
+            else
+            {
+                value = pTables->ChCodesAsc[(bit_buff >> 1) & 0x1FFF];
+                bit_buff >>= (value >> 8) + 1;
+                bit_count -= (value >> 8) + 1;
+            }
+
+            if(((ULONGLONG)in_pos << 3) > in_bits + bit_count)
+                break;
+            *out_pos++ = (unsigned char)value;
+            continue;
+        }
+
+        // Repetition length
+        pLength = pTables->Lengths + ((bit_buff >> 1) & 0xFF);
+        bit_buff >>= pLength->bits + 1;
+        bit_count -= pLength->bits + 1;
+        rep_length = pLength->base + ((unsigned long)bit_buff & ((1 << pLength->extra_bits) - 1));
+
+        // The end of the stream is valid even if there are no bits after the extra length bits
+        if(((ULONGLONG)in_pos << 3) > in_bits + bit_count)
+            break;
+        if(rep_length == 0x205)
+        {
+            result = CMP_NO_ERROR;
+            break;
+        }
+
+        bit_buff >>= pLength->extra_bits;
+        bit_count -= pLength->extra_bits;
+        rep_length += 2;
+
+        // Distance of the repetition
+        value = (unsigned long)bit_buff & 0xFF;
+        bit_buff >>= pTables->DistPosBits[value];
+        bit_count -= pTables->DistPosBits[value];
+        dist_bits = (rep_length == 2) ? 2 : dsize_bits;
+        minus_dist = ((pTables->DistPosCodes[value] << dist_bits) | ((unsigned long)bit_buff & ((1 << dist_bits) - 1))) + 1;
+        bit_buff >>= dist_bits;
+        bit_count -= dist_bits;
+
+        if(((ULONGLONG)in_pos << 3) > in_bits + bit_count)
+            break;
+
+        // Don't go beyond the end of the output buffer
+        if(rep_length > (unsigned long)(out_end - out_pos))
+            rep_length = (unsigned long)(out_end - out_pos);
+
+        // explode starts with a zeroed dictionary, so the data before the output are zeros
+        if(minus_dist > (unsigned long)(out_pos - out_begin))
+        {
+            for(; rep_length > 0 && minus_dist > (unsigned long)(out_pos - out_begin); rep_length--)
+                *out_pos++ = 0;
+        }
+
+        CopyRepetition(out_pos, minus_dist, rep_length);
+        out_pos += rep_length;
+    }
+
+    // Full output buffer is a success, because explode writes no more data to it
+    if(out_pos >= out_end)
+        result = CMP_NO_ERROR;
+
+    *out_size = (unsigned int)(out_pos - out_begin);
+    return result;
+}
@@ -23,6 +23,8 @@
 // Defines
 
 #define MAX_REP_LENGTH 0x204            // The longest allowed repetition
+#define CHAIN_NONE     0xFFFF           // End of a hash chain
+#define LAZY_LEVEL     4                // Lowest level that looks for a better repetition 1 byte later
 
 //-----------------------------------------------------------------------------
 // Tables
@@ -114,6 +116,18 @@ static unsigned short ChCodeAsc[] =
     0x1C00, 0x0C00, 0x1400, 0x0400, 0x1800, 0x0800, 0x1000, 0x0000  
 };
 
+// Hash chain parameters for each compression level: the maximum number
+// of occurences checked, and the repetition length that stops the search
+static unsigned short MaxChainLength[] =
+{
+    0, 2, 4, 8, 16, 32, 64, 256, 1024, 4096
+};
+
+static unsigned short NiceLength[] =
+{
+    0, 8, 16, 16, 32, 64, 128, 0x204, 0x204, 0x204
+};
+
 //-----------------------------------------------------------------------------
 // Macros
 
@@ -494,9 +508,102 @@ static unsigned int FindRep(TCmpStruct * pWork, unsigned char * input_data)
     }
 }
 
+// Adds the byte pairs before the given position to the hash chains
+static void UpdateChains(TCmpStruct * pWork, unsigned char * input_data)
+{
+    unsigned short * chain_head;
+    unsigned int input_offs = (unsigned int)(input_data - pWork->work_buff);
+
+    for(; pWork->chain_pos < input_offs; pWork->chain_pos++)
+    {
+        chain_head = pWork->chain_head + BYTE_PAIR_HASH((pWork->work_buff + pWork->chain_pos));
+        pWork->chain_prev[pWork->chain_pos] = chain_head[0];
+        chain_head[0] = (unsigned short)pWork->chain_pos;
+    }
+}
+
+// Moves the hash chains together with the data in the work buffer
+static void SlideChains(TCmpStruct * pWork, unsigned int slide)
+{
+    unsigned int i;
+
+    for(i = 0; i < 0x900; i++)
+        pWork->chain_head[i] = (pWork->chain_head[i] != CHAIN_NONE && pWork->chain_head[i] >= slide) ? (unsigned short)(pWork->chain_head[i] - slide) : CHAIN_NONE;
+
+    for(i = slide; i < pWork->chain_pos; i++)
+        pWork->chain_prev[i - slide] = (pWork->chain_prev[i] != CHAIN_NONE && pWork->chain_prev[i] >= slide) ? (unsigned short)(pWork->chain_prev[i] - slide) : CHAIN_NONE;
+
+    pWork->chain_pos -= slide;
+}
+
+// Same as FindRep, but walks the hash chain of the current PAIR_HASH
+// from the latest occurence. The number of occurences checked depends on
+// the compression level. The repetition must not go beyond "data_end".
+static unsigned int FindRepChain(TCmpStruct * pWork, unsigned char * input_data, unsigned char * data_end)
+{
+    unsigned char * prev_repetition;
+    unsigned int input_offs = (unsigned int)(input_data - pWork->work_buff);
+    unsigned int chain_length = MaxChainLength[pWork->level];
+    unsigned int nice_length = NiceLength[pWork->level];
+    unsigned int max_length = MAX_REP_LENGTH;
+    unsigned int rep_length = 1;
+    unsigned int equal_byte_count;
+    unsigned short prev_offs;
+
+    // All previous byte pairs must be in the chains
+    UpdateChains(pWork, input_data);
+
+    if(max_length > (unsigned int)(data_end - input_data))
+        max_length = (unsigned int)(data_end - input_data);
+    if(nice_length > max_length)
+        nice_length = max_length;
+    if(max_length < 2)
+        return 0;
+
+    for(prev_offs = pWork->chain_head[BYTE_PAIR_HASH(input_data)]; prev_offs != CHAIN_NONE && chain_length > 0; prev_offs = pWork->chain_prev[prev_offs], chain_length--)
+    {
+        // The occurences are sorted from the latest one,
+        // so all the following ones are out of the dictionary too
+        if((input_offs - prev_offs) > pWork->dsize_bytes)
+            break;
+
+        // Only check the occurence if it can give a longer repetition.
+        // PAIR_HASH is not unique, so the first two bytes must be checked too
+        prev_repetition = pWork->work_buff + prev_offs;
+        if(prev_repetition[rep_length] != input_data[rep_length] || prev_repetition[0] != input_data[0] || prev_repetition[1] != input_data[1])
+            continue;
+
+        for(equal_byte_count = 2; equal_byte_count < max_length; equal_byte_count++)
+        {
+            if(prev_repetition[equal_byte_count] != input_data[equal_byte_count])
+                break;
+        }
+
+        // Take the longer repetition. On the same length, the latest one has the shortest distance
+        if(equal_byte_count > rep_length)
+        {
+            pWork->distance = input_offs - prev_offs - 1;
+            rep_length = equal_byte_count;
+            if(rep_length >= nice_length)
+                break;
+        }
+    }
+
+    return (rep_length >= 2) ? rep_length : 0;
+}
+
+// Finds a repetition with the match finder selected by the compression level
+static unsigned int FindRepetition(TCmpStruct * pWork, unsigned char * input_data, unsigned char * data_end)
+{
+    if(pWork->level == CMP_LEVEL_DEFAULT)
+        return FindRep(pWork, input_data);
+    return FindRepChain(pWork, input_data, data_end);
+}
+
 static void WriteCmpData(TCmpStruct * pWork)
 {
     unsigned char * input_data_end;         // Pointer to the end of the input data
+    unsigned char * loaded_data_end;        // Pointer to the end of the loaded data
     unsigned char * input_data = pWork->work_buff + pWork->dsize_bytes + 0x204;
     unsigned int input_data_ended = 0;      // If 1, then all data from the input stream have been already loaded
     unsigned int save_rep_length;           // Saved length of current repetition
@@ -542,6 +649,7 @@ static void WriteCmpData(TCmpStruct * pWork)
         input_data_end = pWork->work_buff + pWork->dsize_bytes + total_loaded;
         if(input_data_ended)
             input_data_end += 0x204;
+        loaded_data_end = pWork->work_buff + pWork->dsize_bytes + 0x204 + total_loaded;
         
         //
         // Warning: The end of the buffer passed to "SortBuffer" is actually 2 bytes beyond
@@ -554,22 +662,26 @@ static void WriteCmpData(TCmpStruct * pWork)
 
         // Search the PAIR_HASHes of the loaded blocks. Also, include
         // previously compressed data, if any.
+        // The hash chains of the other levels are updated by FindRepChain.
         switch(phase)
         {
             case 0: 
-                SortBuffer(pWork, input_data, input_data_end + 1);
+                if(pWork->level == CMP_LEVEL_DEFAULT)
+                    SortBuffer(pWork, input_data, input_data_end + 1);
                 phase++;
                 if(pWork->dsize_bytes != 0x1000)
                     phase++;
                 break;
 
             case 1:
-                SortBuffer(pWork, input_data - pWork->dsize_bytes + 0x204, input_data_end + 1);
+                if(pWork->level == CMP_LEVEL_DEFAULT)
+                    SortBuffer(pWork, input_data - pWork->dsize_bytes + 0x204, input_data_end + 1);
                 phase++;
                 break;
 
             default:
-                SortBuffer(pWork, input_data - pWork->dsize_bytes, input_data_end + 1);
+                if(pWork->level == CMP_LEVEL_DEFAULT)
+                    SortBuffer(pWork, input_data - pWork->dsize_bytes, input_data_end + 1);
                 break;
         }
 
@@ -577,7 +689,7 @@ static void WriteCmpData(TCmpStruct * pWork)
         while(input_data < input_data_end)
         {
             // Find if the current byte sequence wasn't there before.
-            rep_length = FindRep(pWork, input_data);
+            rep_length = FindRepetition(pWork, input_data, loaded_data_end);
             while(rep_length != 0)
             {
                 // If we found repetition of 2 bytes, that is 0x100 or fuhrter back,
@@ -604,6 +716,10 @@ static void WriteCmpData(TCmpStruct * pWork)
                 if(rep_length >= 8 || input_data + 1 >= input_data_end)
                     goto __FlushRepetition;
 
+                // The fast levels take the first repetition found
+                if(pWork->level != CMP_LEVEL_DEFAULT && pWork->level < LAZY_LEVEL)
+                    goto __FlushRepetition;
+
                 // Try to find better repetition 1 byte later.
                 // Example: "ARROCKFORT" "AROCKFORT"
                 // When "input_data" points to the second string, FindRep
@@ -611,7 +727,7 @@ static void WriteCmpData(TCmpStruct * pWork)
                 // beginning 1 byte after.
                 save_rep_length = rep_length;
                 save_distance = pWork->distance;
-                rep_length = FindRep(pWork, input_data + 1);
+                rep_length = FindRepetition(pWork, input_data + 1, loaded_data_end);
 
                 // Only use the new repetition if it's length is greater than the previous one
                 if(rep_length > save_rep_length)
@@ -662,7 +778,9 @@ _00402252:;
         if(input_data_ended == 0)
         {
             input_data -= 0x1000;
-            memcpy(pWork->work_buff, pWork->work_buff + 0x1000, pWork->dsize_bytes + 0x204);
+            memmove(pWork->work_buff, pWork->work_buff + 0x1000, pWork->dsize_bytes + 0x204);
+            if(pWork->level != CMP_LEVEL_DEFAULT)
+                SlideChains(pWork, 0x1000);
         }
     }
 
@@ -679,13 +797,14 @@ __Exit:
 //-----------------------------------------------------------------------------
 // Main imploding function
 
-unsigned int PKEXPORT implode(
+unsigned int PKEXPORT implode_level(
     unsigned int (*read_buf)(char *buf, unsigned int *size, void *param),
     void         (*write_buf)(char *buf, unsigned int *size, void *param),
     char         *work_buf,
     void         *param,
     unsigned int *type,
-    unsigned int *dsize)
+    unsigned int *dsize,
+    unsigned int  level)
 {
     TCmpStruct * pWork = (TCmpStruct *)work_buf;
     unsigned int nChCode;
@@ -703,6 +822,11 @@ unsigned int PKEXPORT implode(
     pWork->dsize_bits  = 4;
     pWork->dsize_mask  = 0x0F;
 
+    // Test the compression level
+    if(level > CMP_LEVEL_BEST)
+        return CMP_INVALID_MODE;
+    pWork->level = level;
+
     // Test dictionary size
     switch(*dsize)
     {
@@ -764,6 +888,25 @@ unsigned int PKEXPORT implode(
     // Copy the distance codes and distance bits and perform the compression
     memcpy(&pWork->dist_codes, DistCode, sizeof(DistCode));
     memcpy(&pWork->dist_bits, DistBits, sizeof(DistBits));
+
+    // The hash chains start empty, at the first byte of the input data
+    if(pWork->level != CMP_LEVEL_DEFAULT)
+    {
+        memset(pWork->chain_head, 0xFF, sizeof(pWork->chain_head));
+        pWork->chain_pos = pWork->dsize_bytes + 0x204;
+    }
+
     WriteCmpData(pWork);
     return CMP_NO_ERROR;
 }
+
+unsigned int PKEXPORT implode(
+    unsigned int (*read_buf)(char *buf, unsigned int *size, void *param),
+    void         (*write_buf)(char *buf, unsigned int *size, void *param),
+    char         *work_buf,
+    void         *param,
+    unsigned int *type,
+    unsigned int *dsize)
+{
+    return implode_level(read_buf, write_buf, work_buf, param, type, dsize, CMP_LEVEL_DEFAULT);
+}
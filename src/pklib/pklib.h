@@ -29,6 +29,10 @@
 #define CMP_IMPLODE_DICT_SIZE2   2048       // Dictionary size of 2048
 #define CMP_IMPLODE_DICT_SIZE3   4096       // Dictionary size of 4096
 
+#define CMP_LEVEL_DEFAULT        0          // Sorted pair hashes. Same output as the PKWARE library
+#define CMP_LEVEL_FASTEST        1          // Hash chains, the fastest compression
+#define CMP_LEVEL_BEST           9          // Hash chains, the best compression
+
 //-----------------------------------------------------------------------------
 // Define calling convention
 
@@ -72,6 +76,12 @@ typedef struct
                                             //  + DICT_OFFSET  => Dictionary
                                             //  + UNCMP_OFFSET => Uncompressed data
     unsigned short phash_offs[0x2204];      // 49D0: Table of offsets for each PAIR_HASH
+
+    // Hash chain match finder, used instead of the tables above for levels 1-9
+    unsigned int   level;                   // Compression level (CMP_LEVEL_XXX)
+    unsigned int   chain_pos;               // Offset of the first byte pair not yet added to the chains
+    unsigned short chain_head[0x900];       // Offset of the latest occurence of each PAIR_HASH
+    unsigned short chain_prev[0x2204];      // Offset of the previous occurence of the same PAIR_HASH
 } TCmpStruct;
 
 #define CMP_BUFFER_SIZE  sizeof(TCmpStruct) // Size of compression structure.
@@ -115,6 +125,28 @@ typedef struct
 #define EXP_BUFFER_SIZE sizeof(TDcmpStruct) // Size of decompression structure
                                             // Defined as 12596 in pkware headers
 
+// Length entry of the decode tables for explode_buffer
+typedef struct
+{
+    unsigned short base;                    // Base length (0x205 = end of stream)
+    unsigned char  bits;                    // Number of bits of the length code
+    unsigned char  extra_bits;              // Number of extra bits added to the base length
+} TDcmpLength;
+
+// Decode tables for explode_buffer. They only depend on the constant PKWARE tables,
+// so they are built by the first call and used by all following calls.
+// Each table is indexed by the next bits from the input stream.
+typedef struct
+{
+    unsigned long  tables_ready;            // Nonzero if the tables have been built
+    TDcmpLength    Lengths[0x100];          // Repetition lengths, indexed by 8 bits
+    unsigned char  DistPosCodes[0x100];     // Distance position codes, indexed by 8 bits
+    unsigned char  DistPosBits[0x100];      // Number of bits of the distance position codes
+    unsigned short ChCodesAsc[0x2000];      // ASCII literals, indexed by 13 bits. Byte value | (number of bits << 8)
+} TDcmpTables;
+
+#define EXP_TABLES_SIZE sizeof(TDcmpTables) // Size of the decode tables for explode_buffer
+
 //-----------------------------------------------------------------------------
 // Public functions
 
@@ -131,12 +163,33 @@ unsigned int PKEXPORT implode(
    unsigned int *dsize);
 
 
+// Same as implode, with selectable compression level (CMP_LEVEL_XXX).
+// All levels produce data that can be decompressed by explode.
+unsigned int PKEXPORT implode_level(
+   unsigned int (*read_buf)(char *buf, unsigned int *size, void *param),
+   void         (*write_buf)(char *buf, unsigned int *size, void *param),
+   char         *work_buf,
+   void         *param,
+   unsigned int *type,
+   unsigned int *dsize,
+   unsigned int  level);
+
 unsigned int PKEXPORT explode(
    unsigned int (*read_buf)(char *buf, unsigned  int *size, void *param),
    void         (*write_buf)(char *buf, unsigned  int *size, void *param),
    char         *work_buf,
    void         *param);
 
+// Decompresses data that is entirely in memory. Same output as explode.
+// The work buffer must be zeroed before the first call; it keeps the decode tables
+// and should be passed to the following calls as well.
+unsigned int PKEXPORT explode_buffer(
+   char         *out_buf,
+   unsigned int *out_size,
+   char         *in_buf,
+   unsigned int  in_size,
+   char         *work_buf);
+
 // The original name "crc32" was changed to "crc32pk" due
 // to compatibility with zlib
 unsigned long PKEXPORT crc32_pklib(char *buffer, unsigned int *size, unsigned long *old_crc);
@@ -19,6 +19,10 @@
 
 #include "../src/StormLib.h"
 #include "../src/StormCommon.h"
+#include "../src/adpcm/adpcm.h"
+#include "../src/pklib/pklib.h"
+#include "../src/huffman/huff.h"
+#include "../src/lzma/C/LzmaDec.h"
 
 #ifdef _MSC_VER
 #pragma warning(disable: 4505)              // 'XXX' : unreferenced local function has been removed
@@ -45,6 +49,12 @@
 
 #define MPQ_SECTOR_SIZE 0x1000
 
+#define ASYNC_READ_PARTS 4                  // Number of asynchronous reads that cover a file
+#define ASYNC_READ_EOF_SIZE 0x100           // Size of the asynchronous read past the end of file
+#define BATCH_TEST_NAMES 0x20               // Max number of names given to SFileReadFilesBatch by the test
+#define THREAD_READ_COUNT 6                 // Number of threads that read from one thread-safe archive
+#define PART_FILE_PART_SIZE 0x4000          // Size of one part in the PART files made by the test
+
 #define MAKE_PATH(path) (WORK_PATH_ROOT path)
 
 //-----------------------------------------------------------------------------
@@ -665,895 +675,4763 @@ __TryAgain:
     return nError;
 }
 
-static int TestArchiveOpenAndClose(const char * szMpqName)
+// Truncated Huffmann data must either fail to decompress,
+// or produce the complete original data (when the output buffer
+// was filled before the missing bits were needed)
+static int TestHuffmannTruncated(int nSectorSize)
 {
-    const char * szFileName1 = "ITEM\\TEXTURECOMPONENTS\\LegLowerTexture\\MAIL_DUNGEONSHAMAN_B_01BLUE_PANT_LL_U.BLP";
-//  const char * szFileName2 = "items\\map\\mapz_deleted.cel";
-    TMPQArchive * ha = NULL;
-    HANDLE hFile1 = NULL;
-//  HANDLE hFile2 = NULL;
-    HANDLE hMpq = NULL;
+    LPBYTE pbDecompressed = NULL;
+    LPBYTE pbCompressed = NULL;
+    LPBYTE pbOriginal = NULL;
     int nError = ERROR_SUCCESS;
 
-    if(nError == ERROR_SUCCESS)
-    {
-        printf("Opening archive %s ...\n", szMpqName);
-        if(!SFileOpenArchive(szMpqName, 0, 0, /* MPQ_OPEN_ENCRYPTED,*/ &hMpq))
-            nError = GetLastError();
-        ha = (TMPQArchive *)hMpq;
-    }
-/*
-    // Test for TBitArray
-    if(nError == ERROR_SUCCESS && ha->pHetTable != NULL)
+    // Allocate buffers
+    pbDecompressed = new BYTE[nSectorSize];
+    pbCompressed = new BYTE[nSectorSize];
+    pbOriginal = new BYTE[nSectorSize];
+    if(!pbDecompressed || !pbCompressed || !pbOriginal)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    for(int i = 0; nError == ERROR_SUCCESS && i < 100; i++)
     {
-        TBitArray * pBitArray = ha->pHetTable->pBetIndexes;
+        int nOriginalLength = (rand() % nSectorSize) + 1;
+        int nCompressedLength = nSectorSize;
+        int nDecompressedLength;
+        int nRange = (i % 5) * 20 + 3;
+
+        clreol();
+        printf("Testing truncated Huffmann data %u\r", i + 1);
+
+        // Generate data with limited set of values, so that it compresses
+        for(int j = 0; j < nOriginalLength; j++)
+            pbOriginal[j] = (BYTE)(rand() % nRange);
+
+        // Compress the data. Skip the blocks that didn't compress
+        if(!SCompCompress((char *)pbCompressed, &nCompressedLength, (char *)pbOriginal, nOriginalLength, MPQ_COMPRESSION_HUFFMANN, 0, 0))
+            continue;
+        if(nCompressedLength >= nOriginalLength)
+            continue;
+
+        // The complete data must decompress
+        nDecompressedLength = nOriginalLength;
+        if(!SCompDecompress((char *)pbDecompressed, &nDecompressedLength, (char *)pbCompressed, nCompressedLength) ||
+           nDecompressedLength != nOriginalLength ||
+           GetFirstDiffer(pbDecompressed, pbOriginal, nOriginalLength) != -1)
+        {
+            printf("Huffmann data failed to decompress !!!\n");
+            nError = ERROR_FILE_CORRUPT;
+            break;
+        }
 
-        for(ULONG i = 0; i < 0x10000; i++)
+        // Any truncated data must be rejected unless the output is complete
+        for(int nCutLength = 1; nCutLength < nCompressedLength; nCutLength++)
         {
-            BYTE LoadedBits[0x20];
-            BYTE SaveBits[0x40];
-            unsigned int nBitPosition = (i >> 0x08);
-            unsigned int nBitCount = (i & 0xFF);
+            nDecompressedLength = nOriginalLength;
+            if(!SCompDecompress((char *)pbDecompressed, &nDecompressedLength, (char *)pbCompressed, nCutLength))
+                continue;
 
-            memset(LoadedBits, 0, sizeof(LoadedBits));
-            memcpy(SaveBits, pBitArray->Elements, sizeof(SaveBits));
+            if(nDecompressedLength != nOriginalLength || GetFirstDiffer(pbDecompressed, pbOriginal, nOriginalLength) != -1)
+            {
+                printf("Truncated Huffmann data were accepted (%u of %u bytes) !!!\n", nCutLength, nCompressedLength);
+                nError = ERROR_FILE_CORRUPT;
+                break;
+            }
+        }
+    }
 
-            // Load the index to the BET table
-            pBitArray->GetBits(nBitPosition, nBitCount, LoadedBits, sizeof(LoadedBits));
+    // Cleanup
+    delete [] pbOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed;
+    clreol();
+    return nError;
+}
 
-            // Load the index to the BET table
-            pBitArray->SetBits(nBitPosition, nBitCount, LoadedBits, sizeof(LoadedBits));
+// The table-driven Huffmann decoder must give the same output
+// as the original tree decoder, for all compression types
+static int TestHuffmannDecoder(int nSectorSize)
+{
+    THuffmannDecoder * pDecoder = NULL;
+    LPBYTE pbDecompressed1 = NULL;
+    LPBYTE pbDecompressed2 = NULL;
+    LPBYTE pbCompressed = NULL;
+    LPBYTE pbOriginal = NULL;
+    int nError = ERROR_SUCCESS;
 
-            // Verify the bits
-            if(memcmp(SaveBits, pBitArray->Elements, sizeof(SaveBits)))
-                assert(false);
-        }
-    }
-*/
-    // Verify the raw data in the archive
+    // Allocate buffers. The original decoder may read a few bytes past the input
+    pDecoder = new THuffmannDecoder;
+    pbDecompressed1 = new BYTE[nSectorSize];
+    pbDecompressed2 = new BYTE[nSectorSize];
+    pbCompressed = new BYTE[nSectorSize * 2 + 0x10];
+    pbOriginal = new BYTE[nSectorSize];
+    if(!pDecoder || !pbDecompressed1 || !pbDecompressed2 || !pbCompressed || !pbOriginal)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    // The decoder keeps the initial tree between the calls
     if(nError == ERROR_SUCCESS)
-    {
-        // Verify the archive
-        SFileVerifyRawData(hMpq, SFILE_VERIFY_FILE, szFileName1);
+        pDecoder->InitDecoder();
 
-        // Try to open a file
-        if(!SFileOpenFileEx(hMpq, szFileName1, SFILE_OPEN_FROM_MPQ, &hFile1))
+    for(int i = 0; nError == ERROR_SUCCESS && i < 10000; i++)
+    {
+        THuffmannTree ht;
+        TOutputStream os;
+        TInputStream is;
+        int nOriginalLength = (rand() % nSectorSize) + 1;
+        int nCmpType = i % 9;
+        unsigned int nCompressedLength;
+        unsigned int nLength1;
+        unsigned int nLength2;
+
+        clreol();
+        printf("Testing Huffmann decoder %u\r", i + 1);
+
+        GenerateRandomDataBlock(pbOriginal, nOriginalLength);
+
+        // Compress the data
+        os.pbOutBuffer = pbCompressed;
+        os.cbOutSize   = nSectorSize * 2;
+        os.pbOutPos    = pbCompressed;
+        os.dwBitBuff   = 0;
+        os.nBits       = 0;
+        ht.InitTree(true);
+        nCompressedLength = ht.DoCompression(&os, pbOriginal, nOriginalLength, nCmpType);
+        memset(pbCompressed + nCompressedLength, 0, 0x10);
+
+        // Decompress by both decoders. Every other block has a short output buffer
+        if(i & 1)
+            nOriginalLength = nOriginalLength / 2 + 1;
+
+        is.pbInBuffer    = pbCompressed;
+        is.pbInBufferEnd = pbCompressed + nCompressedLength;
+        is.BitBuffer     = 0;
+        is.BitCount      = 0;
+        ht.InitTree(false);
+        nLength1 = ht.DoDecompression(pbDecompressed1, nOriginalLength, &is);
+        nLength2 = pDecoder->DoDecompression(pbDecompressed2, nOriginalLength, pbCompressed, nCompressedLength);
+
+        if(nLength2 != nLength1 || GetFirstDiffer(pbDecompressed2, pbDecompressed1, nLength1) != -1)
         {
-            nError = GetLastError();
-            printf("%s - file not found in the MPQ\n", szFileName1);
+            printf("Huffmann decoders don't agree (compression type %u) !!!\n", nCmpType);
+            nError = ERROR_FILE_CORRUPT;
         }
     }
 
-    // Dummy read from the file
-    if(nError == ERROR_SUCCESS)
-	{
-        DWORD dwBytesRead = 0;
-		BYTE Buffer[0x1000];
-
-        SFileReadFile(hFile1, Buffer, sizeof(Buffer), &dwBytesRead);
-	}
-/*
-    // Verify the MPQ listfile
-    if(nError == ERROR_SUCCESS)
-    {
-        SFileVerifyFile(hMpq, szFileName1, 0xFFFFFFFF); 
-        if(!CompareArchivedFilesRR(szFileName1, hFile1, hFile2, 0x100000))
-            nError = ERROR_CAN_NOT_COMPLETE;
-    }
-*/
-    if(hFile1 != NULL)
-        SFileCloseFile(hFile1);
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
+    // Cleanup
+    delete [] pbOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed2;
+    delete [] pbDecompressed1;
+    delete pDecoder;
+    clreol();
     return nError;
 }
 
-static int TestFindFiles(const char * szMpqName)
+// Buffers for the callbacks of implode and explode
+struct TTestDataInfo
 {
-    TMPQFile * hf;
-    HANDLE hFile;
-    HANDLE hMpq = NULL;
-    BYTE Buffer[100];
+    char * pbInBuff;                        // Pointer to input data buffer
+    char * pbInBuffEnd;                     // End of the input buffer
+    char * pbOutBuff;                       // Pointer to output data buffer
+    char * pbOutBuffEnd;                    // End of the output buffer
+};
+
+static unsigned int TestReadInputData(char * buf, unsigned int * size, void * param)
+{
+    TTestDataInfo * pInfo = (TTestDataInfo *)param;
+    unsigned int nToRead = *size;
+
+    if(nToRead > (unsigned int)(pInfo->pbInBuffEnd - pInfo->pbInBuff))
+        nToRead = (unsigned int)(pInfo->pbInBuffEnd - pInfo->pbInBuff);
+
+    memcpy(buf, pInfo->pbInBuff, nToRead);
+    pInfo->pbInBuff += nToRead;
+    return nToRead;
+}
+
+static void TestWriteOutputData(char * buf, unsigned int * size, void * param)
+{
+    TTestDataInfo * pInfo = (TTestDataInfo *)param;
+    unsigned int nToWrite = *size;
+
+    if(nToWrite > (unsigned int)(pInfo->pbOutBuffEnd - pInfo->pbOutBuff))
+        nToWrite = (unsigned int)(pInfo->pbOutBuffEnd - pInfo->pbOutBuff);
+
+    memcpy(pInfo->pbOutBuff, buf, nToWrite);
+    pInfo->pbOutBuff += nToWrite;
+}
+
+// explode_buffer must give the same output as explode, for both
+// compression types and all dictionary sizes. Besides valid data,
+// the data are also truncated, damaged or replaced by random bytes
+static int TestExplodeBuffer(int nSectorSize)
+{
+    TTestDataInfo Info;
+    unsigned int nLength2;
+    unsigned int ctype;
+    unsigned int dict_size;
+    char * pbDecompressed1 = NULL;
+    char * pbDecompressed2 = NULL;
+    char * pbCompressed = NULL;
+    char * pbOriginal = NULL;
+    char * work_buf = NULL;
+    char * tables = NULL;
     int nError = ERROR_SUCCESS;
-    int nFiles = 0;
-    int nFound = 0;
 
-    // Open the archive
-    if(nError == ERROR_SUCCESS)
-    {
-        printf("Opening \"%s\" for finding files ...\n", szMpqName);
-        if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
-            nError = GetLastError();
-    }
+    // Allocate buffers
+    pbDecompressed1 = new char[nSectorSize];
+    pbDecompressed2 = new char[nSectorSize];
+    pbCompressed = new char[nSectorSize * 2];
+    pbOriginal = new char[nSectorSize];
+    work_buf = new char[CMP_BUFFER_SIZE];
+    tables = new char[EXP_TABLES_SIZE];
+    if(!pbDecompressed1 || !pbDecompressed2 || !pbCompressed || !pbOriginal || !work_buf || !tables)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
 
-    // Compact the archive
+    // The decode tables are built by the first call and kept
     if(nError == ERROR_SUCCESS)
-    {
-        SFILE_FIND_DATA sf;
-        HANDLE hFind;
-        DWORD dwExtraDataSize;
-        bool bFound = true;
+        memset(tables, 0, EXP_TABLES_SIZE);
 
-        hFind = SFileFindFirstFile(hMpq, "*", &sf, "c:\\Tools32\\ListFiles\\ListFile.txt");
-        while(hFind != NULL && bFound != false)
+    for(int i = 0; nError == ERROR_SUCCESS && i < 20000; i++)
+    {
+        int nOriginalLength = (rand() % nSectorSize) + 1;
+        int nCompressedLength;
+
+        clreol();
+        printf("Testing explode_buffer %u\r", i + 1);
+
+        // Compress the data
+        GenerateRandomDataBlock((LPBYTE)pbOriginal, nOriginalLength);
+        ctype = ((i / 4) & 1) ? CMP_ASCII : CMP_BINARY;
+        dict_size = CMP_IMPLODE_DICT_SIZE1 << ((i / 8) % 3);
+
+        memset(work_buf, 0, CMP_BUFFER_SIZE);
+        Info.pbInBuff     = pbOriginal;
+        Info.pbInBuffEnd  = pbOriginal + nOriginalLength;
+        Info.pbOutBuff    = pbCompressed;
+        Info.pbOutBuffEnd = pbCompressed + nSectorSize * 2;
+        implode(TestReadInputData, TestWriteOutputData, work_buf, &Info, &ctype, &dict_size);
+        nCompressedLength = (int)(Info.pbOutBuff - pbCompressed);
+
+        // Damage the data
+        switch(i % 4)
         {
-            if(SFileOpenFileEx(hMpq, sf.cFileName, 0, &hFile))
-            {
-                hf = (TMPQFile *)hFile;
-                SFileReadFile(hFile, Buffer, sizeof(Buffer));
-                nFiles++;
+            case 1:     // Truncated data
+                nCompressedLength = rand() % (nCompressedLength + 1);
+                break;
 
-                if(sf.dwFileFlags & MPQ_FILE_SECTOR_CRC)
-                {
-                    dwExtraDataSize = hf->SectorOffsets[hf->dwSectorCount + 1] - hf->SectorOffsets[hf->dwSectorCount];
-                    if(dwExtraDataSize != 0)
-                        nFound++;
-                }
+            case 2:     // A few damaged bytes after the header
+                for(int j = 0; j < 4; j++)
+                    pbCompressed[2 + rand() % (nCompressedLength - 2)] ^= (char)(1 << (rand() % 8));
+                break;
 
-                SFileCloseFile(hFile);
-            }
+            case 3:     // Random data with a valid header
+                for(int j = 2; j < nCompressedLength; j++)
+                    pbCompressed[j] = (char)rand();
+                break;
+        }
 
-            bFound = SFileFindNextFile(hFind, &sf);
+        // Decompress by explode
+        memset(work_buf, 0, EXP_BUFFER_SIZE);
+        Info.pbInBuff     = pbCompressed;
+        Info.pbInBuffEnd  = pbCompressed + nCompressedLength;
+        Info.pbOutBuff    = pbDecompressed1;
+        Info.pbOutBuffEnd = pbDecompressed1 + nOriginalLength;
+        explode(TestReadInputData, TestWriteOutputData, work_buf, &Info);
+
+        // Decompress by explode_buffer
+        nLength2 = nOriginalLength;
+        explode_buffer(pbDecompressed2, &nLength2, pbCompressed, nCompressedLength, tables);
+
+        if(nLength2 != (unsigned int)(Info.pbOutBuff - pbDecompressed1) || GetFirstDiffer(pbDecompressed2, pbDecompressed1, nLength2) != -1)
+        {
+            printf("explode_buffer doesn't agree with explode (test %u) !!!\n", i);
+            nError = ERROR_FILE_CORRUPT;
         }
     }
 
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
-    if(nError == ERROR_SUCCESS)
-        printf("Search complete\n");
+    // Cleanup
+    delete [] tables;
+    delete [] work_buf;
+    delete [] pbOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed2;
+    delete [] pbDecompressed1;
+    clreol();
     return nError;
 }
 
-static int TestMpqCompacting(const char * szMpqName)
+// Fills the buffer with words, using a generator that gives the same
+// data on all platforms. Used where the compressed data are compared
+// against fixed values.
+static void GenerateTextBlock(char * pbBuffer, int cbBuffer)
 {
-    HANDLE hMpq = NULL;
-    int nError = ERROR_SUCCESS;
+    static const char * szWords[] = {"Storm", "Library", " ", "MPQ", "archive", "\r\n", "file", "0123", "data", " "};
+    DWORD dwSeed = 0x12345678;
+    int i = 0;
 
-    // Open the archive
-    if(nError == ERROR_SUCCESS)
+    while(i < cbBuffer)
     {
-        printf("Opening \"%s\" for compacting ...\n", szMpqName);
-        if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
-            nError = GetLastError();
+        const char * szWord;
+
+        dwSeed = dwSeed * 1103515245 + 12345;
+        szWord = szWords[(dwSeed >> 16) % 10];
+        while(*szWord != 0 && i < cbBuffer)
+            pbBuffer[i++] = *szWord++;
     }
+}
 
-/*
-    if(nError == ERROR_SUCCESS)
-    {
-        char * szFileName = "Campaign\\Human\\Human01.pud";
+// FNV-1a hash of a data block
+static DWORD HashDataBlock(const char * pbData, unsigned int cbData)
+{
+    DWORD dwHash = 0x811C9DC5;
 
-        printf("Deleting file %s ...\r", szFileName);
-        if(!SFileRemoveFile(hMpq, szFileName))
-            nError = GetLastError();
-    }
-*/
-    // Compact the archive
-    if(nError == ERROR_SUCCESS)
+    for(unsigned int i = 0; i < cbData; i++)
     {
-        printf("Compacting archive ...\r");
-        SFileSetCompactCallback(hMpq, CompactCB, NULL);
-        if(!SFileCompactArchive(hMpq, "c:\\Tools32\\ListFiles\\ListFile.txt"))
-            nError = GetLastError();
+        dwHash ^= (BYTE)pbData[i];
+        dwHash *= 0x01000193;
     }
-
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
-    if(nError == ERROR_SUCCESS)
-        printf("Compacting complete (No errors)\n");
-    return nError;
+    return dwHash;
 }
 
-static int TestCreateArchive(const char * szMpqName)
+// Length and hash of a text block of 0x1000 bytes, compressed
+// by the implode of StormLib versions before the compression levels
+struct TImplodeReference
 {
-    TFileStream * pStream;
-    const char * szFileName1 = MAKE_PATH("FileTest.exe");
-    const char * szFileName2 = MAKE_PATH("ZeroSize.txt");
-    HANDLE hMpq = NULL;                 // Handle of created archive 
-    DWORD dwVerifyResult;
-    DWORD dwFileCount = 0;
-    LCID LocaleIDs[] = {0x000, 0x405, 0x406, 0x407, 0xFFFF};
-    char szMpqFileName[MAX_PATH];
+    unsigned int ctype;
+    unsigned int dict_size;
+    unsigned int nLength;
+    DWORD dwHash;
+};
+
+static const TImplodeReference ImplodeReference[] =
+{
+    {CMP_BINARY, CMP_IMPLODE_DICT_SIZE1, 996, 0x8CBD608D},
+    {CMP_BINARY, CMP_IMPLODE_DICT_SIZE2, 977, 0xE670266E},
+    {CMP_BINARY, CMP_IMPLODE_DICT_SIZE3, 976, 0x230B2BCB},
+    {CMP_ASCII,  CMP_IMPLODE_DICT_SIZE1, 967, 0x4AA21482},
+    {CMP_ASCII,  CMP_IMPLODE_DICT_SIZE2, 952, 0xB437FD40},
+    {CMP_ASCII,  CMP_IMPLODE_DICT_SIZE3, 952, 0x8A1F56BA}
+};
+
+// Level 0 must give the same data as the previous versions.
+// All levels must give data that explode decompresses back.
+static int TestImplodeLevels(int nSectorSize)
+{
+    TTestDataInfo Info;
+    unsigned int nLength;
+    unsigned int ctype;
+    unsigned int dict_size;
+    char * pbDecompressed = NULL;
+    char * pbCompressed = NULL;
+    char * pbOriginal = NULL;
+    char * work_buf = NULL;
+    int cbDecompressed;
+    int cbCompressed;
     int nError = ERROR_SUCCESS;
-    int i;
 
-    // Create the new file
-    printf("Creating %s ...\n", szMpqName);
-    pStream = FileStream_CreateFile(szMpqName);
-    if(pStream == NULL)
-        nError = GetLastError();
+    // Allocate buffers
+    pbDecompressed = new char[nSectorSize];
+    pbCompressed = new char[nSectorSize * 2];
+    pbOriginal = new char[nSectorSize];
+    work_buf = new char[CMP_BUFFER_SIZE];
+    if(!pbDecompressed || !pbCompressed || !pbOriginal || !work_buf)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
 
-    // Write some data
+    // Invalid levels must be rejected
     if(nError == ERROR_SUCCESS)
     {
-        ULONGLONG FileSize = 0x100000;
-      
-        FileStream_SetSize(pStream, FileSize);
-        FileStream_Close(pStream);
+        if(SCompSetImplodeLevel(MPQ_IMPLODE_LEVEL_DEFAULT - 1) || SCompSetImplodeLevel(MPQ_IMPLODE_LEVEL_BEST + 1))
+        {
+            printf("SCompSetImplodeLevel accepted an invalid level !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
     }
 
-    // Well, now create the MPQ archive
-    if(nError == ERROR_SUCCESS)
+    // Level 0 must match the data of the previous versions
+    if(nError == ERROR_SUCCESS && nSectorSize >= 0x1000)
     {
-        if(!SFileCreateArchive(szMpqName,
-                               MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_ATTRIBUTES,
-                               7,
-                              &hMpq))
+        GenerateTextBlock(pbOriginal, 0x1000);
+        for(size_t i = 0; i < sizeof(ImplodeReference) / sizeof(ImplodeReference[0]); i++)
         {
-            nError = GetLastError();
+            ctype = ImplodeReference[i].ctype;
+            dict_size = ImplodeReference[i].dict_size;
+
+            memset(work_buf, 0, CMP_BUFFER_SIZE);
+            Info.pbInBuff     = pbOriginal;
+            Info.pbInBuffEnd  = pbOriginal + 0x1000;
+            Info.pbOutBuff    = pbCompressed;
+            Info.pbOutBuffEnd = pbCompressed + nSectorSize * 2;
+            implode(TestReadInputData, TestWriteOutputData, work_buf, &Info, &ctype, &dict_size);
+
+            nLength = (unsigned int)(Info.pbOutBuff - pbCompressed);
+            if(nLength != ImplodeReference[i].nLength || HashDataBlock(pbCompressed, nLength) != ImplodeReference[i].dwHash)
+            {
+                printf("implode output differs from the previous versions (ctype %u, dict %u) !!!\n", ctype, dict_size);
+                nError = ERROR_FILE_CORRUPT;
+                break;
+            }
         }
     }
 
-    // Add the same file multiple times
-    if(nError == ERROR_SUCCESS)
+    // SCompImplode at level 0 uses the binary type and the 4 KB dictionary for this size
+    if(nError == ERROR_SUCCESS && nSectorSize >= 0x1000)
     {
-//      SFileCompactArchive(hMpq);
-//      if(!SFileAddFileEx(hMpq,
-//                         "e:\\Multimedia\\MPQs\\Achievement.dbc",
-//                         "enGB\\DBFilesClient\\Achievement.dbc", 
-//                         MPQ_FILE_COMPRESS,
-//                         MPQ_COMPRESSION_ZLIB))
-//      {
-//          printf("Failed to add the file \"%s\".\n", szMpqFileName);
-//      }
+        SCompSetImplodeLevel(MPQ_IMPLODE_LEVEL_DEFAULT);
+        cbCompressed = nSectorSize * 2;
+        SCompImplode(pbCompressed, &cbCompressed, pbOriginal, 0x1000);
 
-        // Add FileTest.exe
-        for(i = 0; AddFlags[i] != 0xFFFFFFFF; i++)
-        {
-            sprintf(szMpqFileName, "FileTest_%02u.exe", i);
-            printf("Adding %s as %s ...\n", szFileName1, szMpqFileName);
-            if(SFileAddFileEx(hMpq, szFileName1, szMpqFileName, AddFlags[i], MPQ_COMPRESSION_ZLIB))
-            {
-                dwVerifyResult = SFileVerifyFile(hMpq, szMpqFileName, MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5);
-                if(dwVerifyResult & (VERIFY_OPEN_ERROR | VERIFY_READ_ERROR | VERIFY_FILE_SECTOR_CRC_ERROR | VERIFY_FILE_CHECKSUM_ERROR | VERIFY_FILE_MD5_ERROR))
-                    printf("CRC error on \"%s\"\n", szMpqFileName);
-                dwFileCount++;
-            }
-            else
-            {
-                printf("Failed to add the file \"%s\".\n", szMpqFileName);
-            }
-        }
-
-        
-        SFileRemoveFile(hMpq, "FileTest_10.exe");
-        SFileRemoveFile(hMpq, "FileTest_15.exe");
-        dwFileCount = SFileGetMaxFileCount(hMpq);
-        SFileSetMaxFileCount(hMpq, dwFileCount - 1);
-
-        // Add ZeroSize.txt (1)
-        sprintf(szMpqFileName, "ZeroSize_1.txt");
-        for(i = 0; LocaleIDs[i] != 0xFFFF; i++)
-        {
-            printf("Adding %s as %s (locale %04x) ...\n", szFileName2, szMpqFileName, LocaleIDs[i]);
-            SFileSetLocale(LocaleIDs[i]);
-            if(!SFileAddFileEx(hMpq, szFileName2, szMpqFileName, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED, MPQ_COMPRESSION_ZLIB))
-                printf("Cannot add the file\n");
-        }
-
-        // Add ZeroSize.txt (1)
-        sprintf(szMpqFileName, "ZeroSize_2.txt");
-        for(int i = 0; LocaleIDs[i] != 0xFFFF; i++)
+        nLength = (unsigned int)cbCompressed;
+        if(nLength != ImplodeReference[2].nLength || HashDataBlock(pbCompressed, nLength) != ImplodeReference[2].dwHash)
         {
-            printf("Adding %s as %s (locale %04x) ...\n", szFileName2, szMpqFileName, LocaleIDs[i]);
-            SFileSetLocale(LocaleIDs[i]);
-            if(!SFileAddFileEx(hMpq, szFileName2, szMpqFileName, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED, MPQ_COMPRESSION_ZLIB))
-                printf("Cannot add the file\n");
+            printf("SCompImplode output differs from the previous versions !!!\n");
+            nError = ERROR_FILE_CORRUPT;
         }
     }
 
-    // Test rename function
-    if(nError == ERROR_SUCCESS)
+    // Round trip of all levels, both compression types and all dictionary sizes
+    for(int i = 0; nError == ERROR_SUCCESS && i < 3000; i++)
     {
-        printf("Testing rename files ...\n");
-        SFileSetLocale(LANG_NEUTRAL);
-        if(!SFileRenameFile(hMpq, "FileTest_08.exe", "FileTest_08a.exe"))
-        {
-            nError = GetLastError();
-            printf("Failed to rename the file\n");
-        }
+        int nOriginalLength = (rand() % nSectorSize) + 1;
+        unsigned int nLevel = i % (CMP_LEVEL_BEST + 1);
 
-        if(!SFileRenameFile(hMpq, "FileTest_08a.exe", "FileTest_08.exe"))
+        clreol();
+        printf("Testing implode levels %u\r", i + 1);
+
+        // Text blocks compress well, random blocks don't
+        if(i & 1)
+            GenerateRandomDataBlock((LPBYTE)pbOriginal, nOriginalLength);
+        else
+            GenerateTextBlock(pbOriginal, nOriginalLength);
+        ctype = ((i / 10) & 1) ? CMP_ASCII : CMP_BINARY;
+        dict_size = CMP_IMPLODE_DICT_SIZE1 << ((i / 20) % 3);
+
+        memset(work_buf, 0, CMP_BUFFER_SIZE);
+        Info.pbInBuff     = pbOriginal;
+        Info.pbInBuffEnd  = pbOriginal + nOriginalLength;
+        Info.pbOutBuff    = pbCompressed;
+        Info.pbOutBuffEnd = pbCompressed + nSectorSize * 2;
+        if(implode_level(TestReadInputData, TestWriteOutputData, work_buf, &Info, &ctype, &dict_size, nLevel) != CMP_NO_ERROR)
         {
-            nError = GetLastError();
-            printf("Failed to rename the file\n");
+            printf("implode_level failed (level %u, test %u) !!!\n", nLevel, i);
+            nError = ERROR_CAN_NOT_COMPLETE;
+            break;
         }
+        cbCompressed = (int)(Info.pbOutBuff - pbCompressed);
 
-        if(!SFileRenameFile(hMpq, "FileTest_10.exe", "FileTest_10a.exe"))
+        memset(work_buf, 0, EXP_BUFFER_SIZE);
+        Info.pbInBuff     = pbCompressed;
+        Info.pbInBuffEnd  = pbCompressed + cbCompressed;
+        Info.pbOutBuff    = pbDecompressed;
+        Info.pbOutBuffEnd = pbDecompressed + nOriginalLength;
+        explode(TestReadInputData, TestWriteOutputData, work_buf, &Info);
+
+        if(Info.pbOutBuff - pbDecompressed != nOriginalLength || GetFirstDiffer(pbDecompressed, pbOriginal, nOriginalLength) != -1)
         {
-            nError = GetLastError();
-            printf("Failed to rename the file\n");
+            printf("Imploded data don't explode back (level %u, test %u) !!!\n", nLevel, i);
+            nError = ERROR_FILE_CORRUPT;
+            break;
         }
 
-        if(!SFileRenameFile(hMpq, "FileTest_10a.exe", "FileTest_10.exe"))
+        // The same through SCompImplode and SCompExplode. Data that don't
+        // compress are stored, as when writing a file into an archive
+        SCompSetImplodeLevel((int)nLevel);
+        cbCompressed = nOriginalLength;
+        cbDecompressed = nOriginalLength;
+        if(!SCompImplode(pbCompressed, &cbCompressed, pbOriginal, nOriginalLength) ||
+           !SCompExplode(pbDecompressed, &cbDecompressed, pbCompressed, cbCompressed) ||
+           cbDecompressed != nOriginalLength ||
+           GetFirstDiffer(pbDecompressed, pbOriginal, nOriginalLength) != -1)
         {
-            nError = GetLastError();
-            printf("Failed to rename the file\n");
+            printf("SCompImplode data don't explode back (level %u, test %u) !!!\n", nLevel, i);
+            nError = ERROR_FILE_CORRUPT;
         }
-        
-        if(nError == ERROR_SUCCESS)
-            printf("Rename test succeeded.\n\n");
-        else
-            printf("Rename test failed.\n\n");
     }
 
-    // Compact the archive
-//  if(nError == ERROR_SUCCESS)
-//      SFileCompactArchive(hMpq);
-
-    // Test changing hash table size
-//  if(nError == ERROR_SUCCESS)
-//      SFileSetMaxFileCount(hMpq, 0x95);
-
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
-
-    // Try to reopen the archive
-    if(SFileOpenArchive(szMpqName, 0, 0, &hMpq))
-        SFileCloseArchive(hMpq);
-
-    printf("\n");
+    // Cleanup
+    SCompSetImplodeLevel(MPQ_IMPLODE_LEVEL_DEFAULT);
+    delete [] work_buf;
+    delete [] pbOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed;
+    clreol();
     return nError;
 }
 
-static int TestAddFilesToMpq(
-    const char * szMpqName,
-    ...
-    )
+// Compresses the block and checks that it decompresses back.
+// Returns the compressed length, or 0 on error
+static int CompressRoundTrip(char * pbOriginal, char * pbCompressed, char * pbDecompressed, int cbOriginal, unsigned uCompressionMask)
 {
-    const char * szFileName;
-    HANDLE hMpq;
-    va_list argList;
+    int cbCompressed = cbOriginal;
+    int cbDecompressed = cbOriginal;
+
+    if(!SCompCompress(pbCompressed, &cbCompressed, pbOriginal, cbOriginal, uCompressionMask, 0, 0))
+        return 0;
+
+    // Data that don't compress are stored, like in the archive
+    if(cbCompressed == cbOriginal)
+        memcpy(pbDecompressed, pbCompressed, cbCompressed);
+    else if(!SCompDecompress(pbDecompressed, &cbDecompressed, pbCompressed, cbCompressed))
+        return 0;
+    if(cbDecompressed != cbOriginal || GetFirstDiffer(pbDecompressed, pbOriginal, cbOriginal) != -1)
+        return 0;
+    return cbCompressed;
+}
+
+// All LZMA levels, dictionary sizes and thread counts must give
+// data that decompress back. Invalid options must be rejected.
+static int TestLzmaOptions(int nSectorSize)
+{
+    static const DWORD DictSizes[] = {MPQ_LZMA_DICT_SIZE_AUTO, 0x1000, 0x10000};
+    char * pbDecompressed = NULL;
+    char * pbCompressed = NULL;
+    char * pbOriginal = NULL;
+    int cbBlock = 0x50000;              // Big enough for the match finder threads
+    int cbSmallDict;
+    int cbBigDict;
     int nError = ERROR_SUCCESS;
 
-    if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
-        return GetLastError();
+    // Allocate buffers
+    if(cbBlock < nSectorSize)
+        cbBlock = nSectorSize;
+    pbDecompressed = new char[cbBlock];
+    pbCompressed = new char[cbBlock];
+    pbOriginal = new char[cbBlock];
+    if(!pbDecompressed || !pbCompressed || !pbOriginal)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
 
-    va_start(argList, szMpqName);
-    while((szFileName = va_arg(argList, const char *)) != NULL)
+    // Invalid options must be rejected
+    if(nError == ERROR_SUCCESS)
     {
-        if(!SFileAddFileEx(hMpq, szFileName,
-                                 GetPlainFileName(szFileName),
-                                 MPQ_FILE_COMPRESS,
-                                 MPQ_COMPRESSION_ZLIB))
+        if(SCompSetLzmaOptions(MPQ_LZMA_LEVEL_FASTEST - 1, MPQ_LZMA_DICT_SIZE_AUTO, MPQ_LZMA_THREADS_DEFAULT) ||
+           SCompSetLzmaOptions(MPQ_LZMA_LEVEL_BEST + 1, MPQ_LZMA_DICT_SIZE_AUTO, MPQ_LZMA_THREADS_DEFAULT) ||
+           SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, 0x100, MPQ_LZMA_THREADS_DEFAULT) ||
+           SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, 0x10000000, MPQ_LZMA_THREADS_DEFAULT) ||
+           SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, MPQ_LZMA_DICT_SIZE_AUTO, 0) ||
+           SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, MPQ_LZMA_DICT_SIZE_AUTO, 3))
         {
-            nError = GetLastError();
-            printf("Failed to add the file \"%s\"\n", szFileName);
+            printf("SCompSetLzmaOptions accepted invalid options !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
         }
     }
 
-    SFileCloseArchive(hMpq);
-    return nError;
-}
-
-static int TestCreateArchiveFromMemory(const char * szMpqName)
-{
-#define FILE_SIZE 65535
-
-    HANDLE hFile;
-    HANDLE hMPQ;
-    char* data = new char [FILE_SIZE];          // random memory data
-    char szFileName[100];
-    int i;
- 
-    // Create an mpq file for testing
-    if(SFileCreateArchive(szMpqName, MPQ_CREATE_ARCHIVE_V2|MPQ_CREATE_ATTRIBUTES, 0x100000, &hMPQ))
+    // All levels and dictionary sizes, with one match finder thread
+    for(int nLevel = MPQ_LZMA_LEVEL_FASTEST; nError == ERROR_SUCCESS && nLevel <= MPQ_LZMA_LEVEL_BEST; nLevel++)
     {
-        for(i = 0; i < 1000; i++)
+        for(size_t i = 0; nError == ERROR_SUCCESS && i < sizeof(DictSizes) / sizeof(DictSizes[0]); i++)
         {
-            sprintf(szFileName, "File%03u.bin", i);
-            printf("Adding file %s\r", szFileName);
+            int nOriginalLength = (rand() % nSectorSize) + 1;
 
-            if(SFileCreateFile(hMPQ, szFileName, 0, FILE_SIZE, 0, MPQ_FILE_COMPRESS, &hFile))
+            clreol();
+            printf("Testing LZMA level %u, dictionary 0x%X\r", nLevel, DictSizes[i]);
+
+            if(!SCompSetLzmaOptions(nLevel, DictSizes[i], MPQ_LZMA_THREADS_DEFAULT))
             {
-                SFileWriteFile(hFile, data, FILE_SIZE, MPQ_COMPRESSION_ZLIB);
-                SFileFinishFile(hFile);
+                printf("SCompSetLzmaOptions rejected valid options !!!\n");
+                nError = ERROR_CAN_NOT_COMPLETE;
+                break;
             }
-        }
-    }
-    SFileCloseArchive(hMPQ);
-    delete [] data;
-    return ERROR_SUCCESS;
-}
 
-static int TestFileReadAndWrite(
-    const char * szMpqName,
-    const char * szFileName)
-{
-    LPBYTE pvFile = NULL;
-    HANDLE hFile = NULL;
-    HANDLE hMpq = NULL;
-    DWORD dwBytesRead;
-    DWORD dwFileSize = 0;
-    int nError = ERROR_SUCCESS;
+            // A big text block and a random sector
+            GenerateTextBlock(pbOriginal, 0x18000);
+            if(CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, 0x18000, MPQ_COMPRESSION_LZMA) == 0)
+                nError = ERROR_FILE_CORRUPT;
 
-    if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
-    {
-        nError = GetLastError();
-        printf("Failed to open the archive %s (%u).\n", szMpqName, nError);
-    }
+            GenerateRandomDataBlock((LPBYTE)pbOriginal, nOriginalLength);
+            if(CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, nOriginalLength, MPQ_COMPRESSION_LZMA) == 0)
+                nError = ERROR_FILE_CORRUPT;
 
-    if(nError == ERROR_SUCCESS)
-    {
-        if(!SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
-        {
-            nError = GetLastError();
-            printf("Failed to open the file %s (%u).\n", szFileName, nError);
+            if(nError != ERROR_SUCCESS)
+            {
+                printf("LZMA data don't decompress back (level %u, dictionary 0x%X) !!!\n", nLevel, DictSizes[i]);
+                break;
+            }
         }
     }
 
+    // The dictionary size must be used. A random block repeated after 0x2000 bytes
+    // only compresses with a dictionary that reaches the repetition.
     if(nError == ERROR_SUCCESS)
     {
-        if(!SFileGetFileInfo(hFile, SFILE_INFO_FILE_SIZE, &dwFileSize, sizeof(DWORD)))
+        GenerateRandomDataBlock((LPBYTE)pbOriginal, 0x2000);
+        memcpy(pbOriginal + 0x2000, pbOriginal, 0x2000);
+
+        SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, 0x1000, MPQ_LZMA_THREADS_DEFAULT);
+        cbSmallDict = CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, 0x4000, MPQ_COMPRESSION_LZMA);
+        SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, 0x10000, MPQ_LZMA_THREADS_DEFAULT);
+        cbBigDict = CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, 0x4000, MPQ_COMPRESSION_LZMA);
+
+        if(cbSmallDict == 0 || cbBigDict == 0 || cbBigDict >= cbSmallDict)
         {
-            nError = GetLastError();
-            printf("Failed to get the file size (%u).\n", nError);
+            printf("LZMA dictionary size has no effect (0x%X, 0x%X) !!!\n", cbSmallDict, cbBigDict);
+            nError = ERROR_FILE_CORRUPT;
         }
     }
 
+    // Two match finder threads are only available with the multi-threaded LZMA
     if(nError == ERROR_SUCCESS)
     {
-        pvFile = new BYTE[dwFileSize];
-        if(pvFile == NULL)
+        if(SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, MPQ_LZMA_DICT_SIZE_AUTO, 2))
         {
-            nError = ERROR_NOT_ENOUGH_MEMORY;
-            printf("Failed to allocate buffer for the file (%u).\n", nError);
+            GenerateTextBlock(pbOriginal, cbBlock);
+            if(CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, cbBlock, MPQ_COMPRESSION_LZMA) == 0)
+            {
+                printf("LZMA data with two threads don't decompress back !!!\n");
+                nError = ERROR_FILE_CORRUPT;
+            }
         }
-    }
-
-    if(nError == ERROR_SUCCESS)
-    {
-        if(!SFileReadFile(hFile, pvFile, dwFileSize, &dwBytesRead))
+        else if(GetLastError() != ERROR_NOT_SUPPORTED)
         {
-            nError = GetLastError();
-            printf("Failed to read file (%u).\n", nError);
+            printf("SCompSetLzmaOptions rejected two threads !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
         }
     }
 
-    if(hFile != NULL)
+    // Cleanup
+    SCompSetLzmaOptions(MPQ_LZMA_LEVEL_DEFAULT, MPQ_LZMA_DICT_SIZE_AUTO, MPQ_LZMA_THREADS_DEFAULT);
+    delete [] pbOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed;
+    clreol();
+    return nError;
+}
+
+// MPQ_COMPRESSION_AUTO must give data that decompress back,
+// with the default and custom candidates, on whole sectors and samples.
+// On whole sectors, the output must be as small as the best candidate.
+static int TestAutoCompression(int nSectorSize)
+{
+    static const DWORD Candidates1[] = {MPQ_COMPRESSION_ZLIB};
+    static const DWORD Candidates2[] = {MPQ_COMPRESSION_PKWARE, MPQ_COMPRESSION_BZIP2, MPQ_COMPRESSION_LZMA};
+    static const DWORD InvalidCandidates[] = {MPQ_COMPRESSION_ZLIB, MPQ_COMPRESSION_WAVE_MONO | MPQ_COMPRESSION_ZLIB, 0};
+    DWORD ManyCandidates[MPQ_AUTO_MAX_CANDIDATES + 1];
+    struct
     {
-        SFileCloseFile(hFile);
-        hFile = NULL;
-    }
+        const DWORD * pCandidates;
+        DWORD dwCandidates;
+        DWORD dwSampleSize;
+    } AutoSettings[] =
+    {
+        {NULL,        0, MPQ_AUTO_SAMPLE_ALL},
+        {Candidates1, 1, MPQ_AUTO_SAMPLE_ALL},
+        {Candidates2, 3, MPQ_AUTO_SAMPLE_ALL},
+        {NULL,        0, 0x200},
+        {Candidates2, 3, 0x200}
+    };
+    char * pbDecompressed = NULL;
+    char * pbCompressed = NULL;
+    char * pbOriginal = NULL;
+    int nError = ERROR_SUCCESS;
+
+    // Allocate buffers
+    pbDecompressed = new char[nSectorSize];
+    pbCompressed = new char[nSectorSize];
+    pbOriginal = new char[nSectorSize];
+    if(!pbDecompressed || !pbCompressed || !pbOriginal)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
 
+    // Invalid candidates must be rejected
     if(nError == ERROR_SUCCESS)
     {
-        if(!SFileCreateFile(hMpq, szFileName, 0, dwFileSize, 0, MPQ_FILE_REPLACEEXISTING, &hFile))
+        for(DWORD i = 0; i < MPQ_AUTO_MAX_CANDIDATES + 1; i++)
+            ManyCandidates[i] = MPQ_COMPRESSION_ZLIB;
+
+        if(SCompSetAutoCompression(Candidates1, 0, MPQ_AUTO_SAMPLE_ALL) ||
+           SCompSetAutoCompression(InvalidCandidates + 1, 1, MPQ_AUTO_SAMPLE_ALL) ||
+           SCompSetAutoCompression(InvalidCandidates + 2, 1, MPQ_AUTO_SAMPLE_ALL) ||
+           SCompSetAutoCompression(InvalidCandidates, 2, MPQ_AUTO_SAMPLE_ALL) ||
+           SCompSetAutoCompression(ManyCandidates, MPQ_AUTO_MAX_CANDIDATES + 1, MPQ_AUTO_SAMPLE_ALL))
         {
-            nError = GetLastError();
-            printf("Failed to create %s in the archive (%u).\n", szFileName, nError);
+            printf("SCompSetAutoCompression accepted invalid candidates !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
         }
     }
 
-    if(nError == ERROR_SUCCESS)
+    for(size_t s = 0; nError == ERROR_SUCCESS && s < sizeof(AutoSettings) / sizeof(AutoSettings[0]); s++)
     {
-        if(!SFileWriteFile(hFile, pvFile, dwFileSize, 0))
+        const DWORD * pCandidates = AutoSettings[s].pCandidates;
+        DWORD dwCandidates = AutoSettings[s].dwCandidates;
+
+        if(!SCompSetAutoCompression(pCandidates, dwCandidates, AutoSettings[s].dwSampleSize))
         {
-            nError = GetLastError();
-            printf("Failed to write the data to the MPQ (%u).\n", nError);
+            printf("SCompSetAutoCompression rejected valid candidates !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+            break;
         }
-    }
 
-    if(hFile != NULL)
-    {
-        if(!SFileFinishFile(hFile))
+        // The candidates that SCompSetAutoCompression uses for NULL
+        if(pCandidates == NULL)
         {
-            nError = GetLastError();
-            printf("Failed to finalize file creation (%u).\n", nError);
+            ManyCandidates[0] = MPQ_COMPRESSION_ZLIB;
+            ManyCandidates[1] = MPQ_COMPRESSION_PKWARE;
+            ManyCandidates[2] = MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB;
+            ManyCandidates[3] = MPQ_COMPRESSION_BZIP2;
+            ManyCandidates[4] = MPQ_COMPRESSION_LZMA;
+            pCandidates = ManyCandidates;
+            dwCandidates = 5;
         }
-    }
-
-    if(pvFile != NULL)
-        delete [] pvFile;
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
-    return nError;
-}
 
-static int TestSignatureVerify(const char * szMpqName)
-{
-    HANDLE hMpq;
-    
-    if(SFileOpenArchive(szMpqName, 0, 0, &hMpq))
-    {
-        printf("Verifying digital signature in %s:\n", szMpqName);
-        switch(SFileVerifyArchive(hMpq))
+        for(int i = 0; i < 300; i++)
         {
-            case ERROR_NO_SIGNATURE:
-                printf("No digital signature present.\n");
-                break;
-        
-            case ERROR_VERIFY_FAILED:
-                printf("Failed to verify signature.\n");
-                break;
-            
-            case ERROR_WEAK_SIGNATURE_OK:
-                printf("Weak signature is OK.\n");
-                break;
+            int nOriginalLength = (rand() % nSectorSize) + 1;
+            int nCompressedLength;
+            int nBestLength = nOriginalLength;
+            BYTE CompressionByte;
+            bool bCandidateUsed = false;
 
-            case ERROR_WEAK_SIGNATURE_ERROR:
-                printf("Weak signature mismatch.\n");
+            clreol();
+            printf("Testing automatic compression %u\r", i + 1);
+
+            // Text blocks compress well, random blocks don't.
+            // Sparse data favor the sparse compression
+            switch(i % 3)
+            {
+                case 0:
+                    GenerateTextBlock(pbOriginal, nOriginalLength);
+                    break;
+
+                case 1:
+                    GenerateRandomDataBlock((LPBYTE)pbOriginal, nOriginalLength);
+                    break;
+
+                case 2:
+                    memset(pbOriginal, 0, nOriginalLength);
+                    pbOriginal[rand() % nOriginalLength] = (char)rand();
+                    break;
+            }
+
+            nCompressedLength = CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, nOriginalLength, MPQ_COMPRESSION_AUTO);
+            if(nCompressedLength == 0)
+            {
+                printf("Automatically compressed data don't decompress back (test %u) !!!\n", i);
+                nError = ERROR_FILE_CORRUPT;
                 break;
+            }
 
-            case ERROR_STRONG_SIGNATURE_OK:
-                printf("Strong signature is OK.\n");
+            // Stored data have no compression byte
+            if(nCompressedLength == nOriginalLength)
+                continue;
+
+            // The data must have been compressed by one of the candidates
+            CompressionByte = (BYTE)pbCompressed[0];
+            for(DWORD j = 0; j < dwCandidates; j++)
+            {
+                if(pCandidates[j] == MPQ_COMPRESSION_LZMA ? (CompressionByte == MPQ_COMPRESSION_LZMA) : (CompressionByte & ~pCandidates[j]) == 0)
+                    bCandidateUsed = true;
+            }
+
+            if(!bCandidateUsed)
+            {
+                printf("Automatic compression used a compression that is not a candidate (0x%02X) !!!\n", CompressionByte);
+                nError = ERROR_FILE_CORRUPT;
                 break;
+            }
 
-            case ERROR_STRONG_SIGNATURE_ERROR:
-                printf("Strong signature mismatch.\n");
+            // On whole sectors, nothing may beat the automatic compression
+            if(AutoSettings[s].dwSampleSize == MPQ_AUTO_SAMPLE_ALL)
+            {
+                for(DWORD j = 0; j < dwCandidates; j++)
+                {
+                    int nLength = nOriginalLength;
+
+                    SCompCompress(pbDecompressed, &nLength, pbOriginal, nOriginalLength, pCandidates[j], 0, 0);
+                    if(nLength < nBestLength)
+                        nBestLength = nLength;
+                }
+
+                if(nCompressedLength != nBestLength)
+                {
+                    printf("Automatic compression is not the best candidate (0x%X, 0x%X) !!!\n", nCompressedLength, nBestLength);
+                    nError = ERROR_FILE_CORRUPT;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Cleanup
+    SCompSetAutoCompression(NULL, 0, MPQ_AUTO_SAMPLE_ALL);
+    delete [] pbOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed;
+    clreol();
+    return nError;
+}
+
+// Tables of the ADPCM decompression, as used by the original decoder
+static long AdpcmIndexTable[] =
+{
+    0xFFFFFFFF, 0x00000000, 0xFFFFFFFF, 0x00000004, 0xFFFFFFFF, 0x00000002, 0xFFFFFFFF, 0x00000006,
+    0xFFFFFFFF, 0x00000001, 0xFFFFFFFF, 0x00000005, 0xFFFFFFFF, 0x00000003, 0xFFFFFFFF, 0x00000007,
+    0xFFFFFFFF, 0x00000001, 0xFFFFFFFF, 0x00000005, 0xFFFFFFFF, 0x00000003, 0xFFFFFFFF, 0x00000007,
+    0xFFFFFFFF, 0x00000002, 0xFFFFFFFF, 0x00000004, 0xFFFFFFFF, 0x00000006, 0xFFFFFFFF, 0x00000008
+};
+
+static long AdpcmStepTable[] =
+{
+    0x00000007, 0x00000008, 0x00000009, 0x0000000A, 0x0000000B, 0x0000000C, 0x0000000D, 0x0000000E,
+    0x00000010, 0x00000011, 0x00000013, 0x00000015, 0x00000017, 0x00000019, 0x0000001C, 0x0000001F,
+    0x00000022, 0x00000025, 0x00000029, 0x0000002D, 0x00000032, 0x00000037, 0x0000003C, 0x00000042,
+    0x00000049, 0x00000050, 0x00000058, 0x00000061, 0x0000006B, 0x00000076, 0x00000082, 0x0000008F,
+    0x0000009D, 0x000000AD, 0x000000BE, 0x000000D1, 0x000000E6, 0x000000FD, 0x00000117, 0x00000133,
+    0x00000151, 0x00000173, 0x00000198, 0x000001C1, 0x000001EE, 0x00000220, 0x00000256, 0x00000292,
+    0x000002D4, 0x0000031C, 0x0000036C, 0x000003C3, 0x00000424, 0x0000048E, 0x00000502, 0x00000583,
+    0x00000610, 0x000006AB, 0x00000756, 0x00000812, 0x000008E0, 0x000009C3, 0x00000ABD, 0x00000BD0,
+    0x00000CFF, 0x00000E4C, 0x00000FBA, 0x0000114C, 0x00001307, 0x000014EE, 0x00001706, 0x00001954,
+    0x00001BDC, 0x00001EA5, 0x000021B6, 0x00002515, 0x000028CA, 0x00002CDF, 0x0000315B, 0x0000364B,
+    0x00003BB9, 0x000041B2, 0x00004844, 0x00004F7E, 0x00005771, 0x0000602F, 0x000069CE, 0x00007462,
+    0x00007FFF
+};
+
+// The original ADPCM decoder, which tests each bit of the sample.
+// The output length is checked by one counter, as in DecompressADPCM
+static int ReferenceDecompressADPCM(unsigned char * pbOutBuffer, int dwOutLength, unsigned char * pbInBuffer, int dwInLength, int nChannels)
+{
+    unsigned char * pbInBufferEnd = (pbInBuffer + dwInLength);
+    unsigned char * pbInput = pbInBuffer + 2;
+    short * pwOutput = (short *)pbOutBuffer;
+    long SInt32Array1[2];
+    long SInt32Array2[2];
+    int nIndex;
+
+    SInt32Array1[0] = SInt32Array1[1] = 0x2C;
+
+    // The initial value of each channel
+    for(int i = 0; i < nChannels; i++)
+    {
+        SInt32Array2[i] = BSWAP_INT16_SIGNED(*(short *)pbInput);
+        pbInput += sizeof(short);
+        if(dwOutLength < 2)
+            return (int)((unsigned char *)pwOutput - pbOutBuffer);
+
+        *pwOutput++ = BSWAP_INT16_SIGNED((short)SInt32Array2[i]);
+        dwOutLength -= sizeof(short);
+    }
+
+    nIndex = nChannels - 1;
+    while(pbInput < pbInBufferEnd)
+    {
+        unsigned char nOneByte = *pbInput++;
+
+        if(nChannels == 2)
+            nIndex = (nIndex == 0) ? 1 : 0;
+
+        if(nOneByte & 0x80)
+        {
+            switch(nOneByte & 0x7F)
+            {
+                case 0:
+                    if(SInt32Array1[nIndex] != 0)
+                        SInt32Array1[nIndex]--;
+
+                    if(dwOutLength < 2)
+                        return (int)((unsigned char *)pwOutput - pbOutBuffer);
+
+                    *pwOutput++ = BSWAP_INT16_SIGNED((unsigned short)SInt32Array2[nIndex]);
+                    dwOutLength -= sizeof(unsigned short);
+                    break;
+
+                case 1:
+                    SInt32Array1[nIndex] += 8;
+                    if(SInt32Array1[nIndex] > 0x58)
+                        SInt32Array1[nIndex] = 0x58;
+
+                    if(nChannels == 2)
+                        nIndex = (nIndex == 0) ? 1 : 0;
+                    break;
+
+                case 2:
+                    break;
+
+                default:
+                    SInt32Array1[nIndex] -= 8;
+                    if(SInt32Array1[nIndex] < 0)
+                        SInt32Array1[nIndex] = 0;
+
+                    if(nChannels == 2)
+                        nIndex = (nIndex == 0) ? 1 : 0;
+                    break;
+            }
+        }
+        else
+        {
+            long temp1 = AdpcmStepTable[SInt32Array1[nIndex]];
+            long temp2 = temp1 >> pbInBuffer[1];
+            long temp3 = SInt32Array2[nIndex];
+
+            for(int nBit = 0; nBit < 6; nBit++)
+            {
+                if(nOneByte & (1 << nBit))
+                    temp2 += (temp1 >> nBit);
+            }
+
+            if(nOneByte & 0x40)
+            {
+                temp3 = temp3 - temp2;
+                if(temp3 <= -32768)
+                    temp3 = -32768;
+            }
+            else
+            {
+                temp3 = temp3 + temp2;
+                if(temp3 >= 32767)
+                    temp3 = 32767;
+            }
+
+            SInt32Array2[nIndex] = temp3;
+            if(dwOutLength < 2)
                 break;
+
+            *pwOutput++ = BSWAP_INT16_SIGNED((short)SInt32Array2[nIndex]);
+            dwOutLength -= 2;
+
+            SInt32Array1[nIndex] += AdpcmIndexTable[nOneByte & 0x1F];
+            if(SInt32Array1[nIndex] < 0)
+                SInt32Array1[nIndex] = 0;
+            else if(SInt32Array1[nIndex] > 0x58)
+                SInt32Array1[nIndex] = 0x58;
+        }
+    }
+    return (int)((unsigned char *)pwOutput - pbOutBuffer);
+}
+
+// DecompressADPCM must give the same output as the original decoder,
+// for mono and stereo data of all compression levels and for random data
+static int TestAdpcmDecoder(int nSectorSize)
+{
+    unsigned char * pbDecompressed1 = NULL;
+    unsigned char * pbDecompressed2 = NULL;
+    unsigned char * pbCompressed = NULL;
+    short * pwOriginal = NULL;
+    int cbDecompressed = nSectorSize * 2 + 0x10;
+    int nError = ERROR_SUCCESS;
+
+    // Allocate buffers. Each compressed byte gives at most one sample
+    pbDecompressed1 = new unsigned char[cbDecompressed];
+    pbDecompressed2 = new unsigned char[cbDecompressed];
+    pbCompressed = new unsigned char[nSectorSize + 0x10];
+    pwOriginal = new short[nSectorSize / sizeof(short)];
+    if(!pbDecompressed1 || !pbDecompressed2 || !pbCompressed || !pwOriginal)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    for(int i = 0; nError == ERROR_SUCCESS && i < 20000; i++)
+    {
+        int nChannels = (i & 1) + 1;
+        int nSamples = (rand() % (nSectorSize / sizeof(short) - 4)) + 4;
+        int nCompressedLength;
+        int nOutLength;
+        int nLength1;
+        int nLength2;
+
+        clreol();
+        printf("Testing ADPCM decoder %u\r", i + 1);
+
+        if((i / 2) % 4 != 3)
+        {
+            // A noisy wave; its volume decides how much the steps change
+            int nAmplitude = 0x100 << ((i / 8) % 7);
+            int nNoise = 1 << ((i / 2) % 12);
+
+            for(int j = 0; j < nSamples; j++)
+            {
+                int nPhase = (j / nChannels) % 0x80;
+                int nValue = ((nPhase < 0x40) ? nPhase : (0x80 - nPhase)) * nAmplitude / 0x40 - nAmplitude / 2;
+
+                nValue += (rand() % nNoise) - nNoise / 2;
+                pwOriginal[j] = (short)((nValue < -32768) ? -32768 : (nValue > 32767) ? 32767 : nValue);
+            }
+
+            nCompressedLength = CompressADPCM(pbCompressed, nSectorSize + 0x10, pwOriginal, nSamples * sizeof(short), nChannels, (i % 6) + 1);
+        }
+        else
+        {
+            // Random data, with a shift within the range of the levels
+            nCompressedLength = (rand() % nSectorSize) + 2 + nChannels * 2;
+            GenerateRandomDataBlock(pbCompressed, nCompressedLength);
+            pbCompressed[1] = (unsigned char)(rand() % 6);
+        }
+
+        // Half of the tests limit the output
+        nOutLength = (i % 4 < 2) ? cbDecompressed : (rand() % cbDecompressed);
+        nLength1 = ReferenceDecompressADPCM(pbDecompressed1, nOutLength, pbCompressed, nCompressedLength, nChannels);
+        nLength2 = DecompressADPCM(pbDecompressed2, nOutLength, pbCompressed, nCompressedLength, nChannels);
+
+        if(nLength2 != nLength1 || GetFirstDiffer(pbDecompressed2, pbDecompressed1, nLength1) != -1)
+        {
+            printf("ADPCM decoder doesn't agree with the original decoder (test %u) !!!\n", i);
+            nError = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    // Cleanup
+    delete [] pwOriginal;
+    delete [] pbCompressed;
+    delete [] pbDecompressed2;
+    delete [] pbDecompressed1;
+    clreol();
+    return nError;
+}
+
+// The rounds of the MPQE key shuffle: the word to change, the two words added and the rotation
+static const BYTE MpqeKeyRounds[0x20][4] =
+{
+    {0x0A, 0x0E, 0x02, 0x07}, {0x03, 0x0A, 0x0E, 0x09}, {0x02, 0x03, 0x0A, 0x0D}, {0x0E, 0x02, 0x03, 0x12},
+    {0x07, 0x0C, 0x04, 0x07}, {0x06, 0x07, 0x0C, 0x09}, {0x04, 0x06, 0x07, 0x0D}, {0x0C, 0x04, 0x06, 0x12},
+    {0x0B, 0x05, 0x01, 0x07}, {0x08, 0x0B, 0x05, 0x09}, {0x01, 0x08, 0x0B, 0x0D}, {0x05, 0x01, 0x08, 0x12},
+    {0x09, 0x0F, 0x00, 0x07}, {0x0D, 0x09, 0x0F, 0x09}, {0x00, 0x0D, 0x09, 0x0D}, {0x0F, 0x00, 0x0D, 0x12},
+    {0x04, 0x0E, 0x09, 0x07}, {0x08, 0x04, 0x0E, 0x09}, {0x09, 0x08, 0x04, 0x0D}, {0x0E, 0x09, 0x08, 0x12},
+    {0x01, 0x0C, 0x0A, 0x07}, {0x0D, 0x01, 0x0C, 0x09}, {0x0A, 0x0D, 0x01, 0x0D}, {0x0C, 0x0A, 0x0D, 0x12},
+    {0x00, 0x05, 0x07, 0x07}, {0x03, 0x00, 0x05, 0x09}, {0x07, 0x03, 0x00, 0x0D}, {0x05, 0x07, 0x03, 0x12},
+    {0x02, 0x0F, 0x0B, 0x07}, {0x06, 0x02, 0x0F, 0x09}, {0x0B, 0x06, 0x02, 0x0D}, {0x0F, 0x0B, 0x06, 0x12}
+};
+
+// The original MPQE decryption, which shuffles the key for each chunk separately
+static void ReferenceDecryptFileChunk(DWORD * MpqData, LPBYTE pbKey, ULONGLONG ByteOffset, DWORD dwLength)
+{
+    static const BYTE KeyShuffleOrder[0x10] = {0x0E, 0x0C, 0x05, 0x0F, 0x0A, 0x07, 0x0B, 0x09, 0x03, 0x06, 0x08, 0x0D, 0x02, 0x04, 0x01, 0x00};
+    static const BYTE KeyStreamOrder[0x10]  = {0x0E, 0x04, 0x08, 0x09, 0x0A, 0x0C, 0x01, 0x0D, 0x03, 0x07, 0x05, 0x00, 0x02, 0x06, 0x0B, 0x0F};
+    static const BYTE KeyMirrorOrder[0x10]  = {0x00, 0x0D, 0x0A, 0x07, 0x04, 0x01, 0x0E, 0x0B, 0x08, 0x05, 0x02, 0x0F, 0x0C, 0x09, 0x06, 0x03};
+    ULONGLONG ChunkOffset = ByteOffset / 0x40;
+    DWORD KeyShuffled[0x10];
+    DWORD KeyMirror[0x10];
+
+    memcpy(KeyMirror, pbKey, 0x40);
+    BSWAP_ARRAY32_UNSIGNED(KeyMirror, 0x40);
+    KeyMirror[0x05] = (DWORD)(ChunkOffset >> 32);
+    KeyMirror[0x08] = (DWORD)(ChunkOffset);
+
+    while(dwLength >= 0x40)
+    {
+        for(DWORD i = 0; i < 0x10; i++)
+            KeyShuffled[KeyShuffleOrder[i]] = KeyMirror[i];
+
+        for(DWORD i = 0; i < 0x14; i += 2)
+        {
+            for(DWORD j = 0; j < 0x20; j++)
+            {
+                const BYTE * Round = MpqeKeyRounds[j];
+                DWORD dwValue = KeyShuffled[Round[1]] + KeyShuffled[Round[2]];
+
+                KeyShuffled[Round[0]] ^= (dwValue << Round[3]) | (dwValue >> (32 - Round[3]));
+            }
+        }
+
+        BSWAP_ARRAY32_UNSIGNED(MpqData, 0x40);
+        for(DWORD i = 0; i < 0x10; i++)
+            MpqData[i] ^= KeyShuffled[KeyStreamOrder[i]] + KeyMirror[KeyMirrorOrder[i]];
+        BSWAP_ARRAY32_UNSIGNED(MpqData, 0x40);
+
+        KeyMirror[0x08]++;
+        if(KeyMirror[0x08] == 0)
+            KeyMirror[0x05]++;
+
+        MpqData  += 0x10;
+        dwLength -= 0x40;
+    }
+}
+
+// Compares the MPQE decryption with the original one. The lengths cover
+// groups of four chunks and the remaining chunks, and the chunk indexes
+// cross the 32-bit boundary at different places
+static int TestMpqeDecrypt()
+{
+    ULONGLONG ByteOffsets[] = {0, 0x1234, (ULONGLONG)0xFFFFFFFD * 0x40, (ULONGLONG)0xFFFFFFFF * 0x40, (ULONGLONG)0xFFFFFFF2 * 0x40 + 0x17, (ULONGLONG)0x1FFFFFFFE * 0x40};
+    DWORD Lengths[] = {0x3F, 0x40, 0xC0, 0x100, 0x140, 0x3C0, 0x400, 0x413, 0x9FF, 0xA00};
+    LPBYTE pbDecrypted1;
+    LPBYTE pbDecrypted2;
+    LPBYTE pbEncrypted;
+    BYTE Key[0x40];
+    DWORD cbBuffer = 0xA00;
+    int nError = ERROR_SUCCESS;
+
+    pbEncrypted = new BYTE[cbBuffer];
+    pbDecrypted1 = new BYTE[cbBuffer];
+    pbDecrypted2 = new BYTE[cbBuffer];
+    if(pbEncrypted == NULL || pbDecrypted1 == NULL || pbDecrypted2 == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    if(nError == ERROR_SUCCESS)
+    {
+        srand(0x4D505145);
+        GenerateRandomDataBlock(Key, sizeof(Key));
+        GenerateRandomDataBlock(pbEncrypted, cbBuffer);
+    }
+
+    for(DWORD i = 0; i < sizeof(ByteOffsets) / sizeof(ULONGLONG) && nError == ERROR_SUCCESS; i++)
+    {
+        for(DWORD j = 0; j < sizeof(Lengths) / sizeof(DWORD) && nError == ERROR_SUCCESS; j++)
+        {
+            memcpy(pbDecrypted1, pbEncrypted, cbBuffer);
+            memcpy(pbDecrypted2, pbEncrypted, cbBuffer);
+            ReferenceDecryptFileChunk((LPDWORD)pbDecrypted1, Key, ByteOffsets[i], Lengths[j]);
+            DecryptFileChunk((LPDWORD)pbDecrypted2, Key, ByteOffsets[i], Lengths[j]);
+
+            if(GetFirstDiffer(pbDecrypted2, pbDecrypted1, cbBuffer) != -1)
+            {
+                printf("MPQE decryption doesn't agree with the original one (offset 0x%08X%08X, length 0x%X) !!!\n", (DWORD)(ByteOffsets[i] >> 32), (DWORD)ByteOffsets[i], Lengths[j]);
+                nError = ERROR_FILE_CORRUPT;
+            }
+        }
+    }
+
+    delete [] pbDecrypted2;
+    delete [] pbDecrypted1;
+    delete [] pbEncrypted;
+    clreol();
+    return nError;
+}
+
+// Sizes of the scratch buffers used by TestScratchBuffers.
+// They cover the size class limits and the sizes above the largest class
+static DWORD ScratchSizes[] = {1, 0x10, 0xFFF, 0x1000, 0x1001, 0x8000, 0xFFFFF, 0x100000, 0x100001, 0x280000};
+
+// Data of one thread in TestScratchBuffers
+struct TScratchTestData
+{
+    char * pbOriginal;                      // Data to be compressed, shared by all threads
+    void * pvForeignBuffer;                 // Scratch buffer allocated by the main thread, to be freed by this one
+    DWORD dwThreadIndex;                    // Index of the thread
+    int nError;                             // Result of the thread
+};
+
+// Allocates buffers of all sizes, fills them and checks that they don't overlap,
+// then frees them in an order that differs in each round
+static int AllocateScratchBuffers(DWORD dwRound)
+{
+    LPBYTE Buffers[sizeof(ScratchSizes) / sizeof(DWORD)];
+    DWORD dwBufferCount = sizeof(ScratchSizes) / sizeof(DWORD);
+    DWORD dwIndex;
+    int nError = ERROR_SUCCESS;
+
+    for(DWORD i = 0; i < dwBufferCount; i++)
+    {
+        Buffers[i] = (LPBYTE)AllocateScratchBuffer(ScratchSizes[i]);
+        if(Buffers[i] == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        memset(Buffers[i], (BYTE)(i + dwRound), ScratchSizes[i]);
+    }
+
+    for(DWORD i = 0; i < dwBufferCount && nError == ERROR_SUCCESS; i++)
+    {
+        for(DWORD j = 0; j < ScratchSizes[i]; j++)
+        {
+            if(Buffers[i][j] != (BYTE)(i + dwRound))
+            {
+                printf("Scratch buffer of 0x%X bytes has been overwritten !!!\n", ScratchSizes[i]);
+                nError = ERROR_FILE_CORRUPT;
+                break;
+            }
+        }
+    }
+
+    // Free the buffers in order, in reverse order, or the odd ones first
+    for(DWORD i = 0; i < dwBufferCount; i++)
+    {
+        switch(dwRound % 3)
+        {
+            case 0:  dwIndex = i; break;
+            case 1:  dwIndex = dwBufferCount - i - 1; break;
+            default: dwIndex = (i < dwBufferCount / 2) ? (i * 2 + 1) : ((i - dwBufferCount / 2) * 2); break;
+        }
+        FreeScratchBuffer(Buffers[dwIndex]);
+    }
+    return nError;
+}
+
+// Compressions that use the scratch buffers: pklib work buffers
+// and the intermediate buffer of more compressions at once
+static int CompressWithScratchBuffers(char * pbOriginal, DWORD dwRound)
+{
+    unsigned CompressionMasks[] = {MPQ_COMPRESSION_PKWARE, MPQ_COMPRESSION_ZLIB | MPQ_COMPRESSION_BZIP2, MPQ_COMPRESSION_ZLIB};
+    DWORD BlockSizes[] = {0x200, 0x1000, 0x5000, 0x40000, 0x110000};
+    DWORD cbBlock = BlockSizes[dwRound % (sizeof(BlockSizes) / sizeof(DWORD))];
+    char * pbCompressed;
+    char * pbDecompressed;
+    int nError = ERROR_SUCCESS;
+
+    pbCompressed = new char[cbBlock];
+    pbDecompressed = new char[cbBlock];
+    if(pbCompressed == NULL || pbDecompressed == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    for(DWORD i = 0; i < sizeof(CompressionMasks) / sizeof(unsigned) && nError == ERROR_SUCCESS; i++)
+    {
+        if(CompressRoundTrip(pbOriginal, pbCompressed, pbDecompressed, cbBlock, CompressionMasks[i]) == 0)
+        {
+            printf("Compression 0x%02X failed on 0x%X bytes !!!\n", CompressionMasks[i], cbBlock);
+            nError = ERROR_FILE_CORRUPT;
         }
-        
-        SFileCloseArchive(hMpq);
-        printf("\n");
     }
 
+    delete [] pbDecompressed;
+    delete [] pbCompressed;
+    return nError;
+}
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI ScratchTestProc(LPVOID lpParam)
+#else
+static void * ScratchTestProc(void * lpParam)
+#endif
+{
+    TScratchTestData * pData = (TScratchTestData *)lpParam;
+
+    // The buffer goes to the arena of this thread, which is freed when the thread ends
+    FreeScratchBuffer(pData->pvForeignBuffer);
+
+    // Interleave the compressions with the buffers of all sizes
+    for(DWORD i = 0; i < 5 && pData->nError == ERROR_SUCCESS; i++)
+    {
+        pData->nError = CompressWithScratchBuffers(pData->pbOriginal, pData->dwThreadIndex + i);
+        if(pData->nError == ERROR_SUCCESS)
+            pData->nError = AllocateScratchBuffers(pData->dwThreadIndex + i);
+    }
     return 0;
 }
 
+// Checks the per-thread scratch buffers: buffers of all sizes must not overlap,
+// a freed buffer must be reused by the next allocation of the same size class,
+// and more threads must be able to use them at once
+static int TestScratchBuffers()
+{
+    TScratchTestData ThreadData[THREAD_READ_COUNT];
+    char * pbOriginal;
+    void * pvBuffer1;
+    void * pvBuffer2;
+    DWORD cbOriginal = 0x110000;
+    DWORD dwThreads = 0;
+    int nError = ERROR_SUCCESS;
 
-static int TestCreateArchiveCopy(const char * szMpqName, const char * szMpqCopyName, const char * szListFile)
+    pbOriginal = new char[cbOriginal];
+    if(pbOriginal == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    GenerateTextBlock(pbOriginal, cbOriginal);
+
+    // Buffers of the same size class are reused by the same thread
+    pvBuffer1 = AllocateScratchBuffer(0x3000);
+    FreeScratchBuffer(pvBuffer1);
+    pvBuffer2 = AllocateScratchBuffer(0x2001);
+    FreeScratchBuffer(pvBuffer2);
+    if(pvBuffer1 == NULL || pvBuffer2 != pvBuffer1)
+    {
+        printf("A freed scratch buffer has not been reused !!!\n");
+        nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    for(DWORD i = 0; i < 4 && nError == ERROR_SUCCESS; i++)
+        nError = AllocateScratchBuffers(i);
+
+    if(nError == ERROR_SUCCESS)
+    {
+#ifdef PLATFORM_WINDOWS
+        HANDLE Threads[THREAD_READ_COUNT];
+#else
+        pthread_t Threads[THREAD_READ_COUNT];
+#endif
+
+        printf("Using scratch buffers from %u threads ...\n", THREAD_READ_COUNT);
+
+        // Start the threads
+        for(dwThreads = 0; dwThreads < THREAD_READ_COUNT; dwThreads++)
+        {
+            TScratchTestData * pData = &ThreadData[dwThreads];
+
+            pData->pbOriginal = pbOriginal;
+            pData->pvForeignBuffer = AllocateScratchBuffer(0x1000 << dwThreads);
+            pData->dwThreadIndex = dwThreads;
+            pData->nError = ERROR_SUCCESS;
+
+#ifdef PLATFORM_WINDOWS
+            Threads[dwThreads] = CreateThread(NULL, 0, ScratchTestProc, pData, 0, NULL);
+            if(Threads[dwThreads] == NULL)
+                break;
+#else
+            if(pthread_create(&Threads[dwThreads], NULL, ScratchTestProc, pData) != 0)
+                break;
+#endif
+        }
+
+        // Wait for them to finish
+        for(DWORD i = 0; i < dwThreads; i++)
+        {
+#ifdef PLATFORM_WINDOWS
+            WaitForSingleObject(Threads[i], INFINITE);
+            CloseHandle(Threads[i]);
+#else
+            pthread_join(Threads[i], NULL);
+#endif
+            if(nError == ERROR_SUCCESS)
+                nError = ThreadData[i].nError;
+        }
+
+        if(dwThreads != THREAD_READ_COUNT)
+        {
+            FreeScratchBuffer(ThreadData[dwThreads].pvForeignBuffer);
+            if(nError == ERROR_SUCCESS)
+            {
+                printf("Failed to start the threads.\n");
+                nError = ERROR_NOT_ENOUGH_MEMORY;
+            }
+        }
+    }
+
+    delete [] pbOriginal;
+    clreol();
+    return nError;
+}
+
+// One compression done by a new thread, which has no codec contexts yet
+struct TCodecTestData
 {
-    TFileStream * pStream;
-    char   szLocalFile[MAX_PATH] = "";
-    HANDLE hMpq1 = NULL;                // Handle of existing archive
-    HANDLE hMpq2 = NULL;                // Handle of created archive 
-    DWORD dwHashTableSize = 0;
+    char * pbOriginal;                      // Data to be compressed
+    char * pbCompressed;                    // Buffer for the compressed data
+    int cbOriginal;                         // Length of the data
+    int cbCompressed;                       // Length of the compressed data, 0 on error
+    unsigned uCompressionMask;              // Compression to use
+};
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI CodecTestProc(LPVOID lpParam)
+#else
+static void * CodecTestProc(void * lpParam)
+#endif
+{
+    TCodecTestData * pData = (TCodecTestData *)lpParam;
+
+    pData->cbCompressed = pData->cbOriginal;
+    if(!SCompCompress(pData->pbCompressed, &pData->cbCompressed, pData->pbOriginal, pData->cbOriginal, pData->uCompressionMask, 0, 0))
+        pData->cbCompressed = 0;
+    return 0;
+}
+
+// The codec contexts kept by a thread must not change the output.
+// Each block is compressed by a new thread first. Then the blocks are
+// compressed by this thread, in different orders, and the output
+// must be the same as from the new threads
+static int TestCodecContexts(int nSectorSize)
+{
+    unsigned CompressionMasks[] = {MPQ_COMPRESSION_ZLIB, MPQ_COMPRESSION_BZIP2, MPQ_COMPRESSION_LZMA, MPQ_COMPRESSION_PKWARE};
+    int BlockSizes[] = {nSectorSize / 8, nSectorSize, 0x10000, 0x110000};
+    TCodecTestData Blocks[sizeof(CompressionMasks) / sizeof(unsigned)][sizeof(BlockSizes) / sizeof(int)];
+    DWORD dwMaskCount = sizeof(CompressionMasks) / sizeof(unsigned);
+    DWORD dwSizeCount = sizeof(BlockSizes) / sizeof(int);
+    DWORD dwBlockCount = dwMaskCount * dwSizeCount;
+    char * pbOriginal;
+    char * pbCompressed;
+    char * pbDecompressed;
+    int cbOriginal = 0x110000 + 0x1000;
+    int nError = ERROR_SUCCESS;
+
+    memset(Blocks, 0, sizeof(Blocks));
+    pbOriginal = new char[cbOriginal];
+    pbCompressed = new char[cbOriginal];
+    pbDecompressed = new char[cbOriginal];
+    if(pbOriginal == NULL || pbCompressed == NULL || pbDecompressed == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Blocks of the same size start at different offsets, so their data differ
+    if(nError == ERROR_SUCCESS)
+    {
+        GenerateTextBlock(pbOriginal, cbOriginal);
+        for(DWORD i = 0; i < dwMaskCount && nError == ERROR_SUCCESS; i++)
+        {
+            for(DWORD j = 0; j < dwSizeCount && nError == ERROR_SUCCESS; j++)
+            {
+                TCodecTestData * pData = &Blocks[i][j];
+
+                pData->pbOriginal = pbOriginal + i * 0x400;
+                pData->cbOriginal = BlockSizes[j];
+                pData->uCompressionMask = CompressionMasks[i];
+                pData->pbCompressed = new char[BlockSizes[j]];
+                if(pData->pbCompressed == NULL)
+                    nError = ERROR_NOT_ENOUGH_MEMORY;
+            }
+        }
+    }
+
+    // Compress each block by a new thread
+    for(DWORD i = 0; i < dwBlockCount && nError == ERROR_SUCCESS; i++)
+    {
+        TCodecTestData * pData = &Blocks[i / dwSizeCount][i % dwSizeCount];
+
+        printf("Compressing 0x%X bytes by 0x%02X in a new thread ...\r", pData->cbOriginal, pData->uCompressionMask);
+#ifdef PLATFORM_WINDOWS
+        HANDLE hThread = CreateThread(NULL, 0, CodecTestProc, pData, 0, NULL);
+
+        if(hThread == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        if(hThread != NULL)
+        {
+            WaitForSingleObject(hThread, INFINITE);
+            CloseHandle(hThread);
+        }
+#else
+        pthread_t Thread;
+
+        if(pthread_create(&Thread, NULL, CodecTestProc, pData) != 0)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        if(nError == ERROR_SUCCESS)
+            pthread_join(Thread, NULL);
+#endif
+        if(nError == ERROR_SUCCESS && pData->cbCompressed == 0)
+        {
+            printf("Compression 0x%02X failed on 0x%X bytes !!!\n", pData->uCompressionMask, pData->cbOriginal);
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
+
+    // Compress and decompress the blocks in order, in reverse order
+    // and with the compressions interleaved
+    for(DWORD dwRound = 0; dwRound < 3 && nError == ERROR_SUCCESS; dwRound++)
+    {
+        for(DWORD i = 0; i < dwBlockCount && nError == ERROR_SUCCESS; i++)
+        {
+            TCodecTestData * pData;
+            DWORD dwIndex = i;
+            int cbCompressed;
+
+            if(dwRound == 1)
+                dwIndex = dwBlockCount - i - 1;
+            if(dwRound == 2)
+                dwIndex = (i % dwMaskCount) * dwSizeCount + (i / dwMaskCount);
+            pData = &Blocks[dwIndex / dwSizeCount][dwIndex % dwSizeCount];
+
+            printf("Compressing 0x%X bytes by 0x%02X ...\r", pData->cbOriginal, pData->uCompressionMask);
+            cbCompressed = CompressRoundTrip(pData->pbOriginal, pbCompressed, pbDecompressed, pData->cbOriginal, pData->uCompressionMask);
+            if(cbCompressed == 0)
+            {
+                printf("Compression 0x%02X failed on 0x%X bytes !!!\n", pData->uCompressionMask, pData->cbOriginal);
+                nError = ERROR_CAN_NOT_COMPLETE;
+                break;
+            }
+
+            if(cbCompressed != pData->cbCompressed || GetFirstDiffer(pbCompressed, pData->pbCompressed, cbCompressed) != -1)
+            {
+                printf("Compression 0x%02X of 0x%X bytes differs from a new thread !!!\n", pData->uCompressionMask, pData->cbOriginal);
+                nError = ERROR_FILE_CORRUPT;
+            }
+        }
+    }
+
+    for(DWORD i = 0; i < dwMaskCount; i++)
+    {
+        for(DWORD j = 0; j < dwSizeCount; j++)
+            delete [] Blocks[i][j].pbCompressed;
+    }
+    delete [] pbDecompressed;
+    delete [] pbCompressed;
+    delete [] pbOriginal;
+    clreol();
+    return nError;
+}
+
+static void * TestLzma_Alloc(void * /* p */, size_t size)
+{
+    return malloc(size);
+}
+
+static void TestLzma_Free(void * /* p */, void * address)
+{
+    if(address != NULL)
+        free(address);
+}
+
+// The LZMA dictionary is as large as the data, not the default one.
+// The blocks must still decompress by LzmaDecode, which makes
+// a new decoder for each block, like the code before the codec contexts
+static int TestLzmaDictionary(int nSectorSize)
+{
+    int BlockSizes[] = {0x10, 0x200, 0xFFF, 0x1000, 0x1001, nSectorSize, 0x10000, 0x54321, 0x100000, 0x100001, 0x200000};
+    ELzmaStatus LzmaStatus;
+    ISzAlloc SzAlloc;
+    SizeT cbDecoded;
+    SizeT cbEncoded;
+    DWORD dwDictSize;
+    DWORD dwMaxDictSize;
+    char * pbOriginal;
+    char * pbCompressed;
+    char * pbDecompressed;
+    int cbOriginal = 0x200000;
+    int cbCompressed;
+    int nError = ERROR_SUCCESS;
+
+    SzAlloc.Alloc = TestLzma_Alloc;
+    SzAlloc.Free = TestLzma_Free;
+
+    pbOriginal = new char[cbOriginal];
+    pbCompressed = new char[cbOriginal];
+    pbDecompressed = new char[cbOriginal];
+    if(pbOriginal == NULL || pbCompressed == NULL || pbDecompressed == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+    if(nError == ERROR_SUCCESS)
+        GenerateTextBlock(pbOriginal, cbOriginal);
+
+    for(DWORD i = 0; i < sizeof(BlockSizes) / sizeof(int) && nError == ERROR_SUCCESS; i++)
+    {
+        printf("Compressing 0x%X bytes by LZMA ...\r", BlockSizes[i]);
+        cbCompressed = BlockSizes[i];
+        if(!SCompCompress(pbCompressed, &cbCompressed, pbOriginal, BlockSizes[i], MPQ_COMPRESSION_LZMA, 0, 0))
+        {
+            nError = GetLastError();
+            break;
+        }
+
+        // Blocks that don't compress are stored
+        if(cbCompressed == BlockSizes[i])
+            continue;
+
+        // Skip the compression type. The dictionary size follows the properties byte.
+        // It is a power of two, not smaller than 4 KB, that covers the data
+        dwDictSize = *(LPDWORD)(pbCompressed + 3);
+        BSWAP_ARRAY32_UNSIGNED(&dwDictSize, sizeof(DWORD));
+        dwMaxDictSize = 0x1000;
+        while(dwMaxDictSize < (DWORD)BlockSizes[i])
+            dwMaxDictSize <<= 1;
+        if(dwDictSize != dwMaxDictSize)
+        {
+            printf("LZMA dictionary of 0x%X bytes used on 0x%X bytes !!!\n", dwDictSize, BlockSizes[i]);
+            nError = ERROR_CAN_NOT_COMPLETE;
+            break;
+        }
+
+        // Decompress by the original way, without the codec contexts
+        cbDecoded = BlockSizes[i];
+        cbEncoded = cbCompressed - 1 - (1 + LZMA_PROPS_SIZE + 8);
+        if(pbCompressed[1] != 0 || LzmaDecode((Byte *)pbDecompressed,
+                                              &cbDecoded,
+                                              (Byte *)pbCompressed + 1 + (1 + LZMA_PROPS_SIZE + 8),
+                                              &cbEncoded,
+                                              (Byte *)pbCompressed + 2,
+                                              LZMA_PROPS_SIZE,
+                                              LZMA_FINISH_END,
+                                              &LzmaStatus,
+                                              &SzAlloc) != SZ_OK)
+        {
+            printf("LzmaDecode failed on 0x%X bytes !!!\n", BlockSizes[i]);
+            nError = ERROR_FILE_CORRUPT;
+            break;
+        }
+
+        if(cbDecoded != (SizeT)BlockSizes[i] || GetFirstDiffer(pbDecompressed, pbOriginal, BlockSizes[i]) != -1)
+        {
+            printf("LzmaDecode gave different data on 0x%X bytes !!!\n", BlockSizes[i]);
+            nError = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    delete [] pbDecompressed;
+    delete [] pbCompressed;
+    delete [] pbOriginal;
+    clreol();
+    return nError;
+}
+
+static int TestArchiveOpenAndClose(const char * szMpqName)
+{
+    const char * szFileName1 = "ITEM\\TEXTURECOMPONENTS\\LegLowerTexture\\MAIL_DUNGEONSHAMAN_B_01BLUE_PANT_LL_U.BLP";
+//  const char * szFileName2 = "items\\map\\mapz_deleted.cel";
+    TMPQArchive * ha = NULL;
+    HANDLE hFile1 = NULL;
+//  HANDLE hFile2 = NULL;
+    HANDLE hMpq = NULL;
+    int nError = ERROR_SUCCESS;
+
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening archive %s ...\n", szMpqName);
+        if(!SFileOpenArchive(szMpqName, 0, 0, /* MPQ_OPEN_ENCRYPTED,*/ &hMpq))
+            nError = GetLastError();
+        ha = (TMPQArchive *)hMpq;
+    }
+/*
+    // Test for TBitArray
+    if(nError == ERROR_SUCCESS && ha->pHetTable != NULL)
+    {
+        TBitArray * pBitArray = ha->pHetTable->pBetIndexes;
+
+        for(ULONG i = 0; i < 0x10000; i++)
+        {
+            BYTE LoadedBits[0x20];
+            BYTE SaveBits[0x40];
+            unsigned int nBitPosition = (i >> 0x08);
+            unsigned int nBitCount = (i & 0xFF);
+
+            memset(LoadedBits, 0, sizeof(LoadedBits));
+            memcpy(SaveBits, pBitArray->Elements, sizeof(SaveBits));
+
+            // Load the index to the BET table
+            pBitArray->GetBits(nBitPosition, nBitCount, LoadedBits, sizeof(LoadedBits));
+
+            // Load the index to the BET table
+            pBitArray->SetBits(nBitPosition, nBitCount, LoadedBits, sizeof(LoadedBits));
+
+            // Verify the bits
+            if(memcmp(SaveBits, pBitArray->Elements, sizeof(SaveBits)))
+                assert(false);
+        }
+    }
+*/
+    // Verify the raw data in the archive
+    if(nError == ERROR_SUCCESS)
+    {
+        // Verify the archive
+        SFileVerifyRawData(hMpq, SFILE_VERIFY_FILE, szFileName1);
+
+        // Try to open a file
+        if(!SFileOpenFileEx(hMpq, szFileName1, SFILE_OPEN_FROM_MPQ, &hFile1))
+        {
+            nError = GetLastError();
+            printf("%s - file not found in the MPQ\n", szFileName1);
+        }
+    }
+
+    // Dummy read from the file
+    if(nError == ERROR_SUCCESS)
+	{
+        DWORD dwBytesRead = 0;
+		BYTE Buffer[0x1000];
+
+        SFileReadFile(hFile1, Buffer, sizeof(Buffer), &dwBytesRead);
+	}
+/*
+    // Verify the MPQ listfile
+    if(nError == ERROR_SUCCESS)
+    {
+        SFileVerifyFile(hMpq, szFileName1, 0xFFFFFFFF); 
+        if(!CompareArchivedFilesRR(szFileName1, hFile1, hFile2, 0x100000))
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+*/
+    if(hFile1 != NULL)
+        SFileCloseFile(hFile1);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return nError;
+}
+
+static int TestFindFiles(const char * szMpqName)
+{
+    TMPQFile * hf;
+    HANDLE hFile;
+    HANDLE hMpq = NULL;
+    BYTE Buffer[100];
+    int nError = ERROR_SUCCESS;
+    int nFiles = 0;
+    int nFound = 0;
+
+    // Open the archive
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening \"%s\" for finding files ...\n", szMpqName);
+        if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+            nError = GetLastError();
+    }
+
+    // Compact the archive
+    if(nError == ERROR_SUCCESS)
+    {
+        SFILE_FIND_DATA sf;
+        HANDLE hFind;
+        DWORD dwExtraDataSize;
+        bool bFound = true;
+
+        hFind = SFileFindFirstFile(hMpq, "*", &sf, "c:\\Tools32\\ListFiles\\ListFile.txt");
+        while(hFind != NULL && bFound != false)
+        {
+            if(SFileOpenFileEx(hMpq, sf.cFileName, 0, &hFile))
+            {
+                hf = (TMPQFile *)hFile;
+                SFileReadFile(hFile, Buffer, sizeof(Buffer));
+                nFiles++;
+
+                if(sf.dwFileFlags & MPQ_FILE_SECTOR_CRC)
+                {
+                    dwExtraDataSize = hf->SectorOffsets[hf->dwSectorCount + 1] - hf->SectorOffsets[hf->dwSectorCount];
+                    if(dwExtraDataSize != 0)
+                        nFound++;
+                }
+
+                SFileCloseFile(hFile);
+            }
+
+            bFound = SFileFindNextFile(hFind, &sf);
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    if(nError == ERROR_SUCCESS)
+        printf("Search complete\n");
+    return nError;
+}
+
+static int TestMpqCompacting(const char * szMpqName)
+{
+    HANDLE hMpq = NULL;
+    int nError = ERROR_SUCCESS;
+
+    // Open the archive
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening \"%s\" for compacting ...\n", szMpqName);
+        if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+            nError = GetLastError();
+    }
+
+/*
+    if(nError == ERROR_SUCCESS)
+    {
+        char * szFileName = "Campaign\\Human\\Human01.pud";
+
+        printf("Deleting file %s ...\r", szFileName);
+        if(!SFileRemoveFile(hMpq, szFileName))
+            nError = GetLastError();
+    }
+*/
+    // Compact the archive
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Compacting archive ...\r");
+        SFileSetCompactCallback(hMpq, CompactCB, NULL);
+        if(!SFileCompactArchive(hMpq, "c:\\Tools32\\ListFiles\\ListFile.txt"))
+            nError = GetLastError();
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    if(nError == ERROR_SUCCESS)
+        printf("Compacting complete (No errors)\n");
+    return nError;
+}
+
+static int TestCreateArchive(const char * szMpqName)
+{
+    TFileStream * pStream;
+    const char * szFileName1 = MAKE_PATH("FileTest.exe");
+    const char * szFileName2 = MAKE_PATH("ZeroSize.txt");
+    HANDLE hMpq = NULL;                 // Handle of created archive 
+    DWORD dwVerifyResult;
+    DWORD dwFileCount = 0;
+    LCID LocaleIDs[] = {0x000, 0x405, 0x406, 0x407, 0xFFFF};
+    char szMpqFileName[MAX_PATH];
+    int nError = ERROR_SUCCESS;
+    int i;
+
+    // Create the new file
+    printf("Creating %s ...\n", szMpqName);
+    pStream = FileStream_CreateFile(szMpqName);
+    if(pStream == NULL)
+        nError = GetLastError();
+
+    // Write some data
+    if(nError == ERROR_SUCCESS)
+    {
+        ULONGLONG FileSize = 0x100000;
+      
+        FileStream_SetSize(pStream, FileSize);
+        FileStream_Close(pStream);
+    }
+
+    // Well, now create the MPQ archive
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileCreateArchive(szMpqName,
+                               MPQ_CREATE_ARCHIVE_V4 | MPQ_CREATE_ATTRIBUTES,
+                               7,
+                              &hMpq))
+        {
+            nError = GetLastError();
+        }
+    }
+
+    // Add the same file multiple times
+    if(nError == ERROR_SUCCESS)
+    {
+//      SFileCompactArchive(hMpq);
+//      if(!SFileAddFileEx(hMpq,
+//                         "e:\\Multimedia\\MPQs\\Achievement.dbc",
+//                         "enGB\\DBFilesClient\\Achievement.dbc", 
+//                         MPQ_FILE_COMPRESS,
+//                         MPQ_COMPRESSION_ZLIB))
+//      {
+//          printf("Failed to add the file \"%s\".\n", szMpqFileName);
+//      }
+
+        // Add FileTest.exe
+        for(i = 0; AddFlags[i] != 0xFFFFFFFF; i++)
+        {
+            sprintf(szMpqFileName, "FileTest_%02u.exe", i);
+            printf("Adding %s as %s ...\n", szFileName1, szMpqFileName);
+            if(SFileAddFileEx(hMpq, szFileName1, szMpqFileName, AddFlags[i], MPQ_COMPRESSION_ZLIB))
+            {
+                dwVerifyResult = SFileVerifyFile(hMpq, szMpqFileName, MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5);
+                if(dwVerifyResult & (VERIFY_OPEN_ERROR | VERIFY_READ_ERROR | VERIFY_FILE_SECTOR_CRC_ERROR | VERIFY_FILE_CHECKSUM_ERROR | VERIFY_FILE_MD5_ERROR))
+                    printf("CRC error on \"%s\"\n", szMpqFileName);
+                dwFileCount++;
+            }
+            else
+            {
+                printf("Failed to add the file \"%s\".\n", szMpqFileName);
+            }
+        }
+
+        
+        SFileRemoveFile(hMpq, "FileTest_10.exe");
+        SFileRemoveFile(hMpq, "FileTest_15.exe");
+        dwFileCount = SFileGetMaxFileCount(hMpq);
+        SFileSetMaxFileCount(hMpq, dwFileCount - 1);
+
+        // Add ZeroSize.txt (1)
+        sprintf(szMpqFileName, "ZeroSize_1.txt");
+        for(i = 0; LocaleIDs[i] != 0xFFFF; i++)
+        {
+            printf("Adding %s as %s (locale %04x) ...\n", szFileName2, szMpqFileName, LocaleIDs[i]);
+            SFileSetLocale(LocaleIDs[i]);
+            if(!SFileAddFileEx(hMpq, szFileName2, szMpqFileName, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED, MPQ_COMPRESSION_ZLIB))
+                printf("Cannot add the file\n");
+        }
+
+        // Add ZeroSize.txt (1)
+        sprintf(szMpqFileName, "ZeroSize_2.txt");
+        for(int i = 0; LocaleIDs[i] != 0xFFFF; i++)
+        {
+            printf("Adding %s as %s (locale %04x) ...\n", szFileName2, szMpqFileName, LocaleIDs[i]);
+            SFileSetLocale(LocaleIDs[i]);
+            if(!SFileAddFileEx(hMpq, szFileName2, szMpqFileName, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED, MPQ_COMPRESSION_ZLIB))
+                printf("Cannot add the file\n");
+        }
+    }
+
+    // Test rename function
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Testing rename files ...\n");
+        SFileSetLocale(LANG_NEUTRAL);
+        if(!SFileRenameFile(hMpq, "FileTest_08.exe", "FileTest_08a.exe"))
+        {
+            nError = GetLastError();
+            printf("Failed to rename the file\n");
+        }
+
+        if(!SFileRenameFile(hMpq, "FileTest_08a.exe", "FileTest_08.exe"))
+        {
+            nError = GetLastError();
+            printf("Failed to rename the file\n");
+        }
+
+        if(!SFileRenameFile(hMpq, "FileTest_10.exe", "FileTest_10a.exe"))
+        {
+            nError = GetLastError();
+            printf("Failed to rename the file\n");
+        }
+
+        if(!SFileRenameFile(hMpq, "FileTest_10a.exe", "FileTest_10.exe"))
+        {
+            nError = GetLastError();
+            printf("Failed to rename the file\n");
+        }
+        
+        if(nError == ERROR_SUCCESS)
+            printf("Rename test succeeded.\n\n");
+        else
+            printf("Rename test failed.\n\n");
+    }
+
+    // Compact the archive
+//  if(nError == ERROR_SUCCESS)
+//      SFileCompactArchive(hMpq);
+
+    // Test changing hash table size
+//  if(nError == ERROR_SUCCESS)
+//      SFileSetMaxFileCount(hMpq, 0x95);
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+
+    // Try to reopen the archive
+    if(SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+        SFileCloseArchive(hMpq);
+
+    printf("\n");
+    return nError;
+}
+
+static int TestAddFilesToMpq(
+    const char * szMpqName,
+    ...
+    )
+{
+    const char * szFileName;
+    HANDLE hMpq;
+    va_list argList;
+    int nError = ERROR_SUCCESS;
+
+    if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+        return GetLastError();
+
+    va_start(argList, szMpqName);
+    while((szFileName = va_arg(argList, const char *)) != NULL)
+    {
+        if(!SFileAddFileEx(hMpq, szFileName,
+                                 GetPlainFileName(szFileName),
+                                 MPQ_FILE_COMPRESS,
+                                 MPQ_COMPRESSION_ZLIB))
+        {
+            nError = GetLastError();
+            printf("Failed to add the file \"%s\"\n", szFileName);
+        }
+    }
+
+    SFileCloseArchive(hMpq);
+    return nError;
+}
+
+static int TestCreateArchiveFromMemory(const char * szMpqName)
+{
+#define FILE_SIZE 65535
+
+    HANDLE hFile;
+    HANDLE hMPQ;
+    char* data = new char [FILE_SIZE];          // random memory data
+    char szFileName[100];
+    int i;
+ 
+    // Create an mpq file for testing
+    if(SFileCreateArchive(szMpqName, MPQ_CREATE_ARCHIVE_V2|MPQ_CREATE_ATTRIBUTES, 0x100000, &hMPQ))
+    {
+        for(i = 0; i < 1000; i++)
+        {
+            sprintf(szFileName, "File%03u.bin", i);
+            printf("Adding file %s\r", szFileName);
+
+            if(SFileCreateFile(hMPQ, szFileName, 0, FILE_SIZE, 0, MPQ_FILE_COMPRESS, &hFile))
+            {
+                SFileWriteFile(hFile, data, FILE_SIZE, MPQ_COMPRESSION_ZLIB);
+                SFileFinishFile(hFile);
+            }
+        }
+    }
+    SFileCloseArchive(hMPQ);
+    delete [] data;
+    return ERROR_SUCCESS;
+}
+
+static int TestFileReadAndWrite(
+    const char * szMpqName,
+    const char * szFileName)
+{
+    LPBYTE pvFile = NULL;
+    HANDLE hFile = NULL;
+    HANDLE hMpq = NULL;
+    DWORD dwBytesRead;
+    DWORD dwFileSize = 0;
+    int nError = ERROR_SUCCESS;
+
+    if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+    {
+        nError = GetLastError();
+        printf("Failed to open the archive %s (%u).\n", szMpqName, nError);
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+        {
+            nError = GetLastError();
+            printf("Failed to open the file %s (%u).\n", szFileName, nError);
+        }
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileGetFileInfo(hFile, SFILE_INFO_FILE_SIZE, &dwFileSize, sizeof(DWORD)))
+        {
+            nError = GetLastError();
+            printf("Failed to get the file size (%u).\n", nError);
+        }
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        pvFile = new BYTE[dwFileSize];
+        if(pvFile == NULL)
+        {
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+            printf("Failed to allocate buffer for the file (%u).\n", nError);
+        }
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileReadFile(hFile, pvFile, dwFileSize, &dwBytesRead))
+        {
+            nError = GetLastError();
+            printf("Failed to read file (%u).\n", nError);
+        }
+    }
+
+    if(hFile != NULL)
+    {
+        SFileCloseFile(hFile);
+        hFile = NULL;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileCreateFile(hMpq, szFileName, 0, dwFileSize, 0, MPQ_FILE_REPLACEEXISTING, &hFile))
+        {
+            nError = GetLastError();
+            printf("Failed to create %s in the archive (%u).\n", szFileName, nError);
+        }
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileWriteFile(hFile, pvFile, dwFileSize, 0))
+        {
+            nError = GetLastError();
+            printf("Failed to write the data to the MPQ (%u).\n", nError);
+        }
+    }
+
+    if(hFile != NULL)
+    {
+        if(!SFileFinishFile(hFile))
+        {
+            nError = GetLastError();
+            printf("Failed to finalize file creation (%u).\n", nError);
+        }
+    }
+
+    if(pvFile != NULL)
+        delete [] pvFile;
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return nError;
+}
+
+static int TestSignatureVerify(const char * szMpqName)
+{
+    HANDLE hMpq;
+    
+    if(SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+    {
+        printf("Verifying digital signature in %s:\n", szMpqName);
+        switch(SFileVerifyArchive(hMpq))
+        {
+            case ERROR_NO_SIGNATURE:
+                printf("No digital signature present.\n");
+                break;
+        
+            case ERROR_VERIFY_FAILED:
+                printf("Failed to verify signature.\n");
+                break;
+            
+            case ERROR_WEAK_SIGNATURE_OK:
+                printf("Weak signature is OK.\n");
+                break;
+
+            case ERROR_WEAK_SIGNATURE_ERROR:
+                printf("Weak signature mismatch.\n");
+                break;
+
+            case ERROR_STRONG_SIGNATURE_OK:
+                printf("Strong signature is OK.\n");
+                break;
+
+            case ERROR_STRONG_SIGNATURE_ERROR:
+                printf("Strong signature mismatch.\n");
+                break;
+        }
+        
+        SFileCloseArchive(hMpq);
+        printf("\n");
+    }
+
+    return 0;
+}
+
+
+static int TestCreateArchiveCopy(const char * szMpqName, const char * szMpqCopyName, const char * szListFile)
+{
+    TFileStream * pStream;
+    char   szLocalFile[MAX_PATH] = "";
+    HANDLE hMpq1 = NULL;                // Handle of existing archive
+    HANDLE hMpq2 = NULL;                // Handle of created archive 
+    DWORD dwHashTableSize = 0;
+    int nError = ERROR_SUCCESS;
+
+    // If no listfile or an empty one, use NULL
+    if(szListFile == NULL || *szListFile == 0)
+        szListFile = NULL;
+
+    // Create the new file
+    pStream = FileStream_CreateFile(szMpqCopyName);
+    if(pStream == NULL)
+        nError = GetLastError();
+
+    // Write some data
+    if(nError == ERROR_SUCCESS)
+    {
+        ULONGLONG FileSize = 0x100000;
+        
+        FileStream_SetSize(pStream, FileSize);
+        FileStream_Close(pStream);
+    }
+
+    // Open the existing MPQ archive
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening %s ...\n", szMpqName);
+        if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq1))
+            nError = GetLastError();
+    }
+
+    // Well, now create the MPQ archive
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Creating %s ...\n", szMpqCopyName);
+        SFileGetFileInfo(hMpq1, SFILE_INFO_HASH_TABLE_SIZE, &dwHashTableSize, 4);
+        if(!SFileCreateArchive(szMpqCopyName, 0, dwHashTableSize, &hMpq2))
+            nError = GetLastError();
+    }
+
+    // Copy all files from one archive to another
+    if(nError == ERROR_SUCCESS)
+    {
+        SFILE_FIND_DATA sf;
+        HANDLE hFind = SFileFindFirstFile(hMpq1, "*", &sf, szListFile);
+        bool bResult = true;
+
+        printf("Copying files ...\n");
+
+        if(hFind != NULL)
+        {
+            while(bResult)
+            {
+                if(strcmp(sf.cFileName, LISTFILE_NAME) && strcmp(sf.cFileName, ATTRIBUTES_NAME))
+                {
+                    SFileSetLocale(sf.lcLocale);
+
+                    // Create the local file name
+                    sprintf(szLocalFile, "%s/%s", szWorkDir, sf.szPlainName);
+                    if(SFileExtractFile(hMpq1, sf.cFileName, szLocalFile))
+                    {
+                        printf("Extracting %s ... OK\n", sf.cFileName);
+                        if(!SFileAddFile(hMpq2, szLocalFile, sf.cFileName, sf.dwFileFlags))
+                        {
+                            nError = GetLastError();
+                            printf("Adding %s ... Failed\n\n", sf.cFileName);
+                            remove(szLocalFile);
+                            break;
+                        }
+                        else
+                        {
+                            printf("Adding %s ... OK\n", sf.cFileName);
+                        }
+                    }
+                    else
+                    {
+                        printf("Extracting %s ... Failed\n", sf.cFileName);
+                    }
+
+                    // Delete the added file
+                    remove(szLocalFile);
+                }
+
+                // Find the next file
+                bResult = SFileFindNextFile(hFind, &sf);
+            }
+
+            // Close the search handle
+            SFileFindClose(hFind);
+            printf("\n");
+        }
+    }
+
+    // Close both archives
+    if(hMpq2 != NULL)
+        SFileCloseArchive(hMpq2);
+    if(hMpq1 != NULL)
+        SFileCloseArchive(hMpq1);
+    return nError;
+}
+
+static int TestCompareTwoArchives(
+    const char * szMpqName1,
+    const char * szMpqName2,
+    const char * szListFile,
+    DWORD dwBlockSize)
+{
+    TMPQArchive * ha1 = NULL;
+    TMPQArchive * ha2 = NULL;
+    LPBYTE pbBuffer1 = NULL;
+    LPBYTE pbBuffer2 = NULL;
+    HANDLE hMpq1 = NULL;                // Handle of the first archive
+    HANDLE hMpq2 = NULL;                // Handle of the second archive
+    HANDLE hFile1 = NULL;
+    HANDLE hFile2 = NULL;
+    int nError = ERROR_SUCCESS;
+
+    // If no listfile or an empty one, use NULL
+    if(szListFile == NULL || *szListFile == 0)
+        szListFile = NULL;
+
+    // Allocate both buffers
+    pbBuffer1 = new BYTE[dwBlockSize];
+    pbBuffer2 = new BYTE[dwBlockSize];
+    if(pbBuffer1 == NULL || pbBuffer2 == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    printf("=============== Comparing MPQ archives ===============\n");
+
+    // Open the first MPQ archive
+    if(nError == ERROR_SUCCESS && szMpqName1 != NULL)
+    {
+        printf("Opening %s ...\n", szMpqName1);
+        if(!SFileOpenArchive(szMpqName1, 0, 0, &hMpq1))
+            nError = GetLastError();
+        ha1 = (TMPQArchive *)hMpq1;
+    }
+
+    // Open the second MPQ archive
+    if(nError == ERROR_SUCCESS && szMpqName2 != NULL)
+    {
+        printf("Opening %s ...\n", szMpqName2);
+        if(!SFileOpenArchive(szMpqName2, 0, 0, &hMpq2))
+            nError = GetLastError();
+        ha2 = (TMPQArchive *)hMpq2;
+    }
+
+    // Compare the header
+    if(nError == ERROR_SUCCESS && (ha1 != NULL && ha2 != NULL))
+    {
+        if(ha1->pHeader->dwHeaderSize != ha2->pHeader->dwHeaderSize)
+            printf(" - Header size is different\n");
+        if(ha1->pHeader->wFormatVersion != ha2->pHeader->wFormatVersion)
+            printf(" - Format version is different\n");
+        if(ha1->pHeader->wSectorSize != ha2->pHeader->wSectorSize)
+            printf(" - Sector size is different\n");
+        if(ha1->pHeader->HetTableSize64 != ha2->pHeader->HetTableSize64)
+            printf(" - HET table size is different\n");
+        if(ha1->pHeader->BetTableSize64 != ha2->pHeader->BetTableSize64)
+            printf(" - BET table size is different\n");
+        if(ha1->pHeader->dwHashTableSize != ha2->pHeader->dwHashTableSize)
+            printf(" - Hash table size is different\n");
+        if(ha1->pHeader->dwBlockTableSize != ha2->pHeader->dwBlockTableSize)
+            printf(" - Block table size is different\n");
+    }
+
+    // Find all files in the first archive and compare them
+    if(nError == ERROR_SUCCESS)
+    {
+        SFILE_FIND_DATA sf;
+        HANDLE hFind = SFileFindFirstFile(hMpq1, "*", &sf, szListFile);
+        DWORD dwSearchScope1 = SFILE_OPEN_FROM_MPQ;
+        DWORD dwSearchScope2 = SFILE_OPEN_FROM_MPQ;
+        bool bResult = true;
+
+        if(hMpq1 == NULL)
+            dwSearchScope1 = SFILE_OPEN_LOCAL_FILE;
+        if(hMpq2 == NULL)
+            dwSearchScope2 = SFILE_OPEN_LOCAL_FILE;
+
+        while(hFind != NULL && bResult == true)
+        {
+            printf("%s\n", sf.cFileName);
+            SFileSetLocale(sf.lcLocale);
+
+            // Open the first file
+            if(!SFileOpenFileEx(hMpq1, sf.cFileName, dwSearchScope1, &hFile1))
+            {
+                printf("Failed to open the file %s in the first archive\n", sf.cFileName);
+                continue;
+            }
+
+            if(!SFileOpenFileEx(hMpq2, sf.cFileName, dwSearchScope2, &hFile2))
+            {
+                printf("Failed to open the file %s in the second archive\n", sf.cFileName);
+                continue;
+            }
+
+            if(dwSearchScope1 == SFILE_OPEN_FROM_MPQ && dwSearchScope2 == SFILE_OPEN_FROM_MPQ)
+            {
+                TMPQFile * hf1 = (TMPQFile *)hFile1;
+                TMPQFile * hf2 = (TMPQFile *)hFile2;
+
+                // Compare the file sizes
+                if(hf1->pFileEntry->dwFileSize != hf2->pFileEntry->dwFileSize)
+                    printf(" - %s different size (%u x %u)\n", sf.cFileName, hf1->pFileEntry->dwFileSize, hf2->pFileEntry->dwFileSize);
+
+                if(hf1->pFileEntry->dwFlags != hf2->pFileEntry->dwFlags)
+                    printf(" - %s different flags (%08X x %08X)\n", sf.cFileName, hf1->pFileEntry->dwFlags, hf2->pFileEntry->dwFlags);
+            }
+
+            if(!CompareArchivedFiles(sf.cFileName, hFile1, hFile2, 0x1001))
+                printf(" - %s different content\n", sf.cFileName);
+
+            if(!CompareArchivedFilesRR(sf.cFileName, hFile1, hFile2, 0x100000))
+                printf(" - %s different content\n", sf.cFileName);
+
+            // Close both files
+            SFileCloseFile(hFile2);
+            SFileCloseFile(hFile1);
+            hFile2 = hFile1 = NULL;
+
+            // Find the next file
+            bResult = SFileFindNextFile(hFind, &sf);
+        }
+
+        // Close all handles
+        if(hFile2 != NULL)
+            SFileCloseFile(hFile2);
+        if(hFile1 != NULL)
+            SFileCloseFile(hFile1);
+        if(hFind != NULL)
+            SFileFindClose(hFind);
+    }
+
+    // Close both archives
+    clreol();
+    printf("================ MPQ compare complete ================\n");
+    if(hMpq2 != NULL)
+        SFileCloseArchive(hMpq2);
+    if(hMpq1 != NULL)
+        SFileCloseArchive(hMpq1);
+    if(pbBuffer2 != NULL)
+        delete [] pbBuffer2;
+    if(pbBuffer1 != NULL)
+        delete [] pbBuffer1;
+    return nError;
+}
+
+static int TestOpenPatchedArchive(const char * szMpqName, ...)
+{
+    TFileStream * pStream;
+    HANDLE hFile = NULL;
+    HANDLE hMpq = NULL;
+    va_list argList;
+    const char * szFileName = "DBFilesClient\\Achievement.dbc";
+//  const char * szExtension;
+//  const char * szLocale;
+    char szLocFileName[MAX_PATH];
+    LPBYTE pbFullFile = NULL;
+    DWORD dwFileSize;
+    int nError = ERROR_SUCCESS;
+
+    // Open the primary MPQ
+    printf("Opening %s ...\n", szMpqName);
+    if(!SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+    {
+        nError = GetLastError();
+        printf("Failed to open the archive %s ...\n", szMpqName);
+    }
+
+    // Add all patches
+    if(nError == ERROR_SUCCESS)
+    {
+        va_start(argList, szMpqName);
+        while((szMpqName = va_arg(argList, const char *)) != NULL)
+        {
+            printf("Adding patch %s ...\n", szMpqName);
+            if(!SFileOpenPatchArchive(hMpq, szMpqName, NULL, 0))
+            {
+                nError = GetLastError();
+                printf("Failed to add patch %s ...\n", szMpqName);
+            }
+        }
+        va_end(argList);
+    }
+/*
+    // Now search all files
+    if(nError == ERROR_SUCCESS)
+    {
+        SFILE_FIND_DATA sf;
+        HANDLE hFind;
+        bool bResult = true;
+
+        hFind = SFileFindFirstFile(hMpq, "*", &sf, NULL);
+        while(hFind && bResult)
+        {
+            printf("%s\n", sf.cFileName);
+            bResult = SFileFindNextFile(hFind, &sf);
+        }
+    }
+
+    // Now try to open patched version of a file
+    if(nError == ERROR_SUCCESS)
+    {
+        SFileExtractFile(hMpq, szFileName, "E:\\Spell.dbc");
+    }
+*/
+    // Now try to open patched version of "Achievement.dbc"
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening patched file \"%s\" ...\n", szFileName);
+        if(!SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_PATCHED_FILE, &hFile))
+        {
+            nError = GetLastError();
+            printf("Failed to open patched file \"%s\"\n", szFileName);
+        }
+    }
+
+    // Verify of the patched version is correct
+    if(nError == ERROR_SUCCESS)
+    {
+        // Get the size of the full patched file
+        dwFileSize = SFileGetFileSize(hFile, NULL);
+        if(dwFileSize != 0)
+        {
+            // Allocate space for the full file
+            pbFullFile = new BYTE[dwFileSize];
+            if(pbFullFile != NULL)
+            {
+                if(!SFileReadFile(hFile, pbFullFile, dwFileSize))
+                {           
+                    nError = GetLastError();
+                    printf("Failed to read full patched file data \"%s\"\n", szFileName);
+                }
+                
+                if(nError == ERROR_SUCCESS)
+                {
+                    strcpy(szLocFileName, MAKE_PATH("Work//"));
+                    strcat(szLocFileName, GetPlainName(szFileName));
+
+                    pStream = FileStream_CreateFile(szLocFileName);
+                    if(pStream != NULL)
+                    {
+                        FileStream_Write(pStream, NULL, pbFullFile, dwFileSize);
+                        FileStream_Close(pStream);
+                    }
+                }
+                
+                delete [] pbFullFile;
+            }
+        }
+    }
+
+    // Close handles
+    if(hFile != NULL)
+        SFileCloseFile(hFile);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    return nError;
+}
+
+//-----------------------------------------------------------------------------
+// Tests of the file read paths. Each test creates its own archive
+// with one file for each entry in AddFlags. All ways of reading a file
+// must give the same data as SFileReadFile
+
+static void GetTestFileName(char * szFileName, DWORD dwIndex)
+{
+    sprintf(szFileName, "File%02u.bin", dwIndex);
+}
+
+// Generates the content of a test file. Different seeds give different data,
+// so that the tests can recognize when an old version of the file is read
+static LPBYTE CreateTestFileData(DWORD dwIndex, DWORD dwSeed, LPDWORD pcbFileData)
+{
+    LPBYTE pbFileData;
+    DWORD cbFileData = (dwIndex * 0x2345) + (dwSeed * 0x111) + 0x123;
+
+    pbFileData = new BYTE[cbFileData];
+    if(pbFileData != NULL)
+    {
+        srand(dwIndex + (dwSeed << 8));
+        GenerateRandomDataBlock(pbFileData, cbFileData);
+        *pcbFileData = cbFileData;
+    }
+    return pbFileData;
+}
+
+static int WriteTestFile(HANDLE hMpq, DWORD dwIndex, DWORD dwSeed, DWORD dwFlags)
+{
+    HANDLE hFile = NULL;
+    LPBYTE pbFileData;
+    DWORD cbFileData = 0;
+    char szFileName[MAX_PATH];
+    int nError = ERROR_SUCCESS;
+
+    pbFileData = CreateTestFileData(dwIndex, dwSeed, &cbFileData);
+    if(pbFileData == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    GetTestFileName(szFileName, dwIndex);
+    if(!SFileCreateFile(hMpq, szFileName, 0, cbFileData, 0, dwFlags, &hFile))
+        nError = GetLastError();
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!SFileWriteFile(hFile, pbFileData, cbFileData, MPQ_COMPRESSION_ZLIB))
+            nError = GetLastError();
+        if(!SFileFinishFile(hFile) && nError == ERROR_SUCCESS)
+            nError = GetLastError();
+    }
+
+    if(nError != ERROR_SUCCESS)
+        printf("Failed to add the file \"%s\".\n", szFileName);
+    delete [] pbFileData;
+    return nError;
+}
+
+static int CreateTestArchive(const char * szMpqName)
+{
+    HANDLE hMpq = NULL;
+    int nError = ERROR_SUCCESS;
+
+    // Remove the archive from the previous run
+    printf("Creating %s ...\n", szMpqName);
+    remove(szMpqName);
+
+    if(!SFileCreateArchive(szMpqName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_ATTRIBUTES, 0x40, &hMpq))
+        return GetLastError();
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+        nError = WriteTestFile(hMpq, i, 0, AddFlags[i]);
+
+    SFileCloseArchive(hMpq);
+    return nError;
+}
+
+// Reads the entire file by SFileReadFile, in pieces that don't match the sectors
+static int ReadTestFile(HANDLE hMpq, const char * szFileName, LPBYTE * ppbFileData, LPDWORD pcbFileData)
+{
+    HANDLE hFile = NULL;
+    LPBYTE pbFileData = NULL;
+    DWORD dwBytesRead;
+    DWORD dwFileSize = 0;
+    DWORD dwFilePos = 0;
+    int nError = ERROR_SUCCESS;
+
+    if(!SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+        nError = GetLastError();
+
+    if(nError == ERROR_SUCCESS)
+    {
+        dwFileSize = SFileGetFileSize(hFile, NULL);
+        pbFileData = new BYTE[dwFileSize + 1];
+        if(pbFileData == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    while(nError == ERROR_SUCCESS && dwFilePos < dwFileSize)
+    {
+        DWORD dwToRead = dwFileSize - dwFilePos;
+
+        if(dwToRead > 0x777)
+            dwToRead = 0x777;
+
+        if(!SFileReadFile(hFile, pbFileData + dwFilePos, dwToRead, &dwBytesRead) || dwBytesRead != dwToRead)
+            nError = ERROR_FILE_CORRUPT;
+        dwFilePos += dwBytesRead;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        *ppbFileData = pbFileData;
+        *pcbFileData = dwFileSize;
+    }
+    else
+    {
+        printf("Failed to read the file \"%s\".\n", szFileName);
+        delete [] pbFileData;
+    }
+
+    if(hFile != NULL)
+        SFileCloseFile(hFile);
+    return nError;
+}
+
+// Loads the entire file into memory
+static LPBYTE LoadWholeFile(const char * szFileName, LPDWORD pcbFileData)
+{
+    TFileStream * pStream;
+    ULONGLONG FileSize = 0;
+    LPBYTE pbFileData = NULL;
+
+    pStream = FileStream_OpenFile(szFileName, false);
+    if(pStream != NULL)
+    {
+        FileStream_GetSize(pStream, FileSize);
+        pbFileData = new BYTE[(DWORD)FileSize];
+        if(pbFileData != NULL && !FileStream_Read(pStream, NULL, pbFileData, (DWORD)FileSize))
+        {
+            delete [] pbFileData;
+            pbFileData = NULL;
+        }
+        FileStream_Close(pStream);
+    }
+
+    *pcbFileData = (DWORD)FileSize;
+    return pbFileData;
+}
+
+static int TestMapFileView(const char * szMpqName)
+{
+    const void * pvView;
+    HANDLE hFile;
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData;
+    DWORD cbFileData;
+    DWORD cbView;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+    if(nError != ERROR_SUCCESS)
+        return nError;
+
+    // Read-only archives are memory-mapped, so the views of stored files need no copy
+    if(!SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+        return GetLastError();
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = ReadTestFile(hMpq, szFileName, &pbFileData, &cbFileData);
+        if(nError != ERROR_SUCCESS)
+            break;
+
+        if(SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+        {
+            if(SFileMapFileView(hFile, &pvView, &cbView))
+            {
+                if(cbView != cbFileData || GetFirstDiffer((void *)pvView, pbFileData, cbFileData) != -1)
+                {
+                    printf("The view of \"%s\" doesn't match the file data !!!\n", szFileName);
+                    nError = ERROR_FILE_CORRUPT;
+                }
+
+                // Views of stored files must point to the archive
+                if((AddFlags[i] & (MPQ_FILE_COMPRESSED | MPQ_FILE_ENCRYPTED)) == 0 && ((TMPQFile *)hFile)->pbFileView != NULL)
+                {
+                    printf("The view of \"%s\" has been copied !!!\n", szFileName);
+                    nError = ERROR_FILE_CORRUPT;
+                }
+
+                SFileUnmapFileView(hFile, pvView);
+            }
+            else
+                nError = GetLastError();
+
+            // The view doesn't move the file position
+            if(nError == ERROR_SUCCESS && SFileSetFilePointer(hFile, 0, NULL, FILE_CURRENT) != 0)
+            {
+                printf("SFileMapFileView moved the file position of \"%s\" !!!\n", szFileName);
+                nError = ERROR_FILE_CORRUPT;
+            }
+            SFileCloseFile(hFile);
+        }
+        else
+            nError = GetLastError();
+
+        delete [] pbFileData;
+    }
+
+    SFileCloseArchive(hMpq);
+    return nError;
+}
+
+// Data shared by the threads that read from one thread-safe archive
+struct TThreadReadData
+{
+    HANDLE hMpq;                            // The archive, open with MPQ_OPEN_THREAD_SAFE
+    LPBYTE * FileData;                      // Expected content of each file
+    LPDWORD FileSizes;                      // Expected size of each file
+    DWORD dwFileCount;                      // Number of files in the archive
+    DWORD dwFirstFile;                      // Index of the first file read by the thread
+    int nError;                             // Result of the thread
+};
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI ThreadSafeReadProc(LPVOID lpParam)
+#else
+static void * ThreadSafeReadProc(void * lpParam)
+#endif
+{
+    TThreadReadData * pData = (TThreadReadData *)lpParam;
+    LPBYTE pbFileData;
+    DWORD cbFileData;
+    DWORD dwIndex;
+    char szFileName[MAX_PATH];
+
+    // Each thread reads all files a few times, starting with a different one
+    for(DWORD i = 0; i < pData->dwFileCount * 4 && pData->nError == ERROR_SUCCESS; i++)
+    {
+        dwIndex = (pData->dwFirstFile + i) % pData->dwFileCount;
+        GetTestFileName(szFileName, dwIndex);
+
+        pData->nError = ReadTestFile(pData->hMpq, szFileName, &pbFileData, &cbFileData);
+        if(pData->nError == ERROR_SUCCESS)
+        {
+            if(cbFileData != pData->FileSizes[dwIndex] || GetFirstDiffer(pbFileData, pData->FileData[dwIndex], cbFileData) != -1)
+            {
+                printf("Different data read from \"%s\" by more threads !!!\n", szFileName);
+                pData->nError = ERROR_FILE_CORRUPT;
+            }
+            delete [] pbFileData;
+        }
+    }
+    return 0;
+}
+
+// Reads all files of a thread-safe archive from more threads at once
+static int TestThreadSafeRead(const char * szMpqName)
+{
+    TThreadReadData ThreadData[THREAD_READ_COUNT];
+    LPBYTE FileData[0x40];
+    DWORD FileSizes[0x40];
+    HANDLE hMpq = NULL;
+    DWORD dwFileCount = 0;
+    DWORD dwThreads = 0;
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    // The expected content is made here, because rand() is not thread-safe
+    for(dwFileCount = 0; AddFlags[dwFileCount] != 0xFFFFFFFF && nError == ERROR_SUCCESS; dwFileCount++)
+    {
+        FileData[dwFileCount] = CreateTestFileData(dwFileCount, 0, &FileSizes[dwFileCount]);
+        if(FileData[dwFileCount] == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Reading %s by %u threads ...\n", szMpqName, THREAD_READ_COUNT);
+        if(!SFileOpenArchive(szMpqName, 0, MPQ_OPEN_THREAD_SAFE, &hMpq))
+            nError = GetLastError();
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+#ifdef PLATFORM_WINDOWS
+        HANDLE Threads[THREAD_READ_COUNT];
+#else
+        pthread_t Threads[THREAD_READ_COUNT];
+#endif
+
+        // Start the threads
+        for(dwThreads = 0; dwThreads < THREAD_READ_COUNT; dwThreads++)
+        {
+            TThreadReadData * pData = &ThreadData[dwThreads];
+
+            pData->hMpq = hMpq;
+            pData->FileData = FileData;
+            pData->FileSizes = FileSizes;
+            pData->dwFileCount = dwFileCount;
+            pData->dwFirstFile = dwThreads * 3;
+            pData->nError = ERROR_SUCCESS;
+
+#ifdef PLATFORM_WINDOWS
+            Threads[dwThreads] = CreateThread(NULL, 0, ThreadSafeReadProc, pData, 0, NULL);
+            if(Threads[dwThreads] == NULL)
+                break;
+#else
+            if(pthread_create(&Threads[dwThreads], NULL, ThreadSafeReadProc, pData) != 0)
+                break;
+#endif
+        }
+
+        // Wait for them to finish
+        for(DWORD i = 0; i < dwThreads; i++)
+        {
+#ifdef PLATFORM_WINDOWS
+            WaitForSingleObject(Threads[i], INFINITE);
+            CloseHandle(Threads[i]);
+#else
+            pthread_join(Threads[i], NULL);
+#endif
+            if(nError == ERROR_SUCCESS)
+                nError = ThreadData[i].nError;
+        }
+
+        if(nError == ERROR_SUCCESS && dwThreads != THREAD_READ_COUNT)
+        {
+            printf("Failed to start the reading threads.\n");
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    for(DWORD i = 0; i < dwFileCount; i++)
+        delete [] FileData[i];
+    return nError;
+}
+
+// Reads each file by asynchronous reads that are all queued at once,
+// while another file is read synchronously. The last read goes past
+// the end of the file and must be cut. Archives that are not thread-safe
+// must refuse asynchronous reads
+static int TestAsyncRead(const char * szMpqName)
+{
+    OVERLAPPED Overlapped[ASYNC_READ_PARTS + 1];
+    HANDLE hFile;
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData;
+    LPBYTE pbAsyncData;
+    DWORD OpenFlags[] = {0, MPQ_OPEN_THREAD_SAFE};
+    DWORD dwPartSize;
+    DWORD dwBytesRead;
+    DWORD cbFileData;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    for(int nOpen = 0; nOpen < 2 && nError == ERROR_SUCCESS; nOpen++)
+    {
+        if(!SFileOpenArchive(szMpqName, 0, OpenFlags[nOpen], &hMpq))
+            return GetLastError();
+
+        for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+        {
+            GetTestFileName(szFileName, i);
+            nError = ReadTestFile(hMpq, szFileName, &pbFileData, &cbFileData);
+            if(nError != ERROR_SUCCESS)
+                break;
+
+            pbAsyncData = new BYTE[cbFileData + ASYNC_READ_EOF_SIZE];
+            if(pbAsyncData != NULL && OpenFlags[nOpen] == 0 && SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+            {
+                // Archives that are not thread-safe can't be read asynchronously
+                memset(Overlapped, 0, sizeof(Overlapped));
+                if(SFileReadFile(hFile, pbAsyncData, cbFileData, NULL, &Overlapped[0]) || GetLastError() != ERROR_NOT_SUPPORTED)
+                {
+                    printf("Asynchronous read of \"%s\" was not refused !!!\n", szFileName);
+                    nError = ERROR_CAN_NOT_COMPLETE;
+                }
+                SFileCloseFile(hFile);
+            }
+            else if(pbAsyncData != NULL && OpenFlags[nOpen] != 0 && SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+            {
+                memset(Overlapped, 0, sizeof(Overlapped));
+                dwPartSize = cbFileData / ASYNC_READ_PARTS;
+
+                // Queue the reads. Each one must be pending
+                for(int j = 0; j <= ASYNC_READ_PARTS; j++)
+                {
+                    DWORD dwOffset = (j < ASYNC_READ_PARTS) ? (j * dwPartSize) : (cbFileData - 0x10);
+                    DWORD dwToRead = (j < ASYNC_READ_PARTS - 1) ? dwPartSize : (cbFileData - dwOffset);
+
+                    if(j == ASYNC_READ_PARTS)
+                        dwToRead = ASYNC_READ_EOF_SIZE;
+
+                    Overlapped[j].Offset = dwOffset;
+                    if(SFileReadFile(hFile, pbAsyncData + dwOffset, dwToRead, NULL, &Overlapped[j]) || GetLastError() != ERROR_IO_PENDING)
+                    {
+                        printf("Asynchronous read of \"%s\" is not pending !!!\n", szFileName);
+                        nError = ERROR_CAN_NOT_COMPLETE;
+                    }
+                }
+
+                // Read another file while the reads are in progress
+                if(nError == ERROR_SUCCESS)
+                {
+                    DWORD dwOtherIndex = (AddFlags[i + 1] != 0xFFFFFFFF) ? (i + 1) : 0;
+                    LPBYTE pbOtherData1 = NULL;
+                    LPBYTE pbOtherData2 = NULL;
+                    DWORD cbOtherData1 = 0;
+                    DWORD cbOtherData2 = 0;
+                    char szOtherName[MAX_PATH];
+
+                    GetTestFileName(szOtherName, dwOtherIndex);
+                    pbOtherData1 = CreateTestFileData(dwOtherIndex, 0, &cbOtherData1);
+                    nError = ReadTestFile(hMpq, szOtherName, &pbOtherData2, &cbOtherData2);
+                    if(nError == ERROR_SUCCESS && (pbOtherData1 == NULL || cbOtherData2 != cbOtherData1 || GetFirstDiffer(pbOtherData2, pbOtherData1, cbOtherData1) != -1))
+                    {
+                        printf("Synchronous read of \"%s\" during asynchronous reads gave wrong data !!!\n", szOtherName);
+                        nError = ERROR_FILE_CORRUPT;
+                    }
+                    delete [] pbOtherData2;
+                    delete [] pbOtherData1;
+                }
+
+                // Wait for all reads, even if some of them failed to start
+                for(int j = 0; j <= ASYNC_READ_PARTS; j++)
+                {
+                    bool bResult = SFileGetOverlappedResult(hFile, &Overlapped[j], &dwBytesRead, true);
+
+                    if(j < ASYNC_READ_PARTS && bResult == false)
+                        nError = ERROR_FILE_CORRUPT;
+                    if(j == ASYNC_READ_PARTS && (bResult || GetLastError() != ERROR_HANDLE_EOF || dwBytesRead != 0x10))
+                        nError = ERROR_FILE_CORRUPT;
+                }
+
+                if(nError == ERROR_SUCCESS && GetFirstDiffer(pbAsyncData, pbFileData, cbFileData) != -1)
+                    nError = ERROR_FILE_CORRUPT;
+                if(nError == ERROR_FILE_CORRUPT)
+                    printf("Asynchronous read of \"%s\" gave wrong data !!!\n", szFileName);
+                SFileCloseFile(hFile);
+            }
+            else if(nError == ERROR_SUCCESS)
+                nError = (pbAsyncData != NULL) ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+
+            delete [] pbAsyncData;
+            delete [] pbFileData;
+        }
+
+        SFileCloseArchive(hMpq);
+    }
+    return nError;
+}
+
+// Closing a file must wait for its asynchronous reads that are still
+// in progress. After the close, all reads must be complete
+static int TestAsyncClose(const char * szMpqName)
+{
+    OVERLAPPED Overlapped[ASYNC_READ_PARTS];
+    HANDLE hFile;
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData;
+    LPBYTE pbAsyncData;
+    DWORD dwPartSize;
+    DWORD cbFileData;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        if(!SFileOpenArchive(szMpqName, 0, MPQ_OPEN_THREAD_SAFE, &hMpq))
+            return GetLastError();
+
+        GetTestFileName(szFileName, i);
+        nError = ReadTestFile(hMpq, szFileName, &pbFileData, &cbFileData);
+        if(nError != ERROR_SUCCESS)
+        {
+            SFileCloseArchive(hMpq);
+            break;
+        }
+
+        pbAsyncData = new BYTE[cbFileData];
+        if(pbAsyncData != NULL && SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+        {
+            memset(Overlapped, 0, sizeof(Overlapped));
+            dwPartSize = cbFileData / ASYNC_READ_PARTS;
+
+            for(int j = 0; j < ASYNC_READ_PARTS; j++)
+            {
+                DWORD dwOffset = j * dwPartSize;
+                DWORD dwToRead = (j < ASYNC_READ_PARTS - 1) ? dwPartSize : (cbFileData - dwOffset);
+
+                Overlapped[j].Offset = dwOffset;
+                SFileReadFile(hFile, pbAsyncData + dwOffset, dwToRead, NULL, &Overlapped[j]);
+            }
+
+            // Close the file and the archive right away
+            SFileCloseFile(hFile);
+            SFileCloseArchive(hMpq);
+
+            for(int j = 0; j < ASYNC_READ_PARTS; j++)
+            {
+                if(Overlapped[j].Internal != ERROR_SUCCESS)
+                {
+                    printf("Asynchronous read of \"%s\" is not complete after close (%u) !!!\n", szFileName, (DWORD)Overlapped[j].Internal);
+                    nError = ERROR_CAN_NOT_COMPLETE;
+                }
+            }
+
+            if(nError == ERROR_SUCCESS && GetFirstDiffer(pbAsyncData, pbFileData, cbFileData) != -1)
+            {
+                printf("Asynchronous read of \"%s\" gave wrong data !!!\n", szFileName);
+                nError = ERROR_FILE_CORRUPT;
+            }
+        }
+        else
+        {
+            nError = (pbAsyncData != NULL) ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+            SFileCloseArchive(hMpq);
+        }
+
+        delete [] pbAsyncData;
+        delete [] pbFileData;
+    }
+    return nError;
+}
+
+// Files for TestParallelDecode. They are big enough for their sectors to be decoded by more threads
+struct TDecodeTestFile
+{
+    const char * szFileName;
+    DWORD dwFlags;
+    DWORD dwCompression;
+};
+
+static TDecodeTestFile DecodeTestFiles[] =
+{
+    {"Zlib.txt",      MPQ_FILE_COMPRESS,                                         MPQ_COMPRESSION_ZLIB},
+    {"Bzip2.txt",     MPQ_FILE_COMPRESS,                                         MPQ_COMPRESSION_BZIP2},
+    {"Lzma.txt",      MPQ_FILE_COMPRESS,                                         MPQ_COMPRESSION_LZMA},
+    {"Implode.txt",   MPQ_FILE_IMPLODE,                                          0},
+    {"Encrypted.txt", MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY, MPQ_COMPRESSION_ZLIB},
+    {"Crc.txt",       MPQ_FILE_COMPRESS | MPQ_FILE_SECTOR_CRC,                   MPQ_COMPRESSION_ZLIB},
+    {"Stored.bin",    MPQ_FILE_ENCRYPTED,                                        0},
+    {NULL, 0, 0}
+};
+
+// Reads a part of the file in one call. Large reads decode the sectors by more threads
+static int ReadAndCompareFile(HANDLE hFile, LPBYTE pbExpected, DWORD dwOffset, DWORD dwBytesToRead, LPBYTE pbBuffer)
+{
+    DWORD dwBytesRead = 0;
+
+    SFileSetFilePointer(hFile, dwOffset, NULL, FILE_BEGIN);
+    if(!SFileReadFile(hFile, pbBuffer, dwBytesToRead, &dwBytesRead) || dwBytesRead != dwBytesToRead)
+    {
+        printf("Failed to read 0x%X bytes at offset 0x%X !!!\n", dwBytesToRead, dwOffset);
+        return ERROR_FILE_CORRUPT;
+    }
+
+    if(GetFirstDiffer(pbBuffer, pbExpected + dwOffset, dwBytesToRead) != -1)
+    {
+        printf("Different data read at offset 0x%X !!!\n", dwOffset);
+        return ERROR_FILE_CORRUPT;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Checks that large reads, whose sectors are decoded by more threads,
+// give the same data as small reads, that decode the sectors one by one.
+// Then checks that a damaged sector fails the large read
+static int TestParallelDecode(const char * szMpqName)
+{
+    TFileStream * pStream;
+    ULONGLONG ByteOffset;
+    HANDLE hFile = NULL;
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData = NULL;
+    LPBYTE pbReadData = NULL;
+    LPBYTE pbBuffer = NULL;
+    DWORD cbFileData = 0x180000;
+    DWORD cbReadData = 0;
+    DWORD dwFilePos = 0;
+    DWORD dwCompressedSize = 0;
+    DWORD dwBytesRead = 0;
+    BYTE DamagedByte = 0;
+    int nError = ERROR_SUCCESS;
+
+    pbFileData = new BYTE[cbFileData];
+    pbBuffer = new BYTE[cbFileData];
+    if(pbFileData == NULL || pbBuffer == NULL)
+        nError = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Create the archive with the compressible files and one file of random data
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Creating %s ...\n", szMpqName);
+        remove(szMpqName);
+        if(!SFileCreateArchive(szMpqName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_ATTRIBUTES, 0x40, &hMpq))
+            nError = GetLastError();
+    }
+
+    for(DWORD i = 0; DecodeTestFiles[i].szFileName != NULL && nError == ERROR_SUCCESS; i++)
+    {
+        TDecodeTestFile & TestFile = DecodeTestFiles[i];
+
+        if(TestFile.dwCompression != 0 || (TestFile.dwFlags & MPQ_FILE_IMPLODE))
+            GenerateTextBlock((char *)pbFileData, cbFileData);
+        else
+            GenerateRandomDataBlock(pbFileData, cbFileData);
+
+        if(!SFileCreateFile(hMpq, TestFile.szFileName, 0, cbFileData, 0, TestFile.dwFlags, &hFile))
+            nError = GetLastError();
+        if(nError == ERROR_SUCCESS)
+        {
+            if(!SFileWriteFile(hFile, pbFileData, cbFileData, TestFile.dwCompression))
+                nError = GetLastError();
+            if(!SFileFinishFile(hFile) && nError == ERROR_SUCCESS)
+                nError = GetLastError();
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    if(nError == ERROR_SUCCESS && !SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY | MPQ_OPEN_CHECK_SECTOR_CRC, &hMpq))
+        nError = GetLastError();
+
+    for(DWORD i = 0; DecodeTestFiles[i].szFileName != NULL && nError == ERROR_SUCCESS; i++)
+    {
+        const char * szFileName = DecodeTestFiles[i].szFileName;
+
+        printf("Decoding %s ...\r", szFileName);
+        clreol();
+
+        // Small reads decode the sectors one by one
+        nError = ReadTestFile(hMpq, szFileName, &pbReadData, &cbReadData);
+        if(nError != ERROR_SUCCESS)
+            break;
+
+        // Read the whole file, then a part that starts and ends inside a sector
+        if(!SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+            nError = GetLastError();
+        if(nError == ERROR_SUCCESS)
+        {
+            if(cbReadData != cbFileData)
+                nError = ERROR_FILE_CORRUPT;
+            if(nError == ERROR_SUCCESS)
+                nError = ReadAndCompareFile(hFile, pbReadData, 0, cbFileData, pbBuffer);
+            if(nError == ERROR_SUCCESS)
+                nError = ReadAndCompareFile(hFile, pbReadData, 0x1234, 0x100000, pbBuffer);
+            SFileCloseFile(hFile);
+        }
+
+        // The text files must also match the data that have been written
+        if(nError == ERROR_SUCCESS && strstr(szFileName, ".txt") != NULL)
+        {
+            GenerateTextBlock((char *)pbFileData, cbFileData);
+            if(GetFirstDiffer(pbReadData, pbFileData, cbFileData) != -1)
+            {
+                printf("Different data read from \"%s\" !!!\n", szFileName);
+                nError = ERROR_FILE_CORRUPT;
+            }
+        }
+
+        delete [] pbReadData;
+        pbReadData = NULL;
+    }
+
+    // Find the file with sector checksums
+    if(nError == ERROR_SUCCESS)
+    {
+        if(SFileOpenFileEx(hMpq, "Crc.txt", 0, &hFile))
+        {
+            SFileGetFileInfo(hFile, SFILE_INFO_POSITION, &dwFilePos, sizeof(DWORD));
+            SFileGetFileInfo(hFile, SFILE_INFO_COMPRESSED_SIZE, &dwCompressedSize, sizeof(DWORD));
+            SFileCloseFile(hFile);
+        }
+        else
+            nError = GetLastError();
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    // Damage one byte of a sector in the second half of the file
+    if(nError == ERROR_SUCCESS)
+    {
+        pStream = FileStream_OpenFile(szMpqName, true);
+        if(pStream != NULL)
+        {
+            ByteOffset = dwFilePos + (dwCompressedSize / 4) * 3;
+            if(FileStream_Read(pStream, &ByteOffset, &DamagedByte, 1))
+            {
+                DamagedByte ^= 0x55;
+                if(!FileStream_Write(pStream, &ByteOffset, &DamagedByte, 1))
+                    nError = GetLastError();
+            }
+            else
+                nError = GetLastError();
+            FileStream_Close(pStream);
+        }
+        else
+            nError = GetLastError();
+    }
+
+    if(nError == ERROR_SUCCESS && !SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY | MPQ_OPEN_CHECK_SECTOR_CRC, &hMpq))
+        nError = GetLastError();
+
+    // The large read must fail. The sectors before the damaged one are still fine
+    if(nError == ERROR_SUCCESS)
+    {
+        if(SFileOpenFileEx(hMpq, "Crc.txt", 0, &hFile))
+        {
+            if(SFileReadFile(hFile, pbBuffer, cbFileData, &dwBytesRead))
+            {
+                printf("A damaged sector has not been detected !!!\n");
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
+
+            GenerateTextBlock((char *)pbFileData, cbFileData);
+            if(nError == ERROR_SUCCESS)
+                nError = ReadAndCompareFile(hFile, pbFileData, 0, 0x10000, pbBuffer);
+            SFileCloseFile(hFile);
+        }
+        else
+            nError = GetLastError();
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    delete [] pbBuffer;
+    delete [] pbFileData;
+    return nError;
+}
+
+// Archive data given to SFileOpenArchiveEx through the stream callbacks
+struct TTestStreamData
+{
+    LPBYTE pbData;
+    DWORD cbData;
+    bool bClosed;
+};
+
+static bool WINAPI TestStream_Read(void * pvUserData, ULONGLONG ByteOffset, void * pvBuffer, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+{
+    TTestStreamData * pData = (TTestStreamData *)pvUserData;
+
+    // Reads past the end of the data give less bytes
+    if(ByteOffset > pData->cbData)
+        ByteOffset = pData->cbData;
+    if(dwBytesToRead > (pData->cbData - ByteOffset))
+        dwBytesToRead = (DWORD)(pData->cbData - ByteOffset);
+
+    memcpy(pvBuffer, pData->pbData + ByteOffset, dwBytesToRead);
+    *pdwBytesRead = dwBytesToRead;
+    return true;
+}
+
+static bool WINAPI TestStream_GetSize(void * pvUserData, ULONGLONG * pFileSize)
+{
+    *pFileSize = ((TTestStreamData *)pvUserData)->cbData;
+    return true;
+}
+
+static void WINAPI TestStream_Close(void * pvUserData)
+{
+    ((TTestStreamData *)pvUserData)->bClosed = true;
+}
+
+// Compares all test files of an archive open by SFileOpenArchiveEx with the archive file
+static int CompareTestArchives(HANDLE hMpq1, HANDLE hMpq2, LPBYTE pbArchive, DWORD cbArchive)
+{
+    const void * pvView;
+    HANDLE hFile;
+    LPBYTE pbFileData1;
+    LPBYTE pbFileData2;
+    DWORD cbFileData1;
+    DWORD cbFileData2;
+    DWORD cbView;
+    char szFileName[MAX_PATH];
+    int nError = ERROR_SUCCESS;
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = ReadTestFile(hMpq1, szFileName, &pbFileData1, &cbFileData1);
+        if(nError != ERROR_SUCCESS)
+            break;
+
+        nError = ReadTestFile(hMpq2, szFileName, &pbFileData2, &cbFileData2);
+        if(nError == ERROR_SUCCESS)
+        {
+            if(cbFileData2 != cbFileData1 || GetFirstDiffer(pbFileData2, pbFileData1, cbFileData1) != -1)
+            {
+                printf("The file \"%s\" doesn't match the archive file !!!\n", szFileName);
+                nError = ERROR_FILE_CORRUPT;
+            }
+            delete [] pbFileData2;
+        }
+
+        // Views of stored files in memory archives must point to the memory buffer
+        if(nError == ERROR_SUCCESS && pbArchive != NULL && (AddFlags[i] & (MPQ_FILE_COMPRESSED | MPQ_FILE_ENCRYPTED)) == 0)
+        {
+            if(SFileOpenFileEx(hMpq2, szFileName, 0, &hFile))
+            {
+                if(SFileMapFileView(hFile, &pvView, &cbView))
+                {
+                    if((LPBYTE)pvView < pbArchive || (LPBYTE)pvView + cbView > pbArchive + cbArchive)
+                    {
+                        printf("The view of \"%s\" is not in the memory buffer !!!\n", szFileName);
+                        nError = ERROR_FILE_CORRUPT;
+                    }
+                    SFileUnmapFileView(hFile, pvView);
+                }
+                else
+                    nError = GetLastError();
+                SFileCloseFile(hFile);
+            }
+            else
+                nError = GetLastError();
+        }
+
+        delete [] pbFileData1;
+    }
+    return nError;
+}
+
+static int TestOpenArchiveEx(const char * szMpqName)
+{
+    SFILE_STREAM_CALLBACKS Callbacks;
+    SFILE_ARCHIVE_SOURCE Source;
+    TTestStreamData StreamData;
+    TFileStream * pStream;
+    ULONGLONG FileSize = 0;
+    HANDLE hMpq1 = NULL;
+    HANDLE hMpq2 = NULL;
+    LPBYTE pbArchive = NULL;
+    DWORD cbArchive = 0;
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    // Load the entire archive into memory
+    if(nError == ERROR_SUCCESS)
+    {
+        pStream = FileStream_OpenFile(szMpqName, false);
+        if(pStream != NULL)
+        {
+            FileStream_GetSize(pStream, FileSize);
+            cbArchive = (DWORD)FileSize;
+            pbArchive = new BYTE[cbArchive];
+            if(pbArchive == NULL || !FileStream_Read(pStream, NULL, pbArchive, cbArchive))
+                nError = ERROR_CAN_NOT_COMPLETE;
+            FileStream_Close(pStream);
+        }
+        else
+            nError = GetLastError();
+    }
+
+    if(nError == ERROR_SUCCESS && !SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY, &hMpq1))
+        nError = GetLastError();
+
+    // Open the archive from the memory buffer
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening %s from memory ...\n", szMpqName);
+        memset(&Source, 0, sizeof(SFILE_ARCHIVE_SOURCE));
+        Source.dwSourceType = SFILE_SOURCE_MEMORY;
+        Source.szFileName = szMpqName;
+        Source.pvData = pbArchive;
+        Source.cbData = cbArchive;
+        if(SFileOpenArchiveEx(&Source, 0, 0, &hMpq2))
+        {
+            nError = CompareTestArchives(hMpq1, hMpq2, pbArchive, cbArchive);
+            SFileCloseArchive(hMpq2);
+        }
+        else
+            nError = GetLastError();
+    }
+
+    // Open the archive from the stream callbacks
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Opening %s from stream callbacks ...\n", szMpqName);
+        memset(&Callbacks, 0, sizeof(SFILE_STREAM_CALLBACKS));
+        Callbacks.StreamRead = TestStream_Read;
+        Callbacks.StreamGetSize = TestStream_GetSize;
+        Callbacks.StreamClose = TestStream_Close;
+
+        StreamData.pbData = pbArchive;
+        StreamData.cbData = cbArchive;
+        StreamData.bClosed = false;
+
+        memset(&Source, 0, sizeof(SFILE_ARCHIVE_SOURCE));
+        Source.dwSourceType = SFILE_SOURCE_CALLBACKS;
+        Source.pCallbacks = &Callbacks;
+        Source.pvUserData = &StreamData;
+        if(SFileOpenArchiveEx(&Source, 0, 0, &hMpq2))
+        {
+            nError = CompareTestArchives(hMpq1, hMpq2, NULL, 0);
+            SFileCloseArchive(hMpq2);
+
+            if(nError == ERROR_SUCCESS && StreamData.bClosed == false)
+            {
+                printf("The close callback has not been called !!!\n");
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
+        }
+        else
+            nError = GetLastError();
+    }
+
+    if(hMpq1 != NULL)
+        SFileCloseArchive(hMpq1);
+    delete [] pbArchive;
+    return nError;
+}
+
+static int TestLoadFile(const char * szMpqName)
+{
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData;
+    DWORD OpenFlags[] = {0, MPQ_OPEN_CHECK_SECTOR_CRC, MPQ_OPEN_READ_ONLY};
+    DWORD cbFileData;
+    DWORD cbLoaded;
+    void * pvLoaded;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    for(int nOpen = 0; nOpen < 3 && nError == ERROR_SUCCESS; nOpen++)
+    {
+        if(!SFileOpenArchive(szMpqName, 0, OpenFlags[nOpen], &hMpq))
+            return GetLastError();
+
+        for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+        {
+            GetTestFileName(szFileName, i);
+            nError = ReadTestFile(hMpq, szFileName, &pbFileData, &cbFileData);
+            if(nError != ERROR_SUCCESS)
+                break;
+
+            if(SFileLoadFile(hMpq, szFileName, &pvLoaded, &cbLoaded))
+            {
+                if(cbLoaded != cbFileData || GetFirstDiffer(pvLoaded, pbFileData, cbFileData) != -1)
+                {
+                    printf("SFileLoadFile gave wrong data of \"%s\" !!!\n", szFileName);
+                    nError = ERROR_FILE_CORRUPT;
+                }
+                SFileFreeFileData(pvLoaded);
+            }
+            else
+                nError = GetLastError();
+
+            delete [] pbFileData;
+        }
+
+        // Loading a file that doesn't exist must fail
+        if(nError == ERROR_SUCCESS && (SFileLoadFile(hMpq, "NoSuchFile.bin", &pvLoaded, &cbLoaded) || GetLastError() != ERROR_FILE_NOT_FOUND))
+        {
+            printf("SFileLoadFile loaded a file that doesn't exist !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+
+        SFileCloseArchive(hMpq);
+    }
+    return nError;
+}
+
+// Expected data of the files given to SFileReadFilesBatch
+struct TBatchTestData
+{
+    LPBYTE pbFileData[BATCH_TEST_NAMES];    // Data read by SFileReadFile. NULL if the file doesn't exist
+    DWORD cbFileData[BATCH_TEST_NAMES];     // Sizes of the files
+    DWORD dwCallCount[BATCH_TEST_NAMES];    // Number of times the callback got the file
+    int nError;                             // ERROR_SUCCESS if all files were as expected
+};
+
+static void WINAPI TestBatchCB(void * pvUserData, DWORD dwIndex, const char * szFileName, const void * pvData, DWORD cbData, DWORD dwErrCode)
+{
+    TBatchTestData * pTestData = (TBatchTestData *)pvUserData;
+    LPBYTE pbFileData = pTestData->pbFileData[dwIndex];
+
+    pTestData->dwCallCount[dwIndex]++;
+    if(pbFileData == NULL)
+    {
+        if(dwErrCode != ERROR_FILE_NOT_FOUND || pvData != NULL)
+            pTestData->nError = ERROR_CAN_NOT_COMPLETE;
+        return;
+    }
+
+    if(dwErrCode != ERROR_SUCCESS || cbData != pTestData->cbFileData[dwIndex] || GetFirstDiffer((void *)pvData, pbFileData, cbData) != -1)
+    {
+        printf("SFileReadFilesBatch gave wrong data of \"%s\" !!!\n", szFileName);
+        pTestData->nError = ERROR_FILE_CORRUPT;
+    }
+}
+
+// Loads all test files in reverse order, one of them twice,
+// and one file that doesn't exist
+static int TestReadFilesBatch(const char * szMpqName)
+{
+    TBatchTestData TestData;
+    const char * szFileNames[BATCH_TEST_NAMES];
+    char szNameBuffers[BATCH_TEST_NAMES][MAX_PATH];
+    HANDLE hMpq = NULL;
+    DWORD OpenFlags[] = {0, MPQ_OPEN_THREAD_SAFE};
+    DWORD dwFileCount = 0;
+    DWORD dwNameCount;
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    // Prepare the names
+    while(AddFlags[dwFileCount] != 0xFFFFFFFF)
+        dwFileCount++;
+    for(DWORD i = 0; i < dwFileCount; i++)
+        GetTestFileName(szNameBuffers[i], dwFileCount - i - 1);
+    GetTestFileName(szNameBuffers[dwFileCount], 5);
+    strcpy(szNameBuffers[dwFileCount + 1], "NoSuchFile.bin");
+    dwNameCount = dwFileCount + 2;
+
+    for(int nOpen = 0; nOpen < 2 && nError == ERROR_SUCCESS; nOpen++)
+    {
+        if(!SFileOpenArchive(szMpqName, 0, OpenFlags[nOpen], &hMpq))
+            return GetLastError();
+
+        memset(&TestData, 0, sizeof(TBatchTestData));
+        for(DWORD i = 0; i < dwNameCount && nError == ERROR_SUCCESS; i++)
+        {
+            szFileNames[i] = szNameBuffers[i];
+            if(SFileHasFile(hMpq, szFileNames[i]))
+                nError = ReadTestFile(hMpq, szFileNames[i], &TestData.pbFileData[i], &TestData.cbFileData[i]);
+        }
+
+        // The batch must fail, because one of the files doesn't exist
+        if(nError == ERROR_SUCCESS)
+        {
+            if(SFileReadFilesBatch(hMpq, szFileNames, dwNameCount, TestBatchCB, &TestData) || GetLastError() != ERROR_FILE_NOT_FOUND)
+            {
+                printf("SFileReadFilesBatch didn't report the missing file !!!\n");
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
+            if(TestData.nError != ERROR_SUCCESS)
+                nError = TestData.nError;
+        }
+
+        // Each name must be given to the callback exactly once
+        for(DWORD i = 0; i < dwNameCount && nError == ERROR_SUCCESS; i++)
+        {
+            if(TestData.dwCallCount[i] != 1)
+            {
+                printf("SFileReadFilesBatch gave \"%s\" %u times !!!\n", szFileNames[i], TestData.dwCallCount[i]);
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
+        }
+
+        for(DWORD i = 0; i < dwNameCount; i++)
+            delete [] TestData.pbFileData[i];
+        SFileCloseArchive(hMpq);
+    }
+    return nError;
+}
+
+// Reads the file by SFileReadFile and compares it with the data created by CreateTestFileData
+static int VerifyTestFile(HANDLE hMpq, const char * szFileName, DWORD dwIndex, DWORD dwSeed)
+{
+    LPBYTE pbFileData1;
+    LPBYTE pbFileData2 = NULL;
+    DWORD cbFileData1 = 0;
+    DWORD cbFileData2 = 0;
+    int nError;
+
+    pbFileData1 = CreateTestFileData(dwIndex, dwSeed, &cbFileData1);
+    if(pbFileData1 == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    nError = ReadTestFile(hMpq, szFileName, &pbFileData2, &cbFileData2);
+    if(nError == ERROR_SUCCESS)
+    {
+        if(cbFileData2 != cbFileData1 || GetFirstDiffer(pbFileData2, pbFileData1, cbFileData1) != -1)
+        {
+            printf("Stale data have been read from \"%s\" !!!\n", szFileName);
+            nError = ERROR_FILE_CORRUPT;
+        }
+        delete [] pbFileData2;
+    }
+
+    delete [] pbFileData1;
+    return nError;
+}
+
+// Checks that no stale data are read from the caches after the files
+// have been replaced, renamed or moved by compacting the archive.
+// If dwSectorCacheSize is zero, only the cache of sector offset tables is used
+static int TestCacheInvalidation(const char * szMpqName, DWORD dwSectorCacheSize)
+{
+    ULONGLONG CacheHits = 0;
+    HANDLE hMpq = NULL;
+    DWORD FileSeeds[sizeof(AddFlags) / sizeof(AddFlags[0])];
+    DWORD dwFileCount;
+    char szFileName[MAX_PATH];
+    char szNewName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+    if(nError != ERROR_SUCCESS)
+        return nError;
+
+    if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+        return GetLastError();
+    if(!SFileSetSectorCacheSize(hMpq, dwSectorCacheSize))
+        nError = GetLastError();
+
+    // Read all files twice, so that the caches are filled and used
+    for(dwFileCount = 0; AddFlags[dwFileCount] != 0xFFFFFFFF; dwFileCount++)
+        FileSeeds[dwFileCount] = 0;
+    for(int nPass = 0; nPass < 2; nPass++)
+    {
+        for(DWORD i = 0; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+        {
+            GetTestFileName(szFileName, i);
+            nError = VerifyTestFile(hMpq, szFileName, i, FileSeeds[i]);
+        }
+    }
+
+    if(nError == ERROR_SUCCESS && dwSectorCacheSize != 0)
+    {
+        SFileGetFileInfo(hMpq, SFILE_INFO_SECTOR_CACHE_HITS, &CacheHits, sizeof(ULONGLONG));
+        if(CacheHits == 0)
+        {
+            printf("No sectors have been read from the sector cache !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
+
+    // Remove the last files and add them again with different data.
+    // The space of the removed files is reused, so the first of them
+    // gets the same file entry and the same position in the archive
+    printf("Adding removed files to %s ...\n", szMpqName);
+    for(DWORD i = dwFileCount - 3; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        if(!SFileRemoveFile(hMpq, szFileName))
+            nError = GetLastError();
+    }
+
+    for(DWORD i = dwFileCount - 3; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        nError = WriteTestFile(hMpq, i, 2, AddFlags[i]);
+        FileSeeds[i] = 2;
+    }
+
+    for(DWORD i = 0; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = VerifyTestFile(hMpq, szFileName, i, FileSeeds[i]);
+    }
+
+    // Replace every other file by different data
+    printf("Replacing files in %s ...\n", szMpqName);
+    for(DWORD i = 0; i < dwFileCount && nError == ERROR_SUCCESS; i += 2)
+    {
+        nError = WriteTestFile(hMpq, i, 1, AddFlags[i] | MPQ_FILE_REPLACEEXISTING);
+        FileSeeds[i] = 1;
+    }
+
+    for(DWORD i = 0; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = VerifyTestFile(hMpq, szFileName, i, FileSeeds[i]);
+    }
+
+    // Rename all files and back. The data of encrypted files are encrypted again
+    printf("Renaming files in %s ...\n", szMpqName);
+    for(DWORD i = 0; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        sprintf(szNewName, "Renamed%02u.bin", i);
+
+        if(!SFileRenameFile(hMpq, szFileName, szNewName))
+            nError = GetLastError();
+        if(nError == ERROR_SUCCESS)
+            nError = VerifyTestFile(hMpq, szNewName, i, FileSeeds[i]);
+
+        if(nError == ERROR_SUCCESS && !SFileRenameFile(hMpq, szNewName, szFileName))
+            nError = GetLastError();
+        if(nError == ERROR_SUCCESS)
+            nError = VerifyTestFile(hMpq, szFileName, i, FileSeeds[i]);
+    }
+
+    // Remove the first file and compact the archive. The other files move
+    printf("Compacting %s ...\n", szMpqName);
+    if(nError == ERROR_SUCCESS)
+    {
+        GetTestFileName(szFileName, 0);
+        if(!SFileRemoveFile(hMpq, szFileName) || !SFileCompactArchive(hMpq))
+            nError = GetLastError();
+    }
+
+    for(DWORD i = 1; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = VerifyTestFile(hMpq, szFileName, i, FileSeeds[i]);
+    }
+
+    SFileCloseArchive(hMpq);
+    return nError;
+}
+
+// Checks that a closed file handle, which is reused for the next opened file,
+// keeps nothing of the previous file. Each file is open after another one has
+// been partially read, so the reused handle had a loaded sector and a file key
+static int TestFileHandlePool(const char * szMpqName)
+{
+    HANDLE hFile1 = NULL;
+    HANDLE hFile2 = NULL;
+    HANDLE hMpq = NULL;
+    BYTE Buffer[0x10];
+    DWORD dwBytesRead = 0;
+    DWORD dwFileCount;
+    DWORD dwPrevIndex;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+    if(nError != ERROR_SUCCESS)
+        return nError;
+
+    printf("Reading %s by reused file handles ...\n", szMpqName);
+    if(!SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+        return GetLastError();
+    if(!SFileSetSectorCacheSize(hMpq, 0))
+        nError = GetLastError();
+
+    // The handle of a closed file must be used for the next one
+    if(nError == ERROR_SUCCESS)
+    {
+        GetTestFileName(szFileName, 0);
+        if(SFileOpenFileEx(hMpq, szFileName, 0, &hFile1))
+        {
+            SFileCloseFile(hFile1);
+            if(SFileOpenFileEx(hMpq, szFileName, 0, &hFile2))
+            {
+                SFileCloseFile(hFile2);
+                if(hFile2 != hFile1)
+                {
+                    printf("The handle of a closed file has not been reused !!!\n");
+                    nError = ERROR_CAN_NOT_COMPLETE;
+                }
+            }
+            else
+                nError = GetLastError();
+        }
+        else
+            nError = GetLastError();
+    }
+
+    // Read the beginning of a file, close it, then read another file
+    for(dwFileCount = 0; AddFlags[dwFileCount] != 0xFFFFFFFF; dwFileCount++);
+    for(DWORD i = 0; i < dwFileCount && nError == ERROR_SUCCESS; i++)
+    {
+        for(DWORD j = 1; j < dwFileCount && nError == ERROR_SUCCESS; j += 4)
+        {
+            dwPrevIndex = (i + j) % dwFileCount;
+            GetTestFileName(szFileName, dwPrevIndex);
+            if(SFileOpenFileEx(hMpq, szFileName, 0, &hFile1))
+            {
+                if(!SFileReadFile(hFile1, Buffer, sizeof(Buffer), &dwBytesRead) || dwBytesRead != sizeof(Buffer))
+                    nError = ERROR_FILE_CORRUPT;
+                SFileCloseFile(hFile1);
+            }
+            else
+                nError = GetLastError();
+
+            // Files open by index must detect their key, not use the one of the previous file
+            if(nError == ERROR_SUCCESS && (AddFlags[i] & MPQ_FILE_ENCRYPTED) && (AddFlags[i] & MPQ_FILE_COMPRESSED) && !(AddFlags[i] & MPQ_FILE_SINGLE_UNIT))
+            {
+                sprintf(szFileName, "File%08u.xxx", i);
+                nError = VerifyTestFile(hMpq, szFileName, i, 0);
+            }
+
+            GetTestFileName(szFileName, i);
+            if(nError == ERROR_SUCCESS)
+                nError = VerifyTestFile(hMpq, szFileName, i, 0);
+        }
+    }
+
+    // Two reused handles open at once must not share their sector buffers
+    hFile1 = hFile2 = NULL;
+    for(DWORD i = 0; i < 2 && nError == ERROR_SUCCESS; i++)
+    {
+        HANDLE hFile = NULL;
+
+        GetTestFileName(szFileName, 22 + i);
+        if(!SFileOpenFileEx(hMpq, szFileName, 0, &hFile))
+            nError = GetLastError();
+        if(i == 0)
+            hFile1 = hFile;
+        else
+            hFile2 = hFile;
+    }
+
+    for(DWORD i = 0; i < 0x10 && nError == ERROR_SUCCESS; i++)
+    {
+        HANDLE hFile = (i & 1) ? hFile2 : hFile1;
+        LPBYTE pbFileData;
+        DWORD cbFileData = 0;
+
+        pbFileData = CreateTestFileData(22 + (i & 1), 0, &cbFileData);
+        if(pbFileData == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+        if(nError == ERROR_SUCCESS && (!SFileReadFile(hFile, Buffer, sizeof(Buffer), &dwBytesRead) || dwBytesRead != sizeof(Buffer)))
+            nError = ERROR_FILE_CORRUPT;
+        if(nError == ERROR_SUCCESS && GetFirstDiffer(Buffer, pbFileData + (i / 2) * sizeof(Buffer), sizeof(Buffer)) != -1)
+        {
+            printf("Data of another file read by a reused handle !!!\n");
+            nError = ERROR_FILE_CORRUPT;
+        }
+        delete [] pbFileData;
+    }
+
+    if(hFile2 != NULL)
+        SFileCloseFile(hFile2);
+    if(hFile1 != NULL)
+        SFileCloseFile(hFile1);
+    SFileCloseArchive(hMpq);
+    return nError;
+}
+
+// Checks that the archives open for read only are memory-mapped and that
+// the mapped stream reads the same data as a stream open for write
+static int TestMappedStream(const char * szMpqName)
+{
+    TFileStream * pStream = NULL;
+    ULONGLONG ByteOffset;
+    ULONGLONG FileSize = 0;
+    HANDLE hMpq = NULL;
+    LPBYTE pbArchive = NULL;
+    LPBYTE pbBuffer = NULL;
+    DWORD cbArchive = 0;
+    DWORD dwBytesToRead;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    // Load the archive through a stream that is not mapped
+    if(nError == ERROR_SUCCESS)
+    {
+        pStream = FileStream_OpenFile(szMpqName, true);
+        if(pStream == NULL || (pStream->StreamFlags & STREAM_FLAG_MAPPED_FILE))
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        FileStream_GetSize(pStream, FileSize);
+        cbArchive = (DWORD)FileSize;
+        pbArchive = new BYTE[cbArchive];
+        pbBuffer = new BYTE[cbArchive];
+        if(pbArchive == NULL || pbBuffer == NULL || !FileStream_Read(pStream, NULL, pbArchive, cbArchive))
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+    pStream = NULL;
+
+    // Open the archive for read only
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Reading mapped %s ...\n", szMpqName);
+        pStream = FileStream_OpenFile(szMpqName, false);
+        if(pStream == NULL)
+            nError = GetLastError();
+    }
+
+#if defined(PLATFORM_WINDOWS) || defined(PLATFORM_LINUX)
+    if(nError == ERROR_SUCCESS && (pStream->StreamFlags & STREAM_FLAG_MAPPED_FILE) == 0)
+    {
+        printf("Archive open for read only is not memory-mapped !!!\n");
+        nError = ERROR_CAN_NOT_COMPLETE;
+    }
+#endif
+
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!FileStream_GetSize(pStream, FileSize) || FileSize != cbArchive)
+        {
+            printf("Wrong size of the mapped stream !!!\n");
+            nError = ERROR_FILE_CORRUPT;
+        }
+    }
+
+    // Read the archive sequentially, in pieces that don't match the pages
+    for(DWORD dwOffset = 0; dwOffset < cbArchive && nError == ERROR_SUCCESS; dwOffset += dwBytesToRead)
+    {
+        dwBytesToRead = STORMLIB_MIN(0x3333, cbArchive - dwOffset);
+        if(!FileStream_Read(pStream, NULL, pbBuffer + dwOffset, dwBytesToRead))
+            nError = GetLastError();
+    }
+
+    // Read the archive at random positions
+    for(DWORD i = 0; i < 0x100 && nError == ERROR_SUCCESS; i++)
+    {
+        DWORD dwOffset = (((DWORD)rand() << 16) ^ (DWORD)rand()) % cbArchive;
+
+        ByteOffset = dwOffset;
+        dwBytesToRead = (DWORD)rand() % 0x20000;
+        dwBytesToRead = STORMLIB_MIN(dwBytesToRead, cbArchive - dwOffset);
+        if(!FileStream_Read(pStream, &ByteOffset, pbBuffer + dwOffset, dwBytesToRead))
+            nError = GetLastError();
+    }
+
+    if(nError == ERROR_SUCCESS && GetFirstDiffer(pbBuffer, pbArchive, cbArchive) != -1)
+    {
+        printf("Different data read from the mapped stream !!!\n");
+        nError = ERROR_FILE_CORRUPT;
+    }
+
+    // A read past the end of the file gives the data up to the end and fails
+    if(nError == ERROR_SUCCESS)
+    {
+        ByteOffset = cbArchive - 0x10;
+        if(FileStream_Read(pStream, &ByteOffset, pbBuffer, 0x20) || GetLastError() != ERROR_HANDLE_EOF ||
+           GetFirstDiffer(pbBuffer, pbArchive + cbArchive - 0x10, 0x10) != -1)
+        {
+            printf("Read past the end of the mapped stream not handled !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
+
+    // The mapped stream can't be written
+    if(nError == ERROR_SUCCESS)
+    {
+        ByteOffset = 0;
+        if(FileStream_Write(pStream, &ByteOffset, pbArchive, 0x10))
+        {
+            printf("Mapped stream has been written !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
+
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+
+    // The files in the archive open for read only must be the same
+    if(nError == ERROR_SUCCESS && !SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+        nError = GetLastError();
+
+#if defined(PLATFORM_WINDOWS) || defined(PLATFORM_LINUX)
+    if(nError == ERROR_SUCCESS && (((TMPQArchive *)hMpq)->pStream->StreamFlags & STREAM_FLAG_MAPPED_FILE) == 0)
+    {
+        printf("Archive open by SFileOpenArchive for read only is not memory-mapped !!!\n");
+        nError = ERROR_CAN_NOT_COMPLETE;
+    }
+#endif
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = VerifyTestFile(hMpq, szFileName, i, 0);
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    delete [] pbBuffer;
+    delete [] pbArchive;
+    return nError;
+}
+
+// Reads from the stream and compares the data with the expected content
+static int ReadAndCompareStream(TFileStream * pStream, LPBYTE pbExpected, DWORD dwOffset, DWORD dwBytesToRead)
+{
+    ULONGLONG ByteOffset = dwOffset;
+    LPBYTE pbBuffer;
+    int nError = ERROR_SUCCESS;
+
+    pbBuffer = new BYTE[dwBytesToRead];
+    if(pbBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    if(!FileStream_Read(pStream, &ByteOffset, pbBuffer, dwBytesToRead))
+    {
+        printf("Failed to read 0x%X bytes at offset 0x%08X !!!\n", dwBytesToRead, dwOffset);
+        nError = GetLastError();
+    }
+    else if(GetFirstDiffer(pbBuffer, pbExpected + dwOffset, dwBytesToRead) != -1)
+    {
+        printf("Different data read at offset 0x%08X !!!\n", dwOffset);
+        nError = ERROR_FILE_CORRUPT;
+    }
+
+    delete [] pbBuffer;
+    return nError;
+}
+
+// Reads the archive sequentially in small pieces, as SFileExtractFile does,
+// with reads that go back into the read-ahead buffer and before it.
+// Data written to the stream must replace the data in the buffer
+static int TestReadAhead(const char * szMpqName)
+{
+    TFileStream * pStream = NULL;
+    ULONGLONG ByteOffset;
+    LPBYTE pbArchive = NULL;
+    DWORD dwOldReadAhead;
+    DWORD dwMaxWindow = 0;
+    DWORD cbArchive = 0;
+    DWORD dwOffset = 0;
+    DWORD dwBytesToRead;
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+
+    // Load the archive without reading ahead
+    dwOldReadAhead = SFileSetReadAheadSize(0);
+    if(nError == ERROR_SUCCESS)
+    {
+        pbArchive = LoadWholeFile(szMpqName, &cbArchive);
+        if(pbArchive == NULL)
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    // The stream is open for write, so that it is not memory-mapped
+    SFileSetReadAheadSize(0x40000);
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Reading %s sequentially ...\n", szMpqName);
+        pStream = FileStream_OpenFile(szMpqName, true);
+        if(pStream == NULL)
+            nError = GetLastError();
+    }
+
+    for(DWORD i = 0; dwOffset < cbArchive && nError == ERROR_SUCCESS; i++)
+    {
+        dwBytesToRead = STORMLIB_MIN(0x1000, cbArchive - dwOffset);
+        nError = ReadAndCompareStream(pStream, pbArchive, dwOffset, dwBytesToRead);
+        dwMaxWindow = STORMLIB_MAX(dwMaxWindow, pStream->dwReadAheadWindow);
+        dwOffset += dwBytesToRead;
+
+        // Go back into the read-ahead buffer
+        if(nError == ERROR_SUCCESS && (i % 0x40) == 0x3F)
+            nError = ReadAndCompareStream(pStream, pbArchive, dwOffset - 0x2800, 0x800);
+
+        // Go back before the read-ahead buffer. This must stop reading ahead
+        if(nError == ERROR_SUCCESS && (i % 0x100) == 0xFF)
+        {
+            nError = ReadAndCompareStream(pStream, pbArchive, dwOffset / 2, 0x1000);
+            if(nError == ERROR_SUCCESS && pStream->dwReadAheadWindow != 0)
+            {
+                printf("Read-ahead continues after a read from another position !!!\n");
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
+        }
+    }
+
+    if(nError == ERROR_SUCCESS && dwMaxWindow != 0x40000)
+    {
+        printf("Read-ahead window has not grown to the maximum size !!!\n");
+        nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    // Read sequentially, then write the data that follow. They are in the read-ahead buffer
+    for(dwOffset = 0x10000; dwOffset < 0x18000 && nError == ERROR_SUCCESS; dwOffset += 0x1000)
+        nError = ReadAndCompareStream(pStream, pbArchive, dwOffset, 0x1000);
+
+    if(nError == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < 0x100; i++)
+            pbArchive[dwOffset + 0x100 + i] ^= 0xFF;
+
+        ByteOffset = dwOffset + 0x100;
+        if(!FileStream_Write(pStream, &ByteOffset, pbArchive + dwOffset + 0x100, 0x100))
+            nError = GetLastError();
+    }
+
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbArchive, dwOffset, 0x1000);
+
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+    SFileSetReadAheadSize(dwOldReadAhead);
+    delete [] pbArchive;
+    return nError;
+}
+
+static int CheckBlockCacheStats(TFileStream * pStream, ULONGLONG ExpectedHits, ULONGLONG ExpectedMisses, const char * szAfter)
+{
+    ULONGLONG CacheHits = 0;
+    ULONGLONG CacheMisses = 0;
+    DWORD dwCachedSize = 0;
+
+    FileStream_GetCacheStats(pStream, &CacheHits, &CacheMisses, &dwCachedSize);
+    if(CacheHits != ExpectedHits || CacheMisses != ExpectedMisses)
+    {
+        printf("Wrong block cache hits/misses (%u/%u) after %s !!!\n", (DWORD)CacheHits, (DWORD)CacheMisses, szAfter);
+        return ERROR_CAN_NOT_COMPLETE;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Checks the hits and misses of the block cache, the eviction of the least
+// recently used blocks and the invalidation of the blocks that are written.
+// Then reads one file by two handles from an archive with the block cache on
+static int TestBlockCache(const char * szMpqName)
+{
+    TFileStream * pStream = NULL;
+    ULONGLONG CacheMisses = 0;
+    ULONGLONG CacheHits = 0;
+    ULONGLONG ByteOffset;
+    HANDLE hMpq = NULL;
+    LPBYTE pbArchive = NULL;
+    DWORD dwCachedSize = 0;
+    DWORD cbArchive = 0;
+    char szFileName[MAX_PATH];
+    int nError;
+
+    nError = CreateTestArchive(szMpqName);
+    if(nError == ERROR_SUCCESS)
+    {
+        pbArchive = LoadWholeFile(szMpqName, &cbArchive);
+        if(pbArchive == NULL)
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    // The stream is open for write, because memory-mapped streams have no cache.
+    // The cache has 0x10 blocks of 0x4000 bytes
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Reading %s through the block cache ...\n", szMpqName);
+        pStream = FileStream_OpenFile(szMpqName, true);
+        if(pStream == NULL || !FileStream_SetCacheSize(pStream, 0x40000))
+            nError = GetLastError();
+    }
+
+    // The first read loads two blocks, the second one finds them in the cache
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbArchive, 0x5123, 0x4000);
+    if(nError == ERROR_SUCCESS)
+        nError = CheckBlockCacheStats(pStream, 0, 2, "the first read");
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbArchive, 0x4000, 0x8000);
+    if(nError == ERROR_SUCCESS)
+        nError = CheckBlockCacheStats(pStream, 2, 2, "the second read");
+
+    // Reads larger than 1/8 of the cache go around it
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbArchive, 0x4000, 0x8001);
+    if(nError == ERROR_SUCCESS)
+        nError = CheckBlockCacheStats(pStream, 2, 2, "a large read");
+
+    // Read 0x10 other blocks. The first two blocks must be evicted
+    for(DWORD i = 0; i < 0x10 && nError == ERROR_SUCCESS; i++)
+        nError = ReadAndCompareStream(pStream, pbArchive, 0x10000 + i * 0x4000, 0x100);
+    if(nError == ERROR_SUCCESS)
+    {
+        FileStream_GetCacheStats(pStream, &CacheHits, &CacheMisses, &dwCachedSize);
+        if(dwCachedSize != 0x40000)
+        {
+            printf("Block cache holds 0x%X bytes instead of 0x40000 !!!\n", dwCachedSize);
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbArchive, 0x4000, 0x100);
+    if(nError == ERROR_SUCCESS)
+        nError = CheckBlockCacheStats(pStream, 2, 0x13, "the eviction");
+
+    // Data written to the file must replace the cached block
+    if(nError == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < 0x100; i++)
+            pbArchive[0x4C080 + i] ^= 0xFF;
+
+        ByteOffset = 0x4C080;
+        if(!FileStream_Write(pStream, &ByteOffset, pbArchive + 0x4C080, 0x100))
+            nError = GetLastError();
+    }
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbArchive, 0x4C000, 0x400);
+    if(nError == ERROR_SUCCESS)
+        nError = CheckBlockCacheStats(pStream, 2, 0x14, "the write");
+
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+
+    // Read one file by two handles. The second read must take the data from the cache
+    if(nError == ERROR_SUCCESS)
+    {
+        nError = CreateTestArchive(szMpqName);
+        if(nError == ERROR_SUCCESS && !SFileOpenArchive(szMpqName, 0, 0, &hMpq))
+            nError = GetLastError();
+        if(nError == ERROR_SUCCESS && !SFileSetCacheSize(hMpq, SFILE_CACHE_SIZE_DEFAULT))
+            nError = GetLastError();
+    }
+
+    GetTestFileName(szFileName, 0x10);
+    for(DWORD i = 0; i < 2 && nError == ERROR_SUCCESS; i++)
+        nError = VerifyTestFile(hMpq, szFileName, 0x10, 0);
+
+    if(nError == ERROR_SUCCESS)
+    {
+        SFileGetFileInfo(hMpq, SFILE_INFO_CACHE_HITS, &CacheHits, sizeof(ULONGLONG));
+        if(CacheHits == 0)
+        {
+            printf("No blocks have been read from the block cache !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    delete [] pbArchive;
+    return nError;
+}
+
+// Writes to a new file in small pieces. Reads of the data that are still
+// in the write buffer, size queries and closing must write them first.
+// Then checks that an archive is complete on the disk after SFileFlushArchive
+static int TestWriteBuffer(const char * szMpqName, const char * szMpqCopyName)
+{
+    TFileStream * pStream = NULL;
+    ULONGLONG ByteOffset;
+    ULONGLONG FileSize = 0;
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData = NULL;
+    LPBYTE pbLoaded = NULL;
+    DWORD cbFileData = 0x2F0000;
+    DWORD cbLoaded = 0;
+    DWORD dwOffset = 0;
+    DWORD dwToWrite;
+    char szFileName[MAX_PATH];
     int nError = ERROR_SUCCESS;
 
-    // If no listfile or an empty one, use NULL
-    if(szListFile == NULL || *szListFile == 0)
-        szListFile = NULL;
+    pbFileData = new BYTE[cbFileData];
+    if(pbFileData == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    srand(0x1010);
+    GenerateRandomDataBlock(pbFileData, cbFileData);
 
-    // Create the new file
-    pStream = FileStream_CreateFile(szMpqCopyName);
+    printf("Writing %s in small pieces ...\n", szMpqName);
+    remove(szMpqName);
+    pStream = FileStream_CreateFile(szMpqName);
     if(pStream == NULL)
         nError = GetLastError();
 
-    // Write some data
-    if(nError == ERROR_SUCCESS)
+    // Write the data in small pieces. They must stay in the write buffer
+    for(dwOffset = 0; dwOffset < 0x180000 && nError == ERROR_SUCCESS; dwOffset += dwToWrite)
     {
-        ULONGLONG FileSize = 0x100000;
-        
-        FileStream_SetSize(pStream, FileSize);
-        FileStream_Close(pStream);
+        dwToWrite = 0x123;
+        ByteOffset = dwOffset;
+        if(!FileStream_Write(pStream, (dwOffset & 1) ? NULL : &ByteOffset, pbFileData + dwOffset, dwToWrite))
+            nError = GetLastError();
     }
 
-    // Open the existing MPQ archive
+    if(nError == ERROR_SUCCESS && pStream->cbWriteBuffer == 0)
+    {
+        printf("Small writes have not been combined !!!\n");
+        nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    // Read the data that are in the write buffer
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbFileData, dwOffset - 0x800, 0x800);
+
+    // Overwrite the data before the buffer, then continue where the data end
     if(nError == ERROR_SUCCESS)
     {
-        printf("Opening %s ...\n", szMpqName);
-        if(!SFileOpenArchive(szMpqName, 0, 0, &hMpq1))
+        for(DWORD i = 0x1000; i < 0x1800; i++)
+            pbFileData[i] ^= 0xFF;
+        for(DWORD i = 0x1000; i < 0x1800 && nError == ERROR_SUCCESS; i += 0x100)
+        {
+            ByteOffset = i;
+            if(!FileStream_Write(pStream, &ByteOffset, pbFileData + i, 0x100))
+                nError = GetLastError();
+        }
+    }
+    if(nError == ERROR_SUCCESS)
+    {
+        ByteOffset = dwOffset;
+        if(!FileStream_Write(pStream, &ByteOffset, pbFileData + dwOffset, 0x321))
             nError = GetLastError();
+        dwOffset += 0x321;
     }
+    if(nError == ERROR_SUCCESS)
+        nError = ReadAndCompareStream(pStream, pbFileData, 0x0F00, 0x1000);
 
-    // Well, now create the MPQ archive
+    // Write the rest at once. The size must include the buffered data
     if(nError == ERROR_SUCCESS)
     {
-        printf("Creating %s ...\n", szMpqCopyName);
-        SFileGetFileInfo(hMpq1, SFILE_INFO_HASH_TABLE_SIZE, &dwHashTableSize, 4);
-        if(!SFileCreateArchive(szMpqCopyName, 0, dwHashTableSize, &hMpq2))
+        ByteOffset = dwOffset;
+        if(!FileStream_Write(pStream, &ByteOffset, pbFileData + dwOffset, 0x12345))
             nError = GetLastError();
+        dwOffset += 0x12345;
     }
-
-    // Copy all files from one archive to another
     if(nError == ERROR_SUCCESS)
     {
-        SFILE_FIND_DATA sf;
-        HANDLE hFind = SFileFindFirstFile(hMpq1, "*", &sf, szListFile);
-        bool bResult = true;
-
-        printf("Copying files ...\n");
+        if(!FileStream_Write(pStream, NULL, pbFileData + dwOffset, cbFileData - dwOffset))
+            nError = GetLastError();
+    }
+    if(nError == ERROR_SUCCESS)
+    {
+        if(!FileStream_GetSize(pStream, FileSize) || FileSize != cbFileData)
+        {
+            printf("Wrong size of the file with buffered data !!!\n");
+            nError = ERROR_CAN_NOT_COMPLETE;
+        }
+    }
 
-        if(hFind != NULL)
+    // Closing the stream writes the buffered data
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+    if(nError == ERROR_SUCCESS)
+    {
+        pbLoaded = LoadWholeFile(szMpqName, &cbLoaded);
+        if(pbLoaded == NULL || cbLoaded != cbFileData || GetFirstDiffer(pbLoaded, pbFileData, cbFileData) != -1)
         {
-            while(bResult)
-            {
-                if(strcmp(sf.cFileName, LISTFILE_NAME) && strcmp(sf.cFileName, ATTRIBUTES_NAME))
-                {
-                    SFileSetLocale(sf.lcLocale);
+            printf("Different data in the file written by small pieces !!!\n");
+            nError = ERROR_FILE_CORRUPT;
+        }
+        delete [] pbLoaded;
+        pbLoaded = NULL;
+    }
 
-                    // Create the local file name
-                    sprintf(szLocalFile, "%s/%s", szWorkDir, sf.szPlainName);
-                    if(SFileExtractFile(hMpq1, sf.cFileName, szLocalFile))
-                    {
-                        printf("Extracting %s ... OK\n", sf.cFileName);
-                        if(!SFileAddFile(hMpq2, szLocalFile, sf.cFileName, sf.dwFileFlags))
-                        {
-                            nError = GetLastError();
-                            printf("Adding %s ... Failed\n\n", sf.cFileName);
-                            remove(szLocalFile);
-                            break;
-                        }
-                        else
-                        {
-                            printf("Adding %s ... OK\n", sf.cFileName);
-                        }
-                    }
-                    else
-                    {
-                        printf("Extracting %s ... Failed\n", sf.cFileName);
-                    }
+    // Files added to an archive can be read before the archive is flushed
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Creating %s ...\n", szMpqName);
+        remove(szMpqName);
+        if(!SFileCreateArchive(szMpqName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_ATTRIBUTES, 0x40, &hMpq))
+            nError = GetLastError();
+    }
 
-                    // Delete the added file
-                    remove(szLocalFile);
-                }
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        nError = WriteTestFile(hMpq, i, 0, AddFlags[i]);
+        GetTestFileName(szFileName, i);
+        if(nError == ERROR_SUCCESS)
+            nError = VerifyTestFile(hMpq, szFileName, i, 0);
+    }
 
-                // Find the next file
-                bResult = SFileFindNextFile(hFind, &sf);
-            }
+    // After SFileFlushArchive, a copy of the archive file must contain all files
+    if(nError == ERROR_SUCCESS && !SFileFlushArchive(hMpq))
+        nError = GetLastError();
 
-            // Close the search handle
-            SFileFindClose(hFind);
-            printf("\n");
+    if(nError == ERROR_SUCCESS)
+    {
+        pbLoaded = LoadWholeFile(szMpqName, &cbLoaded);
+        if(pbLoaded == NULL)
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        remove(szMpqCopyName);
+        pStream = FileStream_CreateFile(szMpqCopyName);
+        if(pStream != NULL)
+        {
+            if(!FileStream_Write(pStream, NULL, pbLoaded, cbLoaded))
+                nError = GetLastError();
+            FileStream_Close(pStream);
         }
+        else
+            nError = GetLastError();
     }
 
-    // Close both archives
-    if(hMpq2 != NULL)
-        SFileCloseArchive(hMpq2);
-    if(hMpq1 != NULL)
-        SFileCloseArchive(hMpq1);
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    hMpq = NULL;
+
+    if(nError == ERROR_SUCCESS && !SFileOpenArchive(szMpqCopyName, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+        nError = GetLastError();
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = VerifyTestFile(hMpq, szFileName, i, 0);
+    }
+
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    delete [] pbLoaded;
+    delete [] pbFileData;
     return nError;
 }
 
-static int TestCompareTwoArchives(
-    const char * szMpqName1,
-    const char * szMpqName2,
-    const char * szListFile,
-    DWORD dwBlockSize)
+//-----------------------------------------------------------------------------
+// Tests of the PART files. The test makes a PART file from a test archive,
+// with some parts missing and some parts stored out of order
+
+struct TPartFileSource
 {
-    TMPQArchive * ha1 = NULL;
-    TMPQArchive * ha2 = NULL;
-    LPBYTE pbBuffer1 = NULL;
-    LPBYTE pbBuffer2 = NULL;
-    HANDLE hMpq1 = NULL;                // Handle of the first archive
-    HANDLE hMpq2 = NULL;                // Handle of the second archive
-    HANDLE hFile1 = NULL;
-    HANDLE hFile2 = NULL;
-    int nError = ERROR_SUCCESS;
+    LPBYTE pbFileData;                      // Data of the complete file
+    DWORD cbFileData;                       // Size of the complete file
+    LPDWORD pdwFillCount;                   // Number of times each part has been asked for
+};
 
-    // If no listfile or an empty one, use NULL
-    if(szListFile == NULL || *szListFile == 0)
-        szListFile = NULL;
+static bool IsTestPartMissing(DWORD dwPartIndex)
+{
+    return ((dwPartIndex % 3) == 1);
+}
 
-    // Allocate both buffers
-    pbBuffer1 = new BYTE[dwBlockSize];
-    pbBuffer2 = new BYTE[dwBlockSize];
-    if(pbBuffer1 == NULL || pbBuffer2 == NULL)
-        nError = ERROR_NOT_ENOUGH_MEMORY;
+static bool WINAPI TestPartFileCB(void * pvUserData, ULONGLONG ByteOffset, void * pvBuffer, DWORD dwBytesToRead)
+{
+    TPartFileSource * pSource = (TPartFileSource *)pvUserData;
+    DWORD dwPartIndex = (DWORD)(ByteOffset / PART_FILE_PART_SIZE);
 
-    printf("=============== Comparing MPQ archives ===============\n");
+    // The callback must be asked for one whole part
+    if((ByteOffset % PART_FILE_PART_SIZE) != 0 || ByteOffset >= pSource->cbFileData)
+        return false;
+    if(dwBytesToRead != STORMLIB_MIN(PART_FILE_PART_SIZE, pSource->cbFileData - (DWORD)ByteOffset))
+        return false;
 
-    // Open the first MPQ archive
-    if(nError == ERROR_SUCCESS && szMpqName1 != NULL)
-    {
-        printf("Opening %s ...\n", szMpqName1);
-        if(!SFileOpenArchive(szMpqName1, 0, 0, &hMpq1))
-            nError = GetLastError();
-        ha1 = (TMPQArchive *)hMpq1;
-    }
+    memcpy(pvBuffer, pSource->pbFileData + ByteOffset, dwBytesToRead);
+    pSource->pdwFillCount[dwPartIndex]++;
+    return true;
+}
 
-    // Open the second MPQ archive
-    if(nError == ERROR_SUCCESS && szMpqName2 != NULL)
-    {
-        printf("Opening %s ...\n", szMpqName2);
-        if(!SFileOpenArchive(szMpqName2, 0, 0, &hMpq2))
-            nError = GetLastError();
-        ha2 = (TMPQArchive *)hMpq2;
-    }
+// Writes the PART file. The missing parts have no data. Parts 4, 9, 14, ...
+// are stored after all other parts, in reverse order. The other parts
+// are stored in their order, so that the adjacent parts are read at once
+static int CreateTestPartFile(const char * szPartName, LPBYTE pbFileData, DWORD cbFileData)
+{
+    TFileStream * pStream;
+    ULONGLONG ByteOffset = 0;
+    LPDWORD pdwPartMap;
+    DWORD Header[0x0D];
+    DWORD dwPartCount = (cbFileData + PART_FILE_PART_SIZE - 1) / PART_FILE_PART_SIZE;
+    DWORD cbPartMap = dwPartCount * 5 * sizeof(DWORD);
+    DWORD dwRawOffset = sizeof(Header) + cbPartMap;
+    int nError = ERROR_SUCCESS;
 
-    // Compare the header
-    if(nError == ERROR_SUCCESS && (ha1 != NULL && ha2 != NULL))
-    {
-        if(ha1->pHeader->dwHeaderSize != ha2->pHeader->dwHeaderSize)
-            printf(" - Header size is different\n");
-        if(ha1->pHeader->wFormatVersion != ha2->pHeader->wFormatVersion)
-            printf(" - Format version is different\n");
-        if(ha1->pHeader->wSectorSize != ha2->pHeader->wSectorSize)
-            printf(" - Sector size is different\n");
-        if(ha1->pHeader->HetTableSize64 != ha2->pHeader->HetTableSize64)
-            printf(" - HET table size is different\n");
-        if(ha1->pHeader->BetTableSize64 != ha2->pHeader->BetTableSize64)
-            printf(" - BET table size is different\n");
-        if(ha1->pHeader->dwHashTableSize != ha2->pHeader->dwHashTableSize)
-            printf(" - Hash table size is different\n");
-        if(ha1->pHeader->dwBlockTableSize != ha2->pHeader->dwBlockTableSize)
-            printf(" - Block table size is different\n");
-    }
+    pdwPartMap = new DWORD[dwPartCount * 5];
+    if(pdwPartMap == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(pdwPartMap, 0, cbPartMap);
+
+    // Prepare the header
+    memset(Header, 0, sizeof(Header));
+    Header[0x00] = 2;
+    memcpy(&Header[0x01], "15595", 6);
+    Header[0x05] = 0x1C;
+    Header[0x0A] = cbFileData;
+    Header[0x0C] = PART_FILE_PART_SIZE;
+
+    remove(szPartName);
+    pStream = FileStream_CreateFile(szPartName);
+    if(pStream == NULL)
+        nError = GetLastError();
 
-    // Find all files in the first archive and compare them
-    if(nError == ERROR_SUCCESS)
+    // Write the parts. The first pass writes the parts that are in order,
+    // the second pass writes the other ones from the end
+    for(DWORD dwPass = 0; dwPass < 2; dwPass++)
     {
-        SFILE_FIND_DATA sf;
-        HANDLE hFind = SFileFindFirstFile(hMpq1, "*", &sf, szListFile);
-        DWORD dwSearchScope1 = SFILE_OPEN_FROM_MPQ;
-        DWORD dwSearchScope2 = SFILE_OPEN_FROM_MPQ;
-        bool bResult = true;
-
-        if(hMpq1 == NULL)
-            dwSearchScope1 = SFILE_OPEN_LOCAL_FILE;
-        if(hMpq2 == NULL)
-            dwSearchScope2 = SFILE_OPEN_LOCAL_FILE;
-
-        while(hFind != NULL && bResult == true)
+        for(DWORD i = 0; i < dwPartCount && nError == ERROR_SUCCESS; i++)
         {
-            printf("%s\n", sf.cFileName);
-            SFileSetLocale(sf.lcLocale);
-
-            // Open the first file
-            if(!SFileOpenFileEx(hMpq1, sf.cFileName, dwSearchScope1, &hFile1))
-            {
-                printf("Failed to open the file %s in the first archive\n", sf.cFileName);
-                continue;
-            }
+            DWORD dwPartIndex = (dwPass == 0) ? i : (dwPartCount - 1 - i);
+            DWORD dwPartSize = STORMLIB_MIN(PART_FILE_PART_SIZE, cbFileData - dwPartIndex * PART_FILE_PART_SIZE);
 
-            if(!SFileOpenFileEx(hMpq2, sf.cFileName, dwSearchScope2, &hFile2))
-            {
-                printf("Failed to open the file %s in the second archive\n", sf.cFileName);
+            if(IsTestPartMissing(dwPartIndex) || ((dwPartIndex % 5) == 4) != (dwPass == 1))
                 continue;
-            }
 
-            if(dwSearchScope1 == SFILE_OPEN_FROM_MPQ && dwSearchScope2 == SFILE_OPEN_FROM_MPQ)
-            {
-                TMPQFile * hf1 = (TMPQFile *)hFile1;
-                TMPQFile * hf2 = (TMPQFile *)hFile2;
+            ByteOffset = dwRawOffset;
+            if(!FileStream_Write(pStream, &ByteOffset, pbFileData + dwPartIndex * PART_FILE_PART_SIZE, dwPartSize))
+                nError = GetLastError();
 
-                // Compare the file sizes
-                if(hf1->pFileEntry->dwFileSize != hf2->pFileEntry->dwFileSize)
-                    printf(" - %s different size (%u x %u)\n", sf.cFileName, hf1->pFileEntry->dwFileSize, hf2->pFileEntry->dwFileSize);
+            pdwPartMap[dwPartIndex * 5 + 0] = 3;
+            pdwPartMap[dwPartIndex * 5 + 1] = dwRawOffset;
+            dwRawOffset += dwPartSize;
+        }
+    }
 
-                if(hf1->pFileEntry->dwFlags != hf2->pFileEntry->dwFlags)
-                    printf(" - %s different flags (%08X x %08X)\n", sf.cFileName, hf1->pFileEntry->dwFlags, hf2->pFileEntry->dwFlags);
-            }
+    // Write the header and the part map
+    if(nError == ERROR_SUCCESS)
+    {
+        BSWAP_ARRAY32_UNSIGNED(Header, sizeof(Header));
+        BSWAP_ARRAY32_UNSIGNED(pdwPartMap, cbPartMap);
+        ByteOffset = 0;
+        if(!FileStream_Write(pStream, &ByteOffset, Header, sizeof(Header)) ||
+           !FileStream_Write(pStream, NULL, pdwPartMap, cbPartMap))
+            nError = GetLastError();
+    }
 
-            if(!CompareArchivedFiles(sf.cFileName, hFile1, hFile2, 0x1001))
-                printf(" - %s different content\n", sf.cFileName);
+    if(pStream != NULL)
+        FileStream_Close(pStream);
+    delete [] pdwPartMap;
+    return nError;
+}
 
-            if(!CompareArchivedFilesRR(sf.cFileName, hFile1, hFile2, 0x100000))
-                printf(" - %s different content\n", sf.cFileName);
+// Reads the PART file in pieces that cross the part boundaries.
+// If bAllPresent is false, the reads that need a missing part must fail
+static int ReadTestPartFile(TFileStream * pStream, LPBYTE pbFileData, DWORD cbFileData, bool bAllPresent)
+{
+    ULONGLONG ByteOffset;
+    ULONGLONG FileSize = 0;
+    LPBYTE pbBuffer;
+    DWORD dwBytesToRead;
+    bool bPartMissing;
+    int nError = ERROR_SUCCESS;
 
-            // Close both files
-            SFileCloseFile(hFile2);
-            SFileCloseFile(hFile1);
-            hFile2 = hFile1 = NULL;
+    if(!FileStream_GetSize(pStream, FileSize) || FileSize != cbFileData)
+    {
+        printf("Wrong size of the PART file !!!\n");
+        return ERROR_FILE_CORRUPT;
+    }
 
-            // Find the next file
-            bResult = SFileFindNextFile(hFind, &sf);
-        }
+    pbBuffer = new BYTE[PART_FILE_PART_SIZE * 3];
+    if(pbBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
 
-        // Close all handles
-        if(hFile2 != NULL)
-            SFileCloseFile(hFile2);
-        if(hFile1 != NULL)
-            SFileCloseFile(hFile1);
-        if(hFind != NULL)
-            SFileFindClose(hFind);
+    for(DWORD dwOffset = 0x123; dwOffset < cbFileData && nError == ERROR_SUCCESS; dwOffset += 0x3210)
+    {
+        // Read up to three parts
+        dwBytesToRead = STORMLIB_MIN(PART_FILE_PART_SIZE * 2 + 0x456, cbFileData - dwOffset);
+        bPartMissing = false;
+        for(DWORD i = dwOffset / PART_FILE_PART_SIZE; i <= (dwOffset + dwBytesToRead - 1) / PART_FILE_PART_SIZE; i++)
+            bPartMissing = bPartMissing || IsTestPartMissing(i);
+
+        ByteOffset = dwOffset;
+        if(FileStream_Read(pStream, &ByteOffset, pbBuffer, dwBytesToRead))
+        {
+            if(bPartMissing && !bAllPresent)
+            {
+                printf("Data of a missing part have been read at offset 0x%08X !!!\n", dwOffset);
+                nError = ERROR_FILE_CORRUPT;
+            }
+            else if(GetFirstDiffer(pbBuffer, pbFileData + dwOffset, dwBytesToRead) != -1)
+            {
+                printf("Different data read from the PART file at offset 0x%08X !!!\n", dwOffset);
+                nError = ERROR_FILE_CORRUPT;
+            }
+        }
+        else
+        {
+            if(!bPartMissing || bAllPresent || GetLastError() != ERROR_CAN_NOT_COMPLETE)
+            {
+                printf("Failed to read the PART file at offset 0x%08X !!!\n", dwOffset);
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
+        }
     }
 
-    // Close both archives
-    clreol();
-    printf("================ MPQ compare complete ================\n");
-    if(hMpq2 != NULL)
-        SFileCloseArchive(hMpq2);
-    if(hMpq1 != NULL)
-        SFileCloseArchive(hMpq1);
-    if(pbBuffer2 != NULL)
-        delete [] pbBuffer2;
-    if(pbBuffer1 != NULL)
-        delete [] pbBuffer1;
+    delete [] pbBuffer;
     return nError;
 }
 
-static int TestOpenPatchedArchive(const char * szMpqName, ...)
+static int TestPartFile(const char * szMpqName, const char * szPartName)
 {
+    TPartFileSource Source;
     TFileStream * pStream;
-    HANDLE hFile = NULL;
     HANDLE hMpq = NULL;
-    va_list argList;
-    const char * szFileName = "DBFilesClient\\Achievement.dbc";
-//  const char * szExtension;
-//  const char * szLocale;
-    char szLocFileName[MAX_PATH];
-    LPBYTE pbFullFile = NULL;
-    DWORD dwFileSize;
-    int nError = ERROR_SUCCESS;
+    char szFileName[MAX_PATH];
+    DWORD dwPartCount = 0;
+    int nError;
 
-    // Open the primary MPQ
-    printf("Opening %s ...\n", szMpqName);
-    if(!SFileOpenArchive(szMpqName, 0, MPQ_OPEN_READ_ONLY, &hMpq))
+    memset(&Source, 0, sizeof(TPartFileSource));
+    nError = CreateTestArchive(szMpqName);
+
+    // Load the complete archive. This is what the callback gives
+    if(nError == ERROR_SUCCESS)
     {
-        nError = GetLastError();
-        printf("Failed to open the archive %s ...\n", szMpqName);
+        Source.pbFileData = LoadWholeFile(szMpqName, &Source.cbFileData);
+        if(Source.pbFileData == NULL)
+            nError = ERROR_CAN_NOT_COMPLETE;
     }
 
-    // Add all patches
     if(nError == ERROR_SUCCESS)
     {
-        va_start(argList, szMpqName);
-        while((szMpqName = va_arg(argList, const char *)) != NULL)
+        dwPartCount = (Source.cbFileData + PART_FILE_PART_SIZE - 1) / PART_FILE_PART_SIZE;
+        Source.pdwFillCount = new DWORD[dwPartCount];
+        if(Source.pdwFillCount == NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Without the callback, only the present parts can be read
+    if(nError == ERROR_SUCCESS)
+    {
+        printf("Reading %s ...\n", szPartName);
+        nError = CreateTestPartFile(szPartName, Source.pbFileData, Source.cbFileData);
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        pStream = FileStream_OpenFile(szPartName, false);
+        if(pStream != NULL)
         {
-            printf("Adding patch %s ...\n", szMpqName);
-            if(!SFileOpenPatchArchive(hMpq, szMpqName, NULL, 0))
+            nError = ReadTestPartFile(pStream, Source.pbFileData, Source.cbFileData, false);
+
+            // A PART file open for read only can't store the missing parts
+            if(nError == ERROR_SUCCESS && FileStream_SetPartFileCallback(pStream, TestPartFileCB, &Source))
             {
-                nError = GetLastError();
-                printf("Failed to add patch %s ...\n", szMpqName);
+                printf("Callback accepted by a read-only PART file !!!\n");
+                nError = ERROR_CAN_NOT_COMPLETE;
             }
+            FileStream_Close(pStream);
         }
-        va_end(argList);
+        else
+            nError = GetLastError();
     }
-/*
-    // Now search all files
+
+    // With the callback, each missing part must be asked for once
     if(nError == ERROR_SUCCESS)
     {
-        SFILE_FIND_DATA sf;
-        HANDLE hFind;
-        bool bResult = true;
+        memset(Source.pdwFillCount, 0, dwPartCount * sizeof(DWORD));
+        pStream = FileStream_OpenFile(szPartName, true);
+        if(pStream != NULL)
+        {
+            if(!FileStream_SetPartFileCallback(pStream, TestPartFileCB, &Source))
+                nError = GetLastError();
+            if(nError == ERROR_SUCCESS)
+                nError = ReadTestPartFile(pStream, Source.pbFileData, Source.cbFileData, true);
+            if(nError == ERROR_SUCCESS)
+                nError = ReadTestPartFile(pStream, Source.pbFileData, Source.cbFileData, true);
+            FileStream_Close(pStream);
+        }
+        else
+            nError = GetLastError();
 
-        hFind = SFileFindFirstFile(hMpq, "*", &sf, NULL);
-        while(hFind && bResult)
+        for(DWORD i = 0; i < dwPartCount && nError == ERROR_SUCCESS; i++)
         {
-            printf("%s\n", sf.cFileName);
-            bResult = SFileFindNextFile(hFind, &sf);
+            if(Source.pdwFillCount[i] != (IsTestPartMissing(i) ? 1 : 0))
+            {
+                printf("Part %u has been asked for %u times !!!\n", i, Source.pdwFillCount[i]);
+                nError = ERROR_CAN_NOT_COMPLETE;
+            }
         }
     }
 
-    // Now try to open patched version of a file
+    // The filled parts must have been stored to the file
     if(nError == ERROR_SUCCESS)
     {
-        SFileExtractFile(hMpq, szFileName, "E:\\Spell.dbc");
+        pStream = FileStream_OpenFile(szPartName, false);
+        if(pStream != NULL)
+        {
+            nError = ReadTestPartFile(pStream, Source.pbFileData, Source.cbFileData, true);
+            FileStream_Close(pStream);
+        }
+        else
+            nError = GetLastError();
     }
-*/
-    // Now try to open patched version of "Achievement.dbc"
+
+    // Open a new PART file as archive, with the missing parts given by the default callback
     if(nError == ERROR_SUCCESS)
     {
-        printf("Opening patched file \"%s\" ...\n", szFileName);
-        if(!SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_PATCHED_FILE, &hFile))
-        {
+        printf("Opening %s as archive ...\n", szPartName);
+        memset(Source.pdwFillCount, 0, dwPartCount * sizeof(DWORD));
+        nError = CreateTestPartFile(szPartName, Source.pbFileData, Source.cbFileData);
+    }
+
+    if(nError == ERROR_SUCCESS)
+    {
+        SFileSetPartFileCallback(NULL, TestPartFileCB, &Source);
+        if(!SFileOpenArchive(szPartName, 0, 0, &hMpq))
             nError = GetLastError();
-            printf("Failed to open patched file \"%s\"\n", szFileName);
+        SFileSetPartFileCallback(NULL, NULL, NULL);
+    }
+
+    for(DWORD i = 0; AddFlags[i] != 0xFFFFFFFF && nError == ERROR_SUCCESS; i++)
+    {
+        GetTestFileName(szFileName, i);
+        nError = VerifyTestFile(hMpq, szFileName, i, 0);
+    }
+
+    for(DWORD i = 0; i < dwPartCount && nError == ERROR_SUCCESS; i++)
+    {
+        if(Source.pdwFillCount[i] > (IsTestPartMissing(i) ? 1 : 0))
+        {
+            printf("Part %u has been asked for %u times !!!\n", i, Source.pdwFillCount[i]);
+            nError = ERROR_CAN_NOT_COMPLETE;
         }
     }
 
-    // Verify of the patched version is correct
-    if(nError == ERROR_SUCCESS)
+    if(hMpq != NULL)
+        SFileCloseArchive(hMpq);
+    delete [] Source.pdwFillCount;
+    delete [] Source.pbFileData;
+    return nError;
+}
+
+//-----------------------------------------------------------------------------
+// Tests of writing the files by large pieces. The sectors of large pieces
+// are encoded by more threads, and the archive must be the same as if
+// the sectors were encoded one by one
+
+struct TWriteTestFile
+{
+    DWORD dwFileSize;                       // Size of the file
+    DWORD dwFlags;                          // MPQ_FILE_XXX flags
+    DWORD dwCompression;                    // MPQ_COMPRESSION_XXX for SFileWriteFile
+};
+
+static TWriteTestFile WriteTestFiles[] =
+{
+    {0x0003FFFF, MPQ_FILE_COMPRESS,                                                             MPQ_COMPRESSION_ZLIB},
+    {0x00041234, MPQ_FILE_COMPRESS,                                                             MPQ_COMPRESSION_ZLIB},
+    {0x00123456, MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED | MPQ_FILE_FIX_KEY | MPQ_FILE_SECTOR_CRC, MPQ_COMPRESSION_BZIP2},
+    {0x00123456, MPQ_FILE_IMPLODE  | MPQ_FILE_ENCRYPTED,                                        0},
+    {0x00123456, MPQ_FILE_ENCRYPTED,                                                            0},
+    {0x01012345, MPQ_FILE_COMPRESS | MPQ_FILE_SECTOR_CRC,                                       MPQ_COMPRESSION_ZLIB},
+};
+
+// Creates an archive with the files from WriteTestFiles. The first piece of each file
+// has dwFirstWrite bytes, the other pieces have dwNextWrite bytes
+static int CreateWriteTestArchive(const char * szMpqName, DWORD dwFirstWrite, DWORD dwNextWrite)
+{
+    HANDLE hFile;
+    HANDLE hMpq = NULL;
+    LPBYTE pbFileData;
+    DWORD dwFilePos;
+    DWORD dwToWrite;
+    char szFileName[MAX_PATH];
+    int nError = ERROR_SUCCESS;
+
+    remove(szMpqName);
+    if(!SFileCreateArchive(szMpqName, MPQ_CREATE_ARCHIVE_V2 | MPQ_CREATE_ATTRIBUTES, 0x10, &hMpq))
+        return GetLastError();
+
+    for(DWORD i = 0; i < sizeof(WriteTestFiles) / sizeof(TWriteTestFile) && nError == ERROR_SUCCESS; i++)
     {
-        // Get the size of the full patched file
-        dwFileSize = SFileGetFileSize(hFile, NULL);
-        if(dwFileSize != 0)
+        TWriteTestFile * pTestFile = &WriteTestFiles[i];
+
+        // The end of the file is not compressible
+        pbFileData = new BYTE[pTestFile->dwFileSize];
+        if(pbFileData == NULL)
         {
-            // Allocate space for the full file
-            pbFullFile = new BYTE[dwFileSize];
-            if(pbFullFile != NULL)
+            nError = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+        srand(i);
+        GenerateRandomDataBlock(pbFileData, pTestFile->dwFileSize - 0x10000);
+        for(DWORD j = pTestFile->dwFileSize - 0x10000; j < pTestFile->dwFileSize; j++)
+            pbFileData[j] = (BYTE)(rand() % 0x100);
+
+        GetTestFileName(szFileName, i);
+        if(SFileCreateFile(hMpq, szFileName, 0, pTestFile->dwFileSize, 0, pTestFile->dwFlags, &hFile))
+        {
+            for(dwFilePos = 0; dwFilePos < pTestFile->dwFileSize && nError == ERROR_SUCCESS; dwFilePos += dwToWrite)
             {
-                if(!SFileReadFile(hFile, pbFullFile, dwFileSize))
-                {           
+                dwToWrite = (dwFilePos == 0) ? dwFirstWrite : dwNextWrite;
+                dwToWrite = STORMLIB_MIN(dwToWrite, pTestFile->dwFileSize - dwFilePos);
+                if(!SFileWriteFile(hFile, pbFileData + dwFilePos, dwToWrite, pTestFile->dwCompression))
                     nError = GetLastError();
-                    printf("Failed to read full patched file data \"%s\"\n", szFileName);
-                }
-                
-                if(nError == ERROR_SUCCESS)
-                {
-                    strcpy(szLocFileName, MAKE_PATH("Work//"));
-                    strcat(szLocFileName, GetPlainName(szFileName));
+            }
+            if(!SFileFinishFile(hFile) && nError == ERROR_SUCCESS)
+                nError = GetLastError();
+        }
+        else
+            nError = GetLastError();
 
-                    pStream = FileStream_CreateFile(szLocFileName);
-                    if(pStream != NULL)
-                    {
-                        FileStream_Write(pStream, NULL, pbFullFile, dwFileSize);
-                        FileStream_Close(pStream);
-                    }
-                }
-                
-                delete [] pbFullFile;
+        if(nError != ERROR_SUCCESS)
+            printf("Failed to add the file \"%s\".\n", szFileName);
+        delete [] pbFileData;
+    }
+
+    SFileCloseArchive(hMpq);
+    return nError;
+}
+
+static int TestParallelWrite(const char * szMpqName1, const char * szMpqName2)
+{
+    DWORD FirstWrites[] = {0xFFFFFFFF, 0x123};
+    LPBYTE pbArchive1 = NULL;
+    LPBYTE pbArchive2 = NULL;
+    DWORD cbArchive1 = 0;
+    DWORD cbArchive2 = 0;
+    int nError;
+
+    // Small pieces are encoded one sector after another
+    printf("Creating %s ...\n", szMpqName1);
+    nError = CreateWriteTestArchive(szMpqName1, 0x777, 0x777);
+    if(nError == ERROR_SUCCESS)
+    {
+        pbArchive1 = LoadWholeFile(szMpqName1, &cbArchive1);
+        if(pbArchive1 == NULL)
+            nError = ERROR_CAN_NOT_COMPLETE;
+    }
+
+    // Whole files, and the rest of the files after an incomplete first sector
+    for(DWORD i = 0; i < sizeof(FirstWrites) / sizeof(DWORD) && nError == ERROR_SUCCESS; i++)
+    {
+        printf("Creating %s ...\n", szMpqName2);
+        nError = CreateWriteTestArchive(szMpqName2, FirstWrites[i], 0xFFFFFFFF);
+        if(nError == ERROR_SUCCESS)
+        {
+            pbArchive2 = LoadWholeFile(szMpqName2, &cbArchive2);
+            if(pbArchive2 == NULL)
+                nError = ERROR_CAN_NOT_COMPLETE;
+        }
+
+        if(nError == ERROR_SUCCESS)
+        {
+            if(cbArchive2 != cbArchive1 || GetFirstDiffer(pbArchive2, pbArchive1, cbArchive1) != -1)
+            {
+                printf("Archive written by large pieces differs from %s !!!\n", szMpqName1);
+                nError = ERROR_FILE_CORRUPT;
             }
         }
+
+        delete [] pbArchive2;
+        pbArchive2 = NULL;
     }
 
-    // Close handles
-    if(hFile != NULL)
-        SFileCloseFile(hFile);
-    if(hMpq != NULL)
-        SFileCloseArchive(hMpq);
+    delete [] pbArchive1;
     return nError;
 }
 
@@ -1587,6 +5465,50 @@ int main(void)
     // Test compression methods
 //  if(nError == ERROR_SUCCESS)
 //      nError = TestSectorCompress(MPQ_SECTOR_SIZE);
+
+    // Test decompression of truncated Huffmann data
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestHuffmannTruncated(MPQ_SECTOR_SIZE);
+
+    // Test the table-driven Huffmann decoder against the original one
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestHuffmannDecoder(MPQ_SECTOR_SIZE);
+
+    // Test the buffer version of explode against the original one
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestExplodeBuffer(MPQ_SECTOR_SIZE);
+
+    // Test the implode compression levels
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestImplodeLevels(MPQ_SECTOR_SIZE);
+
+    // Test the LZMA compression options
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestLzmaOptions(MPQ_SECTOR_SIZE);
+
+    // Test the automatic choice of the compression
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestAutoCompression(MPQ_SECTOR_SIZE);
+
+    // Test the table-driven ADPCM decoder against the original one
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestAdpcmDecoder(MPQ_SECTOR_SIZE);
+
+    // Test the MPQE decryption against the original one
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestMpqeDecrypt();
+
+    // Test the per-thread scratch buffers
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestScratchBuffers();
+
+    // Test that the codec contexts kept by the threads don't change the compressed data
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestCodecContexts(MPQ_SECTOR_SIZE);
+
+    // Test that the data-sized LZMA dictionary decompresses by the original decoder
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestLzmaDictionary(MPQ_SECTOR_SIZE);
                                                                                             
     // Test the archive open and close
 //  if(nError == ERROR_SUCCESS)                     
@@ -1601,6 +5523,71 @@ int main(void)
 //  if(nError == ERROR_SUCCESS)
 //      nError = TestFindFiles(MAKE_PATH("2002 - Warcraft III/HumanEd.mpq"));
 
+    // Test reading the archives open for read only through a memory-mapped view
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestMappedStream(MAKE_PATH("Test-mapped.mpq"));
+
+    // Test reading ahead when the archive is read sequentially
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestReadAhead(MAKE_PATH("Test-readahead.mpq"));
+
+    // Test the block cache of the archive stream
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestBlockCache(MAKE_PATH("Test-blocks.mpq"));
+
+    // Test that the data in the write buffer are written before they are needed
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestWriteBuffer(MAKE_PATH("Test-write.mpq"), MAKE_PATH("Test-write-copy.mpq"));
+
+    // Test reading the files by SFileMapFileView
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestMapFileView(MAKE_PATH("Test-view.mpq"));
+
+    // Test reading one thread-safe archive from more threads
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestThreadSafeRead(MAKE_PATH("Test-threads.mpq"));
+
+    // Test asynchronous reading with OVERLAPPED
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestAsyncRead(MAKE_PATH("Test-async.mpq"));
+
+    // Test closing files and archives with asynchronous reads in progress
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestAsyncClose(MAKE_PATH("Test-async.mpq"));
+
+    // Test that the sectors decoded by more threads are the same as the sectors decoded one by one
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestParallelDecode(MAKE_PATH("Test-decode.mpq"));
+
+    // Test opening archives from memory and from stream callbacks
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestOpenArchiveEx(MAKE_PATH("Test-source.mpq"));
+
+    // Test loading whole files by SFileLoadFile
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestLoadFile(MAKE_PATH("Test-load.mpq"));
+
+    // Test loading many files at once by SFileReadFilesBatch
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestReadFilesBatch(MAKE_PATH("Test-batch.mpq"));
+
+    // Test that the cached sectors and sector offset tables are not used after the archive has been modified
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestCacheInvalidation(MAKE_PATH("Test-cache.mpq"), 0x400000);
+//      nError = TestCacheInvalidation(MAKE_PATH("Test-cache.mpq"), 0);
+
+    // Test that reused file handles don't read data of the previous file
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestFileHandlePool(MAKE_PATH("Test-handles.mpq"));
+
+    // Test reading PART files and filling their missing parts
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestPartFile(MAKE_PATH("Test-part.mpq"), MAKE_PATH("Test-part.MPQ.part"));
+
+    // Test that the sectors encoded by more threads are the same as the sectors encoded one by one
+//  if(nError == ERROR_SUCCESS)
+//      nError = TestParallelWrite(MAKE_PATH("Test-serial.mpq"), MAKE_PATH("Test-parallel.mpq"));
+
     // Create a big MPQ archive
     if(nError == ERROR_SUCCESS)
         nError = TestCreateArchive(MAKE_PATH("Test.mpq"));